@@ -0,0 +1,31 @@
+#!/bin/bash
+#
+# Compare the startup time of cores saved flat, sparse and compressed
+# (the :core-format argument of save-lisp).  Each core is started RUNS
+# times and the total real time is reported, along with the size of
+# the core.  To time starts from storage instead of the page cache, run
+# as root with DROP_CACHES=1, which drops the page cache before each
+# start.
+
+CMUCL=${CMUCL:-"cmucl-latest"}
+RUNS=${RUNS:-"10"}
+DROP_CACHES=${DROP_CACHES:-""}
+DIR=${DIR:-"/tmp"}
+
+for format in flat sparse compressed; do
+    ${CMUCL} -noinit -eval "(ext:save-lisp \"${DIR}/startup-${format}.core\" :core-format :${format})"
+done
+
+for format in flat sparse compressed; do
+    core=${DIR}/startup-${format}.core
+    start=$(date +%s.%N)
+    for i in $(seq ${RUNS}); do
+        if [ -n "${DROP_CACHES}" ]; then
+            sync
+            echo 3 > /proc/sys/vm/drop_caches
+        fi
+        ${CMUCL} -core ${core} -noinit -quiet -eval '(ext:quit)'
+    done
+    end=$(date +%s.%N)
+    echo ";; ${format}: $(stat -c %s ${core}) bytes, $(echo "(${end} - ${start}) * 1000 / ${RUNS}" | bc -l | cut -c1-8) ms per start"
+done
@@ -0,0 +1,45 @@
+#!/bin/bash
+#
+# Report GC pause percentiles and phase times of the GC-heavy
+# benchmarks, and compare the cost of the mprotect and soft-dirty
+# write barriers, allocation with and without huge pages, and full GCs with and without mark-region collection and
+# concurrent marking, the cost of refilling the allocation region and
+# of allocation sampling, how long finding free pages takes in a
+# fragmented heap, full GCs with many chained weak hash tables,
+# lookups in a large EQ table across GCs, large object allocation and
+# pinned buffers, and the throughput of the GC-heavy benchmarks with
+# the static triggers and with the GC policy's pause and GC time
+# targets.
+
+CMUCL=${CMUCL:-"cmucl-latest"}
+HEAP=${HEAP:-"2048"}
+
+make clean optimize-files
+${CMUCL} -noinit -load sysdep/setup-cmucl -load do-compilation-script -eval '(ext:quit)'
+${CMUCL} -noinit -load sysdep/setup-cmucl -load sysdep/gc-pauses-cmucl -eval '(ext:quit)'
+for barrier in "" -gc-soft-dirty; do
+    ${CMUCL} -noinit ${barrier} -load sysdep/setup-cmucl -load sysdep/gc-barrier-cmucl -eval '(ext:quit)'
+done
+
+# TLB misses are counted with perf when it is available.
+PERF=""
+if command -v perf > /dev/null 2>&1; then
+    PERF="perf stat -e dTLB-load-misses,dTLB-store-misses"
+fi
+for pages in "" -gc-huge-pages; do
+    ${PERF} ${CMUCL} -noinit -dynamic-space-size ${HEAP} ${pages} -load sysdep/setup-cmucl -load sysdep/gc-alloc-cmucl -eval '(ext:quit)'
+done
+${CMUCL} -noinit -load sysdep/setup-cmucl -load sysdep/gc-refill-cmucl -eval '(ext:quit)'
+${CMUCL} -noinit -load sysdep/setup-cmucl -load sysdep/gc-alloc-sample-cmucl -eval '(ext:quit)'
+${CMUCL} -noinit -dynamic-space-size ${HEAP} -load sysdep/setup-cmucl -load sysdep/gc-fragment-cmucl -eval '(ext:quit)'
+${CMUCL} -noinit -load sysdep/setup-cmucl -load sysdep/gc-weak-cmucl -eval '(ext:quit)'
+${CMUCL} -noinit -dynamic-space-size ${HEAP} -load sysdep/setup-cmucl -load sysdep/gc-eq-table-cmucl -eval '(ext:quit)'
+${CMUCL} -noinit -dynamic-space-size ${HEAP} -load sysdep/setup-cmucl -load sysdep/gc-large-cmucl -eval '(ext:quit)'
+
+for full in "" -gc-mark-region "-gc-mark-region -gc-concurrent-mark"; do
+    ${CMUCL} -noinit -dynamic-space-size ${HEAP} ${full} -load sysdep/setup-cmucl -load sysdep/gc-full-cmucl -eval '(ext:quit)'
+done
+
+for policy in "" "-gc-pause-target 5" "-gc-time-target 5"; do
+    ${CMUCL} -noinit ${policy} -load sysdep/setup-cmucl -load sysdep/gc-policy-cmucl -eval '(ext:quit)'
+done
@@ -0,0 +1,20 @@
+#!/bin/bash
+#
+# Measure CMUCL's event loop and streams: the latency of serve-event
+# waking up for one busy descriptor among 10, 1000 and 10000 idle
+# ones, with the select and epoll backends, the cost and accuracy of
+# up to 100000 pending serve-event timers, fd-stream throughput for
+# a 1GB file with buffers of 4KB to 16MB, write system calls and
+# throughput for a socket stream feeding a slow reader, and copying a
+# file with and without sendfile and splice.
+
+CMUCL=${CMUCL:-"cmucl-latest"}
+
+# The idle pipes need two descriptors each.
+ulimit -n 32768 2> /dev/null || echo ";; Can't raise the descriptor limit; the 10000 descriptor runs may fail."
+
+${CMUCL} -noinit -load sysdep/setup-cmucl -load sysdep/io-wakeup-cmucl -eval '(ext:quit)'
+${CMUCL} -noinit -load sysdep/setup-cmucl -load sysdep/io-timers-cmucl -eval '(ext:quit)'
+${CMUCL} -noinit -load sysdep/setup-cmucl -load sysdep/io-buffers-cmucl -eval '(ext:quit)'
+${CMUCL} -noinit -load sysdep/setup-cmucl -load sysdep/io-writev-cmucl -eval '(ext:quit)'
+${CMUCL} -noinit -load sysdep/setup-cmucl -load sysdep/io-sendfile-cmucl -eval '(ext:quit)'
@@ -0,0 +1,34 @@
+#!/bin/bash
+#
+# Measure the memory used by WORKERS CMUCL processes started from the
+# same core, with and without -shared-core.  Each worker does a full GC
+# and then sleeps; once they have all started, the RSS and PSS of each
+# (from /proc/PID/smaps_rollup, Linux 4.14 or later) are summed and
+# averaged.  PSS charges each process its share of the pages it shares
+# with the others, so it shows how much of the core stays shared.
+
+CMUCL=${CMUCL:-"cmucl-latest"}
+WORKERS=${WORKERS:-"16"}
+SETTLE=${SETTLE:-"10"}
+
+for mode in "" -shared-core; do
+    pids=""
+    for i in $(seq ${WORKERS}); do
+        ${CMUCL} -noinit -quiet ${mode} -eval "(progn (ext:gc :full t) (sleep $((SETTLE * 3))) (ext:quit))" > /dev/null &
+        pids="${pids} $!"
+    done
+    sleep ${SETTLE}
+    rss=0
+    pss=0
+    for pid in ${pids}; do
+        # The lisp process may be a child of a wrapper script.
+        lisp=$(pgrep -P ${pid} || echo ${pid})
+        for p in ${lisp}; do
+            rss=$((rss + $(awk '/^Rss:/ {print $2}' /proc/${p}/smaps_rollup)))
+            pss=$((pss + $(awk '/^Pss:/ {print $2}' /proc/${p}/smaps_rollup)))
+        done
+    done
+    echo ";; ${mode:-default}: ${WORKERS} workers, RSS $((rss / WORKERS)) KB, PSS $((pss / WORKERS)) KB per worker, PSS $((pss / 1024)) MB in all"
+    kill ${pids} 2> /dev/null
+    wait
+done
@@ -0,0 +1,63 @@
+;;; gc-alloc-cmucl.lisp --- allocation throughput with a large heap
+;;
+;; Keeps a large live set of vectors and replaces random ones with
+;; fresh vectors and lists, so both allocation and collection walk
+;; over a heap much bigger than the TLB covers.  Reports the
+;; allocation rate, the number of huge pages given back to the kernel
+;; and how much of the heap is backed by huge pages.  Run it with and
+;; without -gc-huge-pages, under "perf stat -e dTLB-load-misses" to see
+;; the TLB misses; run-cmucl-gc.sh does that.
+;;
+;; Load after sysdep/setup-cmucl.
+
+
+(in-package :cl-bench)
+
+(defun anon-huge-pages ()
+  "Return the AnonHugePages line of /proc/self/smaps_rollup, or NIL."
+  (with-open-file (s "/proc/self/smaps_rollup" :if-does-not-exist nil)
+    (when s
+      (loop for line = (read-line s nil)
+            while line
+            when (eql 0 (search "AnonHugePages:" line))
+              return line))))
+
+(defun churn-heap (live-count length rounds)
+  (declare (fixnum live-count length rounds))
+  (let ((live (make-array live-count))
+        (state (make-random-state t)))
+    (dotimes (i live-count)
+      (setf (svref live i) (make-array length :initial-element i)))
+    (dotimes (i rounds)
+      (let ((j (random live-count state)))
+        (setf (svref live j)
+              (if (evenp i)
+                  (make-array length :initial-element i)
+                  (coerce (make-list length :initial-element i)
+                          'simple-vector)))))
+    live))
+
+(defun bench-alloc (&key (live-count 200000) (length 64) (rounds 4000000))
+  (let ((released0 (alien:extern-alien "gc_huge_pages_released"
+                                       c-call:unsigned-long-long))
+        (bytes0 (ext:get-bytes-consed))
+        (start (get-internal-real-time)))
+    (churn-heap live-count length rounds)
+    (let ((elapsed (/ (- (get-internal-real-time) start)
+                      (float internal-time-units-per-second)))
+          (bytes (- (ext:get-bytes-consed) bytes0)))
+      (format t "~&;; huge pages: ~:[off~;on~]~%"
+              (not (zerop (alien:extern-alien "gencgc_huge_pages"
+                                              c-call:int))))
+      (format t ";; ~25a ~10,2f~%" "elapsed seconds" elapsed)
+      (format t ";; ~25a ~10,1f~%" "MB allocated per second"
+              (/ bytes 1048576.0 (max elapsed 0.01)))
+      (format t ";; ~25a ~10d~%" "huge pages released"
+              (- (alien:extern-alien "gc_huge_pages_released"
+                                     c-call:unsigned-long-long)
+                 released0))
+      (format t ";; ~a~%" (or (anon-huge-pages) "AnonHugePages: unknown")))))
+
+(bench-alloc)
+
+;; EOF
@@ -0,0 +1,87 @@
+;;; gc-alloc-sample-cmucl.lisp --- the cost of allocation sampling
+;;
+;; Runs an allocation heavy workload of lists, strings and vectors from
+;; a few different functions, with allocation sampling off and then at
+;; several sampling intervals, and reports the run time and the
+;; overhead against the run without sampling.  The samples of the
+;; default interval (512KB) are printed with LISP::ALLOC-PROFILE-REPORT
+;; and written to /tmp/cmucl-alloc.folded for flamegraph.pl.
+;;
+;; The target is an overhead under 5% at the default interval; intervals
+;; over it are marked.  The runtime doubles the interval when sampling
+;; takes more than 5% of the time, so the interval actually used is
+;; shown too.  Each time is the best of three runs, to keep the noise
+;; of a single run out of the overhead.  To reproduce, build the
+;; runtime and run
+;;
+;;   cmucl -noinit -load sysdep/setup-cmucl -load sysdep/gc-alloc-sample-cmucl
+;;
+;; from benchmarks/cl-bench, or run-cmucl-gc.sh, on an otherwise idle
+;; machine.
+;;
+;; Load after sysdep/setup-cmucl.
+
+
+(in-package :cl-bench)
+
+(defun sample-lists (n)
+  (let ((keep nil))
+    (dotimes (i n keep)
+      (let ((list (make-list 8 :initial-element i)))
+        (when (zerop (mod i 4096))
+          (setq keep list))))))
+
+(defun sample-strings (n)
+  (let ((keep nil))
+    (dotimes (i n keep)
+      (let ((string (format nil "item-~D" i)))
+        (when (zerop (mod i 4096))
+          (setq keep string))))))
+
+(defun sample-vectors (n)
+  (let ((keep nil))
+    (dotimes (i n keep)
+      (let ((vector (make-array 32 :initial-element i)))
+        (when (zerop (mod i 4096))
+          (setq keep vector))))))
+
+(defun sample-workload (n)
+  (sample-lists (* 8 n))
+  (sample-strings n)
+  (sample-vectors (* 2 n)))
+
+(defun time-workload (n)
+  (loop repeat 3
+        minimize (progn
+                   (ext:gc :full t)
+                   (let ((start (get-internal-real-time)))
+                     (sample-workload n)
+                     (/ (- (get-internal-real-time) start)
+                        (float internal-time-units-per-second))))))
+
+(defun bench-alloc-sample (&key (n 500000)
+                                (intervals '(65536 524288 4194304)))
+  (lisp::alloc-profile-stop)
+  (time-workload n)
+  (let ((base (time-workload n)))
+    (format t "~&;; ~20a ~8,3f s~%" "no sampling" base)
+    (dolist (bytes intervals)
+      (lisp::alloc-profile-start :bytes bytes)
+      (let* ((elapsed (time-workload n))
+             (overhead (* 100 (/ (- elapsed base) (max base 0.001)))))
+        (lisp::alloc-profile-stop)
+        (multiple-value-bind (samples dropped nsec interval)
+            (lisp::gencgc-alloc-sample-stats)
+          (format t ";; every ~12:d bytes ~8,3f s ~6,2f% overhead~:[~; (over 5%)~], ~D samples (~D dropped), ~,1f us each, ~:d bytes used~%"
+                  bytes elapsed overhead (> overhead 5)
+                  samples dropped (/ nsec 1000.0 (max samples 1))
+                  interval))))
+    (lisp::alloc-profile-start)
+    (sample-workload n)
+    (lisp::alloc-profile-stop)
+    (lisp::alloc-profile-report :limit 5)
+    (lisp::alloc-profile-write-folded "/tmp/cmucl-alloc.folded")))
+
+(bench-alloc-sample)
+
+;; EOF
@@ -0,0 +1,56 @@
+;;; gc-barrier-cmucl.lisp --- cost of the gencgc write barrier
+;;
+;; Builds a large old-generation structure and then keeps storing
+;; freshly consed objects into random slots of it, so every collection
+;; has to find the old pages written since the last one.  Reports the
+;; elapsed time, the number of write faults, the number of pages found
+;; through the soft-dirty bits and the time spent scavenging the older
+;; generations.  Run it with and without -gc-soft-dirty to compare the
+;; mprotect barrier with soft-dirty tracking; run-cmucl-gc.sh does that.
+;;
+;; Load after sysdep/setup-cmucl.
+
+
+(in-package :cl-bench)
+
+(defun make-old-vectors (count length)
+  (let ((vectors (make-array count)))
+    (dotimes (i count)
+      (setf (svref vectors i) (make-array length :initial-element nil)))
+    ;; Promote it all to the oldest generation.
+    (ext:gc :full t)
+    vectors))
+
+(defun mutate-old-vectors (vectors stores)
+  (declare (simple-vector vectors)
+           (fixnum stores))
+  (let ((count (length vectors))
+        (state (make-random-state t)))
+    (dotimes (i stores)
+      (let ((v (svref vectors (random count state))))
+        (declare (simple-vector v))
+        (setf (svref v (random (length v) state))
+              (cons i i))))))
+
+(defun bench-write-barrier (&key (count 20000) (length 256) (stores 20000000))
+  (let ((vectors (make-old-vectors count length)))
+    (multiple-value-bind (faults0 dirty0 scav0)
+        (lisp::gencgc-write-barrier-stats)
+      (let ((start (get-internal-real-time)))
+        (mutate-old-vectors vectors stores)
+        (let ((elapsed (/ (- (get-internal-real-time) start)
+                          (float internal-time-units-per-second))))
+          (multiple-value-bind (faults1 dirty1 scav1)
+              (lisp::gencgc-write-barrier-stats)
+            (format t "~&;; write barrier: ~:[mprotect~;soft-dirty~]~%"
+                    (not (zerop (alien:extern-alien "gencgc_soft_dirty"
+                                                    c-call:int))))
+            (format t ";; ~25a ~10,2f~%" "elapsed seconds" elapsed)
+            (format t ";; ~25a ~10d~%" "write faults" (- faults1 faults0))
+            (format t ";; ~25a ~10d~%" "soft-dirty pages" (- dirty1 dirty0))
+            (format t ";; ~25a ~10,2f~%" "scavenge_generation ms"
+                    (/ (- scav1 scav0) 1000.0))))))))
+
+(bench-write-barrier)
+
+;; EOF
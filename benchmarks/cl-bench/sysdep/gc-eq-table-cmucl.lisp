@@ -0,0 +1,63 @@
+;;; gc-eq-table-cmucl.lisp --- lookups in a large EQ table while allocating
+;;
+;; Fills an EQ hash table with COUNT keys, then looks keys up in batches
+;; while allocating young garbage, so GCs keep happening.  Keys hashed by
+;; address that the GC moves have to be rehashed by the next lookup; keys
+;; with a stable hash (symbols and PCL instances) never do.  Reports, for
+;; structure instances, symbols and PCL instances as keys, the time per
+;; batch of lookups: the median and the worst, which is the batch that
+;; paid for the rehash after a GC.
+;;
+;; Load after sysdep/setup-cmucl.
+
+
+(in-package :cl-bench)
+
+(defstruct eq-table-key (n 0))
+
+(defclass eq-table-object ()
+  ((n :initarg :n)))
+
+(defun eq-table-msec ()
+  (/ (get-internal-real-time) (/ internal-time-units-per-second 1000.0)))
+
+(defun bench-eq-table-keys (name make-key count batches batch-size)
+  (let ((keys (make-array count))
+        (table (make-hash-table :test 'eq :size count))
+        (times (make-array batches))
+        (junk nil))
+    (dotimes (i count)
+      (let ((key (funcall make-key i)))
+        (setf (svref keys i) key
+              (gethash key table) i)))
+    (dotimes (b batches)
+      ;; Young garbage between batches.
+      (dotimes (i 20000)
+        (setq junk (make-list 8)))
+      (let ((start (eq-table-msec)))
+        (dotimes (i batch-size)
+          (let ((key (svref keys (random count))))
+            (unless (gethash key table)
+              (error "Lost ~S" key))))
+        (setf (svref times b) (- (eq-table-msec) start))))
+    (let ((sorted (sort times #'<)))
+      (format t ";; ~20a ~10,3f ~10,3f~%" name
+              (svref sorted (floor batches 2))
+              (svref sorted (1- batches))))
+    junk))
+
+(defun bench-eq-table (&key (count 10000000) (batches 200) (batch-size 10000))
+  (format t "~&;; EQ table of ~D keys, ~D batches of ~D lookups~%"
+          count batches batch-size)
+  (format t ";; ~20a ~10@a ~10@a~%" "keys" "median ms" "worst ms")
+  (bench-eq-table-keys "structures" #'(lambda (i) (make-eq-table-key :n i))
+                       count batches batch-size)
+  (bench-eq-table-keys "symbols" #'(lambda (i) (declare (ignore i)) (gensym))
+                       count batches batch-size)
+  (bench-eq-table-keys "PCL instances"
+                       #'(lambda (i) (make-instance 'eq-table-object :n i))
+                       count batches batch-size))
+
+(bench-eq-table)
+
+;; EOF
@@ -0,0 +1,68 @@
+;;; gc-fragment-cmucl.lisp --- finding free pages in a fragmented heap
+;;
+;; Fills much of the heap with large vectors, which gencgc never
+;; copies, and drops every other one after promoting them, leaving
+;; holes of free pages all over the heap.  Then it allocates and
+;; collects small objects and reports the distribution of the time
+;; taken to find the pages for each new allocation region or large
+;; object, from lisp::gencgc-alloc-search-histogram.
+;;
+;; Load after sysdep/setup-cmucl.
+
+
+(in-package :cl-bench)
+
+(defun fragment-heap (count length)
+  (let ((vectors (make-array count)))
+    (dotimes (i count)
+      (setf (svref vectors i) (make-array length :initial-element i)))
+    (ext:gc :full t)
+    (loop for i from 0 below count by 2
+          do (setf (svref vectors i) nil))
+    (ext:gc :full t)
+    vectors))
+
+(defun histogram-percentile (histogram fraction)
+  ;; The upper bound in nanoseconds of the bucket holding the given
+  ;; fraction of the searches.
+  (let* ((total (reduce #'+ histogram))
+         (target (* fraction total))
+         (sum 0))
+    (dotimes (i (length histogram) (ash 1 (length histogram)))
+      (incf sum (aref histogram i))
+      (when (and (plusp total) (>= sum target))
+        (return (ash 1 (1+ i)))))))
+
+(defun bench-fragment (&key (count 4000) (length 20000) (rounds 2000000))
+  (let ((vectors (fragment-heap count length))
+        (before (lisp::gencgc-alloc-search-histogram))
+        (start (get-internal-real-time)))
+    (let ((keep nil))
+      (dotimes (i rounds)
+        (let ((list (make-list 8 :initial-element i)))
+          (when (zerop (mod i 256))
+            (push list keep))
+          (when (zerop (mod i 65536))
+            (setf keep nil)))))
+    (let* ((elapsed (/ (- (get-internal-real-time) start)
+                       (float internal-time-units-per-second)))
+           (after (lisp::gencgc-alloc-search-histogram))
+           (histogram (map 'vector #'- after before)))
+      (format t "~&;; fragmented heap: ~d large vectors~%"
+              (count-if-not #'null vectors))
+      (format t ";; ~25a ~10,2f~%" "elapsed seconds" elapsed)
+      (format t ";; ~25a ~10d~%" "page searches"
+              (reduce #'+ histogram))
+      (format t ";; ~25a ~10d~%" "p50 search ns <"
+              (histogram-percentile histogram 0.5))
+      (format t ";; ~25a ~10d~%" "p99 search ns <"
+              (histogram-percentile histogram 0.99))
+      (format t ";; ~25a ~10d~%" "max search ns <"
+              (histogram-percentile histogram 1))
+      (dotimes (i (length histogram))
+        (unless (zerop (aref histogram i))
+          (format t ";;   ~10d ns ~12d~%" (ash 1 i) (aref histogram i)))))))
+
+(bench-fragment)
+
+;; EOF
@@ -0,0 +1,92 @@
+;;; gc-full-cmucl.lisp --- full GCs of a large, partly dead old generation
+;;
+;; Builds a large old generation in which a fraction of the objects is
+;; garbage, then times full collections and reports the peak resident
+;; set size of the process.  Run it with and without -gc-mark-region to
+;; compare copying the whole generation with leaving its dense pages in
+;; place, and with -gc-concurrent-mark to see how much of the marking
+;; moves out of the full GC pauses; run-cmucl-gc.sh does that.  Between
+;; full GCs the program allocates and updates the old objects, so
+;; concurrent marking has work to overlap with.
+;;
+;; Load after sysdep/setup-cmucl.
+
+
+(in-package :cl-bench)
+
+(defun peak-rss ()
+  "Return the VmHWM line of /proc/self/status, or NIL."
+  (with-open-file (s "/proc/self/status" :if-does-not-exist nil)
+    (when s
+      (loop for line = (read-line s nil)
+            while line
+            when (eql 0 (search "VmHWM:" line))
+              return line))))
+
+(defun make-old-heap (count dead-fraction)
+  ;; Lists of small vectors; every dead-fraction'th one is dropped
+  ;; after it has been promoted.
+  (let ((objects (make-array count)))
+    (dotimes (i count)
+      (setf (svref objects i) (list (make-array 6 :initial-element i)
+                                    (make-string 12)
+                                    i)))
+    (ext:gc :full t)
+    (let ((step (max 2 (round 1 dead-fraction))))
+      (loop for i from 0 below count by step
+            do (setf (svref objects i) nil)))
+    objects))
+
+(defun churn (objects rounds)
+  ;; Young garbage, plus some stores into the old objects.
+  (let ((count (length objects)))
+    (dotimes (i rounds)
+      (let ((j (random count)))
+        (when (svref objects j)
+          (setf (third (svref objects j)) (make-list 4)))))))
+
+(defun bench-full-gc (&key (count 2000000) (dead-fraction 0.2) (gcs 5)
+                           (churn 2000000))
+  (let ((objects (make-old-heap count dead-fraction))
+        (total 0)
+        (longest 0))
+    ;; Start concurrent marking as soon as a GC finishes.
+    (setf lisp::gencgc-concurrent-mark-start 0)
+    (multiple-value-bind (pages0 filled0 usec0)
+        (lisp::gencgc-mark-region-stats)
+      (multiple-value-bind (step0 satb0 remark0)
+          (lisp::gencgc-concurrent-mark-stats)
+        (dotimes (i gcs)
+          (churn objects churn)
+          (let ((start (get-internal-real-time)))
+            (ext:gc :full t)
+            (let ((pause (- (get-internal-real-time) start)))
+              (incf total pause)
+              (setf longest (max longest pause)))))
+        (multiple-value-bind (pages1 filled1 usec1)
+            (lisp::gencgc-mark-region-stats)
+          (multiple-value-bind (step1 satb1 remark1)
+              (lisp::gencgc-concurrent-mark-stats)
+            (format t "~&;; mark-region: ~:[off~;on~], concurrent mark: ~:[off~;on~]~%"
+                    (not (zerop lisp::gencgc-mark-region))
+                    (not (zerop lisp::gencgc-concurrent-mark)))
+            (format t ";; ~25a ~10,2f~%" "ms per full GC"
+                    (/ (* 1000.0 total) internal-time-units-per-second gcs))
+            (format t ";; ~25a ~10,2f~%" "longest full GC ms"
+                    (/ (* 1000.0 longest) internal-time-units-per-second))
+            (format t ";; ~25a ~10,2f~%" "marking ms per full GC"
+                    (/ (- (+ usec1 remark1) usec0 remark0) 1000.0 gcs))
+            (format t ";; ~25a ~10,2f~%" "mark step ms per cycle"
+                    (/ (- step1 step0) 1000.0 gcs))
+            (format t ";; ~25a ~10d~%" "pages scanned on write"
+                    (- satb1 satb0))
+            (format t ";; ~25a ~10d~%" "pages kept in place"
+                    (- pages1 pages0))
+            (format t ";; ~25a ~10d~%" "bytes filled"
+                    (- filled1 filled0))
+            (format t ";; ~a~%" (or (peak-rss) "VmHWM: unknown"))))))
+    (length objects)))
+
+(bench-full-gc)
+
+;; EOF
@@ -0,0 +1,65 @@
+;;; gc-large-cmucl.lisp --- large object allocation and pinned buffers
+;;
+;; Allocates (unsigned-byte 8) buffers of mixed sizes, keeping every
+;; fourth, so that the free pages of the heap end up in runs of all
+;; sizes, and times the allocation.  Then makes pinned buffers with
+;; MAKE-ARRAY :ALLOCATION :PINNED, writes them to /dev/null through
+;; UNIX-WRITE, which takes their address with GC enabled, forces GCs in
+;; between, and checks that no buffer moved.  Reports the large object
+;; statistics of the GC: large objects placed from the index of free
+;; page runs and by searching the page table, and the pinned vectors
+;; made and their total size.
+;;
+;; Load after sysdep/setup-cmucl.
+
+
+(in-package :cl-bench)
+
+(defun bench-large-alloc (&key (count 20000) (min-size 65536)
+                               (max-size (* 1024 1024)))
+  (let ((kept '())
+        (start (get-internal-real-time)))
+    (dotimes (i count)
+      (let ((buffer (make-array (+ min-size (random (- max-size min-size)))
+                                :element-type '(unsigned-byte 8))))
+        (when (zerop (mod i 4))
+          (push buffer kept))
+        (when (= (length kept) 64)
+          (setq kept (nthcdr 32 kept)))))
+    (format t "~&;; ~D large buffers: ~,2f ms~%" count
+            (/ (- (get-internal-real-time) start)
+               (/ internal-time-units-per-second 1000.0)))
+    (length kept)))
+
+(defun bench-pinned-io (&key (buffers 64) (size 65536) (rounds 50))
+  (let ((fd (unix:unix-open "/dev/null" unix:o_wronly 0))
+        (pinned (loop repeat buffers
+                      collect (make-array size :element-type '(unsigned-byte 8)
+                                               :allocation :pinned)))
+        (moved 0))
+    (let ((addresses (mapcar #'kernel:get-lisp-obj-address pinned))
+          (start (get-internal-real-time)))
+      (dotimes (round rounds)
+        (dolist (buffer pinned)
+          (unix:unix-write fd buffer 0 size))
+        (make-list 100000)
+        (ext:gc :full (zerop (mod round 10))))
+      (loop for buffer in pinned
+            for address in addresses
+            unless (= address (kernel:get-lisp-obj-address buffer))
+              do (incf moved))
+      (format t ";; ~D writes of ~D pinned buffers: ~,2f ms, ~D moved~%"
+              rounds buffers
+              (/ (- (get-internal-real-time) start)
+                 (/ internal-time-units-per-second 1000.0))
+              moved))
+    (unix:unix-close fd)
+    (multiple-value-bind (hits misses vectors bytes)
+        (lisp::gencgc-large-object-stats)
+      (format t ";; ~D large objects from the run index, ~D searched, ~D pinned vectors of ~D bytes~%"
+              hits misses vectors bytes))))
+
+(bench-large-alloc)
+(bench-pinned-io)
+
+;; EOF
@@ -0,0 +1,88 @@
+;;; gc-pauses-cmucl.lisp --- GC pause times for the GC-heavy benchmarks
+;;
+;; Runs the benchmarks in the :GC group and reports, for each one, the
+;; number of collections, the total time spent in them, the median,
+;; 90th and 99th percentile and longest pauses, and the share of the
+;; GC time spent in each phase.  The pauses are taken from the GC
+;; event log, read after each GC.
+;;
+;; Load after sysdep/setup-cmucl and do-compilation-script.
+
+
+(in-package :cl-user)
+
+(load (compile-file-pathname #p"files/boehm-gc.olisp"))
+(load (compile-file-pathname #p"files/hash.olisp"))
+(load #p"support.lisp")
+(load #p"tests.lisp")
+
+(in-package :cl-bench)
+
+(defvar *gc-next-event* 0)
+(defvar *gc-events* '())
+
+(defparameter *gc-phases*
+  '(:prepare :stacks :roots :older :newspace :weak :free :protect))
+
+(defun gc-read-events ()
+  (multiple-value-bind (events next)
+      (lisp::gc-events *gc-next-event*)
+    (setq *gc-events* (revappend events *gc-events*))
+    (setq *gc-next-event* next)))
+
+;; The pause of each GC in milliseconds, from the start of the first
+;; generation collected to the end of the last.
+(defun gc-event-pauses (events)
+  (let ((pauses (make-hash-table)))
+    (dolist (event events)
+      (let ((pause (gethash (getf event :collection) pauses)))
+        (setf (gethash (getf event :collection) pauses)
+              (cons (min (getf event :start) (or (car pause) (getf event :start)))
+                    (max (getf event :end) (or (cdr pause) 0))))))
+    (sort (loop for (start . end) being the hash-values of pauses
+                collect (/ (- end start) 1000000.0))
+          #'<)))
+
+(defun percentile (sorted p)
+  (if sorted
+      (nth (min (1- (length sorted))
+                (floor (* p (length sorted)) 100))
+           sorted)
+      0.0))
+
+(defun bench-gc-pauses (&key (group :gc))
+  (let ((ext:*after-gc-hooks* (cons 'gc-read-events ext:*after-gc-hooks*)))
+    (format t "~&;; GC pauses, in ms~%")
+    (format t ";; ~25a ~6@a ~10@a ~8@a ~8@a ~8@a ~8@a~%"
+            "Function" "GCs" "total" "p50" "p90" "p99" "max")
+    (dolist (b (reverse *benchmarks*))
+      (when (eq (benchmark-group b) group)
+        (bench-gc)
+        (setq *gc-next-event* (nth-value 1 (lisp::gc-events)))
+        (setq *gc-events* '())
+        (with-slots (function short runs) b
+          (dotimes (i runs)
+            (funcall function))
+          ;; The final full GC is part of the comparison too.
+          (bench-gc)
+          (let* ((pauses (gc-event-pauses *gc-events*))
+                 (total (reduce #'+ pauses)))
+            (format t ";; ~25a ~6d ~10,2f ~8,2f ~8,2f ~8,2f ~8,2f~%"
+                    short (length pauses) total
+                    (percentile pauses 50) (percentile pauses 90)
+                    (percentile pauses 99)
+                    (reduce #'max pauses :initial-value 0.0))
+            ;; Where the time went.
+            (format t ";; ~25a~{ ~a ~,1f%~}~%" ""
+                    (loop for phase in *gc-phases*
+                          collect (string-downcase phase)
+                          collect (if (plusp total)
+                                      (/ (reduce #'+ *gc-events*
+                                                 :key #'(lambda (event)
+                                                          (getf event phase)))
+                                         (* total 10000.0))
+                                      0.0)))))))))
+
+(bench-gc-pauses)
+
+;; EOF
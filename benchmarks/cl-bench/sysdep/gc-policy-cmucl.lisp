@@ -0,0 +1,67 @@
+;;; gc-policy-cmucl.lisp --- throughput of the GC-heavy benchmarks under the GC policy
+;;
+;; Runs the benchmarks in the :GC group and reports, for each one, the
+;; run time, the share of it spent in GC, the number of collections and
+;; the longest pause, followed by the nursery size, average pause,
+;; survival rate and promotion age the GC policy settled on.  Run it
+;; without a target and with -gc-pause-target or -gc-time-target to
+;; compare the static triggers with the adaptive policy;
+;; run-cmucl-gc.sh does that.
+;;
+;; Load after sysdep/setup-cmucl and do-compilation-script.
+
+
+(in-package :cl-user)
+
+(load (compile-file-pathname #p"files/boehm-gc.olisp"))
+(load (compile-file-pathname #p"files/hash.olisp"))
+(load #p"support.lisp")
+(load #p"tests.lisp")
+
+(in-package :cl-bench)
+
+(defvar *policy-gc-start* 0)
+(defvar *policy-gc-pauses* '())
+
+(defun policy-time-msec ()
+  (/ (get-internal-real-time) (/ internal-time-units-per-second 1000.0)))
+
+(defun policy-gc-start ()
+  (setq *policy-gc-start* (policy-time-msec)))
+
+(defun policy-gc-end ()
+  (push (- (policy-time-msec) *policy-gc-start*) *policy-gc-pauses*))
+
+(defun bench-gc-policy (&key (group :gc))
+  (let ((ext:*before-gc-hooks* (cons 'policy-gc-start ext:*before-gc-hooks*))
+        (ext:*after-gc-hooks* (cons 'policy-gc-end ext:*after-gc-hooks*)))
+    (format t "~&;; GC policy: pause target ~D us, GC time target ~D%~%"
+            lisp::gencgc-pause-target lisp::gencgc-gc-time-target)
+    (format t ";; ~25a ~10@a ~6@a ~6@a ~10@a~%"
+            "Function" "total ms" "GC %" "GCs" "max ms")
+    (dolist (b (reverse *benchmarks*))
+      (when (eq (benchmark-group b) group)
+        (bench-gc)
+        (setq *policy-gc-pauses* '())
+        (with-slots (function short runs) b
+          (let ((start (policy-time-msec)))
+            (dotimes (i runs)
+              (funcall function))
+            (let ((total (- (policy-time-msec) start))
+                  (gc (reduce #'+ *policy-gc-pauses*)))
+              (format t ";; ~25a ~10,2f ~6,1f ~6d ~10,2f~%"
+                      short total (/ (* 100 gc) (max total 0.01))
+                      (length *policy-gc-pauses*)
+                      (reduce #'max *policy-gc-pauses* :initial-value 0.0)))))))
+    (multiple-value-bind (nursery updates pause survival gc-time age)
+        (lisp::gencgc-policy-stats)
+      (declare (ignore updates))
+      (format t ";; ~25a ~10,2f~%" "nursery MB" (/ nursery 1048576.0))
+      (format t ";; ~25a ~10,2f~%" "average nursery pause ms" (/ pause 1000.0))
+      (format t ";; ~25a ~10,2f~%" "survival %" survival)
+      (format t ";; ~25a ~10,2f~%" "GC time %" gc-time)
+      (format t ";; ~25a ~10,2f~%" "promotion age" age))))
+
+(bench-gc-policy)
+
+;; EOF
@@ -0,0 +1,51 @@
+;;; gc-refill-cmucl.lisp --- the cost of refilling the allocation region
+;;
+;; Conses short-lived lists, so almost all the time outside the
+;; allocation sequences goes to refilling the allocation region and to
+;; GCs of the nursery.  For a few settings of
+;; lisp::gencgc-alloc-batch-pages it reports the number of refills, the
+;; average time per refill, how many refills had to search the page
+;; table, and the allocation rate.
+;;
+;; Load after sysdep/setup-cmucl.
+
+
+(in-package :cl-bench)
+
+(defun cons-garbage (rounds)
+  (declare (fixnum rounds))
+  (let ((keep nil))
+    (dotimes (i rounds)
+      (let ((list (make-list 16 :initial-element i)))
+        (when (zerop (mod i 1024))
+          (setf keep list))))
+    keep))
+
+(defun bench-refill (&key (rounds 4000000) (batches '(1 8 32)))
+  (dolist (batch batches)
+    (setf lisp::gencgc-alloc-batch-pages batch)
+    (ext:gc)
+    (multiple-value-bind (refills0 nsec0 searches0)
+        (lisp::gencgc-alloc-refill-stats)
+      (let ((bytes0 (ext:get-bytes-consed))
+            (start (get-internal-real-time)))
+        (cons-garbage rounds)
+        (let ((elapsed (/ (- (get-internal-real-time) start)
+                          (float internal-time-units-per-second)))
+              (bytes (- (ext:get-bytes-consed) bytes0)))
+          (multiple-value-bind (refills1 nsec1 searches1)
+              (lisp::gencgc-alloc-refill-stats)
+            (let ((refills (- refills1 refills0)))
+              (format t "~&;; batch pages: ~d~%" batch)
+              (format t ";; ~25a ~10d~%" "refills" refills)
+              (format t ";; ~25a ~10,1f~%" "ns per refill"
+                      (/ (- nsec1 nsec0) (float (max refills 1))))
+              (format t ";; ~25a ~10d~%" "page table searches"
+                      (- searches1 searches0))
+              (format t ";; ~25a ~10,1f~%" "MB allocated per second"
+                      (/ bytes 1048576.0 (max elapsed 0.01)))))))))
+  (setf lisp::gencgc-alloc-batch-pages 8))
+
+(bench-refill)
+
+;; EOF
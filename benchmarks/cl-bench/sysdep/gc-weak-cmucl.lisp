@@ -0,0 +1,60 @@
+;;; gc-weak-cmucl.lisp --- GC time with many weak hash tables
+;;
+;; Builds thousands of small weak caches, chained so that the values of
+;; one table are the keys of the next and only the head of each chain
+;; is otherwise reachable, so the GC has to find the live entries of
+;; each table through the table before it.  Half of the chains are then
+;; dropped.  Times full GCs and reports the weak table statistics of
+;; the GC: the tables and entries looked at, how often waiting entries
+;; were checked again, the entries removed and the time spent on weak
+;; tables in the last GC.
+;;
+;; Load after sysdep/setup-cmucl.
+
+
+(in-package :cl-bench)
+
+(defun make-weak-chain (tables entries)
+  ;; Returns the keys of the first table; the rest of the chain is only
+  ;; reachable through the tables.
+  (let* ((head (loop repeat entries collect (list :key)))
+         (keys head)
+         (chain '()))
+    (dotimes (i tables)
+      (let ((table (make-hash-table :test 'eq :weakness :key))
+            (vals (loop repeat entries collect (list :value))))
+        (loop for k in keys
+              for v in vals
+              do (setf (gethash k table) v))
+        (push table chain)
+        (setq keys vals)))
+    (values head chain)))
+
+(defun bench-weak-gc (&key (chains 2000) (tables 8) (entries 16) (gcs 5))
+  (let ((heads (make-array chains))
+        (caches (make-array chains)))
+    (dotimes (i chains)
+      (multiple-value-bind (head chain)
+          (make-weak-chain tables entries)
+        (setf (svref heads i) head
+              (svref caches i) chain)))
+    (ext:gc :full t)
+    (loop for i from 0 below chains by 2
+          do (setf (svref heads i) nil))
+    (format t "~&;; ~D chains of ~D weak tables of ~D entries~%"
+            chains tables entries)
+    (dotimes (i gcs)
+      (let ((start (get-internal-real-time)))
+        (ext:gc :full t)
+        (format t ";; full GC ~D: ~,2f ms~%" i
+                (/ (- (get-internal-real-time) start)
+                   (/ internal-time-units-per-second 1000.0)))))
+    (multiple-value-bind (seen-tables seen-entries rechecks removed usec)
+        (lisp::gencgc-weak-stats)
+      (format t ";; ~D tables, ~D entries, ~D rechecks, ~D removed, ~,2f ms last GC~%"
+              seen-tables seen-entries rechecks removed (/ usec 1000.0)))
+    (length caches)))
+
+(bench-weak-gc)
+
+;; EOF
@@ -0,0 +1,63 @@
+;;; io-buffers-cmucl.lisp --- fd-stream throughput by buffer size
+;;
+;; Writes a 1GB file through an fd-stream, a kilobyte at a time, then
+;; reads it back the same way, with each of several :BUFFER-SIZEs, and
+;; reports the throughput of each.  Writing a kilobyte at a time keeps
+;; the transfers going through the stream buffer, so the buffer size
+;; decides how many system calls are made.  The file is made in /tmp
+;; unless *IO-BUFFERS-FILE* is set before loading, and deleted after.
+;;
+;; Load after sysdep/setup-cmucl.
+
+
+(in-package :cl-bench)
+
+(defvar *io-buffers-file* "/tmp/cl-bench-io-buffers.dat")
+(defvar *io-buffers-bytes* (expt 2 30))
+
+(defun real-time-usec ()
+  (multiple-value-bind (ok sec usec)
+      (unix:unix-gettimeofday)
+    (declare (ignore ok))
+    (+ (* sec 1000000) usec)))
+
+(defun mb-per-second (bytes usec)
+  (/ (* bytes 1000000.0) (max usec 1) (* 1024 1024)))
+
+(defun bench-buffer-size (buffer-size)
+  (let ((chunk (make-array 1024 :element-type '(unsigned-byte 8)
+                                :initial-element 42))
+        (rounds (floor *io-buffers-bytes* 1024))
+        write-usec read-usec)
+    (let ((start (real-time-usec)))
+      (with-open-file (out *io-buffers-file* :direction :output
+                                             :if-exists :supersede
+                                             :element-type '(unsigned-byte 8)
+                                             :buffer-size buffer-size)
+        (dotimes (i rounds)
+          (write-sequence chunk out)))
+      (setq write-usec (- (real-time-usec) start)))
+    (let ((start (real-time-usec)))
+      (with-open-file (in *io-buffers-file*
+                          :element-type '(unsigned-byte 8)
+                          :buffer-size buffer-size)
+        (loop until (< (read-sequence chunk in) (length chunk))))
+      (setq read-usec (- (real-time-usec) start)))
+    (format t ";; ~10d ~12,1f ~12,1f~%"
+            buffer-size
+            (mb-per-second *io-buffers-bytes* write-usec)
+            (mb-per-second *io-buffers-bytes* read-usec))))
+
+(defun bench-buffer-sizes ()
+  (format t "~&;; fd-stream throughput for ~D MB, in MB/s~%"
+          (floor *io-buffers-bytes* (* 1024 1024)))
+  (format t ";; ~10@a ~12@a ~12@a~%" "Buffer" "write" "read")
+  (unwind-protect
+       (dolist (size (list 4096 65536 (* 1024 1024) (* 16 1024 1024)))
+         (bench-buffer-size size))
+    (when (probe-file *io-buffers-file*)
+      (delete-file *io-buffers-file*))))
+
+(bench-buffer-sizes)
+
+;; EOF
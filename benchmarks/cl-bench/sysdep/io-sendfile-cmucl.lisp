@@ -0,0 +1,96 @@
+;;; io-sendfile-cmucl.lisp --- copying a file to a file and to a pipe
+;;
+;; Copies a 256MB file to another file, and to a pipe read by cat, two
+;; ways: with READ-SEQUENCE and WRITE-SEQUENCE through a 64KB vector,
+;; the loop programs have had to write, and with
+;; EXT:COPY-STREAM-TO-STREAM, which has the kernel move the data with
+;; sendfile or splice.  Reports the throughput of each.  The files are
+;; made in /tmp unless *IO-SENDFILE-DIRECTORY* is set before loading,
+;; and deleted after.
+;;
+;; Load after sysdep/setup-cmucl.
+
+
+(in-package :cl-bench)
+
+(defvar *io-sendfile-directory* "/tmp/")
+(defvar *io-sendfile-bytes* (* 256 1024 1024))
+
+(defun real-time-usec ()
+  (multiple-value-bind (ok sec usec)
+      (unix:unix-gettimeofday)
+    (declare (ignore ok))
+    (+ (* sec 1000000) usec)))
+
+(defun sendfile-path (name)
+  (merge-pathnames name *io-sendfile-directory*))
+
+(defun make-source-file ()
+  (let ((chunk (make-array (* 1024 1024) :element-type '(unsigned-byte 8)
+                                         :initial-element 42)))
+    (with-open-file (out (sendfile-path "cl-bench-sendfile.in")
+                         :direction :output :if-exists :supersede
+                         :element-type '(unsigned-byte 8))
+      (dotimes (i (floor *io-sendfile-bytes* (length chunk)))
+        (write-sequence chunk out)))))
+
+(defun copy-by-loop (in out)
+  (let ((buffer (make-array (* 64 1024) :element-type '(unsigned-byte 8))))
+    (loop for n = (read-sequence buffer in)
+          until (zerop n)
+          do (write-sequence buffer out :end n))))
+
+(defun time-copy (method open-output)
+  (with-open-file (in (sendfile-path "cl-bench-sendfile.in")
+                      :element-type '(unsigned-byte 8))
+    (multiple-value-bind (out cleanup)
+        (funcall open-output)
+      (let ((start (real-time-usec)))
+        (unwind-protect
+             (progn
+               (ecase method
+                 (:loop (copy-by-loop in out))
+                 (:kernel (ext:copy-stream-to-stream in out)))
+               (finish-output out))
+          (close out)
+          (when cleanup
+            (funcall cleanup)))
+        (/ (* *io-sendfile-bytes* 1000000.0)
+           (max (- (real-time-usec) start) 1)
+           (* 1024 1024))))))
+
+(defun open-file-output ()
+  (open (sendfile-path "cl-bench-sendfile.out")
+        :direction :output :if-exists :supersede
+        :element-type '(unsigned-byte 8)))
+
+(defun open-pipe-output ()
+  (let ((process (ext:run-program "/bin/sh" '("-c" "cat > /dev/null")
+                                  :input :stream :output nil :wait nil
+                                  :element-type '(unsigned-byte 8))))
+    (values (ext:process-input process)
+            #'(lambda ()
+                (ext:process-wait process)
+                (ext:process-close process)))))
+
+(defun bench-sendfile ()
+  (make-source-file)
+  (unwind-protect
+       (progn
+         (format t "~&;; Copying ~D MB, in MB/s~%"
+                 (floor *io-sendfile-bytes* (* 1024 1024)))
+         (format t ";; ~10@a ~12@a ~12@a~%" "To" "loop" "kernel")
+         (dolist (to '(:file :pipe))
+           (let ((open-output (ecase to
+                                (:file #'open-file-output)
+                                (:pipe #'open-pipe-output))))
+             (format t ";; ~10a ~12,1f ~12,1f~%" to
+                     (time-copy :loop open-output)
+                     (time-copy :kernel open-output)))))
+    (dolist (name '("cl-bench-sendfile.in" "cl-bench-sendfile.out"))
+      (when (probe-file (sendfile-path name))
+        (delete-file (sendfile-path name))))))
+
+(bench-sendfile)
+
+;; EOF
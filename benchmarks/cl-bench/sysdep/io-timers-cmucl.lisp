@@ -0,0 +1,68 @@
+;;; io-timers-cmucl.lisp --- arming, cancelling and firing timers
+;;
+;; Arms 1000, 10000 and 100000 serve-event timers due at random times
+;; over the next two seconds, cancels every other one, and serves
+;; events until the rest have been called.  Reports the cost of arming
+;; and of cancelling a timer, how late the timers were called, and how
+;; many times SERVE-EVENT returned, which is about how often the event
+;; loop woke up.
+;;
+;; Load after sysdep/setup-cmucl.
+
+
+(in-package :cl-bench)
+
+(defun real-time-usec ()
+  (multiple-value-bind (ok sec usec)
+      (unix:unix-gettimeofday)
+    (declare (ignore ok))
+    (+ (* sec 1000000) usec)))
+
+(defun bench-timer-count (count &key (spread 2.0))
+  (let* ((timers (make-array count))
+         (due (make-array count))
+         (lateness (make-array (ceiling count 2)))
+         (fired 0)
+         (wakeups 0)
+         (state (make-random-state nil))
+         arm-usec cancel-usec)
+    (let ((start (real-time-usec)))
+      (dotimes (i count)
+        (let* ((i i)
+               (delay (random spread state)))
+          (setf (svref due i) (+ start (round (* delay 1000000))))
+          (setf (svref timers i)
+                (system:add-timer
+                 delay
+                 #'(lambda ()
+                     (setf (svref lateness fired)
+                           (- (real-time-usec) (svref due i)))
+                     (incf fired))))))
+      (setq arm-usec (- (real-time-usec) start)))
+    (let ((start (real-time-usec)))
+      (loop for i from 1 below count by 2
+            do (system:remove-timer (svref timers i)))
+      (setq cancel-usec (- (real-time-usec) start)))
+    (loop while (< fired (length lateness))
+          do (system:serve-event)
+             (incf wakeups))
+    (let ((sorted (sort lateness #'<)))
+      (format t ";; ~8d ~10,3f ~10,3f ~10,2f ~10,2f ~10,2f ~8d~%"
+              count
+              (/ arm-usec count)
+              (/ cancel-usec (floor count 2))
+              (/ (svref sorted (floor (length sorted) 2)) 1000.0)
+              (/ (svref sorted (floor (* (length sorted) 99) 100)) 1000.0)
+              (/ (svref sorted (1- (length sorted))) 1000.0)
+              wakeups))))
+
+(defun bench-timers ()
+  (format t "~&;; Serve-event timers: arm and cancel in microseconds, lateness in ms~%")
+  (format t ";; ~8@a ~10@a ~10@a ~10@a ~10@a ~10@a ~8@a~%"
+          "Timers" "arm" "cancel" "late p50" "late p99" "late max" "wakeups")
+  (dolist (count '(1000 10000 100000))
+    (bench-timer-count count)))
+
+(bench-timers)
+
+;; EOF
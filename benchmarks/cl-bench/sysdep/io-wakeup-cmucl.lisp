@@ -0,0 +1,90 @@
+;;; io-wakeup-cmucl.lisp --- serve-event wakeup latency
+;;
+;; Registers input handlers on the read ends of 10, 1000 and 10000
+;; idle pipes, plus one more pipe that is written to, and times how
+;; long SERVE-EVENT takes from the write to the call of its handler,
+;; with each backend of SYSTEM:*SERVE-EVENT-BACKEND*.  Select can't
+;; wait on descriptors past UNIX:FD-SETSIZE, so it is skipped for the
+;; larger counts.  Needs a descriptor limit above 20000 (ulimit -n);
+;; run-cmucl-io.sh raises it.
+;;
+;; Load after sysdep/setup-cmucl.
+
+
+(in-package :cl-bench)
+
+(defun real-time-nsec ()
+  (multiple-value-bind (ok sec usec)
+      (unix:unix-gettimeofday)
+    (declare (ignore ok))
+    (* (+ (* sec 1000000) usec) 1000)))
+
+(defun make-pipes (count)
+  (loop repeat count
+        collect (multiple-value-bind (in out)
+                    (unix:unix-pipe)
+                  (unless in
+                    (error "Can't make ~D pipes: ~A" count
+                           (unix:get-unix-error-msg out)))
+                  (cons in out))))
+
+(defun close-pipes (pipes)
+  (loop for (in . out) in pipes
+        do (unix:unix-close in)
+           (unix:unix-close out)))
+
+(defun bench-wakeup (backend idle &key (rounds 2000))
+  (let* ((system:*serve-event-backend* backend)
+         (pipes (make-pipes idle))
+         (handlers (loop for (in) in pipes
+                         collect (system:add-fd-handler
+                                  in :input #'(lambda (fd)
+                                                (error "Idle descriptor ~D woke up."
+                                                       fd)))))
+         (active (first (make-pipes 1)))
+         (byte (make-array 1 :element-type '(unsigned-byte 8)))
+         (woken nil)
+         (latencies (make-array rounds)))
+    (unwind-protect
+         (let ((handler (system:add-fd-handler
+                         (car active) :input
+                         #'(lambda (fd)
+                             (unix:unix-read fd (sys:vector-sap byte) 1)
+                             (setq woken t)))))
+           (unwind-protect
+                (progn
+                  ;; Let the backend register everything first.
+                  (system:serve-event 0)
+                  (dotimes (i rounds)
+                    (setq woken nil)
+                    (let ((start (real-time-nsec)))
+                      (unix:unix-write (cdr active) byte 0 1)
+                      (loop until woken
+                            do (system:serve-event))
+                      (setf (svref latencies i)
+                            (- (real-time-nsec) start)))))
+             (system:remove-fd-handler handler)))
+      (mapc #'system:remove-fd-handler handlers)
+      (close-pipes (cons active pipes)))
+    (let ((sorted (sort latencies #'<)))
+      (format t ";; ~8a ~8d ~12,2f ~12,2f ~12,2f~%"
+              backend idle
+              (/ (reduce #'+ sorted) rounds 1000.0)
+              (/ (svref sorted (floor rounds 2)) 1000.0)
+              (/ (svref sorted (floor (* rounds 99) 100)) 1000.0)))))
+
+(defun bench-wakeups ()
+  (format t "~&;; Serve-event wakeup latency, in microseconds~%")
+  (format t ";; ~8a ~8@a ~12@a ~12@a ~12@a~%"
+          "Backend" "Idle" "mean" "p50" "p99")
+  (dolist (idle '(10 1000 10000))
+    (dolist (backend '(:select :epoll))
+      ;; Two descriptors a pipe, and the active pipe.
+      (if (and (eq backend :select)
+               (>= (+ (* 2 idle) 8) unix:fd-setsize))
+          (format t ";; ~8a ~8d ~12@a~%" backend idle "n/a")
+          (bench-wakeup backend idle)))))
+
+(bench-wakeups)
+
+;; EOF
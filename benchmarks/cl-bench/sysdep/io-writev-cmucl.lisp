@@ -0,0 +1,91 @@
+;;; io-writev-cmucl.lisp --- fd-stream output to a slow reader
+;;
+;; Streams 256MB over a loopback TCP connection from a non-blocking
+;; fd-stream to a reader that takes only a few kilobytes each time
+;; SERVE-EVENT calls it, so that the writer backs up and its flushed
+;; buffers wait in the stream's output-later queue.  Reports the
+;; throughput and the number of write system calls the process made,
+;; read from the syscw line of /proc/self/io, for several reader chunk
+;; sizes.  Fewer, larger writes are what writev on the queue buys.
+;;
+;; Load after sysdep/setup-cmucl.
+
+
+(in-package :cl-bench)
+
+(defvar *io-writev-bytes* (* 256 1024 1024))
+
+(defun real-time-usec ()
+  (multiple-value-bind (ok sec usec)
+      (unix:unix-gettimeofday)
+    (declare (ignore ok))
+    (+ (* sec 1000000) usec)))
+
+(defun write-syscalls ()
+  (with-open-file (io "/proc/self/io" :if-does-not-exist nil)
+    (when io
+      (loop for line = (read-line io nil)
+            while line
+            when (and (> (length line) 6) (string= "syscw:" line :end2 6))
+              return (parse-integer line :start 6)))))
+
+(defun open-loopback-pair ()
+  (let* ((listener (ext:create-inet-listener 0 :stream :host "127.0.0.1"))
+         (port (nth-value 1 (ext:get-socket-host-and-port listener)))
+         (out (ext:connect-to-inet-socket "127.0.0.1" port))
+         (in (ext:accept-tcp-connection listener)))
+    (ext:close-socket listener)
+    (values in out)))
+
+(defun bench-slow-reader (read-chunk &key (write-chunk 4096))
+  (multiple-value-bind (in out)
+      (open-loopback-pair)
+    (unix:unix-fcntl out unix:f-setfl unix:fndelay)
+    (let* ((stream (system:make-fd-stream out :output t
+                                              :element-type '(unsigned-byte 8)))
+           (chunk (make-array write-chunk :element-type '(unsigned-byte 8)
+                                          :initial-element 7))
+           (buffer (make-array read-chunk :element-type '(unsigned-byte 8)))
+           (received 0)
+           (reader (system:add-fd-handler
+                    in :input
+                    #'(lambda (fd)
+                        (let ((count (unix:unix-read fd (sys:vector-sap buffer)
+                                                     read-chunk)))
+                          (when count
+                            (incf received count))))))
+           (syscalls (write-syscalls))
+           (start (real-time-usec)))
+      (unwind-protect
+           (progn
+             (loop repeat (floor *io-writev-bytes* write-chunk)
+                   do (write-sequence chunk stream)
+                      (force-output stream)
+                      (system:serve-event 0))
+             (finish-output stream)
+             (loop while (< received *io-writev-bytes*)
+                   do (system:serve-event)))
+        (system:remove-fd-handler reader)
+        (close stream)
+        (unix:unix-close in))
+      (let ((usec (- (real-time-usec) start))
+            (writes (and syscalls (- (write-syscalls) syscalls))))
+        (format t ";; ~10d ~12,1f ~12@a ~12@a~%"
+                read-chunk
+                (/ (* *io-writev-bytes* 1000000.0) (max usec 1) (* 1024 1024))
+                (or writes "n/a")
+                (if writes
+                    (floor *io-writev-bytes* (max writes 1))
+                    "n/a"))))))
+
+(defun bench-slow-readers ()
+  (format t "~&;; ~D MB to a slow reader, 4KB forced writes~%"
+          (floor *io-writev-bytes* (* 1024 1024)))
+  (format t ";; ~10@a ~12@a ~12@a ~12@a~%"
+          "Read size" "MB/s" "writes" "bytes/write")
+  (dolist (read-chunk '(1024 8192 65536))
+    (bench-slow-reader read-chunk)))
+
+(bench-slow-readers)
+
+;; EOF
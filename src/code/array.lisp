@@ -212,6 +212,40 @@
 	   (push (make-weak-pointer vector) *static-vectors*)
 	   vector))))))
 
+;;; MAKE-PINNED-VECTOR  --  Internal
+;;;
+;;;    Make a vector that the garbage collector never moves, so that its
+;;; data can be handed to foreign code, read(2) and write(2) say, without
+;;; copying it or disabling GC around the call.  Unlike a static vector it
+;;; lives in the heap and is freed like any other object.  Gencgc does this
+;;; by giving the vector large object pages of its own, which it promotes
+;;; in place rather than copying; elsewhere we make a static vector.
+;;;
+(defun make-pinned-vector (length element-type)
+  #-gencgc
+  (make-static-vector length element-type)
+  #+gencgc
+  (multiple-value-bind (type bits)
+      (%vector-type-code element-type)
+    (declare (type (unsigned-byte 8) type)
+	     (type (integer 1 256) bits))
+    ;; The pages are not scavenged, so the elements must be unboxed.
+    (when (= type vm:simple-vector-type)
+      (error (intl:gettext "Cannot make a pinned array of element type ~S")
+	     element-type))
+    (let ((words (ceiling (* (if (= type vm:simple-string-type)
+				 (1+ length)
+				 length)
+			     bits)
+			  vm:word-bits)))
+      (sys:without-gcing
+       (kernel:make-lisp-obj
+	(alien:alien-funcall
+	 (alien:extern-alien "gc_alloc_pinned_vector"
+			     (function c-call:unsigned-long
+				       c-call:int c-call:int c-call:int))
+	 type length words))))))
+
 (defun make-array (dimensions &key
 			      (element-type t)
 			      (initial-element nil initial-element-p)
@@ -242,8 +276,10 @@
       actually index displaced-index-offset of the target displaced array. 
   :Allocation
       How to allocate the array.  If :MALLOC, a static, nonmovable array is
-      created.  This array is created by calling malloc."
-  (declare (type (member nil :malloc) allocation))
+      created.  This array is created by calling malloc.  If :PINNED, a
+      simple vector is created in the heap that GC never moves; it can be
+      passed to foreign code without WITHOUT-GCING and is freed by GC."
+  (declare (type (member nil :malloc :pinned) allocation))
   (let* ((dimensions (if (listp dimensions) dimensions (list dimensions)))
 	 (array-rank (length (the list dimensions)))
 	 (static-array-p (eq allocation :malloc))
@@ -257,6 +293,9 @@
       (error (intl:gettext "Cannot make an adjustable static array")))
     (when (and displaced-to static-array-p)
       (error (intl:gettext "Cannot make a displaced array static")))
+    (when (and (eq allocation :pinned)
+	       (not (and simple (= array-rank 1))))
+      (error (intl:gettext "A pinned array must be a simple vector")))
     (if (and simple (= array-rank 1))
 	;; It's a (simple-array * (*))
 	(multiple-value-bind (type bits)
@@ -264,16 +303,20 @@
 	  (declare (type (unsigned-byte 8) type)
 		   (type (integer 1 256) bits))
 	  (let* ((length (car dimensions))
-		 (array (if static-array-p
-			    (make-static-vector length element-type)
-			    (allocate-vector
-			     type
-			     length
-			     (ceiling (* (if (= type vm:simple-string-type)
-					     (1+ length)
-					     length)
-					 bits)
-				      vm:word-bits)))))
+		 (array (case allocation
+			  (:malloc
+			   (make-static-vector length element-type))
+			  (:pinned
+			   (make-pinned-vector length element-type))
+			  (t
+			   (allocate-vector
+			    type
+			    length
+			    (ceiling (* (if (= type vm:simple-string-type)
+					    (1+ length)
+					    length)
+					bits)
+				     vm:word-bits))))))
 	    (declare (type index length))
 	    (when initial-element-p
 	      (fill array initial-element))
@@ -318,6 +318,51 @@
   platform-specific."
   "megabytes")
 
+#+gencgc
+(defswitch "gc-soft-dirty" nil
+  "Track writes to older generations with the kernel's soft-dirty page
+  bits instead of write protecting the pages, so the first write to
+  such a page doesn't cost a page fault.  Linux only.")
+
+#+gencgc
+(defswitch "gc-huge-pages" nil
+  "Back the dynamic space with transparent huge pages, and give free
+  memory back to the kernel a whole huge page at a time.  Linux only.")
+
+#+gencgc
+(defswitch "gc-mark-region" nil
+  "Collect the oldest generation by marking it first and leaving its
+  densely occupied pages in place instead of copying everything, so
+  full GCs need less free memory.  x86 only.")
+
+#+gencgc
+(defswitch "gc-concurrent-mark" nil
+  "Mark the oldest generation a step at a time while the program runs,
+  starting from a snapshot taken as the generation nears its trigger, so
+  full GCs only have to finish the marking before leaving the dense pages
+  in place as with -gc-mark-region.  x86 only.")
+
+#+gencgc
+(defswitch "gc-pause-target" nil
+  "Adjust the nursery size and the promotion age of new objects so
+  that nursery GCs take no longer than the given number of
+  milliseconds."
+  "milliseconds")
+
+#+gencgc
+(defswitch "gc-time-target" nil
+  "Adjust the nursery size and the promotion age of new objects so
+  that no more than the given percentage of the run time is spent in
+  GC.  With -gc-pause-target too, the pause target wins."
+  "percent")
+
+#+gencgc
+(defswitch "shared-core" nil
+  "Write protect read-only and static space, so that their pages stay
+  shared between the processes started from the same core until they
+  are written.")
+
+#+gencgc
 (defswitch "lib" nil
   "A colon-separated list of directories to be used for the library:
   search-list."
@@ -200,6 +200,10 @@
 	   "UNIX-OPEN"
 	   "UNIX-READ"
 	   "UNIX-WRITE"
+	   "UNIX-WRITEV"
+	   "IOVEC"
+	   "IOV-BASE"
+	   "IOV-LEN"
 	   "UNIX-GETPAGESIZE"
 	   "UNIX-ERRNO"
 	   "UNIX-MAYBE-PREPEND-CURRENT-DIRECTORY"
@@ -413,6 +417,11 @@
 	   "TTY-OCRNL" "TTY-OFDEL" "TTY-OFILL" "TTY-OLCUC" "TTY-ONLRET" "TTY-ONOCR"
 	   "TTY-XCASE" "UNIX-DUP2" "UNIX-GETITIMER" "UNIX-PID" "UNIX-UNAME"
 	   "UTSNAME"
+	   "EPOLL-CLOEXEC" "EPOLL-CTL-ADD" "EPOLL-CTL-DEL" "EPOLL-CTL-MOD"
+	   "EPOLL-EVENT" "EPOLL-EVENTS" "EPOLL-FD" "EPOLLERR" "EPOLLHUP"
+	   "EPOLLIN" "EPOLLOUT" "UNIX-EPOLL-CREATE" "UNIX-EPOLL-CTL"
+	   "UNIX-EPOLL-WAIT" "SPLICE-F-MORE" "SPLICE-F-MOVE"
+	   "SPLICE-F-NONBLOCK" "UNIX-SENDFILE" "UNIX-SPLICE"
 	   )
   #+solaris
   (:export "D-INO"
@@ -1500,6 +1509,7 @@
              "COMPACT-INFO-ENVIRONMENT" "COMPILE-FROM-STREAM" "COMPILEDP"
              "COMPLETE-FILE"
              "CONSTANT" "CONSTANT-ARGUMENT" "CONSTANT-FUNCTION"
+             "COPY-STREAM-TO-STREAM"
 	     "DEF-SOURCE-CONTEXT"
              "DEFAULT-DIRECTORY"
              "DEFINE-INFO-CLASS"
@@ -1528,7 +1538,7 @@
              "PUTF" "PURGE-BACKUP-FILES" "QUIT" "RATIOP"
              "REALP"
              "RESET-FOREIGN-POINTERS"
-             "SAVE" "SAVE-LISP"
+             "SAVE" "SAVE-LISP" "SEND-FILE"
              "SCAVENGER-HOOK" "SCAVENGER-HOOK-P"
 	     "SCAVENGER-HOOK-VALUE" "SCAVENGER-HOOK-FUNCTION"
 	     "SEARCH-LIST"
@@ -2056,12 +2066,13 @@
 	   "%SP-FIND-CHARACTER-WITH-ATTRIBUTE"
 	   "%SP-REVERSE-FIND-CHARACTER-WITH-ATTRIBUTE" "%STANDARD-CHAR-P"
 	   "*BEEP-FUNCTION*"
-	   "*LONG-SITE-NAME*" "*SHORT-SITE-NAME*"
+	   "*LONG-SITE-NAME*" "*SERVE-EVENT-BACKEND*" "*SHORT-SITE-NAME*"
 	   "*SOFTWARE-TYPE*" "*STDERR*" "*STDIN*" "*STDOUT*" "*TASK-DATA*"
 	   "*TASK-NOTIFY*" "*TASK-SELF*" "*TTY*" "*TYPESCRIPTPORT*"
 	   "*XWINDOW-TABLE*"
 	   "ADD-FD-HANDLER" "ADD-PORT-DEATH-HANDLER" "ADD-PORT-OBJECT"
-	   "ADD-XWINDOW-OBJECT" "ALLOCATE-SYSTEM-MEMORY" "BEEP" "BITS"
+	   "ADD-TIMER" "ADD-XWINDOW-OBJECT" "ALLOCATE-SYSTEM-MEMORY"
+	   "BEEP" "BITS"
 	   "BYTES" "C-PROCEDURE" "CHECK<=" "CHECK=" "COMPILER-VERSION"
 	   "CT-A-VAL" "CT-A-VAL-OFFSET" "CT-A-VAL-P" "CT-A-VAL-SAP"
 	   "CT-A-VAL-SIZE" "CT-A-VAL-TYPE" "DEALLOCATE-SYSTEM-MEMORY"
@@ -2082,7 +2093,7 @@
 	   "PERQ-STRING" "POINTER" "POINTER<" "POINTER>" "PORT" "PRIMEP"
 	   "READ-N-BYTES" "REALLOCATE-SYSTEM-MEMORY" "RECORD-SIZE"
 	   "REMOVE-FD-HANDLER" "REMOVE-PORT-DEATH-HANDLER"
-	   "REMOVE-PORT-OBJECT" "REMOVE-XWINDOW-OBJECT"
+	   "REMOVE-PORT-OBJECT" "REMOVE-TIMER" "REMOVE-XWINDOW-OBJECT"
 	   "RESOLVE-LOADED-ASSEMBLER-REFERENCES" "SAP+" "SAP-" "SAP-INT"
 	   "SAP-REF-16" "SAP-REF-32" "SAP-REF-64" "SAP-REF-8"
 	   "SAP-REF-DESCRIPTOR"
@@ -29,7 +29,7 @@
 
 (in-package "EXTENSIONS")
 
-(export '(*backup-extension*))
+(export '(*backup-extension* copy-stream-to-stream send-file))
 
 
 (in-package "LISP")
@@ -39,29 +39,94 @@
 
 ;;;; Buffer manipulation routines.
 
-(defvar *available-buffers* ()
-  "List of available buffers.  Each buffer is an sap pointing to
-  bytes-per-buffer of memory.")
+(defconstant bytes-per-buffer (* 4 1024)
+  "Number of bytes per buffer, unless the stream asks for another size.
+  Also the smallest buffer size.")
 
-(defvar lisp::*enable-stream-buffer-p* nil)
+(defconstant max-bytes-per-buffer (* 16 1024 1024)
+  "The largest buffer size a stream can have.")
 
-(defconstant bytes-per-buffer (* 4 1024)
-  "Number of bytes per buffer.")
+;;; Buffers come in power of two sizes from BYTES-PER-BUFFER to
+;;; MAX-BYTES-PER-BUFFER, and are pooled by size.
+;;;
+(defconstant buffer-size-classes
+  (1+ (- (integer-length max-bytes-per-buffer)
+	 (integer-length bytes-per-buffer))))
+
+(defvar *available-buffers*
+  (make-array buffer-size-classes :initial-element nil)
+  "Vector of lists of available buffers, by size class.  Each buffer is an sap
+  pointing to bytes-per-buffer times a power of two bytes of memory.")
+
+(defvar *available-buffer-bytes* 0
+  "The number of bytes in all of the available buffers.")
+
+(defvar *max-available-buffer-bytes* (* 32 1024 1024)
+  "The most bytes the available buffers are allowed to hold.  Buffers
+  beyond that are given back to the system, largest first.")
+
+(declaim (type simple-vector *available-buffers*)
+	 (type index *available-buffer-bytes* *max-available-buffer-bytes*))
+
+(defvar lisp::*enable-stream-buffer-p* nil)
 
 ;; This limit is rather arbitrary
 (defconstant max-stream-element-size 1024
   "The maximum supported byte size for a stream element-type.")
 
+;;; BUFFER-SIZE-CLASS -- Internal.
+;;;
+;;; Return the size class of a buffer of at least BYTES bytes, and the size
+;;; of the buffers in that class.
+;;;
+(defun buffer-size-class (bytes)
+  (declare (type index bytes))
+  (let ((class (min (1- buffer-size-classes)
+		    (max 0 (- (integer-length (1- bytes))
+			      (1- (integer-length bytes-per-buffer)))))))
+    (values class (ash bytes-per-buffer class))))
+
 ;;; NEXT-AVAILABLE-BUFFER -- Internal.
 ;;;
-;;; Returns the next available buffer, creating one if necessary.
+;;; Returns the next available buffer of BYTES bytes, creating one if
+;;; necessary.  BYTES must be the size of a class.
+;;;
+(defun next-available-buffer (&optional (bytes bytes-per-buffer))
+  (declare (type index bytes))
+  (let ((class (buffer-size-class bytes)))
+    (cond ((svref *available-buffers* class)
+	   (decf *available-buffer-bytes* bytes)
+	   (pop (svref *available-buffers* class)))
+	  (t
+	   (allocate-system-memory bytes)))))
+
+;;; RELEASE-BUFFER -- Internal.
+;;;
+;;; Make the buffer SAP of BYTES bytes available again, and keep the pool
+;;; under its limit.
+;;;
+(defun release-buffer (sap &optional (bytes bytes-per-buffer))
+  (declare (type system-area-pointer sap) (type index bytes))
+  (push sap (svref *available-buffers* (buffer-size-class bytes)))
+  (incf *available-buffer-bytes* bytes)
+  (when (> *available-buffer-bytes* *max-available-buffer-bytes*)
+    (trim-available-buffers *max-available-buffer-bytes*)))
+
+;;; TRIM-AVAILABLE-BUFFERS -- Internal.
 ;;;
-(declaim (inline next-available-buffer))
+;;; Give available buffers back to the system, largest first, until they hold
+;;; no more than LIMIT bytes.
 ;;;
-(defun next-available-buffer ()
-  (if *available-buffers*
-      (pop *available-buffers*)
-      (allocate-system-memory bytes-per-buffer)))
+(defun trim-available-buffers (&optional (limit 0))
+  (declare (type index limit))
+  (loop for class from (1- buffer-size-classes) downto 0
+	for bytes = (ash bytes-per-buffer class)
+	do (loop while (and (> *available-buffer-bytes* limit)
+			    (svref *available-buffers* class))
+		 do (deallocate-system-memory
+		     (pop (svref *available-buffers* class))
+		     bytes)
+		    (decf *available-buffer-bytes* bytes))))
 
 (declaim (inline buffer-sap bref (setf bref) buffer-copy))
 
@@ -222,9 +287,14 @@
   (obuf-sap nil :type (or system-area-pointer null))
   (obuf-length nil :type (or index null))
   (obuf-tail 0 :type index)
+  ;;
+  ;; The size of the input and output buffers.
+  (buffer-size bytes-per-buffer :type index)
 
-  ;; Output flushed, but not written due to non-blocking io.
+  ;; Output flushed, but not written due to non-blocking io: a queue of
+  ;; (base start end buffer-length) entries, and its last cons.
   (output-later nil)
+  (output-later-tail nil)
   (handler nil)
   ;;
   ;; Timeout specified for this stream, or NIL if none.
@@ -312,64 +382,116 @@
   element-type output, the kind of buffering, the function name, and the number
   of bytes per element.")
 
+;;; The most queued writes DO-OUTPUT-LATER hands to writev at once.
+;;;
+(defconstant output-later-max-iovecs 64)
+
+;;; WRITE-OUTPUT-LATER -- internal
+;;;
+;;;   Write as much of the output-later queue as one writev will take,
+;;; returning what UNIX-WRITEV does.
+;;;
+(defun write-output-later (stream)
+  (alien:with-alien ((iov (array (alien:struct unix:iovec)
+				 #.output-later-max-iovecs)))
+    ;; Some of the bases may be Lisp vectors, which mustn't move
+    ;; between taking their address and the write.
+    (system:without-gcing
+     (let ((count 0))
+       (declare (type index count))
+       (dolist (stuff (fd-stream-output-later stream))
+	 (when (= count output-later-max-iovecs)
+	   (return))
+	 (let ((base (car stuff))
+	       (start (cadr stuff))
+	       (end (caddr stuff))
+	       (iovec (alien:deref iov count)))
+	   (declare (type index start end))
+	   (setf (alien:slot iovec 'unix:iov-base)
+		 (sap+ (if (system-area-pointer-p base)
+			   base
+			   (vector-sap base))
+		       start))
+	   (setf (alien:slot iovec 'unix:iov-len) (- end start))
+	   (incf count)))
+       (unix:unix-writev (fd-stream-fd stream)
+			 (alien:cast iov (* (alien:struct unix:iovec)))
+			 count)))))
+
 ;;; DO-OUTPUT-LATER -- internal
 ;;;
 ;;;   Called by the server when we can write to the given file descriptor.
-;;; Attempt to write the data again. If it worked, remove the data from the
-;;; output-later list. If it didn't work, something is wrong.
+;;; Attempt to write the queued data again, several entries at a time with
+;;; writev, and remove what was written from the output-later queue, giving
+;;; back the buffers that are done with.  If nothing could be written,
+;;; something is wrong.
 ;;;
 (defun do-output-later (stream)
-  (let* ((stuff (pop (fd-stream-output-later stream)))
-	 (base (car stuff))
-	 (start (cadr stuff))
-	 (end (caddr stuff))
-	 (reuse-sap (cadddr stuff))
-	 (length (- end start)))
-    (declare (type index start end length))
-    (multiple-value-bind
-	(count errno)
-	(unix:unix-write (fd-stream-fd stream)
-			 base
-			 start
-			 length)
-      (cond ((not count)
-	     (if (= errno unix:ewouldblock)
-		 (error (intl:gettext "Write would have blocked, but SERVER told us to go."))
-		 (error (intl:gettext "While writing ~S: ~A")
-			stream (unix:get-unix-error-msg errno))))
-	    ((eql count length) ; Hot damn, it worked.
-	     (when reuse-sap
-	       (push base *available-buffers*)))
-	    ((not (null count)) ; Sorta worked.
-	     (push (list base
-			 (the index (+ start count))
-			 end)
-		   (fd-stream-output-later stream))))))
+  (multiple-value-bind
+      (count errno)
+      (let ((queue (fd-stream-output-later stream)))
+	(if (cdr queue)
+	    (write-output-later stream)
+	    (let ((stuff (car queue)))
+	      (unix:unix-write (fd-stream-fd stream)
+			       (car stuff)
+			       (cadr stuff)
+			       (- (the index (caddr stuff))
+				  (the index (cadr stuff)))))))
+    (cond ((not count)
+	   (if (= errno unix:ewouldblock)
+	       (error (intl:gettext "Write would have blocked, but SERVER told us to go."))
+	       (error (intl:gettext "While writing ~S: ~A")
+		      stream (unix:get-unix-error-msg errno))))
+	  (t
+	   (let ((count count))
+	     (declare (type index count))
+	     (loop
+	       (let* ((stuff (car (fd-stream-output-later stream)))
+		      (start (cadr stuff))
+		      (end (caddr stuff))
+		      (length (- end start)))
+		 (declare (type index start end length))
+		 (when (> length count)	; Sorta worked.
+		   (setf (cadr stuff) (+ start count))
+		   (return))
+		 ;; Hot damn, this one worked.
+		 (decf count length)
+		 (pop (fd-stream-output-later stream))
+		 (when (cadddr stuff)
+		   (release-buffer (car stuff) (cadddr stuff)))
+		 (unless (fd-stream-output-later stream)
+		   (return))))))))
   (unless (fd-stream-output-later stream)
+    (setf (fd-stream-output-later-tail stream) nil)
     (system:remove-fd-handler (fd-stream-handler stream))
     (setf (fd-stream-handler stream) nil)))
 
 ;;; OUTPUT-LATER -- internal
 ;;;
 ;;;   Arrange to output the string when we can write on the file descriptor.
+;;; If REUSE-SAP, BASE is the output buffer, which is given back to the pool
+;;; once written, and the stream gets a new one.
 ;;;
 (defun output-later (stream base start end reuse-sap)
-  (cond ((null (fd-stream-output-later stream))
-	 (setf (fd-stream-output-later stream)
-	       (list (list base start end reuse-sap)))
-	 (setf (fd-stream-handler stream)
-	       (system:add-fd-handler (fd-stream-fd stream)
-				      :output
-				      #'(lambda (fd)
-					  (declare (ignore fd))
-					  (do-output-later stream)))))
-	(t
-	 (nconc (fd-stream-output-later stream)
-		(list (list base start end reuse-sap)))))
+  (let ((later (list (list base start end
+			   (and reuse-sap (fd-stream-obuf-length stream))))))
+    (cond ((null (fd-stream-output-later stream))
+	   (setf (fd-stream-output-later stream) later)
+	   (setf (fd-stream-handler stream)
+		 (system:add-fd-handler (fd-stream-fd stream)
+					:output
+					#'(lambda (fd)
+					    (declare (ignore fd))
+					    (do-output-later stream)))))
+	  (t
+	   (setf (cdr (fd-stream-output-later-tail stream)) later)))
+    (setf (fd-stream-output-later-tail stream) later))
   (when reuse-sap
-    (let ((new-buffer (next-available-buffer)))
+    (let* ((length (fd-stream-obuf-length stream))
+	   (new-buffer (next-available-buffer length)))
       (setf (fd-stream-obuf-sap stream) new-buffer)
-      (setf (fd-stream-obuf-length stream) bytes-per-buffer)))) 
+      (setf (fd-stream-obuf-length stream) length))))
 
 ;;; DO-OUTPUT -- internal
 ;;;
@@ -1383,10 +1505,12 @@
 	(output-size nil))
     
     (when (fd-stream-obuf-sap stream)
-      (push (fd-stream-obuf-sap stream) *available-buffers*)
+      (release-buffer (fd-stream-obuf-sap stream)
+		      (fd-stream-obuf-length stream))
       (setf (fd-stream-obuf-sap stream) nil))
     (when (fd-stream-ibuf-sap stream)
-      (push (fd-stream-ibuf-sap stream) *available-buffers*)
+      (release-buffer (fd-stream-ibuf-sap stream)
+		      (fd-stream-ibuf-length stream))
       (setf (fd-stream-ibuf-sap stream) nil))
 
     #+unicode
@@ -1399,8 +1523,9 @@
 	  (pick-input-routine target-type)
 	(unless routine
 	  (error (intl:gettext "Could not find any input routine for ~S") target-type))
-	(setf (fd-stream-ibuf-sap stream) (next-available-buffer))
-	(setf (fd-stream-ibuf-length stream) bytes-per-buffer)
+	(setf (fd-stream-ibuf-sap stream)
+	      (next-available-buffer (fd-stream-buffer-size stream)))
+	(setf (fd-stream-ibuf-length stream) (fd-stream-buffer-size stream))
 	(setf (fd-stream-ibuf-tail stream) 0)
 
 	;; Set the in and bin methods.  Normally put an illegal input
@@ -1469,8 +1594,9 @@
 	  (error (intl:gettext "Could not find any output routine for ~S buffered ~S.")
 		 (fd-stream-buffering stream)
 		 target-type))
-	(setf (fd-stream-obuf-sap stream) (next-available-buffer))
-	(setf (fd-stream-obuf-length stream) bytes-per-buffer)
+	(setf (fd-stream-obuf-sap stream)
+	      (next-available-buffer (fd-stream-buffer-size stream)))
+	(setf (fd-stream-obuf-length stream) (fd-stream-buffer-size stream))
 	(setf (fd-stream-obuf-tail stream) 0)
 	;; Normally signal errors for reading from a stream with the
 	;; wrong element type, but allow binary-text-streams to read
@@ -1619,10 +1745,12 @@
        (cancel-finalization stream))
      (unix:unix-close (fd-stream-fd stream))
      (when (fd-stream-obuf-sap stream)
-       (push (fd-stream-obuf-sap stream) *available-buffers*)
+       (release-buffer (fd-stream-obuf-sap stream)
+		       (fd-stream-obuf-length stream))
        (setf (fd-stream-obuf-sap stream) nil))
      (when (fd-stream-ibuf-sap stream)
-       (push (fd-stream-ibuf-sap stream) *available-buffers*)
+       (release-buffer (fd-stream-ibuf-sap stream)
+		       (fd-stream-ibuf-length stream))
        (setf (fd-stream-ibuf-sap stream) nil))
      (lisp::set-closed-flame stream))
     (:clear-input
@@ -1865,9 +1993,11 @@
 		       (external-format :default)
 		       binary-stream-p
 		       decoding-error
-		       encoding-error)
+		       encoding-error
+		       (buffer-size bytes-per-buffer))
   (declare (type index fd) (type (or index null) timeout)
-	   (type (member :none :line :full) buffering))
+	   (type (member :none :line :full) buffering)
+	   (type index buffer-size))
   "Create a stream for the given unix file descriptor.
   If input is non-nil, allow input operations.
   If output is non-nil, allow output operations.
@@ -1880,7 +2010,9 @@
   Name is used to identify the stream when printed.
   External-format is the external format to use for the stream.
   Decoding-error and Encoding-error indicate how decoding/encoding errors on
-    the stream should be handled.  The default is to use a replacement character."
+    the stream should be handled.  The default is to use a replacement character.
+  Buffer-size is the size in bytes of the input and output buffers.  It is
+    rounded up to a power of two between 4KB and 16MB."
   (cond ((not (or input-p output-p))
 	 (setf input t))
 	((not (or input output))
@@ -1893,7 +2025,10 @@
 					      :delete-original delete-original
 					      :pathname pathname
 					      :buffering buffering
-					      :timeout timeout)
+					      :timeout timeout
+					      :buffer-size
+					      (nth-value 1 (buffer-size-class
+							    buffer-size)))
 		    (let ((e (cond ((characterp encoding-error)
 				    (constantly (char-code encoding-error)))
 				   (t
@@ -1920,6 +2055,9 @@
 				       :pathname pathname
 				       :buffering buffering
 				       :timeout timeout
+				       :buffer-size
+				       (nth-value 1 (buffer-size-class
+						     buffer-size))
 				       :char-to-octets-error e
 				       :octets-to-char-error d)))))
     ;; Set the lisp-stream flags appropriately for the kind of stream
@@ -2211,7 +2349,8 @@
 				(if-does-not-exist nil if-does-not-exist-given)
 				(external-format :default)
 		                class
-		                decoding-error encoding-error)
+		                decoding-error encoding-error
+				(buffer-size bytes-per-buffer))
   (declare (type pathname pathname)
            (type (member :input :output :io :probe) direction)
            (type (member :error :new-version :rename :rename-and-delete
@@ -2238,7 +2377,8 @@
 			 :external-format external-format
 			 :binary-stream-p class
 			 :decoding-error decoding-error
-			 :encoding-error encoding-error))
+			 :encoding-error encoding-error
+			 :buffer-size buffer-size))
 	(:probe
 	 (let ((stream (%make-fd-stream :name namestring :fd fd
 					:pathname pathname
@@ -2257,7 +2397,7 @@
 			   (if-does-not-exist nil if-does-not-exist-given)
 			   (external-format :default)
 			   class mapped input-handle output-handle
-	                   decoding-error encoding-error
+	                   decoding-error encoding-error buffer-size
 		      &allow-other-keys
 		      &aux ; Squelch assignment warning.
 		      (options options)
@@ -2290,10 +2430,13 @@
                        should be a symbol or function oof two
                        arguments: a format message string and the
                        incorrect codepoint.
+   :buffer-size - The size in bytes of the stream's buffers, for fd-streams.
+                       Larger buffers mean fewer system calls for bulk
+                       transfers.  The default is 4KB.
 
   See the manual for details."
   (declare (ignore element-type external-format input-handle output-handle
-		   decoding-error encoding-error))
+		   decoding-error encoding-error buffer-size))
 
   ;; OPEN signals a file-error if the filename is wild.
   (when (wild-pathname-p filename)
@@ -2340,6 +2483,7 @@
            (remf options :output-handle)
 	   (apply #'open-fd-stream filespec options))
 	  ((subtypep class 'stream:simple-stream)
+	   (remf options :buffer-size)
 	   (when element-type-given
              (cerror (intl:gettext "Do it anyway.")
 		     (intl:gettext "Can't create simple-streams with an element-type.")))
@@ -2361,6 +2505,171 @@
 	  (t
 	   (error (intl:gettext "Unable to open streams of class ~S.") class)))))
 
+;;;; Copying between streams.
+
+;;; The most octets asked of sendfile or splice at once.
+;;;
+(defconstant copy-stream-chunk (* 1024 1024))
+
+;;; OCTET-FD-STREAM-P -- Internal
+;;;
+;;;   True if STREAM is an fd-stream of octets, whose descriptor can be
+;;; copied to or from directly.
+;;;
+(defun octet-fd-stream-p (stream)
+  (and (fd-stream-p stream)
+       (= (fd-stream-element-size stream) 1)
+       (not (subtypep (fd-stream-element-type stream) 'character))))
+
+;;; WAIT-FOR-COPY -- Internal
+;;;
+;;;   Wait until FD is usable for DIRECTION, for a copy that would have
+;;; blocked.
+;;;
+(defun wait-for-copy (stream fd direction)
+  (unless #-mp (system:wait-until-fd-usable fd direction
+					    (fd-stream-timeout stream))
+	  #+mp (mp:process-wait-until-fd-usable fd direction
+						(fd-stream-timeout stream))
+    (error 'io-timeout :stream stream
+	   :direction (if (eq direction :input) :read :write))))
+
+;;; KERNEL-COPY-FD-STREAMS -- Internal
+;;;
+;;;   Copy up to COUNT octets, or all of them if COUNT is NIL, from the
+;;; octet fd-stream INPUT to OUTPUT, having the kernel move what isn't
+;;; already buffered.  Return the number copied and true if the copy is
+;;; done, or false if the kernel can't copy between these descriptors and
+;;; the rest has to be copied some other way.
+;;;
+#+linux
+(defun kernel-copy-fd-streams (input output count)
+  (declare (type fd-stream input output) (type (or index null) count))
+  (let ((copied 0)
+	(method :sendfile)
+	(in-fd (fd-stream-fd input))
+	(out-fd (fd-stream-fd output)))
+    (declare (type index copied))
+    ;;
+    ;; What INPUT has buffered goes first, and all of OUTPUT's output
+    ;; has to reach the descriptor before the kernel adds to it.
+    (let* ((head (fd-stream-ibuf-head input))
+	   (available (- (fd-stream-ibuf-tail input) head))
+	   (bytes (if count (min count available) available)))
+      (declare (type index head available bytes))
+      (unless (zerop bytes)
+	(output-raw-bytes output (fd-stream-ibuf-sap input) head (+ head bytes))
+	(setf (fd-stream-ibuf-head input) (+ head bytes))
+	(setf copied bytes)))
+    (finish-output output)
+    (setf (fd-stream-listen input) nil)
+    (loop
+      (let ((want (if count
+		      (min (- count copied) copy-stream-chunk)
+		      copy-stream-chunk)))
+	(declare (type index want))
+	(when (zerop want)
+	  (return (values copied t)))
+	(multiple-value-bind (n errno)
+	    (if (eq method :sendfile)
+		(unix:unix-sendfile out-fd in-fd want)
+		(unix:unix-splice in-fd out-fd want unix:splice-f-more))
+	  (cond ((null n)
+		 (cond ((eql errno unix:eintr))
+		       ((eql errno unix:eagain)
+			;; Sendfile reads a file, so it's the output that is
+			;; full; splice may be waiting on either.
+			(when (eq method :splice)
+			  (wait-for-copy input in-fd :input))
+			(wait-for-copy output out-fd :output))
+		       ((not (or (eql errno unix:einval)
+				 (eql errno unix:enosys)))
+			(error 'simple-stream-error
+			       :stream output
+			       :format-control "while copying from ~S: ~A"
+			       :format-arguments
+			       (list input (unix:get-unix-error-msg errno))))
+		       ((eq method :sendfile)
+			;; The input isn't a file; one end may be a pipe.
+			(setf method :splice))
+		       (t
+			(return (values copied nil)))))
+		((zerop n)
+		 ;; End of the input.
+		 (return (values copied t)))
+		(t
+		 (incf copied n))))))))
+
+;;; COPY-STREAM-LOOP -- Internal
+;;;
+;;;   Copy up to COUNT elements, or all of them if COUNT is NIL, from INPUT
+;;; to OUTPUT through a buffer of BUFFER-SIZE elements.  Return the number
+;;; copied.
+;;;
+(defun copy-stream-loop (input output count buffer-size)
+  (declare (type stream input output) (type (or index null) count)
+	   (type index buffer-size))
+  (let* ((element-type (stream-element-type input))
+	 (buffer (if (subtypep element-type 'character)
+		     (make-string buffer-size)
+		     (make-array buffer-size :element-type element-type)))
+	 (copied 0))
+    (declare (type index copied))
+    (loop
+      (let* ((want (if count
+		       (min buffer-size (- count copied))
+		       buffer-size))
+	     (n (if (zerop want)
+		    0
+		    (read-sequence buffer input :end want))))
+	(declare (type index want n))
+	(write-sequence buffer output :end n)
+	(incf copied n)
+	;; READ-SEQUENCE only comes up short at the end of the input.
+	(when (or (zerop n) (< n want))
+	  (return copied))))))
+
+;;; COPY-STREAM-TO-STREAM -- Public
+;;;
+(defun copy-stream-to-stream (input output &key count (buffer-size (* 64 1024)))
+  "Copy elements from INPUT to OUTPUT until the end of INPUT, or until
+  COUNT elements have been copied if COUNT is given, and return the number
+  copied.  When both are fd-streams of octets, whatever INPUT has buffered
+  is written first, OUTPUT is flushed, and the rest is moved by the kernel
+  with sendfile or splice where it can be.  Otherwise the elements are
+  copied through a buffer of BUFFER-SIZE elements."
+  (declare (type stream input output) (type (or index null) count)
+	   (type index buffer-size))
+  (let ((copied 0)
+	(done nil))
+    (declare (type index copied))
+    #+linux
+    (when (and (octet-fd-stream-p input)
+	       (octet-fd-stream-p output)
+	       (null (fd-stream-unread input)))
+      (multiple-value-setq (copied done)
+	(kernel-copy-fd-streams input output count)))
+    (if done
+	copied
+	(+ copied
+	   (copy-stream-loop input output (and count (- count copied))
+			     buffer-size)))))
+
+;;; SEND-FILE -- Public
+;;;
+(defun send-file (pathname output &key (start 0) end)
+  "Write the octets of the file PATHNAME from START up to END, or to the
+  end of the file, to the stream OUTPUT with COPY-STREAM-TO-STREAM, and
+  return how many were written.  To an fd-stream of octets, such as a
+  socket stream, the kernel sends the file without copying it through Lisp."
+  (declare (type index start) (type (or index null) end))
+  (with-open-file (input pathname :element-type '(unsigned-byte 8))
+    (unless (zerop start)
+      (file-position input start))
+    (copy-stream-to-stream input output
+			   :count (and end (max 0 (- end start))))))
+
+
 ;;;; Initialization.
 
 (defvar *tty* nil
@@ -2394,7 +2703,8 @@
 ;;; Called whenever a saved core is restarted.
 ;;; 
 (defun stream-reinit ()
-  (setf *available-buffers* nil)
+  (fill *available-buffers* nil)
+  (setf *available-buffer-bytes* 0)
   (setf *stdin*
 	(make-fd-stream 0 :name "Standard Input" :input t :buffering :line
 			:external-format :utf-8))
@@ -469,6 +469,23 @@
        (warn (intl:gettext "(FUNCALL ~S~{ ~S~}) lost:~%~A") ',function ',args cond)
        nil)))
 
+;;;
+;;; NEXT-GC-BYTES -- Internal
+;;;
+;;; The number of bytes to cons before the next GC: the nursery size
+;;; picked by the gencgc policy when a pause or GC time target is set,
+;;; otherwise *BYTES-CONSED-BETWEEN-GCS*.
+;;;
+(defun next-gc-bytes ()
+  #+gencgc
+  (let ((nursery (alien:extern-alien "gc_policy_nursery_bytes"
+				     c-call:unsigned-long)))
+    (if (zerop nursery)
+	*bytes-consed-between-gcs*
+	nursery))
+  #-gencgc
+  *bytes-consed-between-gcs*)
+
 ;;;
 ;;; SUB-GC -- Internal
 ;;;
@@ -534,7 +551,7 @@
 		(setq *last-bytes-in-use* post-gc-dyn-usage))
 	      (setf *need-to-collect-garbage* nil)
 	      (setf *gc-trigger*
-		    (+ post-gc-dyn-usage *bytes-consed-between-gcs*))
+		    (+ post-gc-dyn-usage (next-gc-bytes)))
 	      (set-auto-gc-trigger *gc-trigger*)
 	      (dolist (hook *after-gc-hooks*)
 		(carefully-funcall hook))
@@ -670,4 +687,307 @@
 (alien:def-alien-routine set-max-gen-to-gc c-call:unsigned-int
   (gen c-call:int))
 
+;; Non-zero if full GCs leave the dense pages of the oldest generation
+;; in place, initially set by the -gc-mark-region switch.  A page block
+;; is dense if at least gencgc-mark-region-density percent of it is
+;; live.
+(alien:def-alien-variable ("gencgc_mark_region" gencgc-mark-region) c-call:int)
+
+(alien:def-alien-variable ("gencgc_mark_region_density"
+			   gencgc-mark-region-density)
+  c-call:int)
+
+(defun gencgc-mark-region-stats ()
+  "Return some statistics about mark-region collection of the oldest
+  generation (see the -gc-mark-region switch): the number of pages left
+  in place, the number of bytes of dead objects overwritten in those
+  pages, and the total time in microseconds spent marking."
+  (values (alien:extern-alien "gc_mark_region_pages" c-call:unsigned-long-long)
+	  (alien:extern-alien "gc_mark_region_filled_bytes"
+			      c-call:unsigned-long-long)
+	  (alien:extern-alien "gc_mark_region_usec" c-call:unsigned-long-long)))
+
+;; Non-zero if the oldest generation is marked a step at a time between
+;; GCs, initially set by the -gc-concurrent-mark switch.  Marking starts
+;; when a GC leaves the oldest generation at gencgc-concurrent-mark-start
+;; percent of its trigger, and each step marks about
+;; gencgc-concurrent-mark-step words.
+(alien:def-alien-variable ("gencgc_concurrent_mark" gencgc-concurrent-mark)
+  c-call:int)
+
+(alien:def-alien-variable ("gencgc_concurrent_mark_start"
+			   gencgc-concurrent-mark-start)
+  c-call:int)
+
+(alien:def-alien-variable ("gencgc_concurrent_mark_step"
+			   gencgc-concurrent-mark-step)
+  c-call:int)
+
+(defun gencgc-concurrent-mark-stats ()
+  "Return some statistics about concurrent marking of the oldest
+  generation (see the -gc-concurrent-mark switch): the total time in
+  microseconds spent in mark steps, the number of pages scanned when
+  first written, and the total time in microseconds spent finishing the
+  marking in full GCs."
+  (values (alien:extern-alien "gc_concurrent_mark_usec"
+			      c-call:unsigned-long-long)
+	  (alien:extern-alien "gc_satb_pages" c-call:unsigned-long-long)
+	  (alien:extern-alien "gc_remark_usec" c-call:unsigned-long-long)))
+
+(defun gencgc-write-barrier-stats ()
+  "Return some statistics about the GC write barrier: the number of
+  write faults on protected pages, the number of protected pages found
+  written through the soft-dirty page bits (see the -gc-soft-dirty
+  switch), and the total time in microseconds spent scavenging older
+  generations for pointers to the generation being collected."
+  (values (alien:extern-alien "gc_write_faults" c-call:unsigned-long-long)
+	  (alien:extern-alien "gc_soft_dirty_pages" c-call:unsigned-long-long)
+	  (alien:extern-alien "gc_scavenge_generation_usec" c-call:unsigned-long-long)))
+
+(defun gencgc-weak-stats ()
+  "Return some statistics about weak hash tables in GC: the number of
+  weak tables and of their entries looked at, the number of times an
+  entry waiting for its key or value to survive was checked again, the
+  number of entries removed, and the time in microseconds the most
+  recent GC spent on weak tables."
+  (values (alien:extern-alien "gc_weak_tables" c-call:unsigned-long-long)
+	  (alien:extern-alien "gc_weak_entries" c-call:unsigned-long-long)
+	  (alien:extern-alien "gc_weak_rechecks" c-call:unsigned-long-long)
+	  (alien:extern-alien "gc_weak_removed" c-call:unsigned-long-long)
+	  (alien:extern-alien "gc_weak_usec" c-call:unsigned-long-long)))
+
+(defun gencgc-large-object-stats ()
+  "Return some statistics about large objects: the number whose pages
+  were found in the index of free page runs, the number that needed a
+  search of the page table, and the number of pinned vectors made by
+  MAKE-ARRAY with :ALLOCATION :PINNED and their total size in bytes."
+  (values (alien:extern-alien "gc_large_run_hits" c-call:unsigned-long-long)
+	  (alien:extern-alien "gc_large_run_misses" c-call:unsigned-long-long)
+	  (alien:extern-alien "gc_pinned_vectors" c-call:unsigned-long-long)
+	  (alien:extern-alien "gc_pinned_bytes" c-call:unsigned-long-long)))
+
+;; The number of free pages claimed at a time for the allocation region,
+;; so that most refills of the region don't search the page table.  1
+;; turns this off.
+(alien:def-alien-variable ("gencgc_alloc_batch_pages" gencgc-alloc-batch-pages)
+  c-call:int)
+
+(defun gencgc-alloc-refill-stats ()
+  "Return some statistics about refilling the allocation region: the
+  number of refills, the total time in nanoseconds they took, and the
+  number of times the page table was searched for free pages."
+  (values (alien:extern-alien "gc_alloc_refills" c-call:unsigned-long-long)
+	  (alien:extern-alien "gc_alloc_refill_nsec" c-call:unsigned-long-long)
+	  (alien:extern-alien "gc_alloc_page_searches"
+			      c-call:unsigned-long-long)))
+
+(defun gencgc-alloc-search-histogram ()
+  "Return a vector of the number of searches for the pages of a new
+  allocation region or large object, by how long they took: element I
+  counts the searches that took from 2^I up to 2^(I+1) nanoseconds."
+  (let* ((histogram (alien:extern-alien "gc_alloc_search_histogram"
+					(array c-call:unsigned-long-long 32)))
+	 (result (make-array 32)))
+    (dotimes (i 32 result)
+      (setf (aref result i) (alien:deref histogram i)))))
+
+;; Allocation sampling: when the allocation region is refilled and at
+;; least this many bytes have been allocated since the last sample, the
+;; functions on the stack and the type of the object are recorded.  0
+;; turns sampling off.
+(alien:def-alien-variable ("gencgc_alloc_sample_bytes" gencgc-alloc-sample-bytes)
+  c-call:unsigned-long)
+
+(defun alloc-profile-start (&key (bytes 524288) (reset t))
+  "Start sampling allocation about every BYTES bytes.  Unless RESET is
+  NIL, the samples taken before are discarded."
+  (when reset
+    (alien:alien-funcall
+     (alien:extern-alien "gc_alloc_samples_reset" (function c-call:void))))
+  (setf gencgc-alloc-sample-bytes bytes))
+
+(defun alloc-profile-stop ()
+  "Stop sampling allocation, keeping the samples taken."
+  (setf gencgc-alloc-sample-bytes 0))
+
+(defun alloc-profile-samples ()
+  "Return a list of the allocation samples with the same stack and
+  object type, most bytes first.  Each is a list of the bytes they
+  stand for, the number of samples, the type of the object and the
+  names of the functions on the stack, innermost first."
+  (let ((samples '()))
+    (dotimes (i (alien:alien-funcall
+		 (alien:extern-alien "gc_alloc_sample_count"
+				     (function c-call:int))))
+      (flet ((field (n)
+	       (alien:alien-funcall
+		(alien:extern-alien "gc_alloc_sample_field"
+				    (function c-call:unsigned-long-long
+					      c-call:int c-call:int))
+		i n)))
+	(let ((type (field 2))
+	      (frames '()))
+	  (dotimes (j (field 3))
+	    (push (alien:alien-funcall
+		   (alien:extern-alien "gc_alloc_sample_frame"
+				       (function c-call:c-string
+						 c-call:int c-call:int))
+		   i j)
+		  frames))
+	  (push (list* (field 1) (field 0)
+		       (if (zerop type)
+			   'cons
+			   (let ((info (svref vm::*room-info* type)))
+			     (if info (vm::room-info-name info) type)))
+		       (nreverse frames))
+		samples))))
+    (sort samples #'> :key #'first)))
+
+(defun alloc-profile-report (&key (stream *standard-output*) (limit 20))
+  "Print the LIMIT allocation stacks with the most bytes, and the bytes
+  by object type."
+  (let ((samples (alloc-profile-samples))
+	(types (make-hash-table :test 'eq))
+	(total 0))
+    (dolist (sample samples)
+      (incf total (first sample))
+      (incf (gethash (third sample) types 0) (first sample)))
+    (format stream (intl:gettext "~&~:D bytes sampled, ~D samples taken, ~D dropped.~%")
+	    total
+	    (alien:extern-alien "gc_alloc_samples" c-call:unsigned-long-long)
+	    (alien:extern-alien "gc_alloc_samples_dropped"
+				c-call:unsigned-long-long))
+    (let ((by-type '()))
+      (maphash #'(lambda (type bytes) (push (cons type bytes) by-type)) types)
+      (dolist (entry (sort by-type #'> :key #'cdr))
+	(format stream "~14:D ~5,1F% ~A~%" (cdr entry)
+		(* 100.0 (/ (cdr entry) (max total 1))) (car entry))))
+    (loop for (bytes count type . frames) in samples
+	  repeat limit
+	  do (format stream (intl:gettext "~&~:D bytes, ~D samples, ~A~%")
+		     bytes count type)
+	     (dolist (frame frames)
+	       (format stream "    ~A~%" frame)))
+    (values)))
+
+(defun alloc-profile-write-folded (file)
+  "Write the allocation samples to FILE in the folded format read by
+  flamegraph.pl: one line for each stack, outermost function first,
+  then the object type, separated by semicolons, then the bytes."
+  (with-open-file (stream file :direction :output :if-exists :supersede)
+    (loop for (bytes nil type . frames) in (alloc-profile-samples)
+	  do (format stream "~{~A;~}~A ~D~%" (reverse frames) type bytes)))
+  file)
+
+(defun gencgc-alloc-sample-stats ()
+  "Return some statistics about allocation sampling: the number of
+  samples taken, the number dropped for want of room, the total time
+  in nanoseconds spent taking them, and the bytes between samples in
+  use, which is more than asked for if sampling took over 5% of the
+  run time."
+  (values (alien:extern-alien "gc_alloc_samples" c-call:unsigned-long-long)
+	  (alien:extern-alien "gc_alloc_samples_dropped"
+			      c-call:unsigned-long-long)
+	  (alien:extern-alien "gc_alloc_sample_nsec"
+			      c-call:unsigned-long-long)
+	  (alien:extern-alien "gc_alloc_sample_interval"
+			      c-call:unsigned-long)))
+
+(defun write-heap-snapshot (file &key (gc t))
+  "Write a snapshot of the heap to FILE: every object with its type,
+  its size and the objects it points to, and the roots.  With GC true,
+  the default, do a full GC first so that only live objects remain.
+  The snapshot is written without consing and can be read with the
+  heap-snapshot contrib.  Return the number of objects written."
+  (when gc
+    (gc :full t))
+  (let ((objects (sys:without-gcing
+		   (alien:alien-funcall
+		    (alien:extern-alien "gc_write_heap_snapshot"
+					(function c-call:long c-call:c-string))
+		    (unix-namestring (merge-pathnames file) nil)))))
+    (when (minusp objects)
+      (error (intl:gettext "Couldn't write a heap snapshot to ~S.") file))
+    objects))
+
+(defparameter *gc-event-keys*
+  '(:collection :generation :raise :start :end :bytes-copied :bytes-freed
+    :pages-freed :prepare :stacks :roots :older :newspace :weak :free
+    :protect))
+
+(defun gc-events (&optional (since 0))
+  "Return a list of the GC events numbered SINCE or more, oldest first,
+  and the number of the next event.  Only the last 256 events are kept.
+  There is an event for each generation collected, a property list of
+  :collection, the number of the GC it was part of; :generation and
+  :raise; :start and :end, in nanoseconds of the monotonic clock;
+  :bytes-copied, the bytes copied or promoted to the next generation;
+  :bytes-freed and :pages-freed; and the nanoseconds spent in each phase:
+  :prepare, :stacks, :roots, :older, :newspace, :weak, :free and, for
+  the last generation of a GC, :protect.  The events can be read at any
+  time, even while the GC threads are running."
+  (let ((written (alien:extern-alien "gc_events_written"
+				     c-call:unsigned-long-long))
+	(words (length *gc-event-keys*))
+	(events '()))
+    (alien:with-alien ((event (array c-call:unsigned-long-long 16)))
+      (loop for n from (max since (- written 256)) below written
+	    when (= (alien:alien-funcall
+		     (alien:extern-alien "gc_event_read"
+					 (function c-call:int
+						   c-call:unsigned-long-long
+						   (* c-call:unsigned-long-long)
+						   c-call:int))
+		     n (alien:addr (alien:deref event 0)) words)
+		    words)
+	      do (push (loop for key in *gc-event-keys*
+			     for i from 0
+			     collect key
+			     collect (alien:deref event i))
+		       events)))
+    (values (nreverse events) written)))
+
+;; The GC policy targets, initially set by the -gc-pause-target and
+;; -gc-time-target switches: the longest nursery GC pause wanted, in
+;; microseconds, and the percentage of the run time that may be spent in
+;; GC.  With both 0, *bytes-consed-between-gcs* and the promotion ages
+;; are used as they are.  The nursery size the policy picks stays between
+;; the minimum and maximum; a maximum of 0 means an eighth of the dynamic
+;; space.
+(alien:def-alien-variable ("gencgc_pause_target_usec" gencgc-pause-target)
+  c-call:unsigned-long)
+
+(alien:def-alien-variable ("gencgc_gc_time_target" gencgc-gc-time-target)
+  c-call:int)
+
+(alien:def-alien-variable ("gencgc_nursery_min_bytes" gencgc-nursery-min-bytes)
+  c-call:unsigned-long)
+
+(alien:def-alien-variable ("gencgc_nursery_max_bytes" gencgc-nursery-max-bytes)
+  c-call:unsigned-long)
+
+(defun gencgc-policy-stats ()
+  "Return some statistics about the GC policy (see the -gc-pause-target
+  and -gc-time-target switches): the nursery size in bytes, or 0 if the
+  policy is off; the number of GCs the policy adjusted after; the
+  average nursery GC pause in microseconds; the average percentage of
+  the nursery surviving a GC; the average percentage of the time spent
+  in GC; and the promotion age of the nursery."
+  (values (alien:extern-alien "gc_policy_nursery_bytes" c-call:unsigned-long)
+	  (alien:extern-alien "gc_policy_updates" c-call:unsigned-long-long)
+	  (alien:extern-alien "gc_policy_pause_usec" c-call:unsigned-long)
+	  (alien:extern-alien "gc_policy_survival" c-call:int)
+	  (alien:extern-alien "gc_policy_gc_time" c-call:int)
+	  (nth-value 4 (gencgc-stats 0))))
+
+(defun gencgc-shared-core-stats ()
+  "Return the number of static space pages write protected at startup by
+  the -shared-core switch, and the number of them written since.  The
+  third and fourth values are the same for read-only space."
+  (values (alien:extern-alien "gc_static_pages" c-call:unsigned-long)
+	  (alien:extern-alien "gc_static_pages_written" c-call:unsigned-long)
+	  (alien:extern-alien "gc_read_only_pages" c-call:unsigned-long)
+	  (alien:extern-alien "gc_read_only_pages_written"
+			      c-call:unsigned-long)))
+
 )
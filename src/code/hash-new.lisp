@@ -107,10 +107,10 @@
   ;; slot will only ever be in one of these lists.
   (next-vector (required-argument) :type (simple-array (unsigned-byte 32) (*)))
   ;;
-  ;; This table parallels the KV table, and can be used to store the
-  ;; hash associated with the key, saving recalculation. Could be
-  ;; useful for EQL, and EQUAL hash tables. This table is not needed
-  ;; for EQ hash tables (and is NIL in that case), and when present the
+  ;; This table parallels the KV table, and is used to store the
+  ;; hash associated with the key, saving recalculation.  In EQ and EQL
+  ;; tables it holds the stable hashes of symbols and PCL instances
+  ;; (see STABLE-HASH), so the GC never has to rehash those keys.  The
   ;; value of #x8000000 represents EQ-based hashing on the respective
   ;; Key.
   (hash-vector nil :type (or null (simple-array (unsigned-byte 32) (*))))
@@ -148,11 +148,69 @@
   (declare (values hash))
   (truly-the hash (%primitive make-fixnum key)))
 
+;;; STATIC-SYMBOL-P  --  Internal
+;;;
+;;;    True if SYMBOL is in static space, where purify puts the symbols of
+;;; a saved core, and so never moves.
+;;;
+(declaim (inline static-symbol-p))
+(defun static-symbol-p (symbol)
+  (let ((address (get-lisp-obj-address symbol)))
+    (and (< (alien:extern-alien "static_space" (alien:unsigned 32)) address)
+	 (< address (* (the fixnum *static-space-free-pointer*)
+		       #-amd64 vm:word-bytes #+amd64 4)))))
+
+;;; STABLE-HASH  --  Internal
+;;;
+;;;    Return a hash of KEY that doesn't change when the GC moves KEY, or
+;;; NIL if KEY has none and can only be hashed by its address.  PCL
+;;; instances have a hash slot.  A symbol in static space is hashed by
+;;; its address, which the GC never changes, so symbols of the same name
+;;; don't collide; other symbols use the hash of their name kept in the
+;;; symbol.  The package can't be mixed in, since it changes when a
+;;; symbol is uninterned or imported.  So EQ and EQL tables keyed by
+;;; these are never rehashed after a GC.  The GC knows these keys by
+;;; their type; see removable_hash_entry in gencgc.c.
+;;;
+;;;    Purify moves symbols into static space, changing their hash.  It
+;;; marks every key/value vector with valid hashing as needing a rehash,
+;;; so tables with symbol keys are kept marked, and the rehash computes
+;;; the hash of a symbol key again.
+;;;
+(declaim (inline stable-hash))
+(defun stable-hash (key)
+  (declare (values (or null hash)))
+  (cond ((symbolp key)
+	 (if (static-symbol-p key)
+	     (pointer-hash key)
+	     (ldb (byte 29 0) (sxhash key))))
+	((and (%instancep key)
+	      (not (typep key 'structure-object))
+	      (not (typep key 'condition)))
+	 (ldb (byte 29 0) (sxhash-instance key)))
+	(t nil)))
+
+;;; EQ-HASH-TABLE-P  --  Internal
+;;;
+;;;    True if TABLE is an EQ or EQL table, whose keys are hashed by
+;;; EQ-HASH.  Only these keep hashes of symbols that purify changes, so
+;;; only these need their key/value vector marked for symbol keys.  EQUAL
+;;; and EQUALP tables hash a symbol by its name, and are left alone
+;;; unless they are weak.
+;;;
+(declaim (inline eq-hash-table-p))
+(defun eq-hash-table-p (table)
+  (let ((test (hash-table-test table)))
+    (or (eq test 'eq) (eq test 'eql))))
+
 (declaim (inline eq-hash))
 (defun eq-hash (key)
   (declare (values hash (member t nil)))
-  (values (pointer-hash key)
-	  (oddp (get-lisp-obj-address key))))
+  (let ((stable (stable-hash key)))
+    (if stable
+	(values stable nil)
+	(values (pointer-hash key)
+		(oddp (get-lisp-obj-address key))))))
 
 (declaim (inline eql-hash))
 (defun eql-hash (key)
@@ -302,10 +360,9 @@
 		 :weak-p weak-p
 		 :index-vector index-vector
 		 :next-vector next-vector
-		 :hash-vector (unless (eq test 'eq)
-				(make-array size+1
-					    :element-type '(unsigned-byte 32)
-					    :initial-element +eq-based-hash-value+)))))
+		 :hash-vector (make-array size+1
+					  :element-type '(unsigned-byte 32)
+					  :initial-element +eq-based-hash-value+))))
 	  ;; Setup the free list, all free. These lists are 0
 	  ;; terminated.
 	  (do ((i 1 (1+ i)))
@@ -413,6 +470,19 @@
 	       (setf (aref new-next-vector i)
 		     (hash-table-next-free-kv table))
 	       (setf (hash-table-next-free-kv table) i))
+	      ((and new-hash-vector (symbolp key) (eq-hash-table-p table)
+		    (not (= (aref new-hash-vector i) +eq-based-hash-value+)))
+	       ;; The hash of a symbol changes when purify moves it.
+	       (set-header-data new-kv-vector vm:vector-valid-hashing-subtype)
+	       (let* ((hashing (funcall (hash-table-hash-fun table) key))
+		      (index (rem hashing new-length))
+		      (next (aref new-index-vector index)))
+		 (declare (type index index)
+			  (type hash hashing))
+		 (setf (aref new-hash-vector i) hashing)
+		 ;; Push this slot into the next chain.
+		 (setf (aref new-next-vector i) next)
+		 (setf (aref new-index-vector index) i)))
 	      ((and new-hash-vector
 		    (not (= (aref new-hash-vector i) +eq-based-hash-value+)))
 	       ;; Can use the existing hash value (not EQ based)
@@ -436,6 +506,10 @@
 		 ;; Push this slot onto the next chain.
 		 (setf (aref new-next-vector i) next)
 		 (setf (aref new-index-vector index) i))))))
+    ;; The GC has to see the entries of a weak table, even those with
+    ;; stable hashes.
+    (when (hash-table-weak-p table)
+      (set-header-data new-kv-vector vm:vector-valid-hashing-subtype))
     (setf (hash-table-table table) new-kv-vector)
     (setf (hash-table-index-vector table) new-index-vector)
     (setf (hash-table-next-vector table) new-next-vector)
@@ -486,6 +560,19 @@
 	       ;; Push this slot onto the free list.
 	       (setf (aref next-vector i) (hash-table-next-free-kv table))
 	       (setf (hash-table-next-free-kv table) i))
+	      ((and hash-vector (symbolp key) (eq-hash-table-p table)
+		    (not (= (aref hash-vector i) +eq-based-hash-value+)))
+	       ;; The hash of a symbol changes when purify moves it.
+	       (set-header-data kv-vector vm:vector-valid-hashing-subtype)
+	       (let* ((hashing (funcall (hash-table-hash-fun table) key))
+		      (index (rem hashing length))
+		      (next (aref index-vector index)))
+		 (declare (type index index)
+			  (type hash hashing))
+		 (setf (aref hash-vector i) hashing)
+		 ;; Push this slot into the next chain.
+		 (setf (aref next-vector i) next)
+		 (setf (aref index-vector index) i)))
 	      ((and hash-vector (not (= (aref hash-vector i) +eq-based-hash-value+)))
 	       ;; Can use the existing hash value (not EQ based)
 	       (let* ((hashing (aref hash-vector i))
@@ -506,7 +593,9 @@
 			  (type hash hashing))
 		 ;; Push this slot into the next chain.
 		 (setf (aref next-vector i) next)
-		 (setf (aref index-vector index) i)))))))
+		 (setf (aref index-vector index) i))))))
+    (when (hash-table-weak-p table)
+      (set-header-data kv-vector vm:vector-valid-hashing-subtype)))
   (undefined-value))
 
 (defun flush-needing-rehash (table)
@@ -642,6 +731,11 @@
 	 
 	 (setf (aref kv-vector (* 2 free-kv-slot)) key)
 	 (setf (aref kv-vector (1+ (* 2 free-kv-slot))) value)
+	 ;; The GC has to see the entries of a weak table, and purify
+	 ;; has to mark a table with symbol keys for rehashing.
+	 (when (or (hash-table-weak-p hash-table)
+		   (and (symbolp key) (eq-hash-table-p hash-table)))
+	   (set-header-data kv-vector vm:vector-valid-hashing-subtype))
 
 	 ;; Setup the hash-vector if necessary.
 	 (when hash-vector
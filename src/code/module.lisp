@@ -105,8 +105,8 @@
   requiring this module only defines the following modules:
   \"contrib-demos\", \"contrib-follow-mouse\",
   \"contrib-games-feebs\", \"contrib-hist\", \"contrib-psgraph\",
-  \"contrib-ops\", \"contrib-embedded-c\", \"contrib-sprof\", and
-  \"contrib-packed-sse2\". "
+  \"contrib-ops\", \"contrib-embedded-c\", \"contrib-sprof\",
+  \"contrib-packed-sse2\", and \"contrib-heap-snapshot\". "
   (let ((saved-modules (copy-list *modules*))
         (module-name (module-name-string module-name)))
     (unless (member module-name *modules* :test #'string=)
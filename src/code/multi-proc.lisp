@@ -251,6 +251,9 @@
   ;; Interrupt contexts
   (interrupt-contexts nil :type (or (simple-array (unsigned-byte 32) (*))
 				    null))
+  ;;
+  ;; The gencgc allocation context, or NIL for the main context.
+  (alloc-context nil :type (or system-area-pointer null))
   ;; Resumer
   (resumer nil :type (or stack-group null)))
 
@@ -302,6 +305,45 @@
   (initial-bindings nil :type list))
 
 
+;;; Make-Alloc-Context, Set-Alloc-Context, Free-Alloc-Context -- Internal
+;;;
+;;; With gencgc each stack group but the initial one allocates from an
+;;; allocation context of its own, so it refills its own regions.  NIL
+;;; stands for the main context, which is also used if a context can't
+;;; be made.
+;;;
+(defun make-alloc-context ()
+  #+gencgc
+  (let ((context (alien:alien-funcall
+		  (alien:extern-alien "gc_make_alloc_context"
+				      (function sys:system-area-pointer)))))
+    (if (zerop (sys:sap-int context)) nil context))
+  #-gencgc
+  nil)
+
+(defun set-alloc-context (context)
+  (declare (type (or sys:system-area-pointer null) context))
+  #+gencgc
+  (alien:alien-funcall
+   (alien:extern-alien "gc_set_alloc_context"
+		       (function c-call:void sys:system-area-pointer))
+   (or context (sys:int-sap 0)))
+  #-gencgc
+  (declare (ignore context))
+  (values))
+
+(defun free-alloc-context (context)
+  (declare (type (or sys:system-area-pointer null) context))
+  #+gencgc
+  (when context
+    (alien:alien-funcall
+     (alien:extern-alien "gc_free_alloc_context"
+			 (function c-call:void sys:system-area-pointer))
+     context))
+  #-gencgc
+  (declare (ignore context))
+  (values))
+
 ;;; Init-Stack-Groups -- Interface
 ;;;
 ;;; Setup the initial stack group.
@@ -354,6 +396,8 @@
   (setf (stack-group-alien-stack-pointer stack-group) 0)
   (setf (stack-group-eval-stack stack-group) nil)
   (setf (stack-group-eval-stack-top stack-group) 0)
+  (free-alloc-context (stack-group-alloc-context stack-group))
+  (setf (stack-group-alloc-context stack-group) nil)
   (setf (stack-group-resumer stack-group) nil))
 
 ;;; Scrub-Stack-Group-Stacks -- Internal
@@ -497,6 +541,7 @@
 		    ;; Binding stack.
 		    :binding-stack binding-stack
 		    :binding-stack-size binding-stack-size
+		    :alloc-context (make-alloc-context)
 		    ;; Resumer
 		    :resumer resumer))))))
 	 ;; Allocate a new stack group with fresh stacks and bindings.
@@ -524,6 +569,7 @@
 	      ;; Binding stack - some initial bindings.
 	      :binding-stack binding-stack
 	      :binding-stack-size (length binding-stack)
+	      :alloc-context (make-alloc-context)
 	      ;; Resumer
 	      :resumer resumer))))
     (let ((child-stack-group nil))
@@ -557,13 +603,20 @@
 		  ;; Disable interrupts and GC.
 		  (setf unix::*interrupts-enabled* nil)
 		  (setf lisp::*gc-inhibit* t)
-		  (inactivate-stack-group child-stack-group)
 		  ;; Verify the resumer.
 		  (unless (and resumer
 			       (eq (stack-group-state resumer) :active))
 		    (format t "*Resuming stack-group ~s instead of ~s~%"
 			    *initial-stack-group* resumer)
 		    (setq resumer *initial-stack-group*))
+		  ;; Allocate from the resumer's context, so the child's
+		  ;; context can be freed.
+		  (let ((old-sigs (unix:unix-sigblock
+				   (unix:sigmask :sigint :sigalrm))))
+		    (declare (type (unsigned-byte 32) old-sigs))
+		    (set-alloc-context (stack-group-alloc-context resumer))
+		    (unix:unix-sigsetmask old-sigs))
+		  (inactivate-stack-group child-stack-group)
 		  ;; Restore the resumer state.
 		  (setq *current-stack-group* resumer)
 		  ;; Eval-stack
@@ -686,6 +739,8 @@
 			       (stack-group-binding-stack-size
 				new-stack-group))
 	(rebind-binding-stack)
+	;; Allocate from the new stack group's context.
+	(set-alloc-context (stack-group-alloc-context new-stack-group))
 	(unix:unix-sigsetmask old-sigs))
       
       ;; Restore the interrupt-contexts.
@@ -1187,8 +1242,12 @@
     (setf (process-wait-timeout *current-process*)
 	  (+ timeout (get-real-time)))
     (setf (process-wait-function-args *current-process*) args)
-    (setf (process-wait-function *current-process*) predicate))
-  (process-yield)
+    (setf (process-wait-function *current-process*) predicate)
+    ;; Make sure the idle loop wakes up in time to notice the timeout.
+    (let ((timer (sys:add-timer (max timeout 0d0) #'(lambda ()))))
+      (unwind-protect
+	   (process-yield)
+	(sys:remove-timer timer))))
   (process-wait-return-value *current-process*))
 
 ;;; The remaining processes in the scheduling queue for this cycle,
@@ -1268,14 +1327,14 @@
 ;;;
 (defun idle-process-loop ()
   "An idle loop to be run by the initial process. The select based event
-  server is called with a timeout calculated from the minimum of the
-  *idle-loop-timeout* and the time to the next process wait timeout.
-  To avoid this delay when there are runnable processes the *idle-process*
-  should be setup to the *initial-process*. If one of the processes quits
-  by throwing to %end-of-the-world then *quitting-lisp* will have been
-  set to the exit value which is noted by the idle loop which tries to
-  exit gracefully destroying all the processes and giving them a chance
-  to unwind."
+  server is called with a timeout of *idle-loop-timeout*; it returns
+  sooner when a process wait times out, as each such wait is also a
+  serve-event timer. To avoid this delay when there are runnable
+  processes the *idle-process* should be setup to the *initial-process*.
+  If one of the processes quits by throwing to %end-of-the-world then
+  *quitting-lisp* will have been set to the exit value which is noted by
+  the idle loop which tries to exit gracefully destroying all the
+  processes and giving them a chance to unwind."
   (declare (optimize (speed 3)))
   (assert (eq *current-process* *initial-process*) ()
 	  "Only the *initial-process* is intended to run the idle loop")
@@ -1286,21 +1345,8 @@
   (setf (process-name *current-process*) "Idle Loop")
   (do ()
       (*quitting-lisp*)
-    ;; Calculate the wait period.
-    (let ((real-time (get-real-time))
-	  (timeout *idle-loop-timeout*))
-      (declare (double-float timeout))
-      (dolist (process *all-processes*)
-	(when (process-active-p process)
-	  (let ((wait-timeout (process-wait-timeout process)))
-	    (when wait-timeout
-	      (let ((delta (- wait-timeout real-time)))
-		(when (< delta timeout)
-		  (x86::double-float-reg-bias timeout)
-		  (setf timeout delta)))))))
-      (when (> timeout 1d-5)
-	(sys:serve-all-events timeout))
-      (process-yield)))
+    (sys:serve-all-events *idle-loop-timeout*)
+    (process-yield))
   (shutdown-multi-processing)
   (throw 'lisp::%end-of-the-world *quitting-lisp*))
 
@@ -1312,6 +1358,10 @@
   (declare (optimize (speed 3)))
   "Allow other processes to run."
   (unless *inhibit-scheduling*
+    ;; Serve-event timers that are due, such as those of WITH-TIMEOUT,
+    ;; run here too so they aren't held up by processes that don't
+    ;; wait on events.
+    (lisp::run-timers)
     ;; Catch any FP exceptions before entering the scheduler.
     #+x87 (kernel:float-wait)
     ;; Inhibit recursive entry of the scheduler.
@@ -1657,16 +1707,15 @@
 (defun with-timeout-internal (timeout function timeout-function)
   (catch 'timer-interrupt
     (let* ((current-process mp:*current-process*)
-	   (timer-process (mp:make-process
-			   #'(lambda ()
-			       (sleep timeout)
-			       (mp:process-interrupt
-				current-process
-				#'(lambda () (throw 'timer-interrupt nil))))
-			   :name "Timeout timer")))
+	   (timer (sys:add-timer
+		   timeout
+		   #'(lambda ()
+		       (mp:process-interrupt
+			current-process
+			#'(lambda () (throw 'timer-interrupt nil)))))))
       (unwind-protect
 	   (return-from with-timeout-internal (funcall function))
-	(mp:destroy-process timer-process))))
+	(sys:remove-timer timer))))
    (funcall timeout-function))
 
 ;;; With-Timeout  --  Public
@@ -137,6 +137,10 @@
   (initial-function (alien:unsigned #.vm:word-bits))
   (sse2-mode c-call:int))
 
+;; The format the spaces are written in: 0 as they are, 1 without the
+;; pages that are all zeros, 2 compressed as well.  See :core-format.
+(alien:def-alien-variable ("save_core_format" save-core-format) c-call:int)
+
 #+:executable
 (alien:def-alien-routine "save_executable" (alien:boolean)
   (file c-call:c-string)
@@ -205,7 +209,8 @@
 		                  #+:executable
 		                 (executable nil)
 				 (batch-mode nil)
-				 (quiet nil))
+				 (quiet nil)
+				 (core-format :flat))
   "Saves a CMU Common Lisp core image in the file of the specified name.  The
   following keywords are defined:
   
@@ -264,8 +269,19 @@
      This is equivalent to setting *load-verbose*, *compile-verbose*,
      *compile-print*, *compile-progress*, *require-verbose*, and
      *gc-verbose* all to NIL.  If NIL (the default), the default
-     values of these variables are used."
-
+     values of these variables are used.
+
+  :core-format
+      How the spaces are written to the core file.  :FLAT (the default)
+  writes them as they are, so they can be mapped straight back in.
+  :SPARSE leaves out the pages that are all zeros.  :COMPRESSED
+  compresses the rest as well; it is decompressed in parallel when the
+  core is loaded.  Smaller cores start faster from slow storage.
+  Ignored when saving an executable."
+
+  (unless (member core-format '(:flat :sparse :compressed))
+    (error (intl:gettext "~S is not a core format: ~S, ~S or ~S")
+	   core-format :flat :sparse :compressed))
   (unless (probe-file (directory-namestring core-file-name))
     (error 'simple-file-error
            :format-control (intl:gettext "Directory ~S does not exist")
@@ -389,6 +405,8 @@
 
     (let ((initial-function (get-lisp-obj-address #'restart-lisp))
 	  (core-name (unix-namestring core-file-name nil)))
+      (setf save-core-format
+	    (ecase core-format (:flat 0) (:sparse 1) (:compressed 2)))
       (without-gcing
 	  #+:executable
 	(if executable
@@ -20,7 +20,8 @@
 (intl:textdomain "cmucl")
 
 (export '(with-fd-handler add-fd-handler remove-fd-handler invalidate-descriptor
-	  serve-event serve-all-events wait-until-fd-usable
+	  serve-event serve-all-events wait-until-fd-usable *serve-event-backend*
+	  add-timer remove-timer
 	  make-object-set object-set-operation *xwindow-table*
 	  map-xwindow add-xwindow-object remove-xwindow-object))
 
@@ -154,7 +155,7 @@
   (direction nil :type (member :input :output))
   ;;
   ;; File descriptor this handler is tied to.
-  (descriptor 0 :type (mod #.unix:fd-setsize))
+  (descriptor 0 :type unix:unix-fd)
   
   active		      ; T iff this handler is running.
   (function nil :type function) ; Function to call.
@@ -172,6 +173,166 @@
 (defvar *descriptor-handlers* nil
   "List of all the currently active handlers for file descriptors")
 
+(declaim (type (member :select :epoll) *serve-event-backend*))
+(defvar *serve-event-backend* :select
+  "How SERVE-EVENT waits for file descriptors.  With :SELECT it builds
+  select masks from all the handlers each time, and only descriptors
+  below UNIX:FD-SETSIZE can be waited on.  With :EPOLL, on Linux, the
+  descriptors stay registered with an epoll descriptor between calls,
+  and only the handlers of the ready descriptors are looked at.  Can be
+  changed at any time.")
+
+;;; *FD-HANDLERS* holds the handlers of each file descriptor, in the
+;;; same order as *DESCRIPTOR-HANDLERS*, so that the handlers of a ready
+;;; descriptor can be found without looking at the others.
+;;;
+(declaim (type simple-vector *fd-handlers*))
+(defvar *fd-handlers* (make-array 64 :initial-element nil))
+
+(declaim (inline fd-handlers))
+(defun fd-handlers (fd)
+  (if (< fd (length *fd-handlers*))
+      (svref *fd-handlers* fd)
+      nil))
+
+;;; The epoll descriptor, or NIL if there is none yet, and the events
+;;; each file descriptor is registered for with it.
+;;;
+#+linux
+(defvar *epoll-fd* nil)
+#+linux
+(declaim (type (simple-array (unsigned-byte 32) (*)) *epoll-events*))
+#+linux
+(defvar *epoll-events*
+  (make-array 64 :element-type '(unsigned-byte 32) :initial-element 0))
+
+;;; The descriptors epoll won't take, such as regular files.  Select
+;;; always finds these ready, and so does the epoll backend.
+;;;
+#+linux
+(defvar *epoll-always-ready* nil)
+
+;;; True if a descriptor given to epoll was bad.  The next SERVE-EVENT
+;;; reports it like select would.
+;;;
+#+linux
+(defvar *epoll-bad-descriptor* nil)
+
+;;; EPOLL-UPDATE -- Internal
+;;;
+;;;   Register FD with the epoll descriptor for the events its handlers
+;;; are waiting for.
+;;;
+#+linux
+(defun epoll-update (fd)
+  (let ((events 0)
+	(old 0))
+    (declare (type (unsigned-byte 32) events old))
+    (dolist (handler (fd-handlers fd))
+      (unless (handler-bogus handler)
+	(setf events (logior events (ecase (handler-direction handler)
+				      (:input unix:epollin)
+				      (:output unix:epollout))))))
+    (when (>= fd (length *epoll-events*))
+      (setf *epoll-events*
+	    (replace (make-array (max (1+ fd) (* 2 (length *epoll-events*)))
+				 :element-type '(unsigned-byte 32)
+				 :initial-element 0)
+		     *epoll-events*)))
+    (setf old (aref *epoll-events* fd))
+    (unless (and (= events old)
+		 (not (member fd *epoll-always-ready*)))
+      (multiple-value-bind (ok err)
+	  (unix:unix-epoll-ctl *epoll-fd*
+			       (cond ((zerop events) unix:epoll-ctl-del)
+				     ((zerop old) unix:epoll-ctl-add)
+				     (t unix:epoll-ctl-mod))
+			       fd events)
+	;; The descriptor may have been closed, which unregisters it,
+	;; and then reused.
+	(cond ((or ok (zerop events)))
+	      ((eql err unix:enoent)
+	       (multiple-value-setq (ok err)
+		 (unix:unix-epoll-ctl *epoll-fd* unix:epoll-ctl-add fd events)))
+	      ((eql err unix:eexist)
+	       (multiple-value-setq (ok err)
+		 (unix:unix-epoll-ctl *epoll-fd* unix:epoll-ctl-mod fd events))))
+	(setf *epoll-always-ready* (delete fd *epoll-always-ready*))
+	(setf (aref *epoll-events* fd) (if ok events 0))
+	(cond ((or ok (zerop events)))
+	      ((eql err unix:eperm)
+	       (push fd *epoll-always-ready*))
+	      (t
+	       (setf *epoll-bad-descriptor* t)))))))
+
+;;; EPOLL-START, EPOLL-STOP -- Internal
+;;;
+;;;   Make the epoll descriptor and register all the handlers with it,
+;;; or close it.  If it can't be made, go back to select.
+;;;
+#+linux
+(defun epoll-start ()
+  (multiple-value-bind (fd err)
+      (unix:unix-epoll-create)
+    (cond ((null fd)
+	   (warn (intl:gettext "Can't use epoll, using select instead: ~A")
+		 (unix:get-unix-error-msg err))
+	   (setf *serve-event-backend* :select)
+	   nil)
+	  (t
+	   (setf *epoll-fd* fd)
+	   (fill *epoll-events* 0)
+	   (setf *epoll-always-ready* nil)
+	   (dotimes (fd (length *fd-handlers*))
+	     (when (svref *fd-handlers* fd)
+	       (epoll-update fd)))
+	   t))))
+
+#+linux
+(defun epoll-stop ()
+  (unix:unix-close *epoll-fd*)
+  (setf *epoll-fd* nil))
+
+;;; The epoll descriptor doesn't survive a save.
+;;;
+#+linux
+(defun reinit-epoll ()
+  (setf *epoll-fd* nil))
+
+#+linux
+(pushnew 'reinit-epoll ext:*after-save-initializations*)
+
+;;; FD-HANDLERS-CHANGED -- Internal
+;;;
+;;;   Called whenever the handlers of FD, or their bogus flags, change.
+;;;
+(defun fd-handlers-changed (fd)
+  #-linux (declare (ignore fd))
+  #+linux
+  (when *epoll-fd*
+    (epoll-update fd)))
+
+;;; NOTE-HANDLER-ADDED, NOTE-HANDLER-REMOVED -- Internal
+;;;
+;;;   Keep *FD-HANDLERS* in step with *DESCRIPTOR-HANDLERS*.
+;;;
+(defun note-handler-added (handler)
+  (let ((fd (handler-descriptor handler)))
+    (when (>= fd (length *fd-handlers*))
+      (setf *fd-handlers*
+	    (replace (make-array (max (1+ fd) (* 2 (length *fd-handlers*)))
+				 :initial-element nil)
+		     *fd-handlers*)))
+    (push handler (svref *fd-handlers* fd))
+    (fd-handlers-changed fd)))
+
+(defun note-handler-removed (handler)
+  (let ((fd (handler-descriptor handler)))
+    (when (member handler (fd-handlers fd) :test #'eq)
+      (setf (svref *fd-handlers* fd)
+	    (delete handler (svref *fd-handlers* fd) :test #'eq))
+      (fd-handlers-changed fd))))
+
 ;;; ADD-FD-HANDLER -- public
 ;;;
 ;;;   Add a new handler to *descriptor-handlers*.
@@ -185,6 +346,7 @@
 	  (intl:gettext "Invalid direction ~S, must be either :INPUT or :OUTPUT") direction)
   (let ((handler (make-handler direction fd function)))
     (push handler *descriptor-handlers*)
+    (note-handler-added handler)
     handler))
 
 ;;; REMOVE-FD-HANDLER -- public
@@ -195,7 +357,8 @@
   "Removes HANDLER from the list of active handlers."
   (setf *descriptor-handlers*
 	(delete handler *descriptor-handlers*
-		:test #'eq)))
+		:test #'eq))
+  (note-handler-removed handler))
 
 ;;; INVALIDATE-DESCRIPTOR -- public
 ;;;
@@ -206,7 +369,10 @@
   to recover from a detected inconsistency."
   (setf *descriptor-handlers*
 	(delete fd *descriptor-handlers*
-		:key #'handler-descriptor)))
+		:key #'handler-descriptor))
+  (when (fd-handlers fd)
+    (setf (svref *fd-handlers* fd) nil)
+    (fd-handlers-changed fd)))
 
 ;;; WITH-FD-HANDLER -- Public.
 ;;;
@@ -237,6 +403,7 @@
       (unless (or (handler-bogus handler)
 		  (unix:unix-fstat (handler-descriptor handler)))
 	(setf (handler-bogus handler) t)
+	(fd-handlers-changed (handler-descriptor handler))
 	(push handler bogus-handlers)))
     ;; TRANSLATORS:  This needs more work.
     (restart-case (error (intl:ngettext "~S ~[have~;has a~:;have~] bad file descriptor."
@@ -247,17 +414,326 @@
 	:report (lambda (stream)
 		  (write-string (intl:gettext "Remove bogus handlers.") stream))
        (setf *descriptor-handlers*
-	     (delete-if #'handler-bogus *descriptor-handlers*)))
+	     (delete-if #'handler-bogus *descriptor-handlers*))
+       (dolist (handler bogus-handlers)
+	 (note-handler-removed handler)))
       (retry-them ()
 	:report (lambda (stream)
 		  (write-string (intl:gettext "Retry bogus handlers.") stream))
        (dolist (handler bogus-handlers)
-	 (setf (handler-bogus handler) nil)))
+	 (setf (handler-bogus handler) nil)
+	 (fd-handlers-changed (handler-descriptor handler))))
       (continue ()
 	:report (lambda (stream)
 		  (write-string (intl:gettext "Go on, leaving handlers marked as bogus.") stream))))))
 
 
+;;;; Timers.
+
+;;; Timers are kept in a hierarchical timing wheel, so that arming or
+;;; cancelling one costs the same however many there are.  Time is
+;;; counted in milliseconds from *TIMER-EPOCH*.  The first level of the
+;;; wheel has a slot for each of the next 256 milliseconds, and each
+;;; level above has a slot for 256 slots of the level below.  A timer
+;;; goes in the lowest level its deadline is within reach of, and moves
+;;; down when the wheel gets to the start of its slot.  Each slot is a
+;;; doubly linked list of its timers.
+;;;
+(defconstant timer-level-bits 8)
+(defconstant timer-level-slots (ash 1 timer-level-bits))
+(defconstant timer-levels 4)
+
+(defstruct (timer
+	    (:constructor make-timer (deadline function))
+	    (:print-function
+	     (lambda (timer stream d)
+	       (declare (ignore d))
+	       (print-unreadable-object (timer stream :type t :identity t)
+		 (format stream "~D" (timer-deadline timer))))))
+  ;;
+  ;; The millisecond it expires at.
+  (deadline 0 :type integer)
+  ;;
+  ;; The function to call.
+  (function nil :type function)
+  ;;
+  ;; The index of its slot in *TIMER-SLOTS*, :EXPIRED once it has been
+  ;; taken out of the wheel to be called, or NIL.
+  (slot nil :type (or index null (member :expired)))
+  ;;
+  ;; When the wheel has to wake up for it: its deadline, or the start
+  ;; of its slot if it is above the first level.
+  (wake 0 :type integer)
+  ;;
+  ;; The other timers in its slot.
+  (next nil :type (or timer null))
+  (prev nil :type (or timer null)))
+
+;;; The second of the monotonic clock *TIMER-TIME* and the timer
+;;; deadlines count from, NIL until a timer is first used.  The wheel is
+;;; only changed with interrupts off, since a handler may add or remove
+;;; timers.
+(defvar *timer-epoch* nil)
+
+;;; The millisecond the wheel was last advanced to.  Timers due then or
+;;; before have been taken out of it.
+(declaim (type integer *timer-time*))
+(defvar *timer-time* 0)
+
+(declaim (type simple-vector *timer-slots* *timer-level-counts*))
+(defvar *timer-slots*
+  (make-array (* timer-levels timer-level-slots) :initial-element nil))
+(defvar *timer-level-counts* (make-array timer-levels :initial-element 0))
+
+;;; The earliest wake of any timer, or NIL if there are none.  Only
+;;; good while *TIMER-NEXT-VALID* is true.
+(defvar *timer-next-wake* nil)
+(defvar *timer-next-valid* t)
+
+;;; TIMER-NOW  --  Internal
+;;;
+;;;    Return the current time in milliseconds and the microseconds past
+;;; that.  This is the monotonic clock, so setting the time of day
+;;; doesn't move the timers.
+;;;
+(defun timer-now ()
+  (alien:with-alien ((sec c-call:long-long)
+		     (nsec c-call:long))
+    (alien:alien-funcall
+     (alien:extern-alien "os_monotonic_time"
+			 (function c-call:void
+				   (* c-call:long-long) (* c-call:long)))
+     (alien:addr sec) (alien:addr nsec))
+    (unless *timer-epoch*
+      (setf *timer-epoch* sec))
+    (multiple-value-bind (msec frac)
+	(truncate (truncate nsec 1000) 1000)
+      (values (+ (* (- sec *timer-epoch*) 1000) msec) frac))))
+
+;;; TIMER-INSERT  --  Internal
+;;;
+;;;    Put TIMER in the wheel, due no earlier than the millisecond
+;;; EARLIEST.  A deadline too far out to reach from the top level waits
+;;; in the furthest slot of it and is placed again from there.
+;;;
+(defun timer-insert (timer earliest)
+  (declare (type timer timer) (type integer earliest))
+  (let* ((time *timer-time*)
+	 (deadline (max (timer-deadline timer) earliest))
+	 (slot-time (min deadline
+			 (+ time (1- (ash 1 (* timer-levels
+					       timer-level-bits))))))
+	 (delta (- slot-time time))
+	 (level (if (< delta timer-level-slots)
+		    0
+		    (min (1- timer-levels)
+			 (floor (1- (integer-length delta))
+				timer-level-bits))))
+	 (shift (* level timer-level-bits))
+	 (slot (+ (* level timer-level-slots)
+		  (ldb (byte timer-level-bits shift) slot-time)))
+	 (wake (if (zerop level)
+		   deadline
+		   (ash (ash slot-time (- shift)) shift)))
+	 (head (svref *timer-slots* slot)))
+    (setf (timer-next timer) head)
+    (setf (timer-prev timer) nil)
+    (when head
+      (setf (timer-prev head) timer))
+    (setf (svref *timer-slots* slot) timer)
+    (setf (timer-slot timer) slot)
+    (setf (timer-wake timer) wake)
+    (incf (svref *timer-level-counts* level))
+    (when (and *timer-next-valid*
+	       (or (null *timer-next-wake*) (< wake *timer-next-wake*)))
+      (setf *timer-next-wake* wake))
+    timer))
+
+;;; TIMER-UNLINK  --  Internal
+;;;
+;;;    Take TIMER out of its slot.
+;;;
+(defun timer-unlink (timer)
+  (declare (type timer timer))
+  (let ((slot (timer-slot timer))
+	(next (timer-next timer))
+	(prev (timer-prev timer)))
+    (declare (type index slot))
+    (if prev
+	(setf (timer-next prev) next)
+	(setf (svref *timer-slots* slot) next))
+    (when next
+      (setf (timer-prev next) prev))
+    (setf (timer-next timer) nil)
+    (setf (timer-prev timer) nil)
+    (setf (timer-slot timer) nil)
+    (decf (svref *timer-level-counts* (floor slot timer-level-slots)))
+    (when (and *timer-next-valid*
+	       (eql (timer-wake timer) *timer-next-wake*))
+      (setf *timer-next-valid* nil))
+    timer))
+
+;;; TIMER-NEXT-WAKE  --  Internal
+;;;
+;;;    Return the millisecond the wheel next has to be advanced at, or
+;;; NIL if there are no timers.  This is the first occupied slot of
+;;; each level, so it's only recomputed when the earliest timer goes.
+;;;
+(defun timer-next-wake ()
+  (sys:without-interrupts
+    (unless *timer-next-valid*
+      (let ((time *timer-time*)
+	    (next nil))
+	(dotimes (level timer-levels)
+	  (unless (zerop (svref *timer-level-counts* level))
+	    (let* ((shift (* level timer-level-bits))
+		   (base (ash time (- shift))))
+	      (loop for j from 1 to timer-level-slots
+		    when (svref *timer-slots*
+				(+ (* level timer-level-slots)
+				   (ldb (byte timer-level-bits 0) (+ base j))))
+		      do (let ((wake (if (zerop level)
+					 (+ time j)
+					 (ash (+ base j) shift))))
+			   (when (or (null next) (< wake next))
+			     (setf next wake))
+			   (return))))))
+	(setf *timer-next-wake* next)
+	(setf *timer-next-valid* t)))
+    *timer-next-wake*))
+
+;;; TIMER-WAIT  --  Internal
+;;;
+;;;    Return the seconds and microseconds until the next timer is due,
+;;; or NIL if there are no timers.
+;;;
+(defun timer-wait ()
+  (let ((wake (timer-next-wake)))
+    (when wake
+      (multiple-value-bind (now frac)
+	  (timer-now)
+	(if (<= wake now)
+	    (values 0 0)
+	    (multiple-value-bind (sec msec)
+		(truncate (min (- wake now) (ash 1 (* timer-levels
+						       timer-level-bits)))
+			  1000)
+	      (let ((usec (- (* msec 1000) frac)))
+		(if (minusp usec)
+		    (values (1- sec) (+ usec 1000000))
+		    (values sec usec)))))))))
+
+;;; RUN-TIMERS  --  Internal
+;;;
+;;;    Advance the wheel to the current time and call the functions of
+;;; the timers that are due, earliest first.  Return T if any were.  The
+;;; functions are called with interrupts on, outside the updates.
+;;;
+(defun run-timers ()
+  (when (every #'zerop *timer-level-counts*)
+    (return-from run-timers nil))
+  (let* ((expired (sys:without-interrupts (advance-timers)))
+	 (result (not (null expired))))
+    (unwind-protect
+	(loop while expired do
+	  (let ((timer (pop expired)))
+	    ;; An earlier one may have removed it.
+	    (when (sys:without-interrupts
+		    (when (eq (timer-slot timer) :expired)
+		      (setf (timer-slot timer) nil)
+		      t))
+	      (funcall (timer-function timer)))))
+      ;; If one threw, leave the rest for next time.
+      (sys:without-interrupts
+	(dolist (timer expired)
+	  (when (eq (timer-slot timer) :expired)
+	    (timer-insert timer (1+ *timer-time*))))))
+    result))
+
+;;; ADVANCE-TIMERS  --  Internal
+;;;
+;;;    Advance the wheel to the current time and return the timers that
+;;; are due, earliest first, marked :EXPIRED.  Called with interrupts
+;;; off.
+;;;
+(defun advance-timers ()
+  (let ((now (timer-now))
+	(expired ()))
+    (loop while (< *timer-time* now) do
+      (let ((time (if (zerop (svref *timer-level-counts* 0))
+		      ;; Nothing on the first level: skip ahead to where
+		      ;; the levels above have to be looked at.
+		      (min now (logandc2 (+ *timer-time* timer-level-slots)
+					 (1- timer-level-slots)))
+		      (1+ *timer-time*))))
+	(setf *timer-time* time)
+	;; Move the timers in the slots that start now down a level.
+	(do ((level 1 (1+ level)))
+	    ((or (= level timer-levels)
+		 (/= (ldb (byte timer-level-bits
+				(* (1- level) timer-level-bits))
+			  time)
+		     0)))
+	  (let ((slot (+ (* level timer-level-slots)
+			 (ldb (byte timer-level-bits
+				    (* level timer-level-bits))
+			      time))))
+	    (loop for timer = (svref *timer-slots* slot)
+		  while timer
+		  do (timer-insert (timer-unlink timer) time))))
+	(loop for timer = (svref *timer-slots*
+				 (ldb (byte timer-level-bits 0) time))
+	      while timer
+	      do (timer-unlink timer)
+		 (setf (timer-slot timer) :expired)
+		 (push timer expired))))
+    (setf *timer-next-valid* nil)
+    (stable-sort (nreverse expired) #'< :key #'timer-deadline)))
+
+;;; ADD-TIMER -- Public
+;;;
+(defun add-timer (seconds function)
+  "Arrange for SERVE-EVENT to call FUNCTION, with no arguments, once
+  SECONDS have passed.  The value returned should be passed to
+  SYSTEM:REMOVE-TIMER to cancel it."
+  (declare (type (real 0) seconds) (type function function))
+  (sys:without-interrupts
+    (multiple-value-bind (now frac)
+	(timer-now)
+      ;; Round up, so that it is never called early.
+      (timer-insert (make-timer (+ now (ceiling (+ frac (* seconds 1000000))
+						1000))
+				function)
+		    (1+ *timer-time*)))))
+
+;;; REMOVE-TIMER -- Public
+;;;
+(defun remove-timer (timer)
+  "Cancel TIMER, if its function hasn't been called yet."
+  (declare (type timer timer))
+  (sys:without-interrupts
+    (case (timer-slot timer)
+      ((nil))
+      (:expired
+       (setf (timer-slot timer) nil))
+      (t
+       (timer-unlink timer))))
+  nil)
+
+;;; Timers are counted from the monotonic clock, which starts over in a
+;;; saved core.
+;;;
+(defun reinit-timers ()
+  (fill *timer-slots* nil)
+  (fill *timer-level-counts* 0)
+  (setf *timer-epoch* nil)
+  (setf *timer-time* 0)
+  (setf *timer-next-wake* nil)
+  (setf *timer-next-valid* t))
+
+(pushnew 'reinit-timers ext:*after-save-initializations*)
+
+
 
 ;;;; Serve-all-events, serve-event, and friends.
 
@@ -283,56 +759,39 @@
 
 ;;; WAIT-UNTIL-FD-USABLE -- Public.
 ;;;
-;;; Wait until FD is usable for DIRECTION. The timeout given to serve-event is
-;;; recalculated each time through the loop so that WAIT-UNTIL-FD-USABLE will
-;;; timeout at the correct time irrespective of how many events are handled in
-;;; the meantime.
+;;; Wait until FD is usable for DIRECTION.  The timeout is a timer, so that
+;;; WAIT-UNTIL-FD-USABLE will timeout at the correct time irrespective of how
+;;; many events are handled in the meantime.  A timeout of 0 just polls once.
 ;;;
 (defun wait-until-fd-usable (fd direction &optional timeout)
   "Wait until FD is usable for DIRECTION. DIRECTION should be either :INPUT or
   :OUTPUT. TIMEOUT, if supplied, is the number of seconds to wait before giving
   up."
   (declare (type (or real null) timeout))
-  (let (usable)
-    (multiple-value-bind (to-sec to-usec)
-			 (decode-timeout timeout)
-      (declare (type (or index null) to-sec to-usec))
-      (multiple-value-bind
-	  (stop-sec stop-usec)
-	  (if to-sec
-	      (multiple-value-bind (okay start-sec start-usec)
-				   (unix:unix-gettimeofday)
-		(declare (ignore okay))
-		(let ((usec (+ to-usec start-usec))
-		      (sec (+ to-sec start-sec)))
-		  (declare (type (unsigned-byte 31) usec sec))
-		  (if (>= usec 1000000)
-		      (values (1+ sec) (- usec 1000000))
-		      (values sec usec))))
-	      (values 0 0))
-	(declare (type (unsigned-byte 31) stop-sec stop-usec))
-	(with-fd-handler (fd direction #'(lambda (fd)
-					   (declare (ignore fd))
-					   (setf usable t)))
-	  (loop
-	    (sub-serve-event to-sec to-usec)
-	    
-	    (when usable
-	      (return t))
-	    
+  (let ((usable nil)
+	(timed-out nil)
+	(timer nil))
+    (with-fd-handler (fd direction #'(lambda (fd)
+				       (declare (ignore fd))
+				       (setf usable t)))
+      (when (and timeout (zerop timeout))
+	(sub-serve-event 0 0)
+	(return-from wait-until-fd-usable usable))
+      (unwind-protect
+	  (progn
 	    (when timeout
-	      (multiple-value-bind (okay sec usec)
-				   (unix:unix-gettimeofday)
-		(declare (ignore okay))
-		(when (or (> sec stop-sec)
-			  (and (= sec stop-sec) (>= usec stop-usec)))
-		  (return nil))
-		(setq to-sec (- stop-sec sec))
-		(cond ((> usec stop-usec)
-		       (decf to-sec)
-		       (setq to-usec (- (+ stop-usec 1000000) usec)))
-		      (t
-		       (setq to-usec (- stop-usec usec))))))))))))
+	      (setf timer (add-timer timeout #'(lambda ()
+						 (setf timed-out t)))))
+	    (loop
+	      (sub-serve-event nil 0)
+
+	      (when usable
+		(return t))
+
+	      (when timed-out
+		(return nil))))
+	(when timer
+	  (remove-timer timer))))))
 
 
 (defvar *display-event-handlers* nil
@@ -421,8 +880,11 @@
      (let ((count 0))
        (declare (type index count))
        (dolist (handler *descriptor-handlers*)
+	 ;; Select can't wait on descriptors past FD-SETSIZE; they
+	 ;; need the :EPOLL backend.
 	 (unless (or ; (handler-active handler)
-		     (handler-bogus handler))
+		     (handler-bogus handler)
+		     (>= (handler-descriptor handler) unix:fd-setsize))
 	   (let ((fd (handler-descriptor handler)))
 	     (ecase (handler-direction handler)
 	       (:input (unix:fd-set fd read-fds))
@@ -439,9 +901,10 @@
   '(let ((result nil))
      (dolist (handler *descriptor-handlers*)
        (let ((desc (handler-descriptor handler)))
-	 (when (ecase (handler-direction handler)
-		 (:input (unix:fd-isset desc read-fds))
-		 (:output (unix:fd-isset desc write-fds)))
+	 (when (and (< desc unix:fd-setsize)
+		    (ecase (handler-direction handler)
+		      (:input (unix:fd-isset desc read-fds))
+		      (:output (unix:fd-isset desc write-fds))))
 	   (unwind-protect
 	       (progn
 		 (setf (handler-active handler) t)
@@ -469,13 +932,16 @@
 
 ;;; SUB-SERVE-EVENT  --  Internal
 ;;;
-;;;    Takes timeout broken into seconds and microseconds.
+;;;    Takes timeout broken into seconds and microseconds.  Timers that
+;;; are due count as events.
 ;;;
 (defun sub-serve-event (to-sec to-usec)
   (declare (type (or null (unsigned-byte 29)) to-sec to-usec))
 
   (when (handle-queued-clx-event) (return-from sub-serve-event t))
 
+  (when (run-timers) (return-from sub-serve-event t))
+
   (let ((call-polling-fn nil))
     (when (and *periodic-polling-function*
 	       ;; Enforce a maximum timeout.
@@ -487,30 +953,146 @@
       (setf to-usec *max-event-to-usec*)
       (setf call-polling-fn t))
 
-    ;; Next, wait for something to happen.
-    (alien:with-alien ((read-fds (alien:struct unix:fd-set))
-		       (write-fds (alien:struct unix:fd-set)))
-      (let ((count (calc-masks)))
-	(multiple-value-bind
-	      (value err)
-	    (unix:unix-fast-select
-	     count
-	     (alien:addr read-fds) (alien:addr write-fds)
-	     nil to-sec to-usec)
-	
-	  ;; Now see what it was (if anything)
-	  (cond (value
-		 (cond ((zerop value)
-			;; Timed out.
-			(when call-polling-fn
-			  (funcall *periodic-polling-function*)))
-		       (t
-			(call-fd-handler))))
-		((eql err unix:eintr)
-		 ;; We did an interrupt.
-		 t)
-		(t
-		 ;; One of the file descriptors is bad.
-		 (handler-descriptors-error)
-		 nil)))))))
+    ;; Don't sleep past the next timer.
+    (multiple-value-bind (sec usec)
+	(timer-wait)
+      (when (and sec
+		 (or (null to-sec)
+		     (< sec to-sec)
+		     (and (= sec to-sec) (< usec to-usec))))
+	(setf to-sec sec)
+	(setf to-usec usec)
+	(setf call-polling-fn nil)))
+
+    (or (cond #+linux
+	      ((and (eq *serve-event-backend* :epoll)
+		    (or *epoll-fd* (epoll-start)))
+	       (epoll-serve-event to-sec to-usec call-polling-fn))
+	      (t
+	       #+linux
+	       (when *epoll-fd*
+		 (epoll-stop))
+	       (select-serve-event to-sec to-usec call-polling-fn)))
+	;; The wait may have run into a timer.
+	(run-timers))))
+
+;;; SELECT-SERVE-EVENT  --  Internal
+;;;
+;;;    SUB-SERVE-EVENT for the :SELECT backend.
+;;;
+(defun select-serve-event (to-sec to-usec call-polling-fn)
+  (declare (type (or null (unsigned-byte 29)) to-sec to-usec))
+  ;; Next, wait for something to happen.
+  (alien:with-alien ((read-fds (alien:struct unix:fd-set))
+		     (write-fds (alien:struct unix:fd-set)))
+    (let ((count (calc-masks)))
+      (multiple-value-bind
+	    (value err)
+	  (unix:unix-fast-select
+	   count
+	   (alien:addr read-fds) (alien:addr write-fds)
+	   nil to-sec to-usec)
 
+	;; Now see what it was (if anything)
+	(cond (value
+	       (cond ((zerop value)
+		      ;; Timed out.
+		      (when call-polling-fn
+			(funcall *periodic-polling-function*)))
+		     (t
+		      (call-fd-handler))))
+	      ((eql err unix:eintr)
+	       ;; We did an interrupt.
+	       t)
+	      (t
+	       ;; One of the file descriptors is bad.
+	       (handler-descriptors-error)
+	       nil))))))
+
+
+;;; The most events EPOLL-SERVE-EVENT takes from the kernel at once.
+;;;
+#+linux
+(defconstant epoll-max-events 256)
+
+;;; EPOLL-CALL-FD-HANDLERS -- Internal
+;;;
+;;;   Call the first handler of FD for each direction in EVENTS, as
+;;; CALL-FD-HANDLER does for the descriptors select finds.
+;;;
+#+linux
+(defun epoll-call-fd-handlers (fd events)
+  (declare (type unix:unix-fd fd)
+	   (type (unsigned-byte 32) events))
+  (let ((result nil))
+    (flet ((call (direction)
+	     (let ((handler (dolist (handler (fd-handlers fd))
+			      (when (and (eq (handler-direction handler)
+					     direction)
+					 (not (handler-bogus handler)))
+				(return handler)))))
+	       (when handler
+		 (unwind-protect
+		     (progn
+		       (setf (handler-active handler) t)
+		       (funcall (handler-function handler) fd))
+		   (setf (handler-active handler) nil))
+		 (setf result t)))))
+      ;; Select finds a descriptor with an error or a hangup ready for
+      ;; both reading and writing.
+      (when (logtest events (logior unix:epollerr unix:epollhup))
+	(setf events (logior events unix:epollin unix:epollout)))
+      (when (logtest events unix:epollin)
+	(call :input))
+      (when (logtest events unix:epollout)
+	(call :output)))
+    result))
+
+;;; EPOLL-SERVE-EVENT  --  Internal
+;;;
+;;;    SUB-SERVE-EVENT for the :EPOLL backend: wait for the registered
+;;; descriptors and call the handlers of those that are ready.
+;;;
+#+linux
+(defun epoll-serve-event (to-sec to-usec call-polling-fn)
+  (declare (type (or null (unsigned-byte 29)) to-sec to-usec))
+  (when *epoll-bad-descriptor*
+    (setf *epoll-bad-descriptor* nil)
+    (handler-descriptors-error)
+    (return-from epoll-serve-event nil))
+  (let ((timeout (cond (*epoll-always-ready* 0)
+		       ((null to-sec) -1)
+		       (t
+			(min (+ (* to-sec 1000) (ceiling to-usec 1000))
+			     most-positive-fixnum)))))
+    (alien:with-alien ((events (array (alien:struct unix:epoll-event)
+				      #.epoll-max-events)))
+      (multiple-value-bind (count err)
+	  (unix:unix-epoll-wait *epoll-fd*
+				(alien:cast events
+					    (* (alien:struct unix:epoll-event)))
+				epoll-max-events timeout)
+	(cond ((null count)
+	       (cond ((eql err unix:eintr)
+		      ;; We did an interrupt.
+		      t)
+		     (t
+		      (handler-descriptors-error)
+		      nil)))
+	      (t
+	       (let ((result nil))
+		 (dotimes (i count)
+		   (let ((event (alien:deref events i)))
+		     (when (epoll-call-fd-handlers
+			    (alien:slot event 'unix:epoll-fd)
+			    (alien:slot event 'unix:epoll-events))
+		       (setf result t))))
+		 (dolist (fd (copy-list *epoll-always-ready*))
+		   (when (epoll-call-fd-handlers
+			  fd (logior unix:epollin unix:epollout))
+		     (setf result t)))
+		 (when (and (zerop count) (null *epoll-always-ready*)
+			    call-polling-fn)
+		   ;; Timed out.
+		   (funcall *periodic-polling-function*))
+		 result)))))))
@@ -872,6 +872,25 @@
 		 (addr (deref ptr offset)))
 	       len))
 
+(def-alien-type nil
+  (struct iovec
+    (iov-base system-area-pointer)	; start of the bytes
+    (iov-len size-t)))			; and how many
+
+;;; Unix-writev is like unix-write, but writes the IOVCNT buffers
+;;; described by the vector of iovecs IOV, in order, with one call.
+
+(defun unix-writev (fd iov iovcnt)
+  _N"Unix-writev writes the iovcnt buffers described by the iovec array iov
+   to the file described by the file descriptor fd, as if by one write.
+   It returns the number of bytes written, or NIL and an error number if
+   the call is unsuccessful."
+  (declare (type unix-fd fd)
+	   (type (alien (* (struct iovec))) iov)
+	   (type (unsigned-byte 31) iovcnt))
+  (int-syscall ("writev" int (* (struct iovec)) int)
+	       fd iov iovcnt))
+
 ;;; Unix-ioctl is used to change parameters of devices in a device
 ;;; dependent way.
 
@@ -2164,6 +2183,103 @@
 	       nfds (frob rdfds rdf) (frob wrfds wrf) (frob xpfds xpf)
 	       (if to-secs (alien-sap (addr tv)) (int-sap 0))))))
 
+;;; The epoll(7) interface, used by SERVE-EVENT when
+;;; SYSTEM:*SERVE-EVENT-BACKEND* is :EPOLL.
+
+#+linux
+(defconstant epollin #x001)
+#+linux
+(defconstant epollout #x004)
+#+linux
+(defconstant epollerr #x008)
+#+linux
+(defconstant epollhup #x010)
+#+linux
+(defconstant epoll-ctl-add 1)
+#+linux
+(defconstant epoll-ctl-del 2)
+#+linux
+(defconstant epoll-ctl-mod 3)
+#+linux
+(defconstant epoll-cloexec #o2000000)
+
+;;; The kernel packs struct epoll_event on x86, so its 64 bit data
+;;; member is declared as two words here.  The descriptor goes in the
+;;; first, the low word.
+#+linux
+(def-alien-type nil
+  (struct epoll-event
+    (epoll-events unsigned-int)
+    (epoll-fd int)
+    (epoll-pad int)))
+
+#+linux
+(defun unix-epoll-create ()
+  _N"Unix-epoll-create returns a new epoll descriptor, closed on exec,
+   or NIL and an error number."
+  (int-syscall ("epoll_create1" int) epoll-cloexec))
+
+#+linux
+(defun unix-epoll-ctl (epfd op fd events)
+  _N"Unix-epoll-ctl adds FD to the epoll descriptor EPFD, changes it or
+   removes it, as OP is EPOLL-CTL-ADD, EPOLL-CTL-MOD or EPOLL-CTL-DEL.
+   EVENTS is a mask of EPOLLIN and EPOLLOUT.  NIL and an error number
+   is returned if the call is unsuccessful."
+  (declare (type unix-fd epfd fd)
+	   (type (unsigned-byte 32) events))
+  (with-alien ((event (struct epoll-event)))
+    (setf (slot event 'epoll-events) events)
+    (setf (slot event 'epoll-fd) fd)
+    (setf (slot event 'epoll-pad) 0)
+    (void-syscall ("epoll_ctl" int int int (* (struct epoll-event)))
+		  epfd op fd (addr event))))
+
+#+linux
+(defun unix-epoll-wait (epfd events max-events timeout)
+  _N"Unix-epoll-wait waits up to TIMEOUT milliseconds, or forever if
+   TIMEOUT is -1, for the descriptors of EPFD to become ready, and
+   stores up to MAX-EVENTS of them in the array EVENTS.  It returns the
+   number stored, or NIL and an error number."
+  (declare (type unix-fd epfd)
+	   (type (alien (* (struct epoll-event))) events)
+	   (type fixnum max-events timeout))
+  (int-syscall ("epoll_wait" int (* (struct epoll-event)) int int)
+	       epfd events max-events timeout))
+
+;;; sendfile(2) and splice(2) move data between descriptors without
+;;; copying it through user memory, for COPY-STREAM-TO-STREAM.  Both
+;;; are passed null offsets, so they use and advance the descriptors'
+;;; file positions.
+
+#+linux
+(defconstant splice-f-move 1 _N"Move pages instead of copying, if possible")
+#+linux
+(defconstant splice-f-nonblock 2 _N"Don't block on the pipe")
+#+linux
+(defconstant splice-f-more 4 _N"More data will be coming")
+
+#+linux
+(defun unix-sendfile (out-fd in-fd count)
+  _N"Unix-sendfile copies up to COUNT bytes from IN-FD, which must be a
+   file that can be mapped, to OUT-FD.  It returns the number of bytes
+   copied, 0 at the end of the file, or NIL and an error number."
+  (declare (type unix-fd out-fd in-fd)
+	   (type (unsigned-byte 31) count))
+  (int-syscall ("sendfile" int int system-area-pointer size-t)
+	       out-fd in-fd (int-sap 0) count))
+
+#+linux
+(defun unix-splice (in-fd out-fd count flags)
+  _N"Unix-splice moves up to COUNT bytes from IN-FD to OUT-FD, one of
+   which must be a pipe.  It returns the number of bytes moved, 0 at
+   the end of the input, or NIL and an error number."
+  (declare (type unix-fd in-fd out-fd)
+	   (type (unsigned-byte 31) count)
+	   (type (unsigned-byte 32) flags))
+  (int-syscall ("splice" int system-area-pointer int system-area-pointer
+			 size-t unsigned-int)
+	       in-fd (int-sap 0) out-fd (int-sap 0) count flags))
+
 (defun unix-symlink (name1 name2)
   _N"Unix-symlink creates a symbolic link named name2 to the file
    named name1.  NIL and an error number is returned if the call
@@ -755,7 +755,7 @@
 		      (:adjustable t) (:fill-pointer t)
 		      (:displaced-to (or array null))
 		      (:displaced-index-offset index)
-		      (:allocation (member nil :malloc)))
+		      (:allocation (member nil :malloc :pinned)))
   array (flushable unsafe))
 
 (defknown vector (&rest t) simple-vector (flushable unsafe))
@@ -0,0 +1,2 @@
+(compile-file "modules:heap-snapshot/heap-snapshot"
+	      :load t)
@@ -0,0 +1,525 @@
+;;; -*- Mode: Lisp; Package: Heap-Snapshot -*-
+;;;
+;;; This code has been placed in the public domain.
+;;;
+;;; Description: Read the heap snapshots written by
+;;;   LISP::WRITE-HEAP-SNAPSHOT and find what keeps the memory alive:
+;;;   the dominator tree of the heap and the retained size of each
+;;;   object, that is, the bytes that would be freed if it went away.
+;;;
+;;; Copyright status: Public domain.
+;;;
+
+(defpackage "HEAP-SNAPSHOT"
+  (:use "COMMON-LISP")
+  (:export "READ-SNAPSHOT" "COMPUTE-DOMINATORS" "TOP-RETAINERS"
+	   "TYPE-SUMMARY" "DOMINATOR-CHAIN" "REPORT"))
+
+(in-package "HEAP-SNAPSHOT")
+
+;;; Usage:
+;;;
+;;;   In the image being debugged:
+;;;     (lisp::write-heap-snapshot "/tmp/heap.snap")
+;;;
+;;;   Then, preferably in another image:
+;;;     (require :contrib-heap-snapshot)
+;;;     (heap-snapshot:report (heap-snapshot:read-snapshot "/tmp/heap.snap"))
+;;;
+;;; The snapshot is held in (unsigned-byte 32) vectors, a little over
+;;; 20 bytes for each object and 4 for each pointer, and the dominators
+;;; take another 40 bytes or so for each object while they're computed,
+;;; so heaps of a few GB can be looked at in an image of similar size.
+;;; Addresses are kept in units of two words, which limits them to the
+;;; first 32GB of the address space.
+;;;
+;;; The objects are numbered in address order.  The dominators are
+;;; found from a virtual root whose successors are the roots in the
+;;; snapshot and all objects outside dynamic space.  Since the stacks
+;;; are scanned conservatively on x86, some of the roots may be stale.
+;;; Weak hash tables look like any other to the snapshot, so what they
+;;; hold shows up as retained by them.
+
+(deftype u32-vector () '(simple-array (unsigned-byte 32) (*)))
+(deftype u8-vector () '(simple-array (unsigned-byte 8) (*)))
+(deftype index () '(integer 0 #.array-dimension-limit))
+
+(defconstant none #xffffffff
+  "Marks a missing object index.")
+
+(defstruct (snapshot (:print-function %print-snapshot))
+  ;;
+  ;; The bounds of dynamic space.
+  (dynamic-start 0 :type unsigned-byte)
+  (dynamic-end 0 :type unsigned-byte)
+  ;;
+  ;; The number of objects.  Object N, the virtual root, has the roots
+  ;; as its successors.
+  (count 0 :type index)
+  ;;
+  ;; The address of each object in units of two words, its size in
+  ;; bytes and its header type, 0 for a cons.
+  (addresses nil :type (or null u32-vector))
+  (sizes nil :type (or null u32-vector))
+  (types nil :type (or null u8-vector))
+  ;;
+  ;; The successors of object I are the indices in EDGES from
+  ;; (aref edge-start i) below (aref edge-start (1+ i)).
+  (edge-start nil :type (or null u32-vector))
+  (edges nil :type (or null u32-vector))
+  ;;
+  ;; Filled in by COMPUTE-DOMINATORS: the immediate dominator of each
+  ;; object, NONE if it's unreachable, and its retained size in bytes.
+  (dominators nil :type (or null u32-vector))
+  (retained nil :type (or null (simple-array double-float (*)))))
+
+(defun %print-snapshot (snapshot stream depth)
+  (declare (ignore depth))
+  (print-unreadable-object (snapshot stream :type t :identity t)
+    (format stream "~D objects" (snapshot-count snapshot))))
+
+(defun make-u32-vector (length &optional (initial-element 0))
+  (make-array length :element-type '(unsigned-byte 32)
+	      :initial-element initial-element))
+
+(defun grow-vector (vector)
+  (let ((new (make-array (max 1024 (* 2 (length vector)))
+			 :element-type (array-element-type vector))))
+    (replace new vector)
+    new))
+
+
+;;;; Reading.
+
+(defstruct (reader)
+  (stream nil :type stream)
+  (buffer (make-array 65536 :element-type '(unsigned-byte 8)) :type u8-vector)
+  (pos 0 :type index)
+  (end 0 :type index))
+
+(defun fill-reader-buffer (reader)
+  (let ((end (read-sequence (reader-buffer reader) (reader-stream reader))))
+    (when (zerop end)
+      (error "Unexpected end of heap snapshot ~S."
+	     (pathname (reader-stream reader))))
+    (setf (reader-pos reader) 0)
+    (setf (reader-end reader) end)))
+
+(declaim (inline read-u8 read-u32 read-address))
+
+(defun read-u8 (reader)
+  (declare (type reader reader)
+	   (optimize (speed 3) (safety 0)))
+  (when (= (reader-pos reader) (reader-end reader))
+    (fill-reader-buffer reader))
+  (prog1 (aref (reader-buffer reader) (reader-pos reader))
+    (incf (reader-pos reader))))
+
+(defun read-u32 (reader)
+  (declare (optimize (speed 3) (safety 0)))
+  (let* ((b0 (read-u8 reader))
+	 (b1 (read-u8 reader))
+	 (b2 (read-u8 reader))
+	 (b3 (read-u8 reader)))
+    (the (unsigned-byte 32)
+	 (logior b0 (ash b1 8) (ash b2 16) (ash b3 24)))))
+
+;;; Read a 64 bit address, returning it in units of two words.
+(defun read-address (reader)
+  (declare (optimize (speed 3) (safety 0)))
+  (let ((low (logior (ash (read-u8 reader) -3) (ash (read-u8 reader) 5)
+		     (ash (read-u8 reader) 13) (ash (read-u8 reader) 21)))
+	(high (read-u32 reader)))
+    (when (> high 7)
+      (error "Address ~X in the heap snapshot is too large."
+	     (logior low (ash high 32))))
+    (the (unsigned-byte 32) (logior low (ash high 29)))))
+
+(defun read-u64 (reader)
+  (let ((low (read-u32 reader)))
+    (logior low (ash (read-u32 reader) 32))))
+
+;;; Return the index of the object containing the given address, in
+;;; units of two words, or NONE.
+(defun find-object-index (addresses sizes count address)
+  (declare (type u32-vector addresses sizes)
+	   (type index count)
+	   (type (unsigned-byte 32) address)
+	   (optimize (speed 3) (safety 0)))
+  (let ((low 0)
+	(high count))
+    (declare (type index low high))
+    ;; Find the last object starting at or below the address.
+    (loop while (< low high)
+	  do (let ((mid (ash (+ low high) -1)))
+	       (if (<= (aref addresses mid) address)
+		   (setf low (1+ mid))
+		   (setf high mid))))
+    (if (and (plusp low)
+	     (< address (+ (aref addresses (1- low))
+			   (ash (aref sizes (1- low)) -3))))
+	(1- low)
+	none)))
+
+;;; Turn the addresses in the edges into object indices, dropping those
+;;; that don't point to an object.
+(defun resolve-edges (snapshot)
+  (let ((addresses (snapshot-addresses snapshot))
+	(sizes (snapshot-sizes snapshot))
+	(count (snapshot-count snapshot))
+	(edge-start (snapshot-edge-start snapshot))
+	(edges (snapshot-edges snapshot)))
+    (declare (type u32-vector addresses sizes edge-start edges)
+	     (type index count)
+	     (optimize (speed 3) (safety 0)))
+    (let ((out 0)
+	  (start (aref edge-start 0)))
+      (declare (type index out start))
+      (dotimes (i (1+ count))
+	(let ((end (aref edge-start (1+ i))))
+	  (setf (aref edge-start i) out)
+	  (loop for e of-type index from start below end
+		for target = (find-object-index addresses sizes count
+						(aref edges e))
+		unless (= target none)
+		  do (setf (aref edges out) target)
+		     (incf out))
+	  (setf start end)))
+      (setf (aref edge-start (1+ count)) out))))
+
+(defun read-snapshot (file)
+  "Read the heap snapshot in FILE and return it."
+  (with-open-file (stream file :element-type '(unsigned-byte 8))
+    (let ((reader (make-reader :stream stream))
+	  (addresses (make-u32-vector 1024))
+	  (sizes (make-u32-vector 1024))
+	  (types (make-array 1024 :element-type '(unsigned-byte 8)))
+	  (edge-start (make-u32-vector 1024))
+	  (edges (make-u32-vector 1024))
+	  (count 0)
+	  (nedges 0))
+      (declare (type u32-vector addresses sizes edge-start edges)
+	       (type u8-vector types)
+	       (type index count nedges))
+      (unless (every #'(lambda (char) (= (char-code char) (read-u8 reader)))
+		     "CMUHEAP1")
+	(error "~S is not a heap snapshot." file))
+      (let ((dynamic-start (read-u64 reader))
+	    (dynamic-end (read-u64 reader)))
+	(flet ((add-edge (address)
+		 (when (= nedges (length edges))
+		   (setf edges (grow-vector edges)))
+		 (setf (aref edges nedges) address)
+		 (incf nedges)))
+	  (loop
+	    (let ((tag (code-char (read-u8 reader))))
+	      (case tag
+		(#\O
+		 (when (>= (1+ count) (length addresses))
+		   (setf addresses (grow-vector addresses))
+		   (setf sizes (grow-vector sizes))
+		   (setf types (grow-vector types))
+		   (setf edge-start (grow-vector edge-start)))
+		 (setf (aref addresses count) (read-address reader))
+		 (setf (aref types count) (read-u32 reader))
+		 (setf (aref sizes count) (read-u32 reader))
+		 (setf (aref edge-start count) nedges)
+		 (dotimes (i (read-u32 reader))
+		   (add-edge (read-address reader)))
+		 (incf count))
+		(#\R
+		 (setf (aref edge-start count) nedges)
+		 (dotimes (i (read-u32 reader))
+		   (add-edge (read-address reader))))
+		(#\E
+		 (return))
+		(t
+		 (error "Bad tag ~S in heap snapshot ~S." tag file)))))
+	  ;; The objects outside dynamic space are roots too.
+	  (dotimes (i count)
+	    (let ((address (* 8 (aref addresses i))))
+	      (unless (and (<= dynamic-start address) (< address dynamic-end))
+		(add-edge (aref addresses i)))))
+	  (when (>= (+ count 2) (length edge-start))
+	    (setf edge-start (grow-vector edge-start)))
+	  (setf (aref edge-start (1+ count)) nedges))
+	(let ((snapshot (make-snapshot :dynamic-start dynamic-start
+				       :dynamic-end dynamic-end
+				       :count count
+				       :addresses addresses
+				       :sizes sizes
+				       :types types
+				       :edge-start edge-start
+				       :edges edges)))
+	  (resolve-edges snapshot)
+	  snapshot)))))
+
+
+;;;; Dominators.
+
+;;; Return the start and contents of the predecessor lists of the
+;;; objects, in the same form as the edges.
+(defun predecessors (snapshot)
+  (let* ((nodes (1+ (snapshot-count snapshot)))
+	 (edge-start (snapshot-edge-start snapshot))
+	 (edges (snapshot-edges snapshot))
+	 (pred-start (make-u32-vector (1+ nodes)))
+	 (preds (make-u32-vector (aref edge-start nodes))))
+    (declare (type u32-vector edge-start edges pred-start preds)
+	     (type index nodes)
+	     (optimize (speed 3) (safety 0)))
+    (loop for e of-type index from 0 below (aref edge-start nodes)
+	  do (incf (aref pred-start (1+ (aref edges e)))))
+    (loop for i of-type index from 1 to nodes
+	  do (incf (aref pred-start i) (aref pred-start (1- i))))
+    ;; Fill each list using the start of the next as its fill pointer,
+    ;; then shift the starts back.
+    (dotimes (v nodes)
+      (loop for e of-type index from (aref edge-start v)
+	      below (aref edge-start (1+ v))
+	    for w = (aref edges e)
+	    do (setf (aref preds (aref pred-start (1+ w))) v)
+	       (incf (aref pred-start (1+ w)))))
+    (loop for i of-type index from nodes above 0
+	  do (setf (aref pred-start i) (aref pred-start (1- i))))
+    (setf (aref pred-start 0) 0)
+    (values pred-start preds)))
+
+(defun compute-dominators (snapshot)
+  "Compute the immediate dominator and the retained size of each object
+  in SNAPSHOT, using the Lengauer-Tarjan algorithm.  Return SNAPSHOT."
+  (multiple-value-bind (pred-start preds)
+      (predecessors snapshot)
+    (let* ((count (snapshot-count snapshot))
+	   (nodes (1+ count))
+	   (root count)
+	   (edge-start (snapshot-edge-start snapshot))
+	   (edges (snapshot-edges snapshot))
+	   (sizes (snapshot-sizes snapshot))
+	   ;; The DFS number of each object, NONE if unreachable, and
+	   ;; the object with each number.
+	   (dfnum (make-u32-vector nodes none))
+	   (vertex (make-u32-vector nodes))
+	   (parent (make-u32-vector nodes none))
+	   ;; The DFS number of the semidominator.
+	   (semi (make-u32-vector nodes))
+	   (ancestor (make-u32-vector nodes none))
+	   (label (make-u32-vector nodes))
+	   (dom (make-u32-vector nodes none))
+	   ;; The objects with the same semidominator, as linked lists.
+	   (bucket (make-u32-vector nodes none))
+	   (bucket-next (make-u32-vector nodes none))
+	   (stack (make-u32-vector nodes))
+	   (reached 0))
+      (declare (type u32-vector pred-start preds edge-start edges sizes
+		     dfnum vertex parent semi ancestor label dom bucket
+		     bucket-next stack)
+	       (type index count nodes root reached)
+	       (optimize (speed 3) (safety 0)))
+      ;; Number the objects depth first from the root.  The cursor of
+      ;; each object on the stack is kept in LABEL, which is set up
+      ;; afterwards.
+      (let ((sp 0))
+	(declare (type index sp))
+	(setf (aref dfnum root) 0)
+	(setf (aref vertex 0) root)
+	(setf (aref label root) (aref edge-start root))
+	(setf (aref stack 0) root)
+	(setf sp 1)
+	(setf reached 1)
+	(loop while (plusp sp)
+	      do (let* ((v (aref stack (1- sp)))
+			(e (aref label v)))
+		   (cond ((< e (aref edge-start (1+ v)))
+			  (setf (aref label v) (1+ e))
+			  (let ((w (aref edges e)))
+			    (when (= (aref dfnum w) none)
+			      (setf (aref dfnum w) reached)
+			      (setf (aref vertex reached) w)
+			      (setf (aref parent w) v)
+			      (setf (aref label w) (aref edge-start w))
+			      (incf reached)
+			      (setf (aref stack sp) w)
+			      (incf sp))))
+			 (t
+			  (decf sp))))))
+      (dotimes (v nodes)
+	(setf (aref semi v) (aref dfnum v))
+	(setf (aref label v) v))
+      (flet ((eval-node (v)
+	       ;; Compress the ancestor path of V and return the object
+	       ;; on it with the least semidominator.
+	       (when (= (aref ancestor v) none)
+		 (return-from eval-node v))
+	       (let ((x v)
+		     (sp 0))
+		 (declare (type index sp))
+		 (loop until (= (aref ancestor (aref ancestor x)) none)
+		       do (setf (aref stack sp) x)
+			  (incf sp)
+			  (setf x (aref ancestor x)))
+		 (loop while (plusp sp)
+		       do (decf sp)
+			  (let* ((x (aref stack sp))
+				 (a (aref ancestor x)))
+			    (when (< (aref semi (aref label a))
+				     (aref semi (aref label x)))
+			      (setf (aref label x) (aref label a)))
+			    (setf (aref ancestor x) (aref ancestor a)))))
+	       (aref label v)))
+	(loop for i of-type index from (1- reached) downto 1
+	      do (let ((w (aref vertex i))
+		       (p 0))
+		   (declare (type index p))
+		   (loop for e of-type index from (aref pred-start w)
+			   below (aref pred-start (1+ w))
+			 for v = (aref preds e)
+			 unless (= (aref dfnum v) none)
+			   do (let ((u (eval-node v)))
+				(when (< (aref semi u) (aref semi w))
+				  (setf (aref semi w) (aref semi u)))))
+		   (let ((s (aref vertex (aref semi w))))
+		     (setf (aref bucket-next w) (aref bucket s))
+		     (setf (aref bucket s) w))
+		   (setf p (aref parent w))
+		   (setf (aref ancestor w) p)
+		   (do ((v (aref bucket p) (aref bucket-next v)))
+		       ((= v none))
+		     (let ((u (eval-node v)))
+		       (setf (aref dom v)
+			     (if (< (aref semi u) (aref semi v)) u p))))
+		   (setf (aref bucket p) none))))
+      (loop for i of-type index from 1 below reached
+	    do (let ((w (aref vertex i)))
+		 (unless (= (aref dom w) (aref vertex (aref semi w)))
+		   (setf (aref dom w) (aref dom (aref dom w))))))
+      (setf (aref dom root) root)
+      ;; Each object comes after its dominator in DFS order, so adding
+      ;; the objects to their dominators in reverse order gives the
+      ;; retained sizes.
+      (let ((retained (make-array nodes :element-type 'double-float
+				  :initial-element 0d0)))
+	(loop for i of-type index from (1- reached) downto 1
+	      do (let ((w (aref vertex i)))
+		   (incf (aref retained w) (float (aref sizes w) 0d0))
+		   (incf (aref retained (aref dom w)) (aref retained w))))
+	(setf (snapshot-dominators snapshot) dom)
+	(setf (snapshot-retained snapshot) retained))))
+  snapshot)
+
+(defun ensure-dominators (snapshot)
+  (unless (snapshot-dominators snapshot)
+    (compute-dominators snapshot)))
+
+
+;;;; Reports.
+
+(defun type-name (type)
+  (if (zerop type)
+      'cons
+      (let ((info (svref vm::*room-info* type)))
+	(if info
+	    (vm::room-info-name info)
+	    (format nil "type #x~X" type)))))
+
+(defun object-address (snapshot i)
+  (* 8 (aref (snapshot-addresses snapshot) i)))
+
+(defun address-object-index (snapshot address)
+  (let ((i (find-object-index (snapshot-addresses snapshot)
+			      (snapshot-sizes snapshot)
+			      (snapshot-count snapshot)
+			      (ash address -3))))
+    (when (= i none)
+      (error "There is no object at ~X in ~S." address snapshot))
+    i))
+
+(defun describe-object-index (snapshot i)
+  (list (object-address snapshot i)
+	(type-name (aref (snapshot-types snapshot) i))
+	(aref (snapshot-sizes snapshot) i)
+	(if (snapshot-retained snapshot)
+	    (round (aref (snapshot-retained snapshot) i))
+	    0)))
+
+(defun top-retainers (snapshot &key (count 20))
+  "Return the COUNT objects in SNAPSHOT with the largest retained sizes
+  as a list of (address type size retained), largest first."
+  (ensure-dominators snapshot)
+  (let ((retained (snapshot-retained snapshot))
+	(top (make-array count :fill-pointer 0)))
+    (declare (type (simple-array double-float (*)) retained))
+    ;; Keep TOP sorted by decreasing retained size.
+    (dotimes (i (snapshot-count snapshot))
+      (let ((size (aref retained i)))
+	(when (and (plusp size) (plusp count)
+		   (or (< (fill-pointer top) count)
+		       (> size (aref retained (aref top (1- count))))))
+	  (when (= (fill-pointer top) count)
+	    (decf (fill-pointer top)))
+	  (vector-push i top)
+	  (loop for j from (1- (fill-pointer top)) above 0
+		while (> size (aref retained (aref top (1- j))))
+		do (rotatef (aref top j) (aref top (1- j)))))))
+    (map 'list #'(lambda (i) (describe-object-index snapshot i)) top)))
+
+(defun type-summary (snapshot &key (count 20))
+  "Return the COUNT types in SNAPSHOT taking the most space as a list of
+  (type number-of-objects bytes), largest first."
+  (let ((counts (make-array 256 :initial-element 0))
+	(bytes (make-array 256 :initial-element 0))
+	(types (snapshot-types snapshot))
+	(sizes (snapshot-sizes snapshot))
+	(totals (make-hash-table :test #'equal))
+	(result '()))
+    (dotimes (i (snapshot-count snapshot))
+      (incf (svref counts (aref types i)))
+      (incf (svref bytes (aref types i)) (aref sizes i)))
+    (dotimes (type 256)
+      (unless (zerop (svref counts type))
+	(let ((total (gethash (type-name type) totals)))
+	  (unless total
+	    (setf total (list (type-name type) 0 0))
+	    (setf (gethash (type-name type) totals) total)
+	    (push total result))
+	  (incf (second total) (svref counts type))
+	  (incf (third total) (svref bytes type)))))
+    (setf result (sort result #'> :key #'third))
+    (subseq result 0 (min count (length result)))))
+
+(defun dominator-chain (snapshot address)
+  "Return the chain of dominators of the object at ADDRESS in SNAPSHOT,
+  the object first and ending with the one directly dominated by the
+  roots, as a list of (address type size retained)."
+  (ensure-dominators snapshot)
+  (let ((dominators (snapshot-dominators snapshot))
+	(root (snapshot-count snapshot))
+	(chain '()))
+    (do ((i (address-object-index snapshot address) (aref dominators i)))
+	((or (= i root) (= i none)))
+      (push (describe-object-index snapshot i) chain))
+    (nreverse chain)))
+
+(defun report (snapshot &key (count 20) (stream *standard-output*))
+  "Print the types taking the most space in SNAPSHOT and the objects
+  retaining the most."
+  (ensure-dominators snapshot)
+  (let ((dominators (snapshot-dominators snapshot))
+	(sizes (snapshot-sizes snapshot))
+	(total 0)
+	(reachable 0))
+    (dotimes (i (snapshot-count snapshot))
+      (incf total (aref sizes i))
+      (unless (= (aref dominators i) none)
+	(incf reachable (aref sizes i))))
+    (format stream "~&~:D objects, ~:D bytes, ~:D bytes reachable.~2%"
+	    (snapshot-count snapshot) total reachable))
+  (format stream "~&~12@A ~15@A  Type~%" "Objects" "Bytes")
+  (loop for (type objects bytes) in (type-summary snapshot :count count)
+	do (format stream "~12:D ~15:D  ~A~%" objects bytes type))
+  (format stream "~2&~15@A ~12@A ~10@A  Type~%" "Retained" "Address" "Size")
+  (loop for (address type size retained) in (top-retainers snapshot
+							   :count count)
+	do (format stream "~15:D ~12,'0X ~10:D  ~A~%"
+		   retained address size type))
+  (values))
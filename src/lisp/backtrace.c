@@ -3,6 +3,7 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 #include <signal.h>
 #include "lisp.h"
 #include "internals.h"
@@ -241,6 +242,22 @@ backtrace(int nframes)
     } while (--nframes > 0 && previous_info(&info));
 }
 
+/*
+ * The allocation sampler only walks x86 stacks so far; elsewhere the
+ * samples have no frames.
+ */
+int
+lisp_backtrace_pcs(unsigned long *pcs, int max)
+{
+    return 0;
+}
+
+int
+lisp_pc_name(unsigned long pc, char *buf, int size)
+{
+    return 0;
+}
+
 #else /* (defined(i386) || defined(__x86_64)) */
 
 #include "x86-validate.h"
@@ -505,4 +522,117 @@ backtrace(int nframes)
     }
 }
 
+/*
+ * Store the return addresses of up to max frames, innermost first, in
+ * pcs and return how many were stored.  Foreign frames are included;
+ * lisp_pc_name tells them apart.  This doesn't allocate, so the
+ * allocator can call it.
+ */
+int
+lisp_backtrace_pcs(unsigned long *pcs, int max)
+{
+    unsigned long fp = (unsigned long) __builtin_frame_address(0);
+    int n = 0;
+
+    while (n < max) {
+	unsigned long ra, next_fp;
+
+	if (!x86_call_context(fp, &ra, &next_fp))
+	    break;
+	pcs[n++] = ra;
+	fp = next_fp;
+    }
+    return n;
+}
+
+static void
+name_append(char *buf, int size, const char *s)
+{
+    int len = strlen(buf);
+
+    if (len < size - 1)
+	snprintf(buf + len, size - len, "%s", s);
+}
+
+static void
+name_append_string(char *buf, int size, struct vector *string)
+{
+    int len = strlen(buf);
+    int n = fixnum_value(string->length);
+    int i;
+#ifdef UNICODE
+    unsigned short *chars = (unsigned short *) string->data;
+#else
+    unsigned char *chars = (unsigned char *) string->data;
+#endif
+
+    /* Like convert_lisp_string, keep the low byte of each character. */
+    for (i = 0; i < n && len < size - 1; i++)
+	buf[len++] = chars[i] & 0xff;
+    buf[len] = '\0';
+}
+
+/* Like print_entry_name, but into buf, as PACKAGE:SYMBOL. */
+static void
+name_append_entry_name(char *buf, int size, lispobj name)
+{
+    if (LowtagOf(name) == type_ListPointer) {
+	name_append(buf, size, "(");
+	while (LowtagOf(name) == type_ListPointer) {
+	    struct cons *cons = (struct cons *) PTR(name);
+
+	    name_append_entry_name(buf, size, cons->car);
+	    name = cons->cdr;
+	    if (name != NIL)
+		name_append(buf, size, " ");
+	}
+	name_append(buf, size, ")");
+    } else if (LowtagOf(name) == type_OtherPointer) {
+	lispobj *object = (lispobj *) PTR(name);
+
+	if (TypeOf(*object) == type_SymbolHeader) {
+	    struct symbol *symbol = (struct symbol *) object;
+
+	    if (symbol->package != NIL) {
+		struct instance *pkg = (struct instance *) PTR(symbol->package);
+
+		name_append_string(buf, size,
+				   (struct vector *) PTR(pkg->slots[2]));
+		name_append(buf, size, ":");
+	    }
+	    name_append_string(buf, size, (struct vector *) PTR(symbol->name));
+	} else if (TypeOf(*object) == type_SimpleString)
+	    name_append_string(buf, size, (struct vector *) object);
+	else
+	    name_append(buf, size, "?");
+    } else
+	name_append(buf, size, "?");
+}
+
+/*
+ * Write the name of the Lisp function containing pc to buf, which
+ * holds size bytes.  Return 0, leaving buf alone, if pc is not in a
+ * code object.
+ */
+int
+lisp_pc_name(unsigned long pc, char *buf, int size)
+{
+    struct code *code = (struct code *) component_ptr_from_pc((lispobj *) pc);
+    struct compiled_debug_function *df;
+
+    if (code == NULL)
+	return 0;
+
+    buf[0] = '\0';
+    df = debug_function_from_pc(code, pc);
+    if (df)
+	name_append_entry_name(buf, size, df->name);
+    else if (code->entry_points != NIL)
+	name_append_entry_name(buf, size,
+			       ((struct function *) PTR(code->entry_points))->name);
+    else
+	snprintf(buf, size, "<code 0x%lx>", (unsigned long) code);
+    return 1;
+}
+
 #endif /* (defined(i386) || defined(__x86_64)) */
@@ -18,6 +18,12 @@
 #define CORE_VERSION 3860
 #define CORE_MACHINE_STATE 3862
 #define CORE_INITIAL_FUNCTION 3863
+/* The gencgc page table of the dynamic space; see gc_save_page_table. */
+#define CORE_PAGE_TABLE 3864
+/* Bumped when struct core_page or struct core_generation changes. */
+#define CORE_PAGE_TABLE_VERSION 2
+/* The page runs of spaces saved sparse or compressed; see core_run. */
+#define CORE_SPACE_RUNS 3865
 
 #define DYNAMIC_SPACE_ID (1)
 #define STATIC_SPACE_ID (2)
@@ -39,6 +45,43 @@ struct ndir_entry {
 #endif
 };
 
+/*
+ * The formats save can write the spaces in: as they are, to be mapped
+ * back; as runs of pages that aren't all zero, leaving out the zero
+ * pages; and as such runs, each compressed if that makes it smaller.
+ */
+#define CORE_FORMAT_FLAT 0
+#define CORE_FORMAT_SPARSE 1
+#define CORE_FORMAT_COMPRESSED 2
+
+/*
+ * The most pages in one run.  Longer stretches of non-zero pages are
+ * split, so compressed runs can be decoded in parallel.
+ */
+#define CORE_RUN_PAGES 256
+
+/*
+ * A run of pages of a sparse or compressed space.  The space's
+ * directory entry then has a page_count of 0, and the CORE_SPACE_RUNS
+ * entry gives, for each such space, its id, the number of runs and
+ * the data page of its table of runs.  The pages not in any run are
+ * zero.
+ *
+ * A compressed run is a sequence of blocks of literals followed by a
+ * match, as in LZ4: a token byte holds the number of literals in its
+ * top four bits and the match length less 4 in the bottom four, a
+ * value of 15 being continued by bytes added to it up to the first
+ * that isn't 255; then come the literals, and the match's offset back
+ * from the output position as two bytes, low byte first.  The last
+ * block has only literals.
+ */
+struct core_run {
+    u32 page;			/* first page, counted from the space start */
+    u32 page_count;
+    u32 data_page;
+    u32 data_bytes;		/* compressed size, or 0 if stored as is */
+};
+
 extern lispobj load_core_file(const char *file, fpu_mode_t *fpu_type);
 
 #endif /* _CORE_H_ */
@@ -11,7 +11,11 @@
 
 #include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#ifdef CORE_THREADS
+#include <pthread.h>
+#endif
 
 #include "os.h"
 #include "lisp.h"
@@ -19,8 +23,16 @@
 #include "core.h"
 #include "internals.h"
 
+#ifdef GENCGC
+#include "gencgc.h"
+#endif
+
 extern int version;
 
+/* Where each space was loaded and its size in pages, for CORE_SPACE_RUNS. */
+static os_vm_address_t space_addresses[READ_ONLY_SPACE_ID + 1];
+static long space_pages[READ_ONLY_SPACE_ID + 1];
+
 static void
 process_directory(int fd, long *ptr, int count)
 {
@@ -53,6 +65,17 @@ process_directory(int fd, long *ptr, int count)
 #if 0
 	printf("Space ID = %d, free pointer = 0x%08x.\n", id, free_pointer);
 #endif
+	/*
+	 * A space saved as runs has no pages of its own in the
+	 * directory, so check the size its words imply.
+	 */
+	if (len == 0)
+	    len = (entry->nwords * sizeof(lispobj) + CORE_PAGESIZE - 1)
+		& ~(CORE_PAGESIZE - 1);
+	if (id > 0 && id <= READ_ONLY_SPACE_ID) {
+	    space_addresses[id] = addr;
+	    space_pages[id] = len / CORE_PAGESIZE;
+	}
 
 	switch (id) {
 	  case DYNAMIC_SPACE_ID:
@@ -64,6 +87,11 @@ process_directory(int fd, long *ptr, int count)
                          (os_vm_address_t) dynamic_1_space);
               }
               
+              if (len > dynamic_space_size) {
+                  fprintf(stderr, "Error:  Dynamic space size (%ld) exceeds allocated space (%u)!\n",
+                          len, dynamic_space_size);
+                  exit(1);
+              }
 	      current_dynamic_space = (lispobj *) addr;
 #if defined(ibmrt) || defined(i386) || defined(__x86_64)
 	      SetSymbolValue(ALLOCATION_POINTER, (lispobj) free_pointer);
@@ -95,6 +123,267 @@ process_directory(int fd, long *ptr, int count)
     }
 }
 
+#ifdef GENCGC
+/*
+ * Read the gencgc page table saved with the dynamic space, if it was
+ * saved in the current format with the same page size.
+ */
+static void
+process_page_table(int fd, void *ptr, long len)
+{
+#if !(defined(alpha) || defined(__x86_64))
+    long *entry = ptr;
+#else
+    u32 *entry = ptr;
+#endif
+    long page_size, npages, ngenerations;
+    off_t offset;
+    size_t bytes;
+    void *data;
+
+    if (len != 7 || entry[0] != CORE_PAGE_TABLE_VERSION) {
+	fprintf(stderr, "Old core page table format; page table ignored.\n");
+	return;
+    }
+    page_size = entry[1];
+    npages = entry[2];
+    ngenerations = entry[3];
+    offset = CORE_PAGESIZE * (1 + entry[4]);
+    bytes = npages * sizeof(struct core_page)
+	+ ngenerations * sizeof(struct core_generation);
+
+    if (page_size != GC_PAGE_SIZE) {
+	fprintf(stderr, "Core page size %ld is not %d; page table ignored.\n",
+		page_size, GC_PAGE_SIZE);
+	return;
+    }
+
+    data = malloc(bytes);
+    if (data == NULL) {
+	fprintf(stderr, "No memory for the core page table; ignored.\n");
+	return;
+    }
+    if (lseek(fd, offset, SEEK_SET) != offset
+	|| read(fd, data, bytes) != (ssize_t) bytes) {
+	perror("reading the core page table");
+    } else {
+	gc_load_page_table(data, npages, ngenerations);
+    }
+    free(data);
+}
+#endif
+
+/*
+ * Decompress len bytes from src, compressed as described in core.h,
+ * into dst, which has room for dst_len bytes.  Returns the number of
+ * bytes decompressed, or -1 if the data is bad.
+ */
+static long
+lz_decompress(const unsigned char *src, long len, unsigned char *dst,
+	      long dst_len)
+{
+    const unsigned char *ip = src, *ip_end = src + len;
+    unsigned char *op = dst, *op_end = dst + dst_len;
+
+    while (ip < ip_end) {
+	unsigned token = *ip++;
+	long nlit = token >> 4, mlen = token & 15, offset;
+	unsigned char *ref;
+	unsigned b;
+
+	if (nlit == 15) {
+	    do {
+		if (ip >= ip_end)
+		    return -1;
+		b = *ip++;
+		nlit += b;
+	    } while (b == 255);
+	}
+	if (nlit > ip_end - ip || nlit > op_end - op)
+	    return -1;
+	memcpy(op, ip, nlit);
+	op += nlit;
+	ip += nlit;
+	if (ip == ip_end)
+	    break;
+
+	if (ip_end - ip < 2)
+	    return -1;
+	offset = ip[0] | (ip[1] << 8);
+	ip += 2;
+	if (mlen == 15) {
+	    do {
+		if (ip >= ip_end)
+		    return -1;
+		b = *ip++;
+		mlen += b;
+	    } while (b == 255);
+	}
+	mlen += 4;
+	if (offset == 0 || offset > op - dst || mlen > op_end - op)
+	    return -1;
+
+	ref = op - offset;
+	if (offset >= mlen) {
+	    memcpy(op, ref, mlen);
+	    op += mlen;
+	} else {
+	    /* Overlapping, as in a run of one repeated byte. */
+	    while (mlen-- > 0)
+		*op++ = *ref++;
+	}
+    }
+
+    return op - dst;
+}
+
+/*
+ * The compressed runs of a space, shared by the threads decoding them.
+ * Each thread takes the next run until there are none left.
+ */
+struct run_loader {
+    int fd;
+    char *space;
+    struct core_run *runs;
+    int nruns;
+    int next;
+    int errors;
+};
+
+static void *
+load_compressed_runs(void *arg)
+{
+    struct run_loader *loader = arg;
+    unsigned char *buffer = NULL;
+    long buffer_bytes = 0;
+    int i;
+
+    while ((i = __sync_fetch_and_add(&loader->next, 1)) < loader->nruns) {
+	struct core_run *run = &loader->runs[i];
+	char *addr = loader->space + CORE_PAGESIZE * run->page;
+	long len = CORE_PAGESIZE * run->page_count;
+	off_t offset = CORE_PAGESIZE * (1 + (off_t) run->data_page);
+
+	if (run->data_bytes == 0)
+	    continue;
+	if (run->data_bytes > buffer_bytes) {
+	    free(buffer);
+	    buffer_bytes = run->data_bytes;
+	    buffer = malloc(buffer_bytes);
+	    if (buffer == NULL) {
+		buffer_bytes = 0;
+		__sync_fetch_and_add(&loader->errors, 1);
+		continue;
+	    }
+	}
+	if (pread(loader->fd, buffer, run->data_bytes, offset)
+	    != (ssize_t) run->data_bytes
+	    || lz_decompress(buffer, run->data_bytes, (unsigned char *) addr,
+			     len) != len)
+	    __sync_fetch_and_add(&loader->errors, 1);
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+/*
+ * Load a space saved as runs of pages.  The runs stored as they are
+ * are mapped like a flat space; the compressed ones are decoded by
+ * up to one thread per processor.
+ */
+static void
+load_space_runs(int fd, int id, int nruns, long table_page)
+{
+    struct run_loader loader;
+    size_t table_bytes = nruns * sizeof(struct core_run);
+    int i, compressed = 0;
+
+    if (id <= 0 || id > READ_ONLY_SPACE_ID || space_addresses[id] == NULL) {
+	fprintf(stderr, "Runs for unknown space %d.\n", id);
+	exit(1);
+    }
+
+    loader.fd = fd;
+    loader.space = (char *) space_addresses[id];
+    loader.runs = malloc(table_bytes);
+    loader.nruns = nruns;
+    loader.next = 0;
+    loader.errors = 0;
+    if (loader.runs == NULL
+	|| pread(fd, loader.runs, table_bytes,
+		 CORE_PAGESIZE * (1 + (off_t) table_page)) != (ssize_t) table_bytes) {
+	fprintf(stderr, "Can't read the page runs of space %d.\n", id);
+	exit(1);
+    }
+
+    /*
+     * The runs are written in page order, each before the table, so
+     * check they stay inside the space, don't overlap and have their
+     * data before the table.
+     */
+    for (i = 0; i < nruns; i++) {
+	struct core_run *run = &loader.runs[i];
+	unsigned long stored = run->data_bytes != 0
+	    ? (run->data_bytes + CORE_PAGESIZE - 1) / CORE_PAGESIZE
+	    : run->page_count;
+
+	if (run->page_count == 0
+	    || (unsigned long) run->page + run->page_count > space_pages[id]
+	    || (i > 0 && run->page < loader.runs[i - 1].page
+		+ loader.runs[i - 1].page_count)
+	    || (unsigned long) run->data_page + stored > table_page) {
+	    fprintf(stderr, "Bad page run %d of space %d.\n", i, id);
+	    exit(1);
+	}
+    }
+
+    for (i = 0; i < nruns; i++) {
+	struct core_run *run = &loader.runs[i];
+
+	if (run->data_bytes != 0) {
+	    compressed++;
+	} else {
+	    os_vm_address_t addr =
+		(os_vm_address_t) (loader.space + CORE_PAGESIZE * run->page);
+
+	    if (os_map(fd, CORE_PAGESIZE * (1 + run->data_page), addr,
+		       CORE_PAGESIZE * run->page_count) != addr)
+		loader.errors++;
+	}
+    }
+
+    if (compressed > 0) {
+#ifdef CORE_THREADS
+	pthread_t threads[8];
+	int nthreads = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+
+	if (nthreads > compressed - 1)
+	    nthreads = compressed - 1;
+	if (nthreads > 8)
+	    nthreads = 8;
+	for (i = 0; i < nthreads; i++)
+	    if (pthread_create(&threads[i], NULL, load_compressed_runs,
+			       &loader) != 0)
+		break;
+	nthreads = i;
+	load_compressed_runs(&loader);
+	for (i = 0; i < nthreads; i++)
+	    pthread_join(threads[i], NULL);
+#else
+	load_compressed_runs(&loader);
+#endif
+    }
+
+    if (loader.errors != 0) {
+	fprintf(stderr, "%d page runs of space %d could not be loaded.\n",
+		loader.errors, id);
+	exit(1);
+    }
+
+    free(loader.runs);
+}
+
 lispobj
 load_core_file(const char *file, fpu_mode_t* fpu_type)
 {
@@ -170,6 +459,21 @@ load_core_file(const char *file, fpu_mode_t* fpu_type)
 	      initial_function = (lispobj) * ptr;
 	      break;
 
+	  case CORE_SPACE_RUNS:
+	      {
+		  int i;
+
+		  for (i = 0; i + 3 <= len - 2; i += 3)
+		      load_space_runs(fd, ptr[i], ptr[i + 1], ptr[i + 2]);
+	      }
+	      break;
+
+	  case CORE_PAGE_TABLE:
+#ifdef GENCGC
+	      process_page_table(fd, ptr, len);
+#endif
+	      break;
+
 	  case CORE_MACHINE_STATE:
 	      fprintf(stderr, "Obsolete core file.\n");
 	      exit(1);
@@ -11,9 +11,20 @@
 
 #include <limits.h>
 #include <stdio.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <signal.h>
 #include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#ifdef __linux__
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "lisp.h"
 #include "arch.h"
 #include "internals.h"
@@ -249,6 +260,233 @@ boolean debug_static_array_p = 0;
  */
 boolean enable_page_protection = TRUE;
 
+/*
+ * If true, writes to boxed pages are tracked with the kernel's
+ * soft-dirty page bits instead of by write protecting the pages.
+ * PAGE_WRITE_PROTECTED then only means that the page had no pointers
+ * to younger generations when it was last scanned; the page itself
+ * stays writable.  At the start of each GC the soft-dirty bits say
+ * which of these pages were written since the end of the previous GC
+ * and only those lose the flag, so the mutator never takes a SIGSEGV
+ * or makes an mprotect call for them.  Set by the -gc-soft-dirty
+ * switch.  Only available on Linux, and turned off again at startup
+ * if the kernel doesn't support soft-dirty tracking.
+ */
+boolean gencgc_soft_dirty = FALSE;
+
+/*
+ * If true, the dynamic space is backed by transparent huge pages and
+ * freed pages are given back to the kernel only a whole huge page at
+ * a time, so the huge pages aren't split up again.  Set by the
+ * -gc-huge-pages switch.  Only available on Linux.
+ */
+boolean gencgc_huge_pages = FALSE;
+
+/* The number of huge pages of free heap given back to the kernel. */
+unsigned long long gc_huge_pages_released = 0;
+
+/*
+ * If true, the oldest generation is collected by marking it first and
+ * leaving its densely occupied blocks in place; only the sparse blocks
+ * are copied.  See mark_region_mark.  Set by the -gc-mark-region
+ * switch.  Only available on x86.
+ */
+boolean gencgc_mark_region = FALSE;
+
+/*
+ * The percentage of a block's bytes that must be live for a
+ * mark-region collection to leave the block in place.
+ */
+int gencgc_mark_region_density = 75;
+
+/*
+ * Mark-region statistics: the number of pages left in place, the
+ * number of bytes of dead objects overwritten with filler in pages
+ * left in place, and the total time in microseconds spent marking.
+ */
+unsigned long long gc_mark_region_pages = 0;
+unsigned long long gc_mark_region_filled_bytes = 0;
+unsigned long long gc_mark_region_usec = 0;
+
+/*
+ * If true, the marking for a mark-region collection of the oldest
+ * generation is started early from a snapshot of the heap and done a
+ * step at a time as the mutator allocates, so that little is left to
+ * do in the collection itself.  See satb_start.  Set by the
+ * -gc-concurrent-mark switch.  Needs the mprotect write barrier, so
+ * it does nothing with -gc-soft-dirty.  Only available on x86.
+ */
+boolean gencgc_concurrent_mark = FALSE;
+
+/*
+ * Concurrent marking starts after a GC leaves the oldest generation
+ * with at least this percentage of its gc_trigger allocated.
+ */
+int gencgc_concurrent_mark_start = 75;
+
+/* The number of words marked in each step of concurrent marking. */
+int gencgc_concurrent_mark_step = 16384;
+
+/*
+ * Concurrent marking statistics: the total time in microseconds spent
+ * in mark steps, the number of pages scanned on their first write,
+ * and the total time in microseconds spent finishing the marking in
+ * collections of the oldest generation.
+ */
+unsigned long long gc_concurrent_mark_usec = 0;
+unsigned long long gc_satb_pages = 0;
+unsigned long long gc_remark_usec = 0;
+
+/*
+ * The number of free pages an allocation context claims at a time for
+ * the mutator's boxed regions.  Most refills then take the next pages
+ * of the batch instead of searching the page table.  1 turns batching
+ * off.
+ */
+int gencgc_alloc_batch_pages = 8;
+
+/*
+ * Allocation statistics: the number of times alloc refilled the
+ * mutator's region, the total time in nanoseconds that took, and the
+ * number of searches of the page table for free pages.
+ */
+unsigned long long gc_alloc_refills = 0;
+unsigned long long gc_alloc_refill_nsec = 0;
+unsigned long long gc_alloc_page_searches = 0;
+
+/*
+ * Allocation sampling, off while gencgc_alloc_sample_bytes is 0.
+ * Otherwise, when alloc refills the region and at least that many
+ * bytes have been allocated since the last sample, it records the
+ * Lisp functions on the stack and the type of the object allocated,
+ * weighted by the bytes since the last sample.  gc_alloc_samples
+ * counts the samples, gc_alloc_samples_dropped those the table had no
+ * room for, and gc_alloc_sample_nsec the time spent taking them.
+ * gc_alloc_sample_interval is the number of bytes between samples
+ * actually used, which grows when sampling costs too much; see
+ * alloc_sample_budget.
+ */
+unsigned long gencgc_alloc_sample_bytes = 0;
+unsigned long long gc_alloc_samples = 0;
+unsigned long long gc_alloc_samples_dropped = 0;
+unsigned long long gc_alloc_sample_nsec = 0;
+unsigned long gc_alloc_sample_interval = 0;
+
+/*
+ * The GC policy.  With both targets 0 the nursery size is
+ * *bytes-consed-between-gcs* and the promotion ages are the static
+ * ones set in gc_init.  Otherwise each GC of the nursery measures its
+ * pause, the survival rate of generation 0 and the share of the time
+ * spent in GC, and adjusts gc_policy_nursery_bytes, which sub-gc then
+ * uses instead of *bytes-consed-between-gcs*, and the promotion age
+ * of generation 0.  The promotion age of generation 0 and the trigger
+ * of generation 1 are restored at the first GC after both targets are
+ * set back to 0.
+ *
+ * gencgc_pause_target_usec is the longest nursery GC pause wanted, in
+ * microseconds; the nursery shrinks when pauses are longer.
+ * gencgc_gc_time_target is the percentage of the run time that may be
+ * spent in GC; the nursery grows when more is.  The pause target wins
+ * when the two disagree.  The nursery stays between
+ * gencgc_nursery_min_bytes and gencgc_nursery_max_bytes; a maximum of
+ * 0 means an eighth of the dynamic space.
+ */
+unsigned long gencgc_pause_target_usec = 0;
+int gencgc_gc_time_target = 0;
+unsigned long gencgc_nursery_min_bytes = 1 << 20;
+unsigned long gencgc_nursery_max_bytes = 0;
+
+/*
+ * GC policy state and statistics: the current nursery size in bytes
+ * (0 while the policy is off), the number of GCs it has adjusted
+ * after, and decaying averages of the nursery GC pause in
+ * microseconds, of the percentage of generation 0 surviving a GC and
+ * of the percentage of time spent in GC.
+ */
+unsigned long gc_policy_nursery_bytes = 0;
+unsigned long long gc_policy_updates = 0;
+unsigned long gc_policy_pause_usec = 0;
+int gc_policy_survival = 0;
+int gc_policy_gc_time = 0;
+
+/*
+ * The promotion age of generation 0 and the trigger of generation 1
+ * the policy replaced, put back when it is turned off.  Saved only
+ * while gc_policy_active.
+ */
+static boolean gc_policy_active = FALSE;
+static int gc_policy_saved_trigger_age;
+static int gc_policy_saved_bytes_consed;
+
+/*
+ * Shared core mode, set by the -shared-core switch, for running many
+ * processes from one core.  Read-only and static space are write
+ * protected at startup, so their pages stay shared with the core
+ * file's page cache until they are really written.  Written pages are
+ * noted by the write barrier, and written static pages are the only
+ * static pages most GCs scavenge.  Read-only space is written only
+ * when purify adds to it or, on x86, where it holds code, when a
+ * breakpoint is set.
+ */
+boolean gencgc_shared_core = FALSE;
+
+/*
+ * Shared core statistics: the number of static space pages write
+ * protected at startup, and the number of them written since.
+ */
+unsigned long gc_static_pages = 0;
+unsigned long gc_static_pages_written = 0;
+
+/* The same for read-only space, protected only in shared core mode. */
+unsigned long gc_read_only_pages = 0;
+unsigned long gc_read_only_pages_written = 0;
+
+/*
+ * Write barrier statistics: the number of write faults handled by
+ * gc_write_barrier, the number of write protected pages found to
+ * have been written by looking at the soft-dirty bits, and the total
+ * time in microseconds spent in scavenge_generation.
+ */
+unsigned long long gc_write_faults = 0;
+unsigned long long gc_soft_dirty_pages = 0;
+unsigned long long gc_scavenge_generation_usec = 0;
+
+/*
+ * Time in microseconds spent scanning the stacks for conservative
+ * roots: the total, and for the most recent GC.
+ */
+unsigned long long gc_stack_scan_usec = 0;
+unsigned long long gc_last_stack_scan_usec = 0;
+
+/*
+ * Weak hash table statistics: the number of weak tables and of their
+ * entries looked at by GCs, the number of times an entry waiting for
+ * its key or value to survive was checked again, the number of
+ * entries removed, and the time in microseconds the most recent GC
+ * spent on weak tables.
+ */
+unsigned long long gc_weak_tables = 0;
+unsigned long long gc_weak_entries = 0;
+unsigned long long gc_weak_rechecks = 0;
+unsigned long long gc_weak_removed = 0;
+unsigned long long gc_weak_usec = 0;
+
+/*
+ * Large object statistics: the number of large objects whose pages
+ * were found in the free run index and the number that needed a page
+ * search, and the number of pinned vectors allocated and their total
+ * size in bytes.
+ */
+unsigned long long gc_large_run_hits = 0;
+unsigned long long gc_large_run_misses = 0;
+unsigned long long gc_pinned_vectors = 0;
+unsigned long long gc_pinned_bytes = 0;
+
+/*
+ * The number of GC events recorded so far; see gc_event_read.
+ */
+unsigned long long gc_events_written = 0;
+
 /*
  * Hunt for pointers to old-space, when GCing generations >= verify_gen.
  * Set to NUM_GENERATIONS to disable.
@@ -430,10 +668,12 @@ static int new_space;
 unsigned dynamic_space_pages;
 
 /*
- * An array of page structures is statically allocated.
- * This helps quickly map between an address and its page structure.
+ * The page table, one entry of each array for each page of the
+ * dynamic space.  See gencgc.h.
  */
-struct page *page_table;
+page_flags_t *page_flags;
+int *page_first_object_offset;
+unsigned short *page_bytes_used;
 
 /*
  * Heap base, needed for mapping addresses to page structures.
@@ -472,11 +712,18 @@ find_page_index(void *addr)
  * to boxed regions outside of generation 0.  When such a store occurs
  * this routine will be automatically invoked by the page fault
  * handler.  If passed an address outside of the dynamic space, this
- * routine will return immediately with a value of 0.  Otherwise, the
- * page belonging to the address is made writable, the protection
+ * routine will return immediately with a value of 0, unless the
+ * address is in protected static or read-only space.  Otherwise,
+ * the page belonging to the address is made writable, the protection
  * change is recorded in the garbage collector page table, and a value
  * of 1 is returned.
  */
+#if defined(i386) || defined(__x86_64)
+static void satb_page_written(int page);
+#endif
+static int static_write_barrier(void *addr);
+static int read_only_write_barrier(void *addr);
+
 int
 gc_write_barrier(void *addr)
 {
@@ -484,7 +731,7 @@ gc_write_barrier(void *addr)
 
     /* Check if the fault is within the dynamic space. */
     if (page_index == -1) {
-	 return 0;
+	 return static_write_barrier(addr) || read_only_write_barrier(addr);
     }
 
     /* The page should have been marked write protected */
@@ -492,13 +739,46 @@ gc_write_barrier(void *addr)
 	 fprintf(stderr,
 		 "*** Page fault in page not marked as write protected\n");
 
+#if defined(i386) || defined(__x86_64)
+    satb_page_written(page_index);
+#endif
+
     /* Un-protect the page */
     os_protect((os_vm_address_t) page_address(page_index), GC_PAGE_SIZE, OS_VM_PROT_ALL);
-    page_table[page_index].flags &= ~PAGE_WRITE_PROTECTED_MASK;
+    page_flags[page_index] &= ~PAGE_WRITE_PROTECTED_MASK;
+    gc_write_faults++;
 
     return 1;
 }
 
+/*
+ * Return a time in nanoseconds, for the GC statistics.
+ */
+static unsigned long long
+gc_time_nsec(void)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#else
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000000ULL + tv.tv_usec * 1000ULL;
+#endif
+}
+
+/*
+ * Return a time in microseconds, for the GC statistics.
+ */
+static unsigned long long
+gc_time_usec(void)
+{
+    return gc_time_nsec() / 1000;
+}
+
 /*
  * A structure to hold the state of a generation.
  */
@@ -620,65 +900,302 @@ int last_free_page;
 static void scan_weak_tables(void);
 static void scan_weak_objects(void);
 
+#ifdef __linux__
 /*
- * Misc. heap functions.
+ * Soft-dirty write tracking; see gencgc_soft_dirty.  Writing "4" to
+ * /proc/self/clear_refs clears the soft-dirty bit of every page of
+ * the process, and the kernel sets it again on the next write to a
+ * page.  The bit is bit 55 of the page's /proc/self/pagemap entry.
+ */
+
+#define PAGEMAP_SOFT_DIRTY	(1ULL << 55)
+#define PAGEMAP_CHUNK		1024
+
+static int pagemap_fd = -1;
+static int clear_refs_fd = -1;
+
+static boolean
+soft_dirty_clear(void)
+{
+    return write(clear_refs_fd, "4", 1) == 1;
+}
+
+static boolean
+soft_dirty_read(void *addr, uint64_t *entries, int count)
+{
+    off_t offset = ((unsigned long) addr / os_vm_page_size) * sizeof(uint64_t);
+    ssize_t size = count * sizeof(uint64_t);
+
+    return pread(pagemap_fd, entries, size, offset) == size;
+}
+
+/*
+ * Check that the kernel really does track soft-dirty pages by
+ * writing to a scratch page.
  */
+static boolean
+soft_dirty_init(void)
+{
+    char *probe;
+    uint64_t entry;
+    boolean ok = FALSE;
+
+    pagemap_fd = open("/proc/self/pagemap", O_RDONLY);
+    clear_refs_fd = open("/proc/self/clear_refs", O_WRONLY);
+    probe = (char *) os_validate(NULL, os_vm_page_size);
+
+    if (pagemap_fd >= 0 && clear_refs_fd >= 0 && probe != NULL) {
+	*probe = 1;
+	if (soft_dirty_clear()
+	    && soft_dirty_read(probe, &entry, 1)
+	    && !(entry & PAGEMAP_SOFT_DIRTY)) {
+	    *probe = 2;
+	    ok = soft_dirty_read(probe, &entry, 1)
+		&& (entry & PAGEMAP_SOFT_DIRTY);
+	}
+    }
+
+    if (probe != NULL)
+	os_invalidate((os_vm_address_t) probe, os_vm_page_size);
+    if (!ok) {
+	if (pagemap_fd >= 0)
+	    close(pagemap_fd);
+	if (clear_refs_fd >= 0)
+	    close(clear_refs_fd);
+	pagemap_fd = clear_refs_fd = -1;
+    }
+
+    return ok;
+}
 
 /*
- * Count the number of write protected pages within the given generation.
+ * Clear the write protected flag of all pages written since the
+ * soft-dirty bits were last cleared.  If the pagemap can't be read,
+ * assume every page was written.
  */
-static int
-count_write_protect_generation_pages(int generation)
+static void
+soft_dirty_unprotect_written_pages(void)
+{
+    uint64_t entries[PAGEMAP_CHUNK];
+    int per_page = GC_PAGE_SIZE / os_vm_page_size;
+    int chunk_pages = PAGEMAP_CHUNK / per_page;
+    int page;
+
+    for (page = 0; page < last_free_page; page += chunk_pages) {
+	int npages = last_free_page - page;
+	boolean ok;
+	int i, j;
+
+	if (npages > chunk_pages)
+	    npages = chunk_pages;
+	ok = soft_dirty_read(page_address(page), entries, npages * per_page);
+
+	for (i = 0; i < npages; i++)
+	    if (PAGE_WRITE_PROTECTED(page + i))
+		for (j = 0; j < per_page; j++)
+		    if (!ok || (entries[i * per_page + j] & PAGEMAP_SOFT_DIRTY)) {
+			page_flags[page + i] &= ~PAGE_WRITE_PROTECTED_MASK;
+			gc_soft_dirty_pages++;
+			break;
+		    }
+    }
+}
+
+/*
+ * Called at the end of a GC, once all pages have been write
+ * protected.  The GC's own writes after a page was scanned only
+ * replace from_space pointers or break weak references, so they
+ * never add pointers to younger generations and can be forgotten.
+ * If the bits can't be cleared, go back to page protection.
+ */
+static void
+soft_dirty_reset(void)
 {
     int i;
-    int cnt = 0;
-    int mmask, mflags;
 
-    mmask = PAGE_ALLOCATED_MASK | PAGE_WRITE_PROTECTED_MASK
-	| PAGE_GENERATION_MASK;
-    mflags = PAGE_ALLOCATED_MASK | PAGE_WRITE_PROTECTED_MASK | generation;
+    if (soft_dirty_clear())
+	return;
 
+    fprintf(stderr,
+	    "GC: unable to clear soft-dirty bits; using page protection.\n");
+    gencgc_soft_dirty = FALSE;
     for (i = 0; i < last_free_page; i++)
-	if (PAGE_FLAGS(i, mmask) == mflags)
-	    cnt++;
-    return cnt;
+	if (PAGE_WRITE_PROTECTED(i))
+	    os_protect((os_vm_address_t) page_address(i), GC_PAGE_SIZE,
+		       OS_VM_PROT_READ | OS_VM_PROT_EXECUTE);
 }
 
 /*
- * Count the number of pages within the given generation.
+ * Transparent huge page support; see gencgc_huge_pages.  The GC pages
+ * are grouped into blocks of GC_HUGE_PAGE_PAGES pages, each covering
+ * one huge page, starting at the first huge page boundary in the
+ * dynamic space.
  */
+#define GC_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define GC_HUGE_PAGE_PAGES (GC_HUGE_PAGE_SIZE / GC_PAGE_SIZE)
+
+static int huge_page_first_page;
+static int huge_page_last_page;
+
 static int
-count_generation_pages(int generation)
+huge_pages_init(void)
 {
-    int i;
+#ifdef MADV_HUGEPAGE
+    unsigned long start = (unsigned long) heap_base;
+    unsigned long end = start + dynamic_space_size;
+
+    start = (start + GC_HUGE_PAGE_SIZE - 1) & ~(GC_HUGE_PAGE_SIZE - 1UL);
+    end &= ~(GC_HUGE_PAGE_SIZE - 1UL);
+    if (end <= start)
+	return FALSE;
+    if (madvise((void *) start, end - start, MADV_HUGEPAGE) != 0)
+	return FALSE;
+    huge_page_first_page = find_page_index((void *) start);
+    huge_page_last_page = huge_page_first_page
+	+ (end - start) / GC_PAGE_SIZE;
+    return TRUE;
+#else
+    return FALSE;
+#endif
+}
+
+/*
+ * Give back to the kernel every huge page block that the free pages
+ * from first_page to last_page - 1 have left entirely free.  The
+ * other freed pages are marked as needing zeroing, as in MODE_LAZY.
+ * So are the pages of a released block, as in MODE_MADVISE: where
+ * dynamic space is mapped from the core file, MADV_DONTNEED brings
+ * back the contents of the file rather than zeros.
+ */
+static void
+release_free_huge_pages(int first_page, int last_page)
+{
+    int page = first_page;
+
+    while (page < last_page) {
+	int block, block_end, end, unused, i;
+
+	if (page < huge_page_first_page || page >= huge_page_last_page) {
+	    /* Not part of any huge page. */
+	    *(int *) page_address(page) = PAGE_NEEDS_ZEROING_MARKER;
+	    page++;
+	    continue;
+	}
+
+	block = page - (page - huge_page_first_page) % GC_HUGE_PAGE_PAGES;
+	block_end = block + GC_HUGE_PAGE_PAGES;
+	end = block_end < last_page ? block_end : last_page;
+
+	unused = TRUE;
+	for (i = block; i < block_end; i++)
+	    if (PAGE_ALLOCATED(i)) {
+		unused = FALSE;
+		break;
+	    }
+
+	if (unused) {
+	    madvise(page_address(block), GC_HUGE_PAGE_SIZE, MADV_DONTNEED);
+	    for (i = block; i < block_end; i++)
+		*(int *) page_address(i) = PAGE_NEEDS_ZEROING_MARKER;
+	    gc_huge_pages_released++;
+	} else {
+	    for (i = page; i < end; i++)
+		*(int *) page_address(i) = PAGE_NEEDS_ZEROING_MARKER;
+	}
+	page = end;
+    }
+}
+#endif /* __linux__ */
+
+/*
+ * Misc. heap functions.
+ */
+
+/*
+ * Return the first page from page below end whose flags under mmask
+ * are mflags, or end if there is none.  With SSE2 the flags of eight
+ * pages are compared at a time.
+ */
+static inline int
+next_page_with_flags(int page, int end, int mmask, int mflags)
+{
+#ifdef __SSE2__
+    __m128i vmask = _mm_set1_epi16((short) mmask);
+    __m128i vflags = _mm_set1_epi16((short) mflags);
+
+    while (page + 8 <= end) {
+	__m128i flags = _mm_loadu_si128((__m128i *) & page_flags[page]);
+	int match = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(flags, vmask),
+						      vflags));
+
+	if (match != 0)
+	    return page + __builtin_ctz(match) / 2;
+	page += 8;
+    }
+#endif
+    while (page < end && PAGE_FLAGS(page, mmask) != mflags)
+	page++;
+    return page;
+}
+
+/*
+ * Count the pages below last_free_page whose flags under mmask are
+ * mflags.
+ */
+static int
+count_pages_with_flags(int mmask, int mflags)
+{
+    int i = 0;
     int cnt = 0;
-    int mmask, mflags;
 
-    mmask = PAGE_ALLOCATED_MASK | PAGE_GENERATION_MASK;
-    mflags = PAGE_ALLOCATED_MASK | generation;
+#ifdef __SSE2__
+    __m128i vmask = _mm_set1_epi16((short) mmask);
+    __m128i vflags = _mm_set1_epi16((short) mflags);
 
-    for (i = 0; i < last_free_page; i++)
+    for (; i + 8 <= last_free_page; i += 8) {
+	__m128i flags = _mm_loadu_si128((__m128i *) & page_flags[i]);
+
+	cnt += __builtin_popcount(_mm_movemask_epi8(
+		   _mm_cmpeq_epi16(_mm_and_si128(flags, vmask), vflags))) / 2;
+    }
+#endif
+    for (; i < last_free_page; i++)
 	if (PAGE_FLAGS(i, mmask) == mflags)
 	    cnt++;
     return cnt;
 }
 
 /*
- * Count the number of dont_move pages.
+ * Count the number of write protected pages within the given generation.
  */
 static int
-count_dont_move_pages(void)
+count_write_protect_generation_pages(int generation)
 {
-    int i;
-    int cnt = 0;
-    int mmask;
+    return count_pages_with_flags(PAGE_ALLOCATED_MASK
+				  | PAGE_WRITE_PROTECTED_MASK
+				  | PAGE_GENERATION_MASK,
+				  PAGE_ALLOCATED_MASK
+				  | PAGE_WRITE_PROTECTED_MASK | generation);
+}
 
-    mmask = PAGE_ALLOCATED_MASK | PAGE_DONT_MOVE_MASK;
+/*
+ * Count the number of pages within the given generation.
+ */
+static int
+count_generation_pages(int generation)
+{
+    return count_pages_with_flags(PAGE_ALLOCATED_MASK | PAGE_GENERATION_MASK,
+				  PAGE_ALLOCATED_MASK | generation);
+}
 
-    for (i = 0; i < last_free_page; i++)
-	if (PAGE_FLAGS(i, mmask) == mmask)
-	    cnt++;
-    return cnt;
+/*
+ * Count the number of dont_move pages.
+ */
+static int
+count_dont_move_pages(void)
+{
+    return count_pages_with_flags(PAGE_ALLOCATED_MASK | PAGE_DONT_MOVE_MASK,
+				  PAGE_ALLOCATED_MASK | PAGE_DONT_MOVE_MASK);
 }
 
 /*
@@ -697,7 +1214,7 @@ generation_bytes_allocated(int generation)
 
     for (i = 0; i < last_free_page; i++) {
 	if (PAGE_FLAGS(i, mmask) == mflags)
-	    bytes_allocated += page_table[i].bytes_used;
+	    bytes_allocated += page_bytes_used[i];
     }
     return bytes_allocated;
 }
@@ -782,7 +1299,7 @@ print_generation_stats(int verbose)
 	int large_unboxed_cnt = 0;
 
 	for (j = 0; j < last_free_page; j++) {
-	    int flags = page_table[j].flags;
+	    int flags = page_flags[j];
 
 	    if ((flags & PAGE_GENERATION_MASK) == i) {
 		if (flags & PAGE_ALLOCATED_MASK) {
@@ -817,6 +1334,8 @@ print_generation_stats(int verbose)
 		(double)gen_av_mem_age(i) / MEM_AGE_SCALE);
     }
     fprintf(stderr, "   Total bytes alloc=%ld\n", bytes_allocated);
+    fprintf(stderr, "   Stack scan time=%.3f ms (last GC %.3f ms)\n",
+	    gc_stack_scan_usec / 1000.0, gc_last_stack_scan_usec / 1000.0);
 
     restore_fpu_state(fpu_state);
 }
@@ -914,40 +1433,359 @@ set_min_mem_age(int gen, double min_mem_age)
  */
 
 /*
- * Only using two regions at present, both are for the current
- * newspace generation.
+ * The regions are kept in allocation contexts.  The GC allocates from
+ * the two regions of main_alloc_context, both for the current
+ * newspace generation.  The mutator allocates from the boxed region
+ * of current_alloc_context, whose free pointer and end address are
+ * kept in CURRENT-REGION-FREE-POINTER and CURRENT-REGION-END-ADDR
+ * while it is current; boxed_region and unboxed_region name the
+ * regions of the current context.  Other contexts can be made with
+ * gc_make_alloc_context and switched to with gc_set_alloc_context,
+ * so each thread of control refills its own region.  On x86 each
+ * stack group but the initial one gets a context of its own, which
+ * stack-group-resume makes current and which is freed when the stack
+ * group's function returns.
  */
-struct alloc_region boxed_region;
-struct alloc_region unboxed_region;
+struct alloc_context main_alloc_context;
+struct alloc_context *current_alloc_context = &main_alloc_context;
+
+/* All the contexts, starting with main_alloc_context. */
+static struct alloc_context *alloc_contexts = &main_alloc_context;
 
-#if 0
 /*
- * X hack. current lisp code uses the following. Need coping in/out.
+ * One byte for each page, non-zero while the page is part of an open
+ * region or of a context's batch.  Pages are taken with a compare and
+ * swap, so that a context can claim pages without a lock, and the
+ * page searches skip claimed pages.
  */
-void *current_region_free_pointer;
-void *current_region_end_addr;
-#endif
+static unsigned char *page_claim = NULL;
 
-/* The generation currently being allocated to. X */
-static int gc_alloc_generation = 0;
+static inline boolean
+claim_page(int page)
+{
+    return __sync_bool_compare_and_swap(&page_claim[page], 0, 1);
+}
 
-extern void do_dynamic_space_overflow_warning(void);
-extern void do_dynamic_space_overflow_error(void);
+static inline void
+release_page(int page)
+{
+    page_claim[page] = 0;
+}
+
+/*
+ * Indexes of the pages the allocator looks for: a bitmap with a bit
+ * for each page, and a summary bitmap with a bit for each word of the
+ * first that is non-zero, so a search can skip 4096 pages (on 64 bit)
+ * at a time.
+ */
+#define PAGE_INDEX_WORD_BITS (8 * sizeof(unsigned long))
+
+struct page_index {
+    unsigned long *bits;
+    unsigned long *summary;
+};
+
+/*
+ * The free pages, and for each generation and boxed or unboxed, the
+ * partly used pages with room left.  The bits are hints: a page may
+ * have its bit set when it is no longer free or partly used, and the
+ * searches check the page table and clear such bits as they go, but a
+ * page that is free or partly used is always in the index.  So wherever
+ * a page is freed, or left with room by the GC, note_page must be
+ * called for it.
+ */
+static struct page_index free_page_index;
+static struct page_index partial_page_index[NUM_GENERATIONS + 1][2];
+
+static inline void
+page_index_set(struct page_index *index, int page)
+{
+    size_t word = page / PAGE_INDEX_WORD_BITS;
+
+    index->bits[word] |= 1UL << (page % PAGE_INDEX_WORD_BITS);
+    index->summary[word / PAGE_INDEX_WORD_BITS] |=
+	1UL << (word % PAGE_INDEX_WORD_BITS);
+}
+
+static inline void
+page_index_clear(struct page_index *index, int page)
+{
+    size_t word = page / PAGE_INDEX_WORD_BITS;
+
+    index->bits[word] &= ~(1UL << (page % PAGE_INDEX_WORD_BITS));
+    if (index->bits[word] == 0)
+	index->summary[word / PAGE_INDEX_WORD_BITS] &=
+	    ~(1UL << (word % PAGE_INDEX_WORD_BITS));
+}
 
-/* Handle heap overflow here, maybe. */
 static void
-handle_heap_overflow(const char *msg, int size)
+page_index_init(struct page_index *index, int set)
 {
-    unsigned long heap_size_mb;
+    size_t words = (dynamic_space_pages + PAGE_INDEX_WORD_BITS - 1)
+	/ PAGE_INDEX_WORD_BITS;
+    size_t summary_words = (words + PAGE_INDEX_WORD_BITS - 1)
+	/ PAGE_INDEX_WORD_BITS;
 
-    if (msg) {
-	fprintf(stderr, msg, size);
+    index->bits = calloc(words, sizeof(unsigned long));
+    index->summary = calloc(summary_words, sizeof(unsigned long));
+    if (index->bits == NULL || index->summary == NULL) {
+	fprintf(stderr, "Unable to allocate the page index.\n");
+	exit(1);
     }
-#ifndef SPARSE_BLOCK_SIZE
-#define SPARSE_BLOCK_SIZE (0)
-#endif
+    if (set) {
+	int page;
 
-    /* Figure out how many MB of heap we have */
+	for (page = 0; page < dynamic_space_pages; page++)
+	    page_index_set(index, page);
+    }
+}
+
+/* Return the first page from page below limit in the index, or limit. */
+static int
+page_index_next(struct page_index *index, int page, int limit)
+{
+    size_t word, summary_word;
+    unsigned long mask;
+
+    if (page >= limit)
+	return limit;
+    word = page / PAGE_INDEX_WORD_BITS;
+    mask = index->bits[word] & (~0UL << (page % PAGE_INDEX_WORD_BITS));
+    if (mask == 0) {
+	/* Find the next non-zero word from the summary. */
+	word++;
+	summary_word = word / PAGE_INDEX_WORD_BITS;
+	if (word * PAGE_INDEX_WORD_BITS >= (size_t) limit)
+	    return limit;
+	mask = index->summary[summary_word]
+	    & (~0UL << (word % PAGE_INDEX_WORD_BITS));
+	while (mask == 0) {
+	    summary_word++;
+	    if (summary_word * PAGE_INDEX_WORD_BITS * PAGE_INDEX_WORD_BITS
+		>= (size_t) limit)
+		return limit;
+	    mask = index->summary[summary_word];
+	}
+	word = summary_word * PAGE_INDEX_WORD_BITS + __builtin_ctzl(mask);
+	mask = index->bits[word];
+    }
+    page = word * PAGE_INDEX_WORD_BITS + __builtin_ctzl(mask);
+    return page < limit ? page : limit;
+}
+
+/* Add the page to the free or partly used page index if it is either. */
+static inline void
+note_page(int page)
+{
+    if (!PAGE_ALLOCATED(page))
+	page_index_set(&free_page_index, page);
+    else if (!PAGE_LARGE_OBJECT(page)
+	     && page_bytes_used[page] < GC_PAGE_SIZE - 32)
+	page_index_set(&partial_page_index[PAGE_GENERATION(page)]
+		       [PAGE_UNBOXED_VAL(page)], page);
+}
+
+/*
+ * Return the first free page from page below limit that is not
+ * claimed, or limit if there is none.
+ */
+static int
+next_free_page(int page, int limit)
+{
+    while ((page = page_index_next(&free_page_index, page, limit)) < limit) {
+	if (!PAGE_ALLOCATED(page)) {
+	    if (!page_claim[page])
+		return page;
+	} else
+	    page_index_clear(&free_page_index, page);
+	page++;
+    }
+    return limit;
+}
+
+/*
+ * Return the first page from page below limit that is either free or
+ * a partly used page matching mflags under mmask with at least 32
+ * bytes free, and not claimed; or limit if there is none.  This is
+ * the first page of a new region.
+ */
+static int
+next_region_page(int page, int limit, int mmask, int mflags, int unboxed)
+{
+    struct page_index *index =
+	&partial_page_index[mflags & PAGE_GENERATION_MASK][unboxed];
+    int partial;
+
+    limit = next_free_page(page, limit);
+    while ((partial = page_index_next(index, page, limit)) < limit) {
+	if ((page_flags[partial] & mmask) == mflags
+	    && page_bytes_used[partial] < GC_PAGE_SIZE - 32
+	    && !page_claim[partial])
+	    return partial;
+	page_index_clear(index, partial);
+	page = partial + 1;
+    }
+    return limit;
+}
+
+/*
+ * Allocation latency: a histogram of the time taken to find the pages
+ * for a new region or a large object, bucket i counting the searches
+ * that took from 2^i to 2^(i+1) - 1 nanoseconds.
+ */
+#define GC_ALLOC_HISTOGRAM_BUCKETS 32
+unsigned long long gc_alloc_search_histogram[GC_ALLOC_HISTOGRAM_BUCKETS];
+
+static void
+gc_alloc_search_record(unsigned long long start)
+{
+    unsigned long long nsec = gc_time_nsec() - start;
+    int bucket = nsec == 0 ? 0 : 63 - __builtin_clzll(nsec);
+
+    if (bucket >= GC_ALLOC_HISTOGRAM_BUCKETS)
+	bucket = GC_ALLOC_HISTOGRAM_BUCKETS - 1;
+    gc_alloc_search_histogram[bucket]++;
+}
+
+/*
+ * Runs of free pages for large objects, by size class: class c holds
+ * runs of 2^c to 2^(c+1) - 1 pages, and the last class all the longer
+ * ones.  The index is rebuilt from the page table after each GC.  In
+ * between, regions take pages without telling it, so it is only a
+ * hint: a run is checked before it is used, and a class that fills up
+ * just drops runs, leaving them to the page search.
+ */
+#define LARGE_RUN_CLASSES 16
+#define LARGE_RUNS_PER_CLASS 64
+
+struct large_run {
+    int first_page;
+    int num_pages;
+};
+
+static struct large_run large_runs[LARGE_RUN_CLASSES][LARGE_RUNS_PER_CLASS];
+static int large_run_count[LARGE_RUN_CLASSES];
+
+static inline int
+large_run_class(int num_pages)
+{
+    int class = 31 - __builtin_clz(num_pages);
+
+    return class < LARGE_RUN_CLASSES ? class : LARGE_RUN_CLASSES - 1;
+}
+
+static void
+large_run_add(int first_page, int num_pages)
+{
+    int class;
+
+    if (num_pages <= 0)
+	return;
+    class = large_run_class(num_pages);
+    if (large_run_count[class] < LARGE_RUNS_PER_CLASS) {
+	struct large_run *run = &large_runs[class][large_run_count[class]++];
+
+	run->first_page = first_page;
+	run->num_pages = num_pages;
+    }
+}
+
+/*
+ * Take num_pages free pages from the index and return the first, or
+ * -1 if the index has no run that long.  What is left of the run goes
+ * back in the index.
+ */
+static int
+large_run_take(int num_pages)
+{
+    int class;
+
+    for (class = large_run_class(num_pages); class < LARGE_RUN_CLASSES;
+	 class++) {
+	int i = 0;
+
+	while (i < large_run_count[class]) {
+	    struct large_run run = large_runs[class][i];
+	    int page, end;
+
+	    if (run.num_pages < num_pages) {
+		i++;
+		continue;
+	    }
+	    large_runs[class][i] = large_runs[class][--large_run_count[class]];
+
+	    end = run.first_page + num_pages;
+	    for (page = run.first_page; page < end; page++)
+		if (PAGE_ALLOCATED(page) || page_claim[page])
+		    break;
+	    if (page == end) {
+		large_run_add(end, run.num_pages - num_pages);
+		return run.first_page;
+	    }
+	    /* Page was taken since the index was built; keep the rest. */
+	    large_run_add(page + 1, run.first_page + run.num_pages - page - 1);
+	}
+    }
+    return -1;
+}
+
+/*
+ * Rebuild the index from the page table.  Runs too short for a large
+ * object are left out, and everything above last_free_page is one
+ * run.
+ */
+static void
+large_runs_rebuild(void)
+{
+    int limit = dynamic_space_pages - reserved_heap_pages;
+    int min_pages = large_object_size / GC_PAGE_SIZE;
+    int page, end;
+
+    memset(large_run_count, 0, sizeof(large_run_count));
+    if (min_pages < 1)
+	min_pages = 1;
+    for (page = next_free_page(0, limit); page < limit;
+	 page = next_free_page(end, limit)) {
+	if (page >= last_free_page) {
+	    large_run_add(page, limit - page);
+	    break;
+	}
+	end = page + 1;
+	while (end < limit && !PAGE_ALLOCATED(end) && !page_claim[end])
+	    end++;
+	if (end - page >= min_pages)
+	    large_run_add(page, end - page);
+    }
+}
+
+#if 0
+/*
+ * X hack. current lisp code uses the following. Need coping in/out.
+ */
+void *current_region_free_pointer;
+void *current_region_end_addr;
+#endif
+
+/* The generation currently being allocated to. X */
+static int gc_alloc_generation = 0;
+
+extern void do_dynamic_space_overflow_warning(void);
+extern void do_dynamic_space_overflow_error(void);
+
+/* Handle heap overflow here, maybe. */
+static void
+handle_heap_overflow(const char *msg, int size)
+{
+    unsigned long heap_size_mb;
+
+    if (msg) {
+	fprintf(stderr, msg, size);
+    }
+#ifndef SPARSE_BLOCK_SIZE
+#define SPARSE_BLOCK_SIZE (0)
+#endif
+
+    /* Figure out how many MB of heap we have */
     heap_size_mb = (dynamic_space_size + SPARSE_BLOCK_SIZE) >> 20;
 
     fprintf(stderr, " CMUCL has run out of dynamic heap space (%lu MB).\n",
@@ -977,11 +1815,11 @@ boolean gencgc_debug_madvise = FALSE;
 static inline void
 handle_madvise_first_page(int first_page)
 {
-    int flags = page_table[first_page].flags;
+    int flags = page_flags[first_page];
         
     if (gencgc_debug_madvise) {
         fprintf(stderr, "first_page = %d, FLAGS = %x, orig = %d",
-                first_page, flags, page_table[first_page].bytes_used);
+                first_page, flags, page_bytes_used[first_page]);
     }
     
     if (!PAGE_ALLOCATED(first_page)) {
@@ -1010,7 +1848,7 @@ handle_madvise_other_pages(int first_page, int last_page)
 
             if (gencgc_debug_madvise) {
                 fprintf(stderr, "MADVISE page %d, FLAGS = %x: marker %x\n",
-                        i, page_table[i].flags, *page_start);
+                        i, page_flags[i], *page_start);
             }
             if (*page_start != 0) {
                 memset(page_start, 0, GC_PAGE_SIZE);
@@ -1019,6 +1857,163 @@ handle_madvise_other_pages(int first_page, int last_page)
     }
 }
 
+/*
+ * Set up alloc_region on the pages from first_page to last_page, which
+ * the caller has claimed.  The first page may be partly used already;
+ * the others are free.
+ */
+static void
+open_region(struct alloc_region *alloc_region, int first_page, int last_page,
+	    int unboxed)
+{
+    int bytes_found;
+    int i;
+    int mmask, mflags;
+
+    mmask = PAGE_ALLOCATED_MASK | PAGE_WRITE_PROTECTED_MASK
+	| PAGE_LARGE_OBJECT_MASK | PAGE_DONT_MOVE_MASK
+	| PAGE_UNBOXED_MASK | PAGE_GENERATION_MASK;
+    mflags = PAGE_ALLOCATED_MASK | (unboxed << PAGE_UNBOXED_SHIFT)
+	| gc_alloc_generation;
+    bytes_found = (GC_PAGE_SIZE - page_bytes_used[first_page])
+	+ GC_PAGE_SIZE * (last_page - first_page);
+
+    /* Setup the alloc_region. */
+    alloc_region->first_page = first_page;
+    alloc_region->last_page = last_page;
+    alloc_region->start_addr = page_bytes_used[first_page]
+	+ page_address(first_page);
+    alloc_region->free_pointer = alloc_region->start_addr;
+    alloc_region->end_addr = alloc_region->start_addr + bytes_found;
+
+    if ((gencgc_unmap_zero == MODE_MADVISE)
+        || (gencgc_unmap_zero == MODE_LAZY)) {
+        handle_madvise_first_page(first_page);
+        handle_madvise_other_pages(first_page, last_page);
+    }
+
+    if (DO_GENCGC_ZERO_CHECK) {
+	int *p;
+
+	for (p = (int *) alloc_region->start_addr;
+	     p < (int *) alloc_region->end_addr; p++)
+	    if (*p != 0)
+		fprintf(stderr, "** new region not zero @ %lx: %x\n",
+			(unsigned long) p, *p);
+    }
+
+    /* Setup the pages. */
+
+    /* The first page may have already been in use. */
+    if (page_bytes_used[first_page] == 0) {
+	PAGE_FLAGS_UPDATE(first_page, mmask, mflags);
+	page_first_object_offset[first_page] = 0;
+    }
+
+    if (gc_assert_level > 0) {
+        gc_assert(PAGE_ALLOCATED(first_page));
+        gc_assert(PAGE_UNBOXED_VAL(first_page) == unboxed);
+        gc_assert(PAGE_GENERATION(first_page) == gc_alloc_generation);
+        gc_assert(!PAGE_LARGE_OBJECT(first_page));
+    }
+    
+    for (i = first_page + 1; i <= last_page; i++) {
+	PAGE_FLAGS_UPDATE(i, PAGE_ALLOCATED_MASK | PAGE_LARGE_OBJECT_MASK
+			  | PAGE_UNBOXED_MASK | PAGE_GENERATION_MASK,
+			  PAGE_ALLOCATED_MASK | (unboxed << PAGE_UNBOXED_SHIFT)
+			  | gc_alloc_generation);
+	/*
+	 * This may not be necessary for unboxed regions (think it was
+	 * broken before!)
+	 */
+	page_first_object_offset[i] =
+	    alloc_region->start_addr - page_address(i);
+    }
+
+    /* Bump up the last_free_page */
+    if (last_page + 1 > last_free_page) {
+	last_free_page = last_page + 1;
+	set_alloc_pointer((lispobj) ((char *) heap_base +
+				     GC_PAGE_SIZE * last_free_page));
+
+    }
+}
+
+/* Give back the unused pages of a context's batch. */
+static void
+release_batch(struct alloc_context *context)
+{
+    int i;
+
+    for (i = context->batch_first_page; i <= context->batch_last_page; i++)
+	release_page(i);
+    context->batch_first_page = 0;
+    context->batch_last_page = -1;
+}
+
+/*
+ * Claim a batch of at least pages free pages for the context, and up
+ * to gencgc_alloc_batch_pages.  Returns false if there is no run of
+ * free pages long enough.
+ */
+static boolean
+claim_batch(struct alloc_context *context, int pages)
+{
+    int want = pages < gencgc_alloc_batch_pages
+	? gencgc_alloc_batch_pages : pages;
+    int limit = dynamic_space_pages - reserved_heap_pages;
+    int first_page = generations[0].alloc_start_page;
+
+    gc_alloc_page_searches++;
+
+    while ((first_page = next_free_page(first_page, limit)) < limit) {
+	int last_page = first_page - 1;
+	int next_page;
+
+	while (last_page + 1 < limit && last_page + 1 - first_page < want
+	       && !PAGE_ALLOCATED(last_page + 1) && claim_page(last_page + 1))
+	    last_page++;
+	if (last_page + 1 - first_page >= pages) {
+	    context->batch_first_page = first_page;
+	    context->batch_last_page = last_page;
+	    return TRUE;
+	}
+
+	/* Too short; skip it and the page that ended it. */
+	next_page = last_page + 2;
+	while (last_page >= first_page)
+	    release_page(last_page--);
+	first_page = next_page;
+    }
+    return FALSE;
+}
+
+/*
+ * Set up the context's boxed region with room for nbytes on the next
+ * pages of its batch, claiming a new batch if there are not enough
+ * left.  Returns false if that fails, and the caller should search for
+ * a region as usual.
+ */
+static boolean
+alloc_context_new_region(struct alloc_context *context, int nbytes)
+{
+    int pages = (nbytes + GC_PAGE_SIZE - 1) / GC_PAGE_SIZE;
+    int first_page;
+
+    /* At least two pages, like gc_alloc_new_region. */
+    if (pages < 2)
+	pages = 2;
+    if (context->batch_last_page - context->batch_first_page + 1 < pages) {
+	release_batch(context);
+	if (!claim_batch(context, pages))
+	    return FALSE;
+    }
+    first_page = context->batch_first_page;
+    context->batch_first_page += pages;
+    open_region(&context->boxed, first_page, first_page + pages - 1, 0);
+    return TRUE;
+}
+
 /*
  * Find a new region with room for at least the given number of bytes.
  *
@@ -1054,6 +2049,7 @@ gc_alloc_new_region(int nbytes, int unboxed, struct alloc_region *alloc_region)
     int num_pages;
     int i;
     int mmask, mflags;
+    unsigned long long search_start = gc_time_nsec();
 
     /* Shut up some compiler warnings */
     last_page = bytes_found = 0;
@@ -1070,6 +2066,16 @@ gc_alloc_new_region(int nbytes, int unboxed, struct alloc_region *alloc_region)
                   && alloc_region->free_pointer == alloc_region->end_addr);
     }
 
+    /* The mutator's boxed regions come from its context's batch. */
+    if (!unboxed && gc_alloc_generation == 0 && gencgc_alloc_batch_pages > 1
+	&& alloc_region == &current_alloc_context->boxed
+	&& alloc_context_new_region(current_alloc_context, nbytes)) {
+	gc_alloc_search_record(search_start);
+	return;
+    }
+
+    gc_alloc_page_searches++;
+
     if (unboxed)
 	restart_page =
 	    generations[gc_alloc_generation].alloc_unboxed_start_page;
@@ -1096,15 +2102,8 @@ gc_alloc_new_region(int nbytes, int unboxed, struct alloc_region *alloc_region)
 	 * not write protected, or marked dont_move.
 	 */
 
-	while (first_page < dynamic_space_pages) {
-	    int flags = page_table[first_page].flags;
-
-	    if (!(flags & PAGE_ALLOCATED_MASK)
-		|| ((flags & mmask) == mflags &&
-		    page_table[first_page].bytes_used < GC_PAGE_SIZE - 32))
-		break;
-	    first_page++;
-	}
+	first_page = next_region_page(first_page, dynamic_space_pages,
+				      mmask, mflags, unboxed);
 
 	/* Check for a failure */
 	if (first_page >= dynamic_space_pages - reserved_heap_pages) {
@@ -1122,7 +2121,7 @@ gc_alloc_new_region(int nbytes, int unboxed, struct alloc_region *alloc_region)
 
 #if 0
 	fprintf(stderr, "  first_page=%d bytes_used=%d\n",
-		first_page, page_table[first_page].bytes_used);
+		first_page, page_bytes_used[first_page]);
 #endif
 
 	/*
@@ -1132,11 +2131,11 @@ gc_alloc_new_region(int nbytes, int unboxed, struct alloc_region *alloc_region)
 	 * number of pages in a region.
 	 */
 	last_page = first_page;
-	bytes_found = GC_PAGE_SIZE - page_table[first_page].bytes_used;
+	bytes_found = GC_PAGE_SIZE - page_bytes_used[first_page];
 	num_pages = 1;
 	while ((bytes_found < nbytes || num_pages < 2)
 	       && last_page < dynamic_space_pages - 1
-	       && !PAGE_ALLOCATED(last_page + 1)) {
+	       && !PAGE_ALLOCATED(last_page + 1) && !page_claim[last_page + 1]) {
 	    last_page++;
 	    num_pages++;
 	    bytes_found += GC_PAGE_SIZE;
@@ -1145,7 +2144,7 @@ gc_alloc_new_region(int nbytes, int unboxed, struct alloc_region *alloc_region)
             }
 	}
 
-	region_size = (GC_PAGE_SIZE - page_table[first_page].bytes_used)
+	region_size = (GC_PAGE_SIZE - page_bytes_used[first_page])
 	    + GC_PAGE_SIZE * (last_page - first_page);
 
         if (gc_assert_level > 0) {
@@ -1178,66 +2177,18 @@ gc_alloc_new_region(int nbytes, int unboxed, struct alloc_region *alloc_region)
 	    page_address(first_page));
 #endif
 
-    /* Setup the alloc_region. */
-    alloc_region->first_page = first_page;
-    alloc_region->last_page = last_page;
-    alloc_region->start_addr = page_table[first_page].bytes_used
-	+ page_address(first_page);
-    alloc_region->free_pointer = alloc_region->start_addr;
-    alloc_region->end_addr = alloc_region->start_addr + bytes_found;
+    /* Claim the pages; the search skipped any that were claimed. */
+    for (i = first_page; i <= last_page; i++) {
+	boolean claimed = claim_page(i);
 
-    if ((gencgc_unmap_zero == MODE_MADVISE)
-        || (gencgc_unmap_zero == MODE_LAZY)) {
-        handle_madvise_first_page(first_page);
-        handle_madvise_other_pages(first_page, last_page);
+	if (gc_assert_level > 0) {
+	    gc_assert(claimed);
+	}
     }
 
-    if (DO_GENCGC_ZERO_CHECK) {
-	int *p;
-
-	for (p = (int *) alloc_region->start_addr;
-	     p < (int *) alloc_region->end_addr; p++)
-	    if (*p != 0)
-		fprintf(stderr, "** new region not zero @ %lx: %x\n",
-			(unsigned long) p, *p);
-    }
-
-    /* Setup the pages. */
-
-    /* The first page may have already been in use. */
-    if (page_table[first_page].bytes_used == 0) {
-	PAGE_FLAGS_UPDATE(first_page, mmask, mflags);
-	page_table[first_page].first_object_offset = 0;
-    }
-
-    if (gc_assert_level > 0) {
-        gc_assert(PAGE_ALLOCATED(first_page));
-        gc_assert(PAGE_UNBOXED_VAL(first_page) == unboxed);
-        gc_assert(PAGE_GENERATION(first_page) == gc_alloc_generation);
-        gc_assert(!PAGE_LARGE_OBJECT(first_page));
-    }
-    
-    for (i = first_page + 1; i <= last_page; i++) {
-	PAGE_FLAGS_UPDATE(i, PAGE_ALLOCATED_MASK | PAGE_LARGE_OBJECT_MASK
-			  | PAGE_UNBOXED_MASK | PAGE_GENERATION_MASK,
-			  PAGE_ALLOCATED_MASK | (unboxed << PAGE_UNBOXED_SHIFT)
-			  | gc_alloc_generation);
-	/*
-	 * This may not be necessary for unboxed regions (think it was
-	 * broken before!)
-	 */
-	page_table[i].first_object_offset =
-	    alloc_region->start_addr - page_address(i);
-    }
-
-    /* Bump up the last_free_page */
-    if (last_page + 1 > last_free_page) {
-	last_free_page = last_page + 1;
-	set_alloc_pointer((lispobj) ((char *) heap_base +
-				     GC_PAGE_SIZE * last_free_page));
-
-    }
-}
+    gc_alloc_search_record(search_start);
+    open_region(alloc_region, first_page, last_page, unboxed);
+}
 
 
 
@@ -1372,11 +2323,11 @@ gc_alloc_update_page_tables(int unboxed, struct alloc_region *alloc_region)
 
     /* Skip if no bytes were allocated */
     if (alloc_region->free_pointer != alloc_region->start_addr) {
-	orig_first_page_bytes_used = page_table[first_page].bytes_used;
+	orig_first_page_bytes_used = page_bytes_used[first_page];
 
         if (gc_assert_level > 0) {
             gc_assert(alloc_region->start_addr == page_address(first_page) +
-                      page_table[first_page].bytes_used);
+                      page_bytes_used[first_page]);
         }
 
 	/* All the pages used need to be updated */
@@ -1388,9 +2339,9 @@ gc_alloc_update_page_tables(int unboxed, struct alloc_region *alloc_region)
 #endif
 
 	/* If the page was free then setup the gen, and first_object_offset. */
-	if (page_table[first_page].bytes_used == 0) {
+	if (page_bytes_used[first_page] == 0) {
             if (gc_assert_level > 0) {
-                gc_assert(page_table[first_page].first_object_offset == 0);
+                gc_assert(page_first_object_offset[first_page] == 0);
             }
         }
 
@@ -1413,7 +2364,7 @@ gc_alloc_update_page_tables(int unboxed, struct alloc_region *alloc_region)
 	    bytes_used = GC_PAGE_SIZE;
 	    more = 1;
 	}
-	page_table[first_page].bytes_used = bytes_used;
+	page_bytes_used[first_page] = bytes_used;
 	byte_cnt += bytes_used;
 
 	/*
@@ -1428,10 +2379,10 @@ gc_alloc_update_page_tables(int unboxed, struct alloc_region *alloc_region)
             if (gc_assert_level > 0) {
                 gc_assert(PAGE_ALLOCATED(next_page));
                 gc_assert(PAGE_UNBOXED_VAL(next_page) == unboxed);
-                gc_assert(page_table[next_page].bytes_used == 0);
+                gc_assert(page_bytes_used[next_page] == 0);
                 gc_assert(PAGE_GENERATION(next_page) == gc_alloc_generation);
                 gc_assert(!PAGE_LARGE_OBJECT(next_page));
-                gc_assert(page_table[next_page].first_object_offset ==
+                gc_assert(page_first_object_offset[next_page] ==
                           alloc_region->start_addr - page_address(next_page));
             }
 
@@ -1442,7 +2393,7 @@ gc_alloc_update_page_tables(int unboxed, struct alloc_region *alloc_region)
 		bytes_used = GC_PAGE_SIZE;
 		more = 1;
 	    }
-	    page_table[next_page].bytes_used = bytes_used;
+	    page_bytes_used[next_page] = bytes_used;
 	    byte_cnt += bytes_used;
 
 	    next_page++;
@@ -1479,18 +2430,24 @@ gc_alloc_update_page_tables(int unboxed, struct alloc_region *alloc_region)
 	/*
 	 * No bytes allocated. Unallocate the first_page if there are 0 bytes_used.
 	 */
-    if (page_table[first_page].bytes_used == 0)
-	page_table[first_page].flags &= ~PAGE_ALLOCATED_MASK;
+    if (page_bytes_used[first_page] == 0)
+	page_flags[first_page] &= ~PAGE_ALLOCATED_MASK;
 
     /* Unallocate any unused pages. */
     while (next_page <= alloc_region->last_page) {
         if (gc_assert_level > 0) {
-            gc_assert(page_table[next_page].bytes_used == 0);
+            gc_assert(page_bytes_used[next_page] == 0);
         }
-	page_table[next_page].flags &= ~PAGE_ALLOCATED_MASK;
+	page_flags[next_page] &= ~PAGE_ALLOCATED_MASK;
 	next_page++;
     }
 
+    for (next_page = first_page; next_page <= alloc_region->last_page;
+	 next_page++) {
+	note_page(next_page);
+	release_page(next_page);
+    }
+
     /* Reset the alloc_region. */
     alloc_region->first_page = 0;
     alloc_region->last_page = -1;
@@ -1505,13 +2462,109 @@ gc_alloc_update_page_tables(int unboxed, struct alloc_region *alloc_region)
 
 
 
+/* Reset the context's regions and batch to the empty state. */
+static void
+alloc_context_reset(struct alloc_context *context)
+{
+    struct alloc_region *regions[2];
+    int i;
+
+    regions[0] = &context->boxed;
+    regions[1] = &context->unboxed;
+    for (i = 0; i < 2; i++) {
+	regions[i]->first_page = 0;
+	regions[i]->last_page = -1;
+	regions[i]->start_addr = page_address(0);
+	regions[i]->free_pointer = page_address(0);
+	regions[i]->end_addr = page_address(0);
+    }
+    context->batch_first_page = 0;
+    context->batch_last_page = -1;
+}
+
+/*
+ * Close the regions of all the contexts and give back their batches,
+ * so the page tables are up to date for a GC.
+ */
+static void
+close_alloc_contexts(void)
+{
+    struct alloc_context *context;
+
+    for (context = alloc_contexts; context != NULL; context = context->next) {
+	gc_alloc_update_page_tables(0, &context->boxed);
+	gc_alloc_update_page_tables(1, &context->unboxed);
+	release_batch(context);
+    }
+}
+
+/*
+ * Make a new allocation context, for another thread of control.
+ * Returns NULL if there is no memory for it.
+ */
+struct alloc_context *
+gc_make_alloc_context(void)
+{
+    struct alloc_context *context = malloc(sizeof(struct alloc_context));
+
+    if (context == NULL)
+	return NULL;
+    alloc_context_reset(context);
+    context->next = main_alloc_context.next;
+    main_alloc_context.next = context;
+    return context;
+}
+
+/*
+ * Make the mutator allocate from the given context, or from
+ * main_alloc_context if it is NULL.  The free pointer of the current
+ * region is saved in the old context.  Must be called with allocation
+ * inhibited, as with pseudo-atomic, or with signals blocked.
+ */
+void
+gc_set_alloc_context(struct alloc_context *context)
+{
+    if (context == NULL)
+	context = &main_alloc_context;
+    boxed_region.free_pointer = (void *) get_current_region_free();
+    current_alloc_context = context;
+    set_current_region_free((lispobj) boxed_region.free_pointer);
+    set_current_region_end((lispobj) boxed_region.end_addr);
+}
+
+/*
+ * Close the regions of a context made by gc_make_alloc_context and
+ * free it.  It must not be the current context.
+ */
+void
+gc_free_alloc_context(struct alloc_context *context)
+{
+    struct alloc_context *prev;
+
+    if (context == &main_alloc_context || context == current_alloc_context) {
+	fprintf(stderr, "*W can't free the main or current allocation context.\n");
+	return;
+    }
+    for (prev = &main_alloc_context; prev->next != NULL; prev = prev->next)
+	if (prev->next == context) {
+	    gc_alloc_update_page_tables(0, &context->boxed);
+	    gc_alloc_update_page_tables(1, &context->unboxed);
+	    release_batch(context);
+	    prev->next = context->next;
+	    free(context);
+	    return;
+	}
+}
+
 static inline void *gc_quick_alloc(int nbytes);
 
 /*
- * Allocate a possibly large object.
+ * Allocate a possibly large object.  A large object gets pages of its
+ * own, flagged as large object pages.
  */
 static void *
-gc_alloc_large(int nbytes, int unboxed, struct alloc_region *alloc_region)
+gc_alloc_large_pages(int nbytes, int unboxed, int large,
+		     struct alloc_region *alloc_region)
 {
     int first_page;
     int last_page;
@@ -1524,8 +2577,9 @@ gc_alloc_large(int nbytes, int unboxed, struct alloc_region *alloc_region)
     int more;
     int bytes_used;
     int next_page;
-    int large = (nbytes >= large_object_size);
+    int from_run = FALSE;
     int mmask, mflags;
+    unsigned long long search_start;
 
 
     /* Shut up some compiler warnings */
@@ -1577,73 +2631,77 @@ gc_alloc_large(int nbytes, int unboxed, struct alloc_region *alloc_region)
     mflags = PAGE_ALLOCATED_MASK | (unboxed << PAGE_UNBOXED_SHIFT)
 	| gc_alloc_generation;
 
-    do {
-	first_page = restart_page;
-
-	if (large) {
-	    while (first_page < dynamic_space_pages
-		   && PAGE_ALLOCATED(first_page)) {
-                first_page++;
-            }
-        } else {
-	    while (first_page < dynamic_space_pages) {
-		int flags = page_table[first_page].flags;
+    search_start = gc_time_nsec();
+    if (large) {
+	num_pages = (nbytes + GC_PAGE_SIZE - 1) / GC_PAGE_SIZE;
+	first_page = large_run_take(num_pages);
+	if (first_page >= 0) {
+	    from_run = TRUE;
+	    last_page = first_page + num_pages - 1;
+	    bytes_found = GC_PAGE_SIZE * num_pages;
+	    gc_large_run_hits++;
+	} else
+	    gc_large_run_misses++;
+    }
+    if (!from_run)
+	do {
+	    first_page = restart_page;
 
-		if (!(flags & PAGE_ALLOCATED_MASK)
-		    || ((flags & mmask) == mflags &&
-			page_table[first_page].bytes_used < GC_PAGE_SIZE - 32))
-		    break;
-		first_page++;
-	    }
-        }
+	    if (large)
+		first_page = next_free_page(first_page, dynamic_space_pages);
+	    else
+		first_page = next_region_page(first_page, dynamic_space_pages,
+					      mmask, mflags, unboxed);
 
-	/* Check for a failure */
-	if (first_page >= dynamic_space_pages - reserved_heap_pages) {
+	    /* Check for a failure */
+	    if (first_page >= dynamic_space_pages - reserved_heap_pages) {
 #if 0
-	    handle_heap_overflow("*A2 gc_alloc_large failed, nbytes=%d.\n",
-				 nbytes);
+		handle_heap_overflow("*A2 gc_alloc_large failed, nbytes=%d.\n",
+				     nbytes);
 #else
-	    break;
+		break;
 #endif
-	}
-        if (gc_assert_level > 0) {
-            gc_assert(!PAGE_WRITE_PROTECTED(first_page));
-        }
+	    }
+	    if (gc_assert_level > 0) {
+		gc_assert(!PAGE_WRITE_PROTECTED(first_page));
+	    }
 
 #if 0
-	fprintf(stderr, "  first_page=%d bytes_used=%d\n",
-		first_page, page_table[first_page].bytes_used);
-#endif
-
-	last_page = first_page;
-	bytes_found = GC_PAGE_SIZE - page_table[first_page].bytes_used;
-	num_pages = 1;
-	while (bytes_found < nbytes
-	       && last_page < dynamic_space_pages - 1
-	       && !PAGE_ALLOCATED(last_page + 1)) {
-	    last_page++;
-	    num_pages++;
-	    bytes_found += GC_PAGE_SIZE;
-            if (gc_assert_level > 0) {
-                gc_assert(!PAGE_WRITE_PROTECTED(last_page));
-            }
-	}
+	    fprintf(stderr, "  first_page=%d bytes_used=%d\n",
+		    first_page, page_bytes_used[first_page]);
+#endif
+
+	    last_page = first_page;
+	    bytes_found = GC_PAGE_SIZE - page_bytes_used[first_page];
+	    num_pages = 1;
+	    while (bytes_found < nbytes
+		   && last_page < dynamic_space_pages - 1
+		   && !PAGE_ALLOCATED(last_page + 1)
+		   && !page_claim[last_page + 1]) {
+		last_page++;
+		num_pages++;
+		bytes_found += GC_PAGE_SIZE;
+		if (gc_assert_level > 0) {
+		    gc_assert(!PAGE_WRITE_PROTECTED(last_page));
+		}
+	    }
 
-	region_size = (GC_PAGE_SIZE - page_table[first_page].bytes_used)
-	    + GC_PAGE_SIZE * (last_page - first_page);
+	    region_size = (GC_PAGE_SIZE - page_bytes_used[first_page])
+		+ GC_PAGE_SIZE * (last_page - first_page);
 
-        if (gc_assert_level > 0) {
-            gc_assert(bytes_found == region_size);
-        }
+	    if (gc_assert_level > 0) {
+		gc_assert(bytes_found == region_size);
+	    }
 
 #if 0
-	fprintf(stderr, "  last_page=%d bytes_found=%d num_pages=%d\n",
-		last_page, bytes_found, num_pages);
+	    fprintf(stderr, "  last_page=%d bytes_found=%d num_pages=%d\n",
+		    last_page, bytes_found, num_pages);
 #endif
 
-	restart_page = last_page + 1;
-    }
-    while ((restart_page < dynamic_space_pages) && (bytes_found < nbytes));
+	    restart_page = last_page + 1;
+	}
+	while ((restart_page < dynamic_space_pages) && (bytes_found < nbytes));
+    gc_alloc_search_record(search_start);
 
     if (first_page >= dynamic_space_pages - reserved_heap_pages) {
 	handle_heap_overflow("*A2 gc_alloc_large failed, nbytes=%d.\n", nbytes);
@@ -1663,16 +2721,20 @@ gc_alloc_large(int nbytes, int unboxed, struct alloc_region *alloc_region)
 #endif
 
         if (gc_assert_level > 0) {
-            gc_assert(first_page > alloc_region->last_page);
+            gc_assert(first_page > alloc_region->last_page
+		      || last_page < alloc_region->first_page);
         }
-    if (unboxed)
-	generations[gc_alloc_generation].alloc_large_unboxed_start_page =
-	    last_page;
-    else
-	generations[gc_alloc_generation].alloc_large_start_page = last_page;
+    /* A run from the index doesn't move where the next search starts. */
+    if (!from_run) {
+	if (unboxed)
+	    generations[gc_alloc_generation].alloc_large_unboxed_start_page =
+		last_page;
+	else
+	    generations[gc_alloc_generation].alloc_large_start_page = last_page;
+    }
 
     /* Setup the pages. */
-    orig_first_page_bytes_used = page_table[first_page].bytes_used;
+    orig_first_page_bytes_used = page_bytes_used[first_page];
 
     if ((gencgc_unmap_zero == MODE_MADVISE)
         || (gencgc_unmap_zero == MODE_LAZY)) {
@@ -1687,9 +2749,9 @@ gc_alloc_large(int nbytes, int unboxed, struct alloc_region *alloc_region)
 
     if (large)
 	mflags |= PAGE_LARGE_OBJECT_MASK;
-    if (page_table[first_page].bytes_used == 0) {
+    if (page_bytes_used[first_page] == 0) {
 	PAGE_FLAGS_UPDATE(first_page, mmask, mflags);
-	page_table[first_page].first_object_offset = 0;
+	page_first_object_offset[first_page] = 0;
     }
 
     if (gc_assert_level > 0) {
@@ -1711,7 +2773,7 @@ gc_alloc_large(int nbytes, int unboxed, struct alloc_region *alloc_region)
 	bytes_used = GC_PAGE_SIZE;
 	more = 1;
     }
-    page_table[first_page].bytes_used = bytes_used;
+    page_bytes_used[first_page] = bytes_used;
     byte_cnt += bytes_used;
 
     next_page = first_page + 1;
@@ -1728,7 +2790,7 @@ gc_alloc_large(int nbytes, int unboxed, struct alloc_region *alloc_region)
 
         if (gc_assert_level > 0) {
             gc_assert(!PAGE_ALLOCATED(next_page));
-            gc_assert(page_table[next_page].bytes_used == 0);
+            gc_assert(page_bytes_used[next_page] == 0);
         }
 
         if ((gencgc_unmap_zero == MODE_MADVISE)
@@ -1738,7 +2800,7 @@ gc_alloc_large(int nbytes, int unboxed, struct alloc_region *alloc_region)
 
 	PAGE_FLAGS_UPDATE(next_page, mmask, mflags);
 
-	page_table[next_page].first_object_offset =
+	page_first_object_offset[next_page] =
 	    orig_first_page_bytes_used - GC_PAGE_SIZE * (next_page - first_page);
 
 	/* Calc. the number of bytes used in this page. */
@@ -1748,7 +2810,7 @@ gc_alloc_large(int nbytes, int unboxed, struct alloc_region *alloc_region)
 	    bytes_used = GC_PAGE_SIZE;
 	    more = 1;
 	}
-	page_table[next_page].bytes_used = bytes_used;
+	page_bytes_used[next_page] = bytes_used;
 	byte_cnt += bytes_used;
 
 	next_page++;
@@ -1761,6 +2823,9 @@ gc_alloc_large(int nbytes, int unboxed, struct alloc_region *alloc_region)
     bytes_allocated += nbytes;
     generations[gc_alloc_generation].bytes_allocated += nbytes;
 
+    /* The last page may have room for more. */
+    note_page(next_page - 1);
+
     /* Add the region to the new_areas if requested. */
     if (!unboxed)
 	add_new_area(first_page, orig_first_page_bytes_used, nbytes);
@@ -1775,6 +2840,13 @@ gc_alloc_large(int nbytes, int unboxed, struct alloc_region *alloc_region)
     return (void *) (page_address(first_page) + orig_first_page_bytes_used);
 }
 
+static inline void *
+gc_alloc_large(int nbytes, int unboxed, struct alloc_region *alloc_region)
+{
+    return gc_alloc_large_pages(nbytes, unboxed, nbytes >= large_object_size,
+				alloc_region);
+}
+
 /*
  * If the current region has more than this much space left, we don't
  * want to abandon the region (wasting space), but do a "large" alloc
@@ -2100,6 +3172,32 @@ gc_quick_alloc_large_unboxed(int nbytes)
     return gc_alloc_unboxed(nbytes);
 }
 
+/*
+ * Allocate a vector of the given type and length, with nwords words
+ * of data, on large object pages of its own however small it is.  GC
+ * never copies an object on large object pages, it promotes the pages
+ * in place, so the vector stays where it is until it is garbage and
+ * its data can be handed to foreign code, by read or write say,
+ * without copying it or disabling GC.  Only purify moves it, when a
+ * core is saved.  Called from Lisp with GC disabled; the vector must
+ * have no boxed elements.
+ */
+lispobj
+gc_alloc_pinned_vector(int type, int length, int nwords)
+{
+    int nbytes = ((2 + nwords) * sizeof(lispobj) + lowtag_Mask) & ~lowtag_Mask;
+    struct vector *vector;
+
+    vector = gc_alloc_large_pages(nbytes, 1, TRUE, &boxed_region);
+    vector->header = type;
+    vector->length = make_fixnum(length);
+
+    gc_pinned_vectors++;
+    gc_pinned_bytes += nbytes;
+
+    return (lispobj) vector | type_OtherPointer;
+}
+
 /***************************************************************************/
 
 
@@ -2352,7 +3450,7 @@ copy_large_object(lispobj object, int nwords)
 	 */
 
         if (gc_assert_level > 0) {
-            gc_assert(page_table[first_page].first_object_offset == 0);
+            gc_assert(page_first_object_offset[first_page] == 0);
         }
 
 	next_page = first_page;
@@ -2363,9 +3461,9 @@ copy_large_object(lispobj object, int nwords)
                 gc_assert(PAGE_ALLOCATED(next_page));
                 gc_assert(!PAGE_UNBOXED(next_page));
                 gc_assert(PAGE_LARGE_OBJECT(next_page));
-                gc_assert(page_table[next_page].first_object_offset ==
+                gc_assert(page_first_object_offset[next_page] ==
                           GC_PAGE_SIZE * (first_page - next_page));
-                gc_assert(page_table[next_page].bytes_used == GC_PAGE_SIZE);
+                gc_assert(page_bytes_used[next_page] == GC_PAGE_SIZE);
             }
 
 	    PAGE_FLAGS_UPDATE(next_page, PAGE_GENERATION_MASK, new_space);
@@ -2375,9 +3473,10 @@ copy_large_object(lispobj object, int nwords)
 	     * WP flag to avoid redundant calls.
 	     */
 	    if (PAGE_WRITE_PROTECTED(next_page)) {
-		os_protect((os_vm_address_t) page_address(next_page), GC_PAGE_SIZE,
-			   OS_VM_PROT_ALL);
-		page_table[next_page].flags &= ~PAGE_WRITE_PROTECTED_MASK;
+		if (!gencgc_soft_dirty)
+		    os_protect((os_vm_address_t) page_address(next_page),
+			       GC_PAGE_SIZE, OS_VM_PROT_ALL);
+		page_flags[next_page] &= ~PAGE_WRITE_PROTECTED_MASK;
 	    }
 	    remaining_bytes -= GC_PAGE_SIZE;
 	    next_page++;
@@ -2390,7 +3489,7 @@ copy_large_object(lispobj object, int nwords)
 
 	/* Object may have shrunk but shouldn't have grown - check. */
         if (gc_assert_level > 0) {
-            gc_assert(page_table[next_page].bytes_used >= remaining_bytes);
+            gc_assert(page_bytes_used[next_page] >= remaining_bytes);
         }
 
 	PAGE_FLAGS_UPDATE(next_page, PAGE_GENERATION_MASK, new_space);
@@ -2400,8 +3499,8 @@ copy_large_object(lispobj object, int nwords)
         }
 
 	/* Adjust the bytes_used. */
-	old_bytes_used = page_table[next_page].bytes_used;
-	page_table[next_page].bytes_used = remaining_bytes;
+	old_bytes_used = page_bytes_used[next_page];
+	page_bytes_used[next_page] = remaining_bytes;
 
 	bytes_freed = old_bytes_used - remaining_bytes;
 
@@ -2413,7 +3512,7 @@ copy_large_object(lispobj object, int nwords)
 	next_page++;
 	while (old_bytes_used == GC_PAGE_SIZE &&
 	       PAGE_FLAGS(next_page, mmask) == mflags &&
-	       page_table[next_page].first_object_offset ==
+	       page_first_object_offset[next_page] ==
 	       GC_PAGE_SIZE * (first_page - next_page)) {
 	    /*
 	     * Checks out OK, free the page. Don't need to both zeroing
@@ -2425,9 +3524,10 @@ copy_large_object(lispobj object, int nwords)
                 gc_assert(!PAGE_WRITE_PROTECTED(next_page));
             }
 
-	    old_bytes_used = page_table[next_page].bytes_used;
-	    page_table[next_page].flags &= ~PAGE_ALLOCATED_MASK;
-	    page_table[next_page].bytes_used = 0;
+	    old_bytes_used = page_bytes_used[next_page];
+	    page_flags[next_page] &= ~PAGE_ALLOCATED_MASK;
+	    page_bytes_used[next_page] = 0;
+	    note_page(next_page);
 	    bytes_freed += old_bytes_used;
 	    next_page++;
 	}
@@ -2550,7 +3650,7 @@ copy_large_unboxed_object(lispobj object, int nwords)
 	int mmask, mflags;
 
         if (gc_assert_level > 0) {
-            gc_assert(page_table[first_page].first_object_offset == 0);
+            gc_assert(page_first_object_offset[first_page] == 0);
         }
 
 	next_page = first_page;
@@ -2560,9 +3660,9 @@ copy_large_unboxed_object(lispobj object, int nwords)
                 gc_assert(PAGE_GENERATION(next_page) == from_space);
                 gc_assert(PAGE_ALLOCATED(next_page));
                 gc_assert(PAGE_LARGE_OBJECT(next_page));
-                gc_assert(page_table[next_page].first_object_offset ==
+                gc_assert(page_first_object_offset[next_page] ==
                           GC_PAGE_SIZE * (first_page - next_page));
-                gc_assert(page_table[next_page].bytes_used == GC_PAGE_SIZE);
+                gc_assert(page_bytes_used[next_page] == GC_PAGE_SIZE);
             }
 
 	    PAGE_FLAGS_UPDATE(next_page,
@@ -2579,7 +3679,7 @@ copy_large_unboxed_object(lispobj object, int nwords)
 
 	/* Object may have shrunk but shouldn't have grown - check. */
         if (gc_assert_level > 0) {
-            gc_assert(page_table[next_page].bytes_used >= remaining_bytes);
+            gc_assert(page_bytes_used[next_page] >= remaining_bytes);
         }
 
 	PAGE_FLAGS_UPDATE(next_page, PAGE_ALLOCATED_MASK | PAGE_UNBOXED_MASK
@@ -2587,8 +3687,8 @@ copy_large_unboxed_object(lispobj object, int nwords)
 			  PAGE_ALLOCATED_MASK | PAGE_UNBOXED_MASK | new_space);
 
 	/* Adjust the bytes_used. */
-	old_bytes_used = page_table[next_page].bytes_used;
-	page_table[next_page].bytes_used = remaining_bytes;
+	old_bytes_used = page_bytes_used[next_page];
+	page_bytes_used[next_page] = remaining_bytes;
 
 	bytes_freed = old_bytes_used - remaining_bytes;
 
@@ -2600,7 +3700,7 @@ copy_large_unboxed_object(lispobj object, int nwords)
 	next_page++;
 	while (old_bytes_used == GC_PAGE_SIZE &&
 	       PAGE_FLAGS(next_page, mmask) == mflags &&
-	       page_table[next_page].first_object_offset ==
+	       page_first_object_offset[next_page] ==
 	       GC_PAGE_SIZE * (first_page - next_page)) {
 	    /*
 	     * Checks out OK, free the page. Don't need to both zeroing
@@ -2612,9 +3712,10 @@ copy_large_unboxed_object(lispobj object, int nwords)
                 gc_assert(!PAGE_WRITE_PROTECTED(next_page));
             }
 
-	    old_bytes_used = page_table[next_page].bytes_used;
-	    page_table[next_page].flags &= ~PAGE_ALLOCATED_MASK;
-	    page_table[next_page].bytes_used = 0;
+	    old_bytes_used = page_bytes_used[next_page];
+	    page_flags[next_page] &= ~PAGE_ALLOCATED_MASK;
+	    page_bytes_used[next_page] = 0;
+	    note_page(next_page);
 	    bytes_freed += old_bytes_used;
 	    next_page++;
 	}
@@ -2715,6 +3816,10 @@ maybe_static_array_p(lispobj header)
 
 #define DIRECT_SCAV 0
 
+/* Weak hash table triggers; see struct weak_link. */
+static boolean weak_triggers;
+static inline void note_weak_trigger(lispobj obj);
+
 static void
 scavenge(void *start_obj, long nwords)
 {
@@ -2748,6 +3853,8 @@ scavenge(void *start_obj, long nwords)
 		    *start = ptr[1];
 		    words_scavenged = 1;
 		} else {
+		    if (weak_triggers)
+			note_weak_trigger(object);
 		    words_scavenged = scavtab[TypeOf(object)] (start, object);
                 }
             } else if (dynamic_space_p(object) || new_space_p(object) || static_space_p(object)
@@ -3920,6 +5027,8 @@ trans_list(lispobj object)
 	    break;
 
 	cdr_cons = (struct cons *) PTR(cdr);
+	if (weak_triggers)
+	    note_weak_trigger(cdr);
 
 	/* copy 'cdr' */
 	new_cdr_cons = (struct cons *) gc_quick_alloc(sizeof(struct cons));
@@ -4353,7 +5462,6 @@ free_hash_entry(struct hash_table *hash_table, int hash_index, int kv_index)
 	unsigned count = fixnum_value(hash_table->number_entries);
         lispobj* kv_vector = (lispobj *) PTR(hash_table->table);
         unsigned *hash_vector = u32_vector(hash_table->hash_vector, 0);
-        unsigned hash_index;
         lispobj empty_symbol;
         
         if (gc_assert_level > 0) {
@@ -4372,12 +5480,11 @@ free_hash_entry(struct hash_table *hash_table, int hash_index, int kv_index)
         kv_vector += 2;         /* Skip over vector header and length slots */
         empty_symbol = kv_vector[1];
 
-        hash_index = EQ_HASH(kv_vector[2 * kv_index]) % length;
         
         kv_vector[2 * kv_index] = empty_symbol;
         kv_vector[2 * kv_index + 1] = empty_symbol;
         if (hash_vector) {
-            hash_vector[hash_index] = EQ_BASED_HASH_VALUE;
+            hash_vector[kv_index] = EQ_BASED_HASH_VALUE;
         }
     }
 }
@@ -4423,6 +5530,33 @@ eq_based_hash_vector(unsigned int* hash_vector, unsigned int index)
     return (hash_vector == 0) || (hash_vector[index] == EQ_BASED_HASH_VALUE);
 }
 
+/* The index in the index vector of the bucket holding entry INDEX:
+   from the key's address if it is EQ-based, otherwise from the hash
+   kept in the hash vector.  */
+
+static inline unsigned int
+hash_entry_bucket(lispobj *kv_vector, unsigned int *hash_vector,
+		  unsigned int length, unsigned int index)
+{
+    if (eq_based_hash_vector(hash_vector, index))
+	return EQ_HASH(kv_vector[2 * index]) % length;
+    return hash_vector[index] % length;
+}
+
+/* Return true if KEY, not hashed by address, has a stable hash of its
+   own: a symbol or a PCL instance (see STABLE-HASH in hash-new.lisp).
+   Such a key is only EQL to itself, like an EQ-based key, so its entry
+   in a weak table can go when it dies.  */
+
+static inline boolean
+stable_hash_key_p(lispobj key)
+{
+    if (LowtagOf(key) == type_InstancePointer)
+	return TRUE;
+    return LowtagOf(key) == type_OtherPointer
+	&& TypeOf(*(lispobj *) PTR(key)) == type_SymbolHeader;
+}
+
 static inline boolean
 removable_weak_key(lispobj old_key, unsigned int index_value, boolean eq_hash_p)
 {
@@ -4509,6 +5643,35 @@ maybe_record_for_rehashing(struct hash_table *hash_table, lispobj* kv_vector,
     }
 }
 
+/* Return true if the entry at index I of hash-table HASH_TABLE, with
+   key/value vector KV_VECTOR, can be removed given what is known to
+   survive the GC so far.  WEAK is the weakness of the table, NIL for
+   a table that isn't weak.  */
+
+static inline boolean
+removable_hash_entry(struct hash_table *hash_table, lispobj weak,
+		     lispobj *kv_vector, unsigned *index_vector,
+		     unsigned *hash_vector, unsigned length, unsigned i)
+{
+    lispobj old_key = kv_vector[2 * i];
+    lispobj value = kv_vector[2 * i + 1];
+    unsigned int index_value =
+	index_vector[hash_entry_bucket(kv_vector, hash_vector, length, i)];
+    boolean eq_hash_p = eq_based_hash_vector(hash_vector, i)
+	|| stable_hash_key_p(old_key);
+
+    return (((weak == KEY)
+	     && removable_weak_key(old_key, index_value, eq_hash_p))
+	    || ((weak == VALUE)
+		&& removable_weak_value(value, index_value))
+	    || ((weak == KEY_AND_VALUE)
+		&& removable_weak_key_and_value(old_key, value, index_value,
+						eq_hash_p))
+	    || ((weak == KEY_OR_VALUE)
+		&& removable_weak_key_or_value(old_key, value, index_value,
+					       eq_hash_p)));
+}
+
 /* Scavenge the keys and values of hash-table HASH_TABLE.  WEAK
    non-zero means this function is called for a weak hash-table at the
    end of a GC.  WEAK zero means this function is called for
@@ -4520,9 +5683,6 @@ scav_hash_entries(struct hash_table *hash_table, lispobj weak, int removep)
 {
     unsigned kv_length;
     lispobj *kv_vector;
-#ifdef DEBUG_SCAV_HASH_ENTRIES
-    lispobj empty_symbol;
-#endif
     unsigned *index_vector, *next_vector, *hash_vector;
     unsigned length = UINT_MAX;
     unsigned next_vector_length = UINT_MAX;
@@ -4532,10 +5692,6 @@ scav_hash_entries(struct hash_table *hash_table, lispobj weak, int removep)
     kv_length = fixnum_value(kv_vector[1]);
     kv_vector += 2;
 
-#ifdef DEBUG_SCAV_HASH_ENTRIES
-    empty_symbol = kv_vector[1];
-#endif
-
     index_vector = u32_vector(hash_table->index_vector, &length);
     next_vector = u32_vector(hash_table->next_vector, &next_vector_length);
     hash_vector = u32_vector(hash_table->hash_vector, 0);
@@ -4549,220 +5705,375 @@ scav_hash_entries(struct hash_table *hash_table, lispobj weak, int removep)
     }
 
     for (i = 1; i < next_vector_length; i++) {
-	lispobj old_key = kv_vector[2 * i];
-        lispobj value = kv_vector[2 * i + 1];
-	unsigned int old_index = EQ_HASH(old_key) % length;
-        boolean eq_hash_p = eq_based_hash_vector(hash_vector, i);
-        unsigned int index_value = index_vector[old_index];
-
-	if (((weak == KEY)
-             && removable_weak_key(old_key, index_value,
-                                   eq_hash_p))
-            || ((weak == VALUE)
-                && removable_weak_value(value, index_value))
-            || ((weak == KEY_AND_VALUE)
-                && removable_weak_key_and_value(old_key, value, index_value, eq_hash_p))
-            || ((weak == KEY_OR_VALUE)
-                && removable_weak_key_or_value(old_key, value, index_value, eq_hash_p))) {
+	unsigned int old_index =
+	    hash_entry_bucket(kv_vector, hash_vector, length, i);
+
+	if (removable_hash_entry(hash_table, weak, kv_vector, index_vector,
+				 hash_vector, length, i)) {
             if (removep) {
                 free_hash_entry(hash_table, old_index, i);
             }
         } else {
 	    /* If the key is EQ-hashed and moves, schedule it for rehashing. */
 	    scavenge(&kv_vector[2 * i], 2);
-#ifdef DEBUG_SCAV_HASH_ENTRIES
-	    new_key = kv_vector[2 * i];
-	    new_index = EQ_HASH(new_key) % length;
-
-	    if (old_index != new_index
-		&& eq_hash_p
-		&& index_value != 0
-		&& (new_key != empty_symbol
-		    || (value != empty_symbol))) {
-                record_for_rehashing(hash_table, old_index, i);
-            }
-#endif
-            maybe_record_for_rehashing(hash_table, kv_vector, length, old_index, i, eq_hash_p,
-                                       index_value);
+            maybe_record_for_rehashing(hash_table, kv_vector, length, old_index, i,
+                                       eq_based_hash_vector(hash_vector, i),
+                                       index_vector[old_index]);
 	}
     }
 }
 
-static inline boolean
-weak_key_survives(lispobj old_key, unsigned index_value, unsigned int eq_hash_p)
-{
-    return (survives_gc(old_key)
-	    && index_value != 0
-	    && eq_hash_p);
-}
+/*
+ * Weak hash-tables are processed as ephemerons.  When the key/value
+ * vector of a weak table is first scavenged in a GC, each entry is
+ * looked at once: an entry that must be kept given what is known to
+ * survive so far is scavenged, and the others are put on the
+ * weak_pending list, waiting for the key or value that would keep
+ * them to survive.  What is still pending at the end of the GC is
+ * removed from its table.  So every entry is scavenged at most once
+ * and no table is scanned twice, however the weak tables refer to
+ * each other.
+ *
+ * A pending entry is also linked from the from_space pages of its
+ * key and value, its triggers.  When scavenge transports an object
+ * from a page with pending entries, the page is queued, and
+ * scav_weak_tables only checks the entries of the queued pages.  A
+ * few objects are transported other ways, so before newspace is
+ * declared done, weak_recheck_all checks all the pending entries
+ * once more.  A kept entry stays in weak_pending with a null table.
+ */
+struct weak_entry {
+    struct hash_table *table;
+    unsigned index;
+};
 
-static inline boolean
-weak_value_survives(lispobj value)
+static struct weak_entry *weak_pending = NULL;
+static unsigned long weak_pending_count = 0;
+static unsigned long weak_pending_size = 0;
+
+/* A link from a trigger page to a pending entry. */
+struct weak_link {
+    unsigned long entry;
+    long next;
+};
+
+static struct weak_link *weak_links = NULL;
+static unsigned long weak_links_count = 0;
+static unsigned long weak_links_size = 0;
+
+/*
+ * For each dynamic space page, the first of its links, or -1, and
+ * whether it is queued.  weak_trigger_pages lists the pages with
+ * links, so they can be cleared, and weak_queue the queued pages.
+ */
+static long *weak_page_links = NULL;
+static unsigned char *weak_page_queued = NULL;
+static int *weak_trigger_pages = NULL;
+static unsigned long weak_trigger_page_count = 0;
+static int *weak_queue = NULL;
+static unsigned long weak_queue_count = 0;
+
+/* True while weak_page_links holds any links; checked by scavenge. */
+static boolean weak_triggers = FALSE;
+
+/* The time spent on weak tables in this GC, in nanoseconds. */
+static unsigned long long weak_phase_nsec = 0;
+
+static void
+note_weak_phase(unsigned long long start)
 {
-    return (survives_gc(value));
+    weak_phase_nsec += gc_time_nsec() - start;
+    gc_weak_usec = weak_phase_nsec / 1000;
 }
 
-/* Scavenge entries of the weak hash-table HASH_TABLE that haven't
-   been already.  Value is 1 if anything new has been scavenged, 0
-   otherwise.  */
+/* Link the pending entry ENTRY from the page of OBJ, if in from_space. */
 
-static int
-scav_weak_entries(struct hash_table *hash_table)
+static void
+add_weak_link(unsigned long entry, lispobj obj)
 {
-    lispobj *kv_vector;
-    unsigned *index_vector, *hash_vector;
-    unsigned length = UINT_MAX;
-    unsigned next_vector_length = UINT_MAX;
-    unsigned i, scavenged = 0;
+    int page;
 
-    kv_vector = (lispobj *) PTR(hash_table->table) + 2;
+    if (!Pointerp(obj) || !from_space_p(obj))
+	return;
+    page = find_page_index((void *) obj);
 
-    index_vector = u32_vector(hash_table->index_vector, &length);
-    u32_vector(hash_table->next_vector, &next_vector_length);
-    hash_vector = u32_vector(hash_table->hash_vector, 0);
+    if (weak_page_links == NULL) {
+	int i;
 
-    if (gc_assert_level > 0) {
-        gc_assert(length != UINT_MAX);
-        gc_assert(next_vector_length != UINT_MAX);
+	weak_page_links = malloc(dynamic_space_pages * sizeof(long));
+	weak_page_queued = calloc(dynamic_space_pages, 1);
+	weak_trigger_pages = malloc(dynamic_space_pages * sizeof(int));
+	weak_queue = malloc(dynamic_space_pages * sizeof(int));
+	if (weak_page_links == NULL || weak_page_queued == NULL
+	    || weak_trigger_pages == NULL || weak_queue == NULL)
+	    lose("No memory for the weak hash table page index.\n");
+	for (i = 0; i < dynamic_space_pages; i++)
+	    weak_page_links[i] = -1;
     }
-    
-    for (i = 1; i < next_vector_length; i++) {
-	lispobj old_key = kv_vector[2 * i];
-        lispobj value = kv_vector[2 * i + 1];
-	unsigned int old_index = EQ_HASH(old_key) % length;
-        boolean eq_hash_p = eq_based_hash_vector(hash_vector, i);
-	boolean key_survives = weak_key_survives(old_key, 
-                                                 index_vector[old_index], eq_hash_p);
-	boolean value_survives = weak_value_survives(value);
-
-
-	if ((hash_table->weak_p == KEY)
-	    && key_survives
-            && !survives_gc(value)) {
-	    /*
-	     * For a weak key hash table, if the key survives,
-	     * scavenge its value, for the case that the only
-	     * reference to a key in a weak table is a value in
-	     * another weak table.  Don't scavenge the value twice;
-	     * scan_weak_tables calls this function more than once for
-	     * the same hash table.
-	     */
-	    scavenge(&kv_vector[2 * i + 1], 1);
-	    scavenged = 1;
-	} else if ((hash_table->weak_p == VALUE)
-                   && value_survives
-                   && !survives_gc(old_key)) {
-	    /*
-	     * For a weak value hash table, scavenge the key, if the
-	     * value survives gc.
-	     */
-	    scavenge(&kv_vector[2 * i], 1);
-            maybe_record_for_rehashing(hash_table, kv_vector, length, old_index, i, eq_hash_p,
-                                       index_vector[old_index]);
-	    scavenged = 1;
-        } else if ((hash_table->weak_p == KEY_AND_VALUE)
-                   && key_survives && value_survives) {
-            /* There's nothing to do for key-and-value.  Both are already alive */
-        } else if ((hash_table->weak_p == KEY_OR_VALUE)
-                   && (key_survives || value_survives)) {
-            /* For key-or-value, make sure the other is scavenged */
-            if (key_survives && !survives_gc(value)) {
-                scavenge(&kv_vector[2 * i + 1], 1);
-                scavenged = 1;
-            }
-            if (value_survives && !survives_gc(old_key)) {
-                scavenge(&kv_vector[2 * i], 1);
-                maybe_record_for_rehashing(hash_table, kv_vector, length, old_index, i,
-                                           eq_hash_p,
-                                           index_vector[old_index]);
-                scavenged = 1;
-            }
-	}
+    if (weak_links_count == weak_links_size) {
+	unsigned long size = weak_links_size ? 2 * weak_links_size : 1024;
+	struct weak_link *links =
+	    realloc(weak_links, size * sizeof(struct weak_link));
+
+	if (links == NULL)
+	    lose("No memory for %lu weak hash table links.\n", size);
+	weak_links = links;
+	weak_links_size = size;
     }
 
-    return scavenged;
+    if (weak_page_links[page] < 0)
+	weak_trigger_pages[weak_trigger_page_count++] = page;
+    weak_links[weak_links_count].entry = entry;
+    weak_links[weak_links_count].next = weak_page_links[page];
+    weak_page_links[page] = weak_links_count++;
+    weak_triggers = TRUE;
 }
 
 static void
-scav_weak_tables(void)
+add_weak_pending(struct hash_table *hash_table, unsigned i)
 {
-    lispobj table, next;
-    int more_scavenged;
-
-    /* Scavenge hash values of surviving keys, until there is nothing
-       new.  This is for the case that the only reference to a weak key
-       is a value in another weak table.  */
-    do {
-	more_scavenged = 0;
+    lispobj *kv_vector = (lispobj *) PTR(hash_table->table) + 2;
 
-	for (table = weak_hash_tables; table != NIL; table = next) {
-	    struct hash_table *ht = (struct hash_table *) PTR(table);
+    if (weak_pending_count == weak_pending_size) {
+	unsigned long size = weak_pending_size ? 2 * weak_pending_size : 1024;
+	struct weak_entry *entries =
+	    realloc(weak_pending, size * sizeof(struct weak_entry));
 
-	    next = ht->next_weak_table;
-	    if (scav_weak_entries(ht))
-		more_scavenged = 1;
-	}
+	if (entries == NULL)
+	    lose("No memory for %lu weak hash table entries.\n", size);
+	weak_pending = entries;
+	weak_pending_size = size;
     }
-    while (more_scavenged);
+    weak_pending[weak_pending_count].table = hash_table;
+    weak_pending[weak_pending_count].index = i;
+    add_weak_link(weak_pending_count, kv_vector[2 * i]);
+    add_weak_link(weak_pending_count, kv_vector[2 * i + 1]);
+    weak_pending_count++;
+}
 
-    for (table = weak_hash_tables; table != NIL; table = next) {
-	struct hash_table *ht = (struct hash_table *) PTR(table);
+/*
+ * Called by scavenge when it transports OBJ: queue its page if
+ * pending weak entries wait on it.
+ */
+static inline void
+note_weak_trigger(lispobj obj)
+{
+    int page = find_page_index((void *) obj);
 
-	next = ht->next_weak_table;
-	scav_hash_entries(ht, ht->weak_p, 0);
+    if (page >= 0 && weak_page_links[page] >= 0 && !weak_page_queued[page]) {
+	weak_page_queued[page] = 1;
+	weak_queue[weak_queue_count++] = page;
     }
 }
 
-    
-/* Process weak hash-tables at the end of a GC.  */
+/* Forget all the pending entries and their links. */
 
 static void
-scan_weak_tables(void)
+clear_weak_pending(void)
 {
-    lispobj table, next;
-
-    for (table = weak_hash_tables; table != NIL; table = next) {
-	struct hash_table *ht = (struct hash_table *) PTR(table);
+    unsigned long i;
 
-	next = ht->next_weak_table;
-        /* We're done with the table, so reset the link! */
-	ht->next_weak_table = NIL;
-        /*
-         * Remove the entries in the table.  (This probably does too
-         * much work!)
-         */
-	scav_hash_entries(ht, ht->weak_p, 1);
+    for (i = 0; i < weak_trigger_page_count; i++) {
+	weak_page_links[weak_trigger_pages[i]] = -1;
+	weak_page_queued[weak_trigger_pages[i]] = 0;
     }
-
-    weak_hash_tables = NIL;
+    weak_trigger_page_count = 0;
+    weak_queue_count = 0;
+    weak_links_count = 0;
+    weak_pending_count = 0;
+    weak_triggers = FALSE;
 }
 
-/* Scavenge a key/value vector of a hash-table.  */
+/* Scavenge the entry at index I of the weak hash-table HASH_TABLE if
+   it must be kept.  Value is 1 if it was, 0 otherwise.  */
 
 static int
-scav_hash_vector(lispobj * where, lispobj object)
+scav_weak_entry(struct hash_table *hash_table, unsigned i)
 {
-    unsigned int kv_length;
-    lispobj *kv_vector;
-    lispobj empty_symbol, hash_table_obj;
-    struct hash_table *hash_table;
+    lispobj *kv_vector = (lispobj *) PTR(hash_table->table) + 2;
+    unsigned length = UINT_MAX;
+    unsigned *index_vector = u32_vector(hash_table->index_vector, &length);
+    unsigned *hash_vector = u32_vector(hash_table->hash_vector, 0);
+    unsigned int old_index =
+	hash_entry_bucket(kv_vector, hash_vector, length, i);
 
-    if (HeaderValue(object) != subtype_VectorValidHashing)
-	return 1;
+    if (removable_hash_entry(hash_table, hash_table->weak_p, kv_vector,
+			     index_vector, hash_vector, length, i))
+	return 0;
 
-    /* WHERE is a hash table key/value vector.  First word is header,
-       second is vector length.  Keys and values follow after the
-       length.  The first value is the symbol :empty, the first key is a
-       reference to the hash-table containing the key/value vector.
-       (See hash-new.lisp, MAKE-HASH-TABLE.)  */
+    scavenge(&kv_vector[2 * i], 2);
+    maybe_record_for_rehashing(hash_table, kv_vector, length, old_index, i,
+			       eq_based_hash_vector(hash_vector, i),
+			       index_vector[old_index]);
+    return 1;
+}
 
-    kv_length = fixnum_value(where[1]);
-    kv_vector = where + 2;
+/* Look at each entry of the weak hash-table HASH_TABLE, scavenging
+   those that must be kept and putting the others on weak_pending.
+   Called when the table's key/value vector is first scavenged.  */
 
-    scavenge(kv_vector, 2);
+static void
+scav_weak_entries(struct hash_table *hash_table)
+{
+    unsigned long long start = gc_time_nsec();
+    unsigned next_vector_length = UINT_MAX;
+    unsigned i;
+
+    u32_vector(hash_table->next_vector, &next_vector_length);
 
     if (gc_assert_level > 0) {
-        gc_assert(Pointerp(kv_vector[0]));
+        gc_assert(next_vector_length != UINT_MAX);
+    }
+
+    gc_weak_tables++;
+    gc_weak_entries += next_vector_length - 1;
+    for (i = 1; i < next_vector_length; i++)
+	if (!scav_weak_entry(hash_table, i))
+	    add_weak_pending(hash_table, i);
+
+    note_weak_phase(start);
+}
+
+/* Check the pending entry ENTRY again, scavenging it if it is now to
+   be kept.  Value is 1 if it was.  */
+
+static int
+recheck_weak_entry(unsigned long entry)
+{
+    struct weak_entry *e = &weak_pending[entry];
+
+    if (e->table == NULL)
+	return 0;
+    gc_weak_rechecks++;
+    if (!scav_weak_entry(e->table, e->index))
+	return 0;
+    e->table = NULL;
+    return 1;
+}
+
+/* Scavenge the pending weak entries whose key or value has been found
+   to survive, until there is nothing new.  This is for the case that
+   the only reference to a weak key is a value in another weak table.
+   Only the entries linked from the pages queued by note_weak_trigger
+   are looked at; scavenging them may queue more.  */
+
+static void
+scav_weak_tables(void)
+{
+    unsigned long long start;
+
+    if (weak_queue_count == 0)
+	return;
+
+    start = gc_time_nsec();
+    while (weak_queue_count > 0) {
+	int page = weak_queue[--weak_queue_count];
+	long link;
+
+	weak_page_queued[page] = 0;
+	for (link = weak_page_links[page]; link >= 0;
+	     link = weak_links[link].next)
+	    recheck_weak_entry(weak_links[link].entry);
+    }
+
+    note_weak_phase(start);
+}
+
+/* Check every pending weak entry, for those kept alive by an object
+   transported without going through scavenge.  Value is 1 if any
+   entry was scavenged.  */
+
+static int
+weak_recheck_all(void)
+{
+    unsigned long long start;
+    unsigned long i;
+    int more_scavenged = 0;
+
+    scav_weak_tables();
+    if (weak_pending_count == 0)
+	return 0;
+
+    start = gc_time_nsec();
+    for (i = 0; i < weak_pending_count; i++)
+	if (recheck_weak_entry(i))
+	    more_scavenged = 1;
+    note_weak_phase(start);
+    scav_weak_tables();
+
+    return more_scavenged;
+}
+
+    
+/* Process weak hash-tables at the end of a GC: remove the entries
+   still pending.  */
+
+static void
+scan_weak_tables(void)
+{
+    unsigned long long start = gc_time_nsec();
+    lispobj table, next;
+    unsigned long i;
+
+    for (i = 0; i < weak_pending_count; i++) {
+	struct hash_table *ht = weak_pending[i].table;
+	unsigned index = weak_pending[i].index;
+	lispobj *kv_vector;
+	unsigned *hash_vector;
+	unsigned length = UINT_MAX;
+
+	if (ht == NULL)
+	    continue;
+	kv_vector = (lispobj *) PTR(ht->table) + 2;
+	hash_vector = u32_vector(ht->hash_vector, 0);
+	u32_vector(ht->index_vector, &length);
+	if (!scav_weak_entry(ht, index)) {
+	    free_hash_entry(ht, hash_entry_bucket(kv_vector, hash_vector,
+						  length, index), index);
+	    gc_weak_removed++;
+	}
+    }
+    clear_weak_pending();
+
+    for (table = weak_hash_tables; table != NIL; table = next) {
+	struct hash_table *ht = (struct hash_table *) PTR(table);
+
+	next = ht->next_weak_table;
+        /* We're done with the table, so reset the link! */
+	ht->next_weak_table = NIL;
+    }
+
+    weak_hash_tables = NIL;
+    note_weak_phase(start);
+    weak_phase_nsec = 0;
+}
+
+/* Scavenge a key/value vector of a hash-table.  */
+
+static int
+scav_hash_vector(lispobj * where, lispobj object)
+{
+    unsigned int kv_length;
+    lispobj *kv_vector;
+    lispobj empty_symbol, hash_table_obj;
+    struct hash_table *hash_table;
+
+    if (HeaderValue(object) != subtype_VectorValidHashing)
+	return 1;
+
+    /* WHERE is a hash table key/value vector.  First word is header,
+       second is vector length.  Keys and values follow after the
+       length.  The first value is the symbol :empty, the first key is a
+       reference to the hash-table containing the key/value vector.
+       (See hash-new.lisp, MAKE-HASH-TABLE.)  */
+
+    kv_length = fixnum_value(where[1]);
+    kv_vector = where + 2;
+
+    scavenge(kv_vector, 2);
+
+    if (gc_assert_level > 0) {
+        gc_assert(Pointerp(kv_vector[0]));
         gc_assert(Pointerp(kv_vector[1]));
     }
 
@@ -4831,6 +6142,7 @@ scav_hash_vector(lispobj * where, lispobj object)
          */
         hash_table->next_weak_table = weak_hash_tables;
         weak_hash_tables = hash_table_obj;
+        scav_weak_entries(hash_table);
     }
       
     return CEILING(kv_length + 2, 2);
@@ -5845,6 +7157,35 @@ gc_init_tables(void)
 
 
 
+/*
+ * True if thing, the first word of an object, is the car of a cons
+ * rather than a header.
+ */
+static inline boolean
+cons_first_word_p(lispobj thing)
+{
+    /* If thing is an immediate then this is a cons */
+    return Pointerp(thing)
+	|| (thing & 3) == 0	/* fixnum */
+	|| TypeOf(thing) == type_BaseChar
+	|| TypeOf(thing) == type_UnboundMarker;
+}
+
+/*
+ * Return the size in words of the object starting at start, not
+ * rounded up to a dual word.
+ */
+static size_t
+object_words(lispobj * start)
+{
+    lispobj thing = *start;
+
+    if (cons_first_word_p(thing))
+	return 2;
+    else
+	return (sizetab[TypeOf(thing)]) (start);
+}
+
 /*
  * Scan an area looking for an object which encloses the given
  * pointer. Returns the object start on success or NULL on failure.
@@ -5853,22 +7194,13 @@ static lispobj *
 search_space(lispobj * start, size_t words, lispobj * pointer)
 {
     while (words > 0) {
-	size_t count = 1;
-	lispobj thing = *start;
-
-	/* If thing is an immediate then this is a cons */
-	if (Pointerp(thing)
-	    || (thing & 3) == 0	/* fixnum */
-	    || TypeOf(thing) == type_BaseChar
-	    || TypeOf(thing) == type_UnboundMarker) count = 2;
-	else
-	    count = (sizetab[TypeOf(thing)]) (start);
+	size_t count = object_words(start);
 
 	/* Check if the pointer is within this object? */
 	if (pointer >= start && pointer < start + count) {
 	    /* Found it. */
 #if 0
-	    fprintf(stderr, "* Found %x in %x %x\n", pointer, start, thing);
+	    fprintf(stderr, "* Found %x in %x %x\n", pointer, start, *start);
 #endif
 	    return start;
 	}
@@ -5918,11 +7250,182 @@ search_dynamic_space(lispobj * pointer)
     if (page_index == -1 || !PAGE_ALLOCATED(page_index))
 	return NULL;
     start = (lispobj *) (page_address(page_index)
-			 + page_table[page_index].first_object_offset);
+			 + page_first_object_offset[page_index]);
     return search_space(start, pointer + 2 - start, pointer);
 }
 
 #if defined(i386) || defined(__x86_64)
+/*
+ * Object start map for the conservative root scan.
+ *
+ * There is one bit for each dual word of the dynamic space, set if an
+ * object starts there.  Lisp code allocates inline, so the bits can't
+ * be kept up to date as objects are allocated; instead a page's bits
+ * are filled in the first time a conservative root lands on it during
+ * a GC, by walking its block from the nearest known object start.
+ * Every page crossed by the walk is filled too, so each page is walked
+ * at most once per GC however many stack words point into it, and
+ * finding the object enclosing an address is then a scan of at most
+ * one page worth of bits.
+ *
+ * A page's bits are only valid if its object_start_epoch matches the
+ * current epoch, which is bumped before each conservative root scan,
+ * so pages freed or reused since the last GC are never consulted.
+ * object_start_span holds the offset from the page start of the last
+ * object starting before the page; that object encloses any address
+ * on the page below the first set bit.
+ */
+#define OBJECT_START_GRAIN (2 * sizeof(lispobj))
+#define OBJECT_START_WORD_BITS (8 * sizeof(unsigned long))
+#define OBJECT_START_PAGE_WORDS \
+  (GC_PAGE_SIZE / OBJECT_START_GRAIN / OBJECT_START_WORD_BITS)
+
+static unsigned long *object_start_bits = NULL;
+static long *object_start_span = NULL;
+static unsigned short *object_start_epoch = NULL;
+static unsigned short object_start_current_epoch = 0;
+
+static void
+object_start_init(void)
+{
+    object_start_bits = malloc(dynamic_space_pages * OBJECT_START_PAGE_WORDS
+			       * sizeof(unsigned long));
+    object_start_span = malloc(dynamic_space_pages * sizeof(long));
+    object_start_epoch = calloc(dynamic_space_pages, sizeof(unsigned short));
+
+    if (object_start_bits == NULL || object_start_span == NULL
+	|| object_start_epoch == NULL) {
+	fprintf(stderr,
+		"*W unable to allocate the object start map; stack scanning will be slower.\n");
+	free(object_start_bits);
+	free(object_start_span);
+	free(object_start_epoch);
+	object_start_bits = NULL;
+	object_start_span = NULL;
+	object_start_epoch = NULL;
+    }
+}
+
+/* Invalidate the object start bits of every page. */
+static void
+object_start_new_epoch(void)
+{
+    if (object_start_epoch == NULL)
+	return;
+    if (++object_start_current_epoch == 0) {
+	memset(object_start_epoch, 0,
+	       dynamic_space_pages * sizeof(unsigned short));
+	object_start_current_epoch = 1;
+    }
+}
+
+static inline void
+object_start_clear_page(int page, lispobj * prev)
+{
+    memset(&object_start_bits[page * OBJECT_START_PAGE_WORDS], 0,
+	   OBJECT_START_PAGE_WORDS * sizeof(unsigned long));
+    object_start_span[page] = prev ? (char *) prev - page_address(page) : 0;
+    object_start_epoch[page] = object_start_current_epoch;
+}
+
+static inline void
+object_start_set(lispobj * addr)
+{
+    size_t bit = ((char *) addr - heap_base) / OBJECT_START_GRAIN;
+
+    object_start_bits[bit / OBJECT_START_WORD_BITS] |=
+	1UL << (bit % OBJECT_START_WORD_BITS);
+}
+
+/*
+ * Return the start of the object enclosing addr, which must be on the
+ * given page whose bits are valid.
+ */
+static lispobj *
+object_start_enclosing(int page, lispobj * addr)
+{
+    unsigned long *bits = &object_start_bits[page * OBJECT_START_PAGE_WORDS];
+    size_t bit = ((char *) addr - page_address(page)) / OBJECT_START_GRAIN;
+    int word = bit / OBJECT_START_WORD_BITS;
+    unsigned long mask = bits[word]
+	& (~0UL >> (OBJECT_START_WORD_BITS - 1 - bit % OBJECT_START_WORD_BITS));
+
+    while (mask == 0) {
+	if (--word < 0)
+	    return (lispobj *) (page_address(page) + object_start_span[page]);
+	mask = bits[word];
+    }
+    bit = word * OBJECT_START_WORD_BITS
+	+ (OBJECT_START_WORD_BITS - 1 - __builtin_clzl(mask));
+    return (lispobj *) (page_address(page) + bit * OBJECT_START_GRAIN);
+}
+
+/*
+ * Fill in the object start bits of the page, and of any page before
+ * it in the same block that the walk crosses.
+ */
+static void
+object_start_fill(int page)
+{
+    lispobj *addr, *prev = NULL, *end;
+    int filled_page, first_page;
+
+    if (page_first_object_offset[page] != 0
+	&& object_start_epoch[page - 1] == object_start_current_epoch) {
+	/* Carry on from the last object of the page before. */
+	filled_page = page - 1;
+	addr = object_start_enclosing(filled_page,
+				      (lispobj *) (page_address(page) -
+						   OBJECT_START_GRAIN));
+    } else {
+	addr = (lispobj *) (page_address(page)
+			    + page_first_object_offset[page]);
+	filled_page = find_page_index(addr);
+	/* The page with the start of the region is only partly walked. */
+	if ((char *) addr == page_address(filled_page))
+	    filled_page--;
+    }
+    first_page = filled_page + 1;
+
+    end = (lispobj *) (page_address(page) + page_bytes_used[page]);
+    while (addr < end) {
+	int addr_page = find_page_index(addr);
+
+	while (filled_page < addr_page)
+	    object_start_clear_page(++filled_page, prev);
+	if (addr_page >= first_page)
+	    object_start_set(addr);
+	prev = addr;
+	addr += CEILING(object_words(addr), 2);
+    }
+    while (filled_page < page)
+	object_start_clear_page(++filled_page, prev);
+}
+
+/*
+ * Find the object enclosing a pointer into a from_space page, using
+ * the object start map when there is one.  Returns NULL if the
+ * pointer is not within an object.
+ */
+static lispobj *
+search_from_space(int page, lispobj * pointer)
+{
+    lispobj *start;
+
+    if (object_start_bits == NULL)
+	return search_dynamic_space(pointer);
+
+    if (object_start_epoch[page] != object_start_current_epoch)
+	object_start_fill(page);
+    start = object_start_enclosing(page, pointer);
+    if (pointer >= start && pointer < start + object_words(start))
+	return start;
+    return NULL;
+}
+
+static int valid_dynamic_space_object_pointer(lispobj * pointer,
+					      lispobj * start_addr);
+
 static int
 valid_dynamic_space_pointer(lispobj * pointer)
 {
@@ -5932,6 +7435,16 @@ valid_dynamic_space_pointer(lispobj * pointer)
     if ((start_addr = search_dynamic_space(pointer)) == NULL)
 	return FALSE;
 
+    return valid_dynamic_space_object_pointer(pointer, start_addr);
+}
+
+/*
+ * Check that pointer is a valid pointer to the object at start_addr,
+ * which encloses it.
+ */
+static int
+valid_dynamic_space_object_pointer(lispobj * pointer, lispobj * start_addr)
+{
     /*
      * Need to allow raw pointers into Code objects for return
      * addresses. This will also pickup pointers to functions in code
@@ -6208,7 +7721,7 @@ maybe_adjust_large_object(lispobj * where)
      */
 
     if (gc_assert_level > 0) {
-        gc_assert(page_table[first_page].first_object_offset == 0);
+        gc_assert(page_first_object_offset[first_page] == 0);
     }
 
     next_page = first_page;
@@ -6218,9 +7731,9 @@ maybe_adjust_large_object(lispobj * where)
 	    gc_assert(PAGE_GENERATION(next_page) == from_space);
 	    gc_assert(PAGE_ALLOCATED(next_page));
 	    gc_assert(PAGE_LARGE_OBJECT(next_page));
-	    gc_assert(page_table[next_page].first_object_offset ==
+	    gc_assert(page_first_object_offset[next_page] ==
 		      GC_PAGE_SIZE * (first_page - next_page));
-	    gc_assert(page_table[next_page].bytes_used == GC_PAGE_SIZE);
+	    gc_assert(page_bytes_used[next_page] == GC_PAGE_SIZE);
 	}
 
 	PAGE_FLAGS_UPDATE(next_page, PAGE_UNBOXED_MASK,
@@ -6244,10 +7757,10 @@ maybe_adjust_large_object(lispobj * where)
 
     /* Object may have shrunk but shouldn't have grown - check. */
     if (gc_assert_level > 0) {
-	gc_assert(page_table[next_page].bytes_used >= remaining_bytes);
+	gc_assert(page_bytes_used[next_page] >= remaining_bytes);
     }
 
-    page_table[next_page].flags |= PAGE_ALLOCATED_MASK;
+    page_flags[next_page] |= PAGE_ALLOCATED_MASK;
     PAGE_FLAGS_UPDATE(next_page, PAGE_UNBOXED_MASK,
 		      unboxed << PAGE_UNBOXED_SHIFT);
     if (gc_assert_level > 0) {
@@ -6255,8 +7768,8 @@ maybe_adjust_large_object(lispobj * where)
     }
 
     /* Adjust the bytes_used. */
-    old_bytes_used = page_table[next_page].bytes_used;
-    page_table[next_page].bytes_used = remaining_bytes;
+    old_bytes_used = page_bytes_used[next_page];
+    page_bytes_used[next_page] = remaining_bytes;
 
     bytes_freed = old_bytes_used - remaining_bytes;
 
@@ -6267,7 +7780,7 @@ maybe_adjust_large_object(lispobj * where)
     next_page++;
     while (old_bytes_used == GC_PAGE_SIZE &&
 	   PAGE_FLAGS(next_page, mmask) == mflags &&
-	   page_table[next_page].first_object_offset == GC_PAGE_SIZE * (first_page
+	   page_first_object_offset[next_page] == GC_PAGE_SIZE * (first_page
 								     -
 								     next_page))
     {
@@ -6281,9 +7794,10 @@ maybe_adjust_large_object(lispobj * where)
 	    gc_assert(!PAGE_WRITE_PROTECTED(next_page));
 	}
 
-	old_bytes_used = page_table[next_page].bytes_used;
-	page_table[next_page].flags &= ~PAGE_ALLOCATED_MASK;
-	page_table[next_page].bytes_used = 0;
+	old_bytes_used = page_bytes_used[next_page];
+	page_flags[next_page] &= ~PAGE_ALLOCATED_MASK;
+	page_bytes_used[next_page] = 0;
+	note_page(next_page);
 	bytes_freed += old_bytes_used;
 	next_page++;
     }
@@ -6329,7 +7843,7 @@ preserve_pointer(void *addr)
 
     /* Address is quite likely to have been invalid - do some checks. */
     if (addr_page_index == -1 || !PAGE_ALLOCATED(addr_page_index)
-	|| page_table[addr_page_index].bytes_used == 0
+	|| page_bytes_used[addr_page_index] == 0
 	|| PAGE_GENERATION(addr_page_index) != from_space
 	/* Skip if already marked dont_move */
 	|| PAGE_DONT_MOVE(addr_page_index))
@@ -6338,23 +7852,31 @@ preserve_pointer(void *addr)
     region_unboxed = PAGE_UNBOXED(addr_page_index);
 
     /* Check the offset within the page */
-    if (((size_t) addr & 0xfff) > page_table[addr_page_index].bytes_used)
+    if (((size_t) addr & 0xfff) > page_bytes_used[addr_page_index])
 	return;
 
-    if (enable_pointer_filter && !valid_dynamic_space_pointer(addr))
-	return;
+    if (enable_pointer_filter) {
+	lispobj *start_addr = search_from_space(addr_page_index, addr);
+
+	if (start_addr == NULL
+	    || !valid_dynamic_space_object_pointer(addr, start_addr))
+	    return;
+    }
 
     /*
      * Work backwards to find a page with a first_object_offset of 0.
      * The pages should be contiguous with all bytes used in the same
-     * gen. Assumes the first_object_offset is negative or zero.
+     * gen. Assumes the first_object_offset is negative or zero.  The
+     * first_object_offset points at the start of the region the page
+     * was allocated in, so skip back a whole region at a time.
      */
     first_page = addr_page_index;
-    while (page_table[first_page].first_object_offset != 0) {
-	first_page--;
+    while (page_first_object_offset[first_page] != 0) {
+	first_page = find_page_index(page_address(first_page)
+				     + page_first_object_offset[first_page]);
 	/* Do some checks */
 	if (gc_assert_level > 0) {
-	    gc_assert(page_table[first_page].bytes_used == GC_PAGE_SIZE);
+	    gc_assert(page_bytes_used[first_page] == GC_PAGE_SIZE);
 	    gc_assert(PAGE_GENERATION(first_page) == from_space);
 	    gc_assert(PAGE_ALLOCATED(first_page));
 	    gc_assert(PAGE_UNBOXED(first_page) == region_unboxed);
@@ -6373,9 +7895,9 @@ preserve_pointer(void *addr)
 	 * valid pointer test above because the tail looks like conses.
 	 */
 	if (!PAGE_ALLOCATED(addr_page_index)
-	    || page_table[addr_page_index].bytes_used == 0
+	    || page_bytes_used[addr_page_index] == 0
 	    /* Check the offset within the page */
-	    || ((size_t) addr & 0xfff) > page_table[addr_page_index].bytes_used) {
+	    || ((size_t) addr & 0xfff) > page_bytes_used[addr_page_index]) {
 	    fprintf(stderr,
 		    "*W ignore pointer 0x%lx to freed area of large object\n",
 		    (unsigned long) addr);
@@ -6396,7 +7918,7 @@ preserve_pointer(void *addr)
 	}
 
 	/* Mark the page static */
-	page_table[i].flags |= PAGE_DONT_MOVE_MASK;
+	page_flags[i] |= PAGE_DONT_MOVE_MASK;
 #if 0
 	fprintf(stderr, "#%d,", i);
 #endif
@@ -6408,8 +7930,8 @@ preserve_pointer(void *addr)
 	 * bytes_allocated counters be updated.
 	 */
 	PAGE_FLAGS_UPDATE(i, PAGE_GENERATION_MASK, new_space);
-	generations[new_space].bytes_allocated += page_table[i].bytes_used;
-	generations[from_space].bytes_allocated -= page_table[i].bytes_used;
+	generations[new_space].bytes_allocated += page_bytes_used[i];
+	generations[from_space].bytes_allocated -= page_bytes_used[i];
 
 	/*
 	 * Essential that the pages are not write protected as they may
@@ -6421,12 +7943,12 @@ preserve_pointer(void *addr)
 	}
 
 	/* Check if this is the last page in this contiguous block */
-	if (page_table[i].bytes_used < GC_PAGE_SIZE
+	if (page_bytes_used[i] < GC_PAGE_SIZE
 	    /* Or it is GC_PAGE_SIZE and is the last in the block */
 	    || !PAGE_ALLOCATED(i + 1)
-	    || page_table[i + 1].bytes_used == 0	/* Next page free */
+	    || page_bytes_used[i + 1] == 0	/* Next page free */
 	    || PAGE_GENERATION(i + 1) != from_space	/* Diff. gen */
-	    || page_table[i + 1].first_object_offset == 0)
+	    || page_first_object_offset[i + 1] == 0)
 	    break;
     }
 
@@ -6440,9 +7962,12 @@ preserve_pointer(void *addr)
 #endif
 
 #ifdef CONTROL_STACKS
-/* Scavenge the thread stack conservative roots. */
+/*
+ * Scavenge the thread stack conservative roots, calling preserve on
+ * each word.
+ */
 static void
-scavenge_thread_stacks(void)
+scavenge_thread_stacks(void (*preserve) (void *))
 {
     lispobj thread_stacks = SymbolValue(CONTROL_STACKS);
 
@@ -6490,7 +8015,7 @@ scavenge_thread_stacks(void)
 				    "Scavenging %d words of control stack %d of length %d words.\n",
 				    length, i, vector_length);
 			for (j = 0; j < length; j++)
-			    preserve_pointer((void *) stack->data[1 + j]);
+			    preserve((void *) stack->data[1 + j]);
 		    }
 		}
 	    }
@@ -6498,7 +8023,805 @@ scavenge_thread_stacks(void)
     }
 }
 #endif
+
+/*
+ * Find the last page of the block starting at first_page, as
+ * preserve_pointer does.
+ */
+static int
+block_last_page(int first_page)
+{
+    int generation = PAGE_GENERATION(first_page);
+    int i;
+
+    for (i = first_page;; i++)
+	if (page_bytes_used[i] < GC_PAGE_SIZE
+	    || !PAGE_ALLOCATED(i + 1)
+	    || page_bytes_used[i + 1] == 0
+	    || PAGE_GENERATION(i + 1) != generation
+	    || page_first_object_offset[i + 1] == 0)
+	    return i;
+}
+
+/*
+ * True if where is the key/value vector of a weak hash table.
+ */
+static inline boolean
+weak_hash_vector_p(lispobj * where)
+{
+    return TypeOf(*where) == type_SimpleVector
+	&& HeaderValue(*where) == subtype_VectorValidHashing
+	&& Pointerp(where[2])
+	&& ((struct hash_table *) PTR(where[2]))->weak_p != NIL;
+}
+
+/*
+ * Call fn with each address that the given words point to, the words
+ * being interpreted like verify_space does: the pointers of boxed
+ * objects, the raw function addresses of closures and fdefns, and the
+ * boxed sections of code.  Unboxed objects are skipped.  The values
+ * of weak pointers and the entries of weak hash tables are passed to
+ * weak_fn instead.
+ */
+static void
+map_space_pointers(lispobj * start, long words, void (*fn) (void *),
+		   void (*weak_fn) (void *))
+{
+    while (words > 0) {
+	lispobj thing = *start;
+	long count = 1;
+
+	if (Pointerp(thing))
+	    fn((void *) thing);
+	else if (thing & 0x3) {
+	    switch (TypeOf(thing)) {
+	      case type_ClosureHeader:
+	      case type_FuncallableInstanceHeader:
+	      case type_ByteCodeFunction:
+	      case type_ByteCodeClosure:
+#ifdef type_DylanFunctionHeader
+	      case type_DylanFunctionHeader:
+#endif
+		  /* The function slot holds a raw address. */
+		  fn((void *) ((struct closure *) start)->function);
+		  count = 2;
+		  break;
+
+	      case type_Fdefn:
+		  fn(((struct fdefn *) start)->raw_addr);
+		  break;
+
+	      case type_WeakPointer:
+		  if (Pointerp(((struct weak_pointer *) start)->value))
+		      weak_fn((void *) ((struct weak_pointer *) start)->value);
+		  count = WEAK_POINTER_NWORDS;
+		  break;
+
+	      case type_SimpleVector:
+		  if (weak_hash_vector_p(start)) {
+		      long length = fixnum_value(start[1]);
+
+		      /* The table and the empty marker, then the entries. */
+		      map_space_pointers(start + 2, 2, fn, weak_fn);
+		      map_space_pointers(start + 4, length - 2, weak_fn,
+					 weak_fn);
+		      count = CEILING(length + 2, 2);
+		  }
+		  break;
+
+	      case type_CodeHeader:
+		  {
+		      struct code *code = (struct code *) start;
+		      int nheader_words = HeaderValue(thing);
+		      lispobj fheaderl;
+
+		      /* The boxed section of the code and of each function. */
+		      map_space_pointers(start + 1, nheader_words - 1, fn,
+					 weak_fn);
+		      for (fheaderl = code->entry_points; fheaderl != NIL;) {
+			  struct function *fheaderp =
+			      (struct function *) PTR(fheaderl);
+
+			  map_space_pointers(&fheaderp->name, 1, fn, weak_fn);
+			  map_space_pointers(&fheaderp->arglist, 1, fn, weak_fn);
+			  map_space_pointers(&fheaderp->type, 1, fn, weak_fn);
+			  fheaderl = fheaderp->next;
+		      }
+		      count = CEILING(nheader_words
+				      + fixnum_value(code->code_size), 2);
+		      break;
+		  }
+
+		  /* Unboxed objects */
+	      case type_Bignum:
+	      case type_SingleFloat:
+	      case type_DoubleFloat:
+#ifdef type_LongFloat
+	      case type_LongFloat:
+#endif
+#ifdef type_DoubleDoubleFloat
+	      case type_DoubleDoubleFloat:
+#endif
+#ifdef type_ComplexSingleFloat
+	      case type_ComplexSingleFloat:
+#endif
+#ifdef type_ComplexDoubleFloat
+	      case type_ComplexDoubleFloat:
+#endif
+#ifdef type_ComplexLongFloat
+	      case type_ComplexLongFloat:
+#endif
+#ifdef type_ComplexDoubleDoubleFloat
+	      case type_ComplexDoubleDoubleFloat:
+#endif
+	      case type_SimpleString:
+	      case type_SimpleBitVector:
+	      case type_SimpleArrayUnsignedByte2:
+	      case type_SimpleArrayUnsignedByte4:
+	      case type_SimpleArrayUnsignedByte8:
+	      case type_SimpleArrayUnsignedByte16:
+	      case type_SimpleArrayUnsignedByte32:
+#ifdef type_SimpleArraySignedByte8
+	      case type_SimpleArraySignedByte8:
+#endif
+#ifdef type_SimpleArraySignedByte16
+	      case type_SimpleArraySignedByte16:
+#endif
+#ifdef type_SimpleArraySignedByte30
+	      case type_SimpleArraySignedByte30:
+#endif
+#ifdef type_SimpleArraySignedByte32
+	      case type_SimpleArraySignedByte32:
+#endif
+	      case type_SimpleArraySingleFloat:
+	      case type_SimpleArrayDoubleFloat:
+#ifdef type_SimpleArrayLongFloat
+	      case type_SimpleArrayLongFloat:
+#endif
+#ifdef type_SimpleArrayDoubleDoubleFloat
+	      case type_SimpleArrayDoubleDoubleFloat:
+#endif
+#ifdef type_SimpleArrayComplexSingleFloat
+	      case type_SimpleArrayComplexSingleFloat:
+#endif
+#ifdef type_SimpleArrayComplexDoubleFloat
+	      case type_SimpleArrayComplexDoubleFloat:
+#endif
+#ifdef type_SimpleArrayComplexLongFloat
+	      case type_SimpleArrayComplexLongFloat:
+#endif
+#ifdef type_SimpleArrayComplexDoubleDoubleFloat
+	      case type_SimpleArrayComplexDoubleDoubleFloat:
+#endif
+	      case type_Sap:
+		  count = (sizetab[TypeOf(thing)]) (start);
+		  break;
+
+	      default:
+		  /* The slots of any other object are scanned in turn. */
+		  break;
+	    }
+	}
+	start += count;
+	words -= count;
+    }
+}
+
+#if defined(i386) || defined(__x86_64)
+/*
+ * Mark-region collection of the oldest generation; see
+ * gencgc_mark_region.
+ *
+ * Before anything is moved, the objects of from_space reachable from
+ * the roots are marked in mark_bits, which has the same layout as the
+ * object start map.  After the conservative roots have pinned their
+ * blocks, every from_space block that is at least
+ * gencgc_mark_region_density percent live is kept in place the same
+ * way preserve_pointer keeps a block: its pages are marked dont_move
+ * and moved to new_space.  The dead objects in all the kept blocks
+ * are then overwritten with unboxed filler vectors, so the scavenger
+ * skips them and they keep nothing else alive.  The remaining sparse
+ * blocks are evacuated by the usual copying.
+ *
+ * The marking is conservative: any word that might be a pointer into
+ * from_space marks the object it points into.  So the marked objects
+ * are a superset of the objects the copying scavenger keeps, which is
+ * all the filling needs.
+ *
+ * The values of weak pointers and the entries of weak hash tables are
+ * traced too, since concurrent marking can't tell when the mutator
+ * takes a strong reference from a weak pointer, but the pages they
+ * point into are noted in mark_weak_pages and their blocks are never
+ * kept dense.  Those objects are then copied or not by the scavenger,
+ * and the weak pass decides them as in any other GC.  Objects that
+ * are only reachable through them may be kept once more, and are
+ * freed by the next collection of the generation.
+ */
+static unsigned long *mark_bits = NULL;
+static char *mark_weak_pages = NULL;
+static lispobj **mark_stack = NULL;
+static size_t mark_stack_size = 0;
+static size_t mark_stack_top = 0;
+static boolean mark_stack_overflow = FALSE;
+
+/* The mark stack can't be grown in the write fault handler. */
+static boolean mark_stack_fixed = FALSE;
+
+/* The generation being marked. */
+static int mark_generation;
+
+/*
+ * True if the marks come from concurrent marking, so objects of
+ * mark_generation allocated after the snapshot are live unmarked.
+ */
+static boolean mark_snapshot = FALSE;
+
+static inline boolean satb_in_snapshot(lispobj * addr);
+
+static inline boolean
+marked_p(lispobj * addr)
+{
+    size_t bit = ((char *) addr - heap_base) / OBJECT_START_GRAIN;
+
+    return (mark_bits[bit / OBJECT_START_WORD_BITS]
+	    >> (bit % OBJECT_START_WORD_BITS)) & 1;
+}
+
+static inline boolean
+mark_live_p(lispobj * addr)
+{
+    return marked_p(addr) || (mark_snapshot && !satb_in_snapshot(addr));
+}
+
+/*
+ * Mark the from_space object enclosing addr, if there is one, and
+ * push it on the mark stack to have its contents marked.
+ */
+static void
+mark_address(void *addr)
+{
+    int page = find_page_index(addr);
+    lispobj *start;
+    size_t bit;
+    unsigned long mask;
+
+    if (page == -1 || !PAGE_ALLOCATED(page)
+	|| PAGE_GENERATION(page) != mark_generation
+	|| (char *) addr - page_address(page) >= page_bytes_used[page])
+	return;
+
+    start = search_from_space(page, addr);
+    if (start == NULL || (mark_snapshot && !satb_in_snapshot(start)))
+	return;
+
+    bit = ((char *) start - heap_base) / OBJECT_START_GRAIN;
+    mask = 1UL << (bit % OBJECT_START_WORD_BITS);
+    if (mark_bits[bit / OBJECT_START_WORD_BITS] & mask)
+	return;
+    mark_bits[bit / OBJECT_START_WORD_BITS] |= mask;
+
+    if (mark_stack_top == mark_stack_size) {
+	size_t size = mark_stack_size ? 2 * mark_stack_size : 4096;
+	lispobj **stack;
+
+	if (mark_stack_fixed
+	    || (stack = realloc(mark_stack, size * sizeof(lispobj *))) == NULL) {
+	    mark_stack_overflow = TRUE;
+	    return;
+	}
+	mark_stack = stack;
+	mark_stack_size = size;
+    }
+    mark_stack[mark_stack_top++] = start;
+}
+
+/*
+ * Mark what a weak reference points to, noting its page so that its
+ * block goes through the copying.
+ */
+static void
+mark_weak_address(void *addr)
+{
+    int page = find_page_index(addr);
+
+    if (page != -1 && PAGE_ALLOCATED(page)
+	&& PAGE_GENERATION(page) == mark_generation)
+	mark_weak_pages[page] = 1;
+    mark_address(addr);
+}
+
+/*
+ * Mark the objects pointed to from the given words, which are
+ * interpreted like verify_space does.
+ */
+static void
+mark_space(lispobj * start, long words)
+{
+    map_space_pointers(start, words, mark_address, mark_weak_address);
+}
+
+/* Allocate the mark bits if necessary, and clear them for the pages
+   of mark_generation. */
+static boolean
+mark_bits_init(void)
+{
+    int i;
+
+    if (mark_bits == NULL) {
+	mark_bits = malloc(dynamic_space_pages * OBJECT_START_PAGE_WORDS
+			   * sizeof(unsigned long));
+	mark_weak_pages = calloc(dynamic_space_pages, 1);
+	if (mark_bits == NULL || mark_weak_pages == NULL) {
+	    free(mark_bits);
+	    free(mark_weak_pages);
+	    mark_bits = NULL;
+	    mark_weak_pages = NULL;
+	    fprintf(stderr,
+		    "*W unable to allocate the mark bits; mark-region collection disabled.\n");
+	    gencgc_mark_region = FALSE;
+	    gencgc_concurrent_mark = FALSE;
+	    return FALSE;
+	}
+    }
+
+    for (i = 0; i < last_free_page; i++)
+	if (PAGE_ALLOCATED(i) && PAGE_GENERATION(i) == mark_generation) {
+	    memset(&mark_bits[i * OBJECT_START_PAGE_WORDS], 0,
+		   OBJECT_START_PAGE_WORDS * sizeof(unsigned long));
+	    mark_weak_pages[i] = 0;
+	}
+    mark_stack_top = 0;
+    mark_stack_overflow = FALSE;
+    return TRUE;
+}
+
+/*
+ * Mark the objects of mark_generation referenced from the roots: the
+ * same roots garbage_collect_generation scavenges, and all the boxed
+ * pages of the other generations.  The control stack is scanned down
+ * to stack_end.
+ */
+static void
+mark_roots(void *stack_end)
+{
+    lispobj **ptr;
+    int i;
+
+    for (ptr = (lispobj **) control_stack_end - 1;
+	 ptr > (lispobj **) stack_end; ptr--)
+	mark_address(*ptr);
+#ifdef CONTROL_STACKS
+    scavenge_thread_stacks(mark_address);
+#endif
+
+    for (i = 0; i < NSIG; i++) {
+	union interrupt_handler handler = interrupt_handlers[i];
+
+	if (handler.c != (void (*)(HANDLER_ARGS)) SIG_IGN
+	    && handler.c != (void (*)(HANDLER_ARGS)) SIG_DFL)
+	    mark_space((lispobj *) (interrupt_handlers + i), 1);
+    }
+    mark_space(binding_stack,
+	       (lispobj *) get_binding_stack_pointer() - binding_stack);
+    mark_space((lispobj *) & scavenger_hooks, 1);
+    mark_space(static_space,
+	       (lispobj *) SymbolValue(STATIC_SPACE_FREE_POINTER) - static_space);
+
+    for (i = 0; i < last_free_page; i++) {
+	int last_page, j;
+	long bytes = 0;
+
+	if (!PAGE_ALLOCATED(i) || page_bytes_used[i] == 0
+	    || PAGE_UNBOXED(i) || PAGE_GENERATION(i) == mark_generation
+	    || page_first_object_offset[i] != 0)
+	    continue;
+	last_page = block_last_page(i);
+	for (j = i; j <= last_page; j++)
+	    bytes += page_bytes_used[j];
+	mark_space((lispobj *) page_address(i), bytes / sizeof(lispobj));
+	i = last_page;
+    }
+}
+
+/*
+ * Mark from the objects on the mark stack until it is empty or about
+ * budget words have been scanned.  Returns the number of words left
+ * of the budget.
+ */
+static long
+mark_drain(long budget)
+{
+    while (budget > 0 && mark_stack_top > 0 && !mark_stack_overflow) {
+	lispobj *start = mark_stack[--mark_stack_top];
+	long size = CEILING(object_words(start), 2);
+
+	mark_space(start, size);
+	budget -= size;
+    }
+    return budget;
+}
+
+/*
+ * Mark everything in from_space reachable from the roots.  The
+ * control stack is scanned down to stack_end.  Returns false if the
+ * marking could not be completed.
+ */
+static boolean
+mark_region_mark(void *stack_end)
+{
+    mark_generation = from_space;
+    mark_snapshot = FALSE;
+    if (!mark_bits_init())
+	return FALSE;
+
+    mark_roots(stack_end);
+    mark_drain(LONG_MAX);
+
+    if (mark_stack_overflow) {
+	fprintf(stderr,
+		"*W mark stack overflow; copying the whole generation.\n");
+	return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+ * Concurrent marking of the oldest generation; see
+ * gencgc_concurrent_mark.
+ *
+ * Marking starts at the end of a GC, once the oldest generation is
+ * gencgc_concurrent_mark_start percent of the way to its trigger, and
+ * takes a snapshot of the heap: it marks the objects referenced from
+ * the roots and from every page that the mutator can write without a
+ * fault, which is every page outside the oldest generation and every
+ * page of the oldest generation that is not write protected.  The
+ * remaining pages of the oldest generation are write protected
+ * already, and are left pending in satb_pending.  Tracing then
+ * proceeds a step at a time from alloc when the allocation region is
+ * refilled.  The first write to a pending page marks everything the
+ * page points to before the write goes ahead, so no pointer in the
+ * snapshot is lost to the marker (snapshot at the beginning).
+ *
+ * Objects added to the oldest generation after the snapshot, by
+ * promotion, are not marked but are treated as live; satb_page_bytes
+ * records how much of each page was in the snapshot.  The following
+ * collection of the oldest generation finishes any marking left with
+ * interrupts off, and then keeps and fills blocks exactly as
+ * mark-region collection does, without marking from scratch.
+ */
+enum satb_state {
+    SATB_OFF,
+    SATB_MARKING,
+    SATB_DONE
+};
+
+static enum satb_state satb_state = SATB_OFF;
+static int *satb_page_bytes = NULL;
+static char *satb_pending = NULL;
+
+/*
+ * Room to keep on the mark stack for the pages written between mark
+ * steps, which are scanned in the fault handler and can't grow it.
+ */
+#define SATB_STACK_RESERVE (8 * GC_PAGE_SIZE / sizeof(lispobj))
+
+/* True if addr, in mark_generation, was allocated before the snapshot. */
+static inline boolean
+satb_in_snapshot(lispobj * addr)
+{
+    int page = find_page_index(addr);
+
+    return (char *) addr - page_address(page) < satb_page_bytes[page];
+}
+
+/* Mark everything the snapshot part of a page points to. */
+static void
+satb_scan_page(int page)
+{
+    lispobj *page_start = (lispobj *) page_address(page);
+    lispobj *page_end = (lispobj *) (page_address(page)
+				     + satb_page_bytes[page]);
+    lispobj *addr;
+
+    if (object_start_epoch[page] != object_start_current_epoch)
+	object_start_fill(page);
+    addr = object_start_enclosing(page, page_start);
+
+    while (addr < page_end) {
+	lispobj header = *addr;
+	long size = CEILING(object_words(addr), 2);
+	lispobj *end = addr + size;
+
+	if (!Pointerp(header) && (header & 3) != 0
+	    && (TypeOf(header) == type_SimpleVector
+		|| TypeOf(header) == type_InstanceHeader)) {
+	    /* Only the part of a big vector that is on the page. */
+	    lispobj *from = addr + 1 < page_start ? page_start : addr + 1;
+	    lispobj *to = end < page_end ? end : page_end;
+
+	    if (weak_hash_vector_p(addr))
+		map_space_pointers(from, to - from, mark_weak_address,
+				   mark_weak_address);
+	    else
+		mark_space(from, to - from);
+	} else
+	    mark_space(addr, size);
+	addr = end;
+    }
+}
+
+/* Make sure the fault handler has room on the mark stack. */
+static boolean
+satb_reserve(void)
+{
+    if (mark_stack_size - mark_stack_top < SATB_STACK_RESERVE) {
+	size_t size = mark_stack_top + 2 * SATB_STACK_RESERVE;
+	lispobj **stack = realloc(mark_stack, size * sizeof(lispobj *));
+
+	if (stack == NULL)
+	    return FALSE;
+	mark_stack = stack;
+	mark_stack_size = size;
+    }
+    return TRUE;
+}
+
+static void
+satb_stop(void)
+{
+    satb_state = SATB_OFF;
+    mark_snapshot = FALSE;
+    memset(satb_pending, 0, dynamic_space_pages);
+}
+
+static void
+satb_start(void *stack_end)
+{
+    int i;
+
+    if (object_start_bits == NULL)
+	return;
+    if (satb_page_bytes == NULL) {
+	satb_page_bytes = malloc(dynamic_space_pages * sizeof(int));
+	satb_pending = calloc(dynamic_space_pages, 1);
+	if (satb_page_bytes == NULL || satb_pending == NULL) {
+	    fprintf(stderr,
+		    "*W unable to allocate the snapshot tables; concurrent marking disabled.\n");
+	    free(satb_page_bytes);
+	    free(satb_pending);
+	    satb_page_bytes = NULL;
+	    satb_pending = NULL;
+	    gencgc_concurrent_mark = FALSE;
+	    return;
+	}
+    }
+
+    object_start_new_epoch();
+    mark_generation = gencgc_oldest_gen_to_gc;
+    if (!mark_bits_init())
+	return;
+    mark_snapshot = TRUE;
+    satb_state = SATB_MARKING;
+
+    memset(satb_page_bytes, 0, dynamic_space_pages * sizeof(int));
+    for (i = 0; i < last_free_page; i++)
+	if (PAGE_ALLOCATED(i) && PAGE_GENERATION(i) == mark_generation) {
+	    satb_page_bytes[i] = page_bytes_used[i];
+	    if (!PAGE_UNBOXED(i) && PAGE_WRITE_PROTECTED(i))
+		satb_pending[i] = 1;
+	}
+
+    mark_roots(stack_end);
+    for (i = 0; i < last_free_page; i++)
+	if (satb_page_bytes[i] != 0 && !PAGE_UNBOXED(i) && !satb_pending[i])
+	    satb_scan_page(i);
+
+    if (mark_stack_overflow || !satb_reserve())
+	satb_stop();
+}
+
+/*
+ * Called at the end of a GC to start concurrent marking if the oldest
+ * generation is getting close to its trigger.
+ */
+static void
+satb_maybe_start(void *stack_end)
+{
+    struct generation *gen = &generations[gencgc_oldest_gen_to_gc];
+
+    if (!gencgc_concurrent_mark || satb_state != SATB_OFF
+	|| !enable_page_protection || gencgc_soft_dirty)
+	return;
+    if ((long long) gen->bytes_allocated * 100
+	< (long long) gen->gc_trigger * gencgc_concurrent_mark_start)
+	return;
+    satb_start(stack_end);
+}
+
+/* Called from alloc when a region is refilled. */
+static void
+satb_mark_step(void)
+{
+    unsigned long long start = gc_time_usec();
+
+    mark_drain(gencgc_concurrent_mark_step);
+    if (mark_stack_overflow || !satb_reserve())
+	satb_stop();
+    else if (mark_stack_top == 0) {
+	/* Everything in the snapshot is marked; stop tracking writes. */
+	satb_state = SATB_DONE;
+	memset(satb_pending, 0, dynamic_space_pages);
+    }
+    gc_concurrent_mark_usec += gc_time_usec() - start;
+}
+
+/* Called from gc_write_barrier before a write protected page is written. */
+static void
+satb_page_written(int page)
+{
+    if (satb_state != SATB_MARKING || !satb_pending[page])
+	return;
+    satb_pending[page] = 0;
+    mark_stack_fixed = TRUE;
+    satb_scan_page(page);
+    mark_stack_fixed = FALSE;
+    gc_satb_pages++;
+}
+
+/*
+ * Finish concurrent marking for a collection of the oldest generation.
+ * Returns false if the marks can't be used.
+ */
+static boolean
+satb_finish(void)
+{
+    unsigned long long start = gc_time_usec();
+    boolean ok;
+
+    mark_drain(LONG_MAX);
+    ok = !mark_stack_overflow;
+    satb_state = SATB_OFF;
+    memset(satb_pending, 0, dynamic_space_pages);
+    if (!ok)
+	mark_snapshot = FALSE;
+    gc_remark_usec += gc_time_usec() - start;
+    return ok;
+}
+
+/*
+ * Overwrite the dead objects from start up to end with a filler
+ * vector.
+ */
+static void
+mark_region_fill(lispobj * start, lispobj * end)
+{
+    struct vector *filler = (struct vector *) start;
+    long words = end - start;
+
+    filler->header = type_SimpleArrayUnsignedByte32;
+    filler->length = make_fixnum((words - 2) * (sizeof(lispobj) / 4));
+    gc_mark_region_filled_bytes += words * sizeof(lispobj);
+}
+
+/*
+ * Fill the dead objects of the block of pages first_page to
+ * last_page.  The objects that the first_object_offset of a page
+ * points at must still start objects afterwards.
+ */
+static void
+mark_region_fill_block(int first_page, int last_page)
+{
+    lispobj *addr = (lispobj *) page_address(first_page);
+    lispobj *end = (lispobj *) (page_address(last_page)
+				+ page_bytes_used[last_page]);
+    lispobj *dead = NULL;
+    int page = first_page + 1;
+
+    while (addr < end) {
+	while (page <= last_page
+	       && page_address(page) + page_first_object_offset[page]
+	       < (char *) addr)
+	    page++;
+	if (dead != NULL && page <= last_page
+	    && page_address(page) + page_first_object_offset[page]
+	    == (char *) addr) {
+	    mark_region_fill(dead, addr);
+	    dead = NULL;
+	}
+
+	if (mark_live_p(addr)) {
+	    if (dead != NULL) {
+		mark_region_fill(dead, addr);
+		dead = NULL;
+	    }
+	} else if (dead == NULL)
+	    dead = addr;
+
+	addr += CEILING(object_words(addr), 2);
+    }
+    if (dead != NULL)
+	mark_region_fill(dead, addr);
+}
+
+/*
+ * Keep the dense blocks of from_space in place, and fill the dead
+ * objects of every block kept in place, including those kept by
+ * preserve_pointer.
+ */
+static void
+mark_region_keep_dense_blocks(void)
+{
+    int first_page, last_page, i;
+
+    for (first_page = 0; first_page < last_free_page; first_page++) {
+	lispobj *addr, *end;
+	long bytes = 0, live = 0;
+	boolean weak = FALSE;
+
+	if (!PAGE_ALLOCATED(first_page)
+	    || page_bytes_used[first_page] == 0
+	    || PAGE_GENERATION(first_page) != from_space
+	    || PAGE_LARGE_OBJECT(first_page)
+	    || page_first_object_offset[first_page] != 0)
+	    continue;
+
+	last_page = block_last_page(first_page);
+	for (i = first_page; i <= last_page; i++) {
+	    bytes += page_bytes_used[i];
+	    weak |= mark_weak_pages[i];
+	}
+
+	addr = (lispobj *) page_address(first_page);
+	end = addr + bytes / sizeof(lispobj);
+	while (addr < end) {
+	    long size = CEILING(object_words(addr), 2);
+
+	    if (mark_live_p(addr))
+		live += size * sizeof(lispobj);
+	    addr += size;
+	}
+
+	if (!weak && live * 100 >= (long) gencgc_mark_region_density * bytes) {
+	    for (i = first_page; i <= last_page; i++) {
+		page_flags[i] |= PAGE_DONT_MOVE_MASK;
+		PAGE_FLAGS_UPDATE(i, PAGE_GENERATION_MASK, new_space);
+		generations[new_space].bytes_allocated +=
+		    page_bytes_used[i];
+		generations[from_space].bytes_allocated -=
+		    page_bytes_used[i];
+	    }
+	    gc_mark_region_pages += last_page - first_page + 1;
+	}
+	first_page = last_page;
+    }
+
+    for (first_page = 0; first_page < last_free_page; first_page++) {
+	if (!PAGE_ALLOCATED(first_page)
+	    || PAGE_GENERATION(first_page) != new_space
+	    || !PAGE_DONT_MOVE(first_page)
+	    || PAGE_LARGE_OBJECT(first_page)
+	    || page_first_object_offset[first_page] != 0)
+	    continue;
+	last_page = block_last_page(first_page);
+	mark_region_fill_block(first_page, last_page);
+	first_page = last_page;
+    }
+}
+#endif
 
+/*
+ * Write protect a page that is known to have no pointers to younger
+ * generations.
+ */
+static void
+write_protect_page(unsigned page)
+{
+    if (!gencgc_soft_dirty)
+	os_protect((os_vm_address_t) page_address(page), GC_PAGE_SIZE,
+		   OS_VM_PROT_READ | OS_VM_PROT_EXECUTE);
+    page_flags[page] |= PAGE_WRITE_PROTECTED_MASK;
+}
+
 
 /*
  * If the given page is not write protected, then scan it for pointers
@@ -6522,12 +8845,12 @@ update_page_write_prot(unsigned page)
     int j;
     int wp_it = 1;
     void **page_addr = (void **) page_address(page);
-    int num_words = page_table[page].bytes_used / sizeof(lispobj);
+    int num_words = page_bytes_used[page] / sizeof(lispobj);
 
     /* Shouldn't be a free page. */
     if (gc_assert_level > 0) {
 	gc_assert(PAGE_ALLOCATED(page));
-	gc_assert(page_table[page].bytes_used != 0);
+	gc_assert(page_bytes_used[page] != 0);
     }
 
     /* Skip if it's already write protected or an unboxed page. */
@@ -6547,7 +8870,7 @@ update_page_write_prot(unsigned page)
 	if (index != -1)
 	    if (		/* Does it point to a younger or the temp. generation? */
 		   (PAGE_ALLOCATED(index)
-		    && page_table[index].bytes_used != 0
+		    && page_bytes_used[index] != 0
 		    && (PAGE_GENERATION(index) < gen
 			|| PAGE_GENERATION(index) == NUM_GENERATIONS))
 
@@ -6567,11 +8890,7 @@ update_page_write_prot(unsigned page)
 	fprintf(stderr, "* WP page %d of gen %d\n", page, gen);
 #endif
 
-	os_protect((os_vm_address_t) page_addr, GC_PAGE_SIZE,
-		   OS_VM_PROT_READ | OS_VM_PROT_EXECUTE);
-
-	/* Note the page as protected in the page tables */
-	page_table[page].flags |= PAGE_WRITE_PROTECTED_MASK;
+	write_protect_page(page);
     }
 
     return wp_it;
@@ -6616,23 +8935,24 @@ scavenge_generation(int generation)
 {
     int i;
     int num_wp = 0;
+    unsigned long long start_time = gc_time_usec();
 
 #define SC_GEN_CK 0
 #if SC_GEN_CK
     /* Clear the write_protected_cleared flags on all pages */
     for (i = 0; i < dynamic_space_pages; i++)
-	page_table[i].flags &= ~PAGE_WRITE_PROTECTED_CLEADED_MASK;
+	page_flags[i] &= ~PAGE_WRITE_PROTECTED_CLEADED_MASK;
 #endif
 
     for (i = 0; i < last_free_page; i++) {
 	if (PAGE_ALLOCATED(i) && !PAGE_UNBOXED(i)
-	    && page_table[i].bytes_used != 0
+	    && page_bytes_used[i] != 0
 	    && PAGE_GENERATION(i) == generation) {
 	    int last_page;
 
 	    /* This should be the start of a contiguous block */
 	    if (gc_assert_level > 0) {
-		gc_assert(page_table[i].first_object_offset == 0);
+		gc_assert(page_first_object_offset[i] == 0);
 	    }
 
 	    /*
@@ -6647,13 +8967,13 @@ scavenge_generation(int generation)
 	     */
 	    for (last_page = i;; last_page++)
 		/* Check if this is the last page in this contiguous block */
-		if (page_table[last_page].bytes_used < GC_PAGE_SIZE
+		if (page_bytes_used[last_page] < GC_PAGE_SIZE
 		    /* Or it is GC_PAGE_SIZE and is the last in the block */
 		    || !PAGE_ALLOCATED(last_page + 1)
 		    || PAGE_UNBOXED(last_page + 1)
-		    || page_table[last_page + 1].bytes_used == 0
+		    || page_bytes_used[last_page + 1] == 0
 		    || PAGE_GENERATION(last_page + 1) != generation
-		    || page_table[last_page + 1].first_object_offset == 0)
+		    || page_first_object_offset[last_page + 1] == 0)
 		    break;
 
 	    /*
@@ -6672,7 +8992,7 @@ scavenge_generation(int generation)
 		if (all_wp == 0)
 #endif
 		{
-		    scavenge(page_address(i), (page_table[last_page].bytes_used
+		    scavenge(page_address(i), (page_bytes_used[last_page]
 					       + GC_PAGE_SIZE * (last_page -
 							      i)) /
 			     sizeof(lispobj));
@@ -6694,6 +9014,8 @@ scavenge_generation(int generation)
 	fprintf(stderr, "Write protected %d pages within generation %d\n",
 		num_wp, generation);
 
+    gc_scavenge_generation_usec += gc_time_usec() - start_time;
+
 #if SC_GEN_CK
     /*
      * Check that none of the write_protected pages in this generation
@@ -6701,7 +9023,7 @@ scavenge_generation(int generation)
      */
     for (i = 0; i < dynamic_space_pages; i++)
 	if (PAGE_ALLOCATED(i)
-	    && page_table[i].bytes_used != 0
+	    && page_bytes_used[i] != 0
 	    && PAGE_GENERATION(i) == generation
 	    && PAGE_WRITE_PROTECTED_CLEARED(i)) {
 	    fprintf(stderr,
@@ -6709,7 +9031,7 @@ scavenge_generation(int generation)
 		    generation, i);
 	    fprintf(stderr,
 		    "*** page: bytes_used=%d first_object_offset=%d dont_move=%d\n",
-		    page_table[i].bytes_used, page_table[i].first_object_offset,
+		    page_bytes_used[i], page_first_object_offset[i],
 		    PAGE_DONT_MOVE(i));
 	}
 #endif
@@ -6760,7 +9082,7 @@ scavenge_newspace_generation_one_scan(int generation)
 
     for (i = 0; i < last_free_page; i++) {
 	if (PAGE_ALLOCATED(i) && !PAGE_UNBOXED(i)
-	    && page_table[i].bytes_used != 0
+	    && page_bytes_used[i] != 0
 	    && PAGE_GENERATION(i) == generation && (!PAGE_WRITE_PROTECTED(i)
 						    /* This may be redundant as WP is now cleared before promotion. */
 						    || PAGE_DONT_MOVE(i))) {
@@ -6780,13 +9102,13 @@ scavenge_newspace_generation_one_scan(int generation)
 	     */
 	    for (last_page = i;; last_page++)
 		/* Check if this is the last page in this contiguous block */
-		if (page_table[last_page].bytes_used < GC_PAGE_SIZE
+		if (page_bytes_used[last_page] < GC_PAGE_SIZE
 		    /* Or it is GC_PAGE_SIZE and is the last in the block */
 		    || !PAGE_ALLOCATED(last_page + 1)
 		    || PAGE_UNBOXED(last_page + 1)
-		    || page_table[last_page + 1].bytes_used == 0
+		    || page_bytes_used[last_page + 1] == 0
 		    || PAGE_GENERATION(last_page + 1) != generation
-		    || page_table[last_page + 1].first_object_offset == 0)
+		    || page_first_object_offset[last_page + 1] == 0)
 		    break;
 
 	    /*
@@ -6810,15 +9132,15 @@ scavenge_newspace_generation_one_scan(int generation)
 
 		    /* Calc. the size */
 		    if (last_page == i)
-			size = (page_table[last_page].bytes_used
+			size = (page_bytes_used[last_page]
 				-
-				page_table[i].first_object_offset) /
+				page_first_object_offset[i]) /
 			    sizeof(lispobj);
 		    else
 			size =
-			    (page_table[last_page].bytes_used +
+			    (page_bytes_used[last_page] +
 			     GC_PAGE_SIZE * (last_page - i) -
-			     page_table[i].first_object_offset) /
+			     page_first_object_offset[i]) /
 			    sizeof(lispobj);
 
 		    {
@@ -6828,14 +9150,14 @@ scavenge_newspace_generation_one_scan(int generation)
 #if 0
 			fprintf(stderr, "scavenge(%x,%d)\n",
 				page_address(i) +
-				page_table[i].first_object_offset, size);
+				page_first_object_offset[i], size);
 #endif
 
 			new_areas_ignore_page = last_page;
 
 			scavenge(
 				 (page_address(i) +
-				  page_table[i].first_object_offset), size);
+				  page_first_object_offset[i]), size);
 
 #if SC_NS_GEN_CK
 			/* Flush the alloc regions updating the tables. */
@@ -6848,8 +9170,8 @@ scavenge_newspace_generation_one_scan(int generation)
 				    i, last_page);
 			    fprintf(stderr,
 				    "*** page: bytes_used=%d first_object_offset=%d dont_move=%d wp=%d wpc=%d\n",
-				    page_table[i].bytes_used,
-				    page_table[i].first_object_offset,
+				    page_bytes_used[i],
+				    page_first_object_offset[i],
 				    PAGE_DONT_MOVE(i), PAGE_WRITE_PROTECTED(i),
 				    PAGE_PROTECTED_CLEARED(i));
 			}
@@ -6879,6 +9201,23 @@ scan_weak_objects(void)
     weak_hash_tables = NIL;
 }
 
+/*
+ * Called when newspace looks done: check all the pending weak
+ * entries, in case one was kept alive by an object that didn't go
+ * through scavenge, and return the number of new areas to scavenge
+ * for those kept.
+ */
+static int
+weak_newspace_rescan(void)
+{
+    if (!weak_recheck_all())
+	return 0;
+
+    gc_alloc_update_page_tables(0, &boxed_region);
+    gc_alloc_update_page_tables(1, &unboxed_region);
+    return new_areas_index;
+}
+
 /* Do a complete scavenge of the newspace generation */
 static void
 scavenge_newspace_generation(int generation)
@@ -6901,7 +9240,7 @@ scavenge_newspace_generation(int generation)
 #if SC_NS_GEN_CK
     /* Clear the write_protected_cleared flags on all pages */
     for (i = 0; i < dynamic_space_pages; i++)
-	page_table[i].flags &= ~PAGE_WRITE_PROTECTED_CLEARED;
+	page_flags[i] &= ~PAGE_WRITE_PROTECTED_CLEARED;
 #endif
 
     /* Flush the current regions updating the tables. */
@@ -6948,7 +9287,8 @@ scavenge_newspace_generation(int generation)
     }
 #endif
 
-    while (current_new_areas_index > 0) {
+    while (current_new_areas_index > 0
+	   || (current_new_areas_index = weak_newspace_rescan()) > 0) {
 	/* Move the current to the previous new areas */
 	previous_new_areas = current_new_areas;
 	previous_new_areas_index = current_new_areas_index;
@@ -7068,7 +9408,7 @@ scavenge_newspace_generation(int generation)
      */
     for (i = 0; i < dynamic_space_pages; i++)
 	if (PAGE_ALLOCATED(i)
-	    && page_table[i].bytes_used != 0
+	    && page_bytes_used[i] != 0
 	    && PAGE_GENERATION(i) == generation
 	    && PAGE_WRITE_PROTECTED_CLEARED(i) && !PAGE_DONT_MOVE(i))
 	    fprintf(stderr,
@@ -7092,12 +9432,14 @@ scavenge_newspace_generation(int generation)
 static void
 unprotect_oldspace(void)
 {
+    int mmask = PAGE_ALLOCATED_MASK | PAGE_GENERATION_MASK;
+    int mflags = PAGE_ALLOCATED_MASK | from_space;
     int i;
 
-    for (i = 0; i < last_free_page; i++)
-	if (PAGE_ALLOCATED(i)
-	    && page_table[i].bytes_used != 0
-	    && PAGE_GENERATION(i) == from_space) {
+    for (i = next_page_with_flags(0, last_free_page, mmask, mflags);
+	 i < last_free_page;
+	 i = next_page_with_flags(i + 1, last_free_page, mmask, mflags))
+	if (page_bytes_used[i] != 0) {
 	    void *page_start;
 
 	    page_start = (void *) page_address(i);
@@ -7107,13 +9449,17 @@ unprotect_oldspace(void)
 	     * WP flag to avoid redundant calls.
 	     */
 	    if (PAGE_WRITE_PROTECTED(i)) {
-		os_protect((os_vm_address_t) page_start, GC_PAGE_SIZE,
-			   OS_VM_PROT_ALL);
-		page_table[i].flags &= ~PAGE_WRITE_PROTECTED_MASK;
+		if (!gencgc_soft_dirty)
+		    os_protect((os_vm_address_t) page_start, GC_PAGE_SIZE,
+			       OS_VM_PROT_ALL);
+		page_flags[i] &= ~PAGE_WRITE_PROTECTED_MASK;
 	    }
 	}
 }
 
+/* The number of pages the last free_oldspace freed. */
+static unsigned long oldspace_pages_freed;
+
 /*
  * Work through all the pages and free any in from_space.  This
  * assumes that all objects have been copied or promoted to an older
@@ -7127,15 +9473,19 @@ free_oldspace(void)
     int first_page, last_page;
 
     first_page = 0;
+    oldspace_pages_freed = 0;
 
     do {
 	/* Find a first page for the next region of pages. */
-	while ((first_page < last_free_page)
-               && (!PAGE_ALLOCATED(first_page)
-                   || page_table[first_page].bytes_used == 0
-                   || PAGE_GENERATION(first_page) != from_space)) {
-            first_page++;
-        }
+	for (;;) {
+	    first_page = next_page_with_flags(first_page, last_free_page,
+					      PAGE_ALLOCATED_MASK
+					      | PAGE_GENERATION_MASK,
+					      PAGE_ALLOCATED_MASK | from_space);
+	    if (first_page >= last_free_page || page_bytes_used[first_page] != 0)
+		break;
+	    first_page++;
+	}
 
 	if (first_page >= last_free_page)
 	    break;
@@ -7145,11 +9495,12 @@ free_oldspace(void)
 
 	do {
 	    /* Free the page */
-	    bytes_freed += page_table[last_page].bytes_used;
+	    bytes_freed += page_bytes_used[last_page];
 	    generations[PAGE_GENERATION(last_page)].bytes_allocated -=
-		page_table[last_page].bytes_used;
-	    page_table[last_page].flags &= ~PAGE_ALLOCATED_MASK;
-	    page_table[last_page].bytes_used = 0;
+		page_bytes_used[last_page];
+	    page_flags[last_page] &= ~PAGE_ALLOCATED_MASK;
+	    page_bytes_used[last_page] = 0;
+	    note_page(last_page);
 
 	    /*
 	     * Remove any write protection.  Should be able to rely on the
@@ -7159,16 +9510,18 @@ free_oldspace(void)
 		void *page_start = (void *) page_address(last_page);
 
 		if (PAGE_WRITE_PROTECTED(last_page)) {
-		    os_protect((os_vm_address_t) page_start, GC_PAGE_SIZE,
-			       OS_VM_PROT_ALL);
-		    page_table[last_page].flags &= ~PAGE_WRITE_PROTECTED_MASK;
+		    if (!gencgc_soft_dirty)
+			os_protect((os_vm_address_t) page_start, GC_PAGE_SIZE,
+				   OS_VM_PROT_ALL);
+		    page_flags[last_page] &= ~PAGE_WRITE_PROTECTED_MASK;
 		}
 	    }
 	    last_page++;
 	}
 	while (last_page < last_free_page && PAGE_ALLOCATED(last_page)
-	       && page_table[last_page].bytes_used != 0
+	       && page_bytes_used[last_page] != 0
 	       && PAGE_GENERATION(last_page) == from_space);
+	oldspace_pages_freed += last_page - first_page;
 
 	/* Zero pages from first_page to (last_page - 1) */
         switch (gencgc_unmap_zero) {
@@ -7201,6 +9554,12 @@ free_oldspace(void)
               int page;
               int *page_start;
 
+#ifdef __linux__
+              if (gencgc_huge_pages) {
+                  release_free_huge_pages(first_page, last_page);
+                  break;
+              }
+#endif
               if (gencgc_debug_madvise) {
                   fprintf(stderr, "ADVISING pages %d-%d\n", first_page, last_page - 1);
               }
@@ -7262,7 +9621,7 @@ print_ptr(lispobj * addr)
 		"  %lx: page %d  alloc %d unboxed %d gen %d  bytes_used %d  offset %d  dont_move %d\n",
 		(unsigned long) addr, pi1, PAGE_ALLOCATED(pi1),
 		PAGE_UNBOXED(pi1), PAGE_GENERATION(pi1),
-		page_table[pi1].bytes_used, page_table[pi1].first_object_offset,
+		page_bytes_used[pi1], page_first_object_offset[pi1],
 		PAGE_DONT_MOVE(pi1));
     fprintf(stderr, "  %lx %lx %lx %lx (%lx) %lx %lx %lx %lx\n", *(addr - 4),
 	    *(addr - 3), *(addr - 2), *(addr - 1), *(addr - 0), *(addr + 1),
@@ -7296,7 +9655,7 @@ verify_space(lispobj * start, size_t words)
 		 * page.  X Could check the offset too.
 		 */
 		if (PAGE_ALLOCATED(page_index)
-		    && page_table[page_index].bytes_used == 0) {
+		    && page_bytes_used[page_index] == 0) {
 		    fprintf(stderr, "*** Ptr %lx @ %lx sees free page.\n",
 			    (unsigned long) thing, (unsigned long) start);
 		    print_ptr(start);
@@ -7536,14 +9895,14 @@ verify_generation(int generation)
 
     for (i = 0; i < last_free_page; i++) {
 	if (PAGE_ALLOCATED(i)
-	    && page_table[i].bytes_used != 0
+	    && page_bytes_used[i] != 0
 	    && PAGE_GENERATION(i) == generation) {
 	    int last_page;
 	    int region_unboxed = PAGE_UNBOXED(i);
 
 	    /* This should be the start of a contiguous block */
 	    if (gc_assert_level > 0) {
-		gc_assert(page_table[i].first_object_offset == 0);
+		gc_assert(page_first_object_offset[i] == 0);
 	    }
 
 	    /*
@@ -7557,17 +9916,17 @@ verify_generation(int generation)
 	     */
 	    for (last_page = i;; last_page++)
 		/* Check if this is the last page in this contiguous block */
-		if (page_table[last_page].bytes_used < GC_PAGE_SIZE
+		if (page_bytes_used[last_page] < GC_PAGE_SIZE
 		    /* Or it is GC_PAGE_SIZE and is the last in the block */
 		    || !PAGE_ALLOCATED(last_page + 1)
 		    || PAGE_UNBOXED(last_page + 1) != region_unboxed
-		    || page_table[last_page + 1].bytes_used == 0
+		    || page_bytes_used[last_page + 1] == 0
 		    || PAGE_GENERATION(last_page + 1) != generation
-		    || page_table[last_page + 1].first_object_offset == 0)
+		    || page_first_object_offset[last_page + 1] == 0)
 		    break;
 
 	    verify_space((lispobj *) page_address(i),
-			 (page_table[last_page].bytes_used +
+			 (page_bytes_used[last_page] +
 			  GC_PAGE_SIZE * (last_page - i)) / sizeof(lispobj));
 	    i = last_page;
 	}
@@ -7592,12 +9951,12 @@ verify_zero_fill(void)
 		    fprintf(stderr, "** free page not zero @ %lx\n",
 			    (unsigned long) (start_addr + i));
 	} else {
-	    int free_bytes = GC_PAGE_SIZE - page_table[page].bytes_used;
+	    int free_bytes = GC_PAGE_SIZE - page_bytes_used[page];
 
 	    if (free_bytes > 0) {
 		unsigned long *start_addr =
 		    (unsigned long *) ((unsigned long) page_address(page)
-				       + page_table[page].bytes_used);
+				       + page_bytes_used[page]);
 		int size = free_bytes / sizeof(lispobj);
 		int i;
 
@@ -7625,6 +9984,223 @@ gencgc_verify_zero_fill(void)
     set_current_region_end((lispobj) boxed_region.end_addr);
 }
 
+/*
+ * Heap snapshots.  gc_write_heap_snapshot writes each object in the
+ * heap to a file with its type, its size and the addresses it points
+ * to, followed by the roots, without allocating in the Lisp heap.  All
+ * numbers in the file are little endian:
+ *
+ *   "CMUHEAP1", u64 start and u64 end of dynamic space
+ *   for each object:	'O', u64 address, u32 type, u32 size in bytes,
+ *			u32 number of pointers, that many u64 addresses
+ *   the roots:		'R', u32 number of roots, that many u64 addresses
+ *   'E'
+ *
+ * Objects come in address order.  The type is the header type, or 0
+ * for a cons.  Pointers may point anywhere inside the object they
+ * refer to, and are only written if they point into the heap; those of
+ * weak pointers are left out.  The roots are the pointers on the
+ * stacks and in the interrupt handlers.  Objects outside dynamic space
+ * are roots too.
+ */
+static FILE *snapshot_file;
+static uint64_t *snapshot_pointers = NULL;
+static unsigned long snapshot_count;
+static unsigned long snapshot_size = 0;
+static boolean snapshot_failed;
+
+static void
+snapshot_put(uint64_t value, int nbytes)
+{
+    while (nbytes-- > 0) {
+	putc(value & 0xff, snapshot_file);
+	value >>= 8;
+    }
+}
+
+static void
+snapshot_pointer(void *addr)
+{
+    lispobj obj = (lispobj) addr;
+
+    if (find_page_index(addr) == -1 && !static_space_p(obj)
+	&& !read_only_space_p(obj))
+	return;
+    if (snapshot_count == snapshot_size) {
+	unsigned long size = snapshot_size ? 2 * snapshot_size : 1024;
+	uint64_t *pointers = realloc(snapshot_pointers,
+				     size * sizeof(uint64_t));
+
+	if (pointers == NULL) {
+	    snapshot_failed = TRUE;
+	    return;
+	}
+	snapshot_pointers = pointers;
+	snapshot_size = size;
+    }
+    snapshot_pointers[snapshot_count++] = (unsigned long) PTR(obj);
+}
+
+static void
+snapshot_put_pointers(void)
+{
+    unsigned long i;
+
+    snapshot_put(snapshot_count, 4);
+    for (i = 0; i < snapshot_count; i++)
+	snapshot_put(snapshot_pointers[i], 8);
+}
+
+/* Write the objects in the given words; return how many there are. */
+static unsigned long
+snapshot_space(lispobj * start, long words)
+{
+    unsigned long objects = 0;
+
+    while (words > 0) {
+	lispobj thing = *start;
+	long count = CEILING(object_words(start), 2);
+	int type = cons_first_word_p(thing) ? 0 : TypeOf(thing);
+
+	snapshot_count = 0;
+	if (type != type_WeakPointer)
+	    map_space_pointers(start, count, snapshot_pointer,
+			       snapshot_pointer);
+	putc('O', snapshot_file);
+	snapshot_put((unsigned long) start, 8);
+	snapshot_put(type, 4);
+	snapshot_put(count * sizeof(lispobj), 4);
+	snapshot_put_pointers();
+
+	objects++;
+	start += count;
+	words -= count;
+    }
+    return objects;
+}
+
+static unsigned long
+snapshot_dynamic_space(void)
+{
+    unsigned long objects = 0;
+    int i;
+
+    for (i = 0; i < last_free_page; i++)
+	if (PAGE_ALLOCATED(i) && page_bytes_used[i] != 0
+	    && page_first_object_offset[i] == 0) {
+	    int last_page = block_last_page(i);
+
+	    objects += snapshot_space((lispobj *) page_address(i),
+				      (page_bytes_used[last_page]
+				       + GC_PAGE_SIZE * (last_page - i))
+				      / sizeof(lispobj));
+	    i = last_page;
+	}
+    return objects;
+}
+
+static void
+snapshot_roots(void)
+{
+    int i;
+
+    snapshot_count = 0;
+#if defined(i386) || defined(__x86_64)
+    {
+	lispobj **ptr;
+
+	/* Conservative roots, as garbage_collect_generation finds them. */
+	for (ptr = (lispobj **) control_stack_end - 1;
+	     ptr > (lispobj **) (void *) &i; ptr--)
+	    if (find_page_index(*ptr) != -1)
+		snapshot_pointer(*ptr);
+    }
+#else
+    map_space_pointers(control_stack,
+		       (lispobj *) current_control_stack_pointer
+		       - control_stack, snapshot_pointer, snapshot_pointer);
+#endif
+    map_space_pointers(binding_stack,
+		       (lispobj *) get_binding_stack_pointer() - binding_stack,
+		       snapshot_pointer, snapshot_pointer);
+    for (i = 0; i < NSIG; i++) {
+	union interrupt_handler handler = interrupt_handlers[i];
+
+	if (handler.c != (void (*)(HANDLER_ARGS)) SIG_IGN
+	    && handler.c != (void (*)(HANDLER_ARGS)) SIG_DFL)
+	    map_space_pointers((lispobj *) (interrupt_handlers + i), 1,
+			       snapshot_pointer, snapshot_pointer);
+    }
+    putc('R', snapshot_file);
+    snapshot_put_pointers();
+}
+
+/*
+ * Write a heap snapshot to the file path.  Return the number of
+ * objects written, or -1 if the file couldn't be written.  Called
+ * from Lisp with GC disabled.
+ */
+long
+gc_write_heap_snapshot(char *path)
+{
+    struct {
+	lispobj *start;
+	lispobj *end;
+    } spaces[3], tmp;
+    unsigned long objects = 0;
+    int i, j;
+
+    snapshot_file = fopen(path, "wb");
+    if (snapshot_file == NULL)
+	return -1;
+    snapshot_failed = FALSE;
+
+    /* Flush the alloc regions updating the tables. */
+    boxed_region.free_pointer = (void *) get_current_region_free();
+    gc_alloc_update_page_tables(0, &boxed_region);
+    gc_alloc_update_page_tables(1, &unboxed_region);
+
+    fputs("CMUHEAP1", snapshot_file);
+    snapshot_put((unsigned long) heap_base, 8);
+    snapshot_put((unsigned long) heap_base
+		 + (unsigned long) dynamic_space_pages * GC_PAGE_SIZE, 8);
+
+    /* Write the spaces in address order. */
+    spaces[0].start = (lispobj *) READ_ONLY_SPACE_START;
+    spaces[0].end = (lispobj *) SymbolValue(READ_ONLY_SPACE_FREE_POINTER);
+    spaces[1].start = static_space;
+    spaces[1].end = (lispobj *) SymbolValue(STATIC_SPACE_FREE_POINTER);
+    spaces[2].start = (lispobj *) heap_base;
+    spaces[2].end = NULL;
+    for (i = 0; i < 3; i++)
+	for (j = i + 1; j < 3; j++)
+	    if (spaces[j].start < spaces[i].start) {
+		tmp = spaces[i];
+		spaces[i] = spaces[j];
+		spaces[j] = tmp;
+	    }
+    for (i = 0; i < 3; i++)
+	if (spaces[i].end == NULL)
+	    objects += snapshot_dynamic_space();
+	else
+	    objects += snapshot_space(spaces[i].start,
+				      spaces[i].end - spaces[i].start);
+    snapshot_roots();
+    putc('E', snapshot_file);
+
+    set_current_region_free((lispobj) boxed_region.free_pointer);
+    set_current_region_end((lispobj) boxed_region.end_addr);
+
+    free(snapshot_pointers);
+    snapshot_pointers = NULL;
+    snapshot_size = 0;
+    if (ferror(snapshot_file))
+	snapshot_failed = TRUE;
+    if (fclose(snapshot_file) != 0)
+	snapshot_failed = TRUE;
+    return snapshot_failed ? -1 : (long) objects;
+}
+
 static void
 verify_dynamic_space(void)
 {
@@ -7646,25 +10222,28 @@ verify_dynamic_space(void)
 static void
 write_protect_generation_pages(int generation)
 {
+    int mmask = PAGE_ALLOCATED_MASK | PAGE_UNBOXED_MASK | PAGE_GENERATION_MASK;
+    int mflags = PAGE_ALLOCATED_MASK | generation;
     int i;
 
     if (gc_assert_level > 0) {
 	gc_assert(generation < NUM_GENERATIONS);
     }
 
-    for (i = 0; i < last_free_page; i++)
-	if (PAGE_ALLOCATED(i) && !PAGE_UNBOXED(i)
-	    && page_table[i].bytes_used != 0
-	    && PAGE_GENERATION(i) == generation) {
+    for (i = next_page_with_flags(0, last_free_page, mmask, mflags);
+	 i < last_free_page;
+	 i = next_page_with_flags(i + 1, last_free_page, mmask, mflags))
+	if (page_bytes_used[i] != 0) {
 	    void *page_start;
 
 	    page_start = (void *) page_address(i);
 
-	    os_protect((os_vm_address_t) page_start, GC_PAGE_SIZE,
-		       OS_VM_PROT_READ | OS_VM_PROT_EXECUTE);
+	    if (!gencgc_soft_dirty)
+		os_protect((os_vm_address_t) page_start, GC_PAGE_SIZE,
+			   OS_VM_PROT_READ | OS_VM_PROT_EXECUTE);
 
 	    /* Note the page as protected in the page tables */
-	    page_table[i].flags |= PAGE_WRITE_PROTECTED_MASK;
+	    page_flags[i] |= PAGE_WRITE_PROTECTED_MASK;
 	}
 
     if (gencgc_verbose > 1)
@@ -7684,35 +10263,350 @@ scavenge_interrupt_handlers(void)
 	   sizeof(interrupt_handlers));
 #endif
 
-    for (i = 0; i < NSIG; i++) {
-	union interrupt_handler handler = interrupt_handlers[i];
+    for (i = 0; i < NSIG; i++) {
+	union interrupt_handler handler = interrupt_handlers[i];
+
+	if (handler.c != (void (*)(HANDLER_ARGS)) SIG_IGN
+	    && handler.c != (void (*)(HANDLER_ARGS)) SIG_DFL)
+	    scavenge((interrupt_handlers + i), 1);
+    }
+}
+
+#if !(defined(i386) || defined(__x86_64))
+static void
+scavenge_control_stack(void)
+{
+    unsigned long current_stack_size;
+
+    current_stack_size = current_control_stack_pointer - control_stack;
+
+#ifdef PRINTNOISE
+    printf("Scavenging the control stack (%d bytes) ...\n",
+	   current_stack_size * sizeof(lispobj));
+#endif
+
+    scavenge(control_stack, current_stack_size);
+
+#ifdef PRINTNOISE
+    printf("Done scavenging the control stack.\n");
+#endif
+}
+#endif
+
+/*
+ * The generation the saved heap was loaded into by
+ * gc_load_page_table, or -1 if the core had no page table.
+ */
+static int core_generation = -1;
+
+/*
+ * Static space in shared core mode.  static_page_written has an entry
+ * for each write protected page of static space, and one more,
+ * always set, for the rest of the space, which may still grow.
+ * static_page_object holds the start of the object containing the
+ * start of each of these pages.
+ *
+ * A page not written since startup can only point to static and read
+ * only space and to the saved heap.  The saved heap stays in
+ * static_clean_generation until that generation is collected, so the
+ * unwritten pages only need scavenging then; if the GC writes them,
+ * the write barrier notes that as usual.  static_clean_generation is
+ * -1 when the core had no page table, and all of static space is
+ * scavenged every time.
+ */
+static unsigned char *static_page_written = NULL;
+static lispobj **static_page_object = NULL;
+static int static_clean_generation = -1;
+
+static char *
+static_page_address(int page)
+{
+    return (char *) static_space + page * GC_PAGE_SIZE;
+}
+
+/*
+ * Write protect static space up to its free pointer and start
+ * tracking writes to it.
+ */
+static void
+protect_static_space(void)
+{
+    lispobj *end = (lispobj *) SymbolValue(STATIC_SPACE_FREE_POINTER);
+    lispobj *obj = static_space;
+    int pages = ((char *) end - (char *) static_space) / GC_PAGE_SIZE;
+    int i;
+
+    static_page_written = malloc(pages + 1);
+    static_page_object = malloc((pages + 1) * sizeof(lispobj *));
+    if (static_page_written == NULL || static_page_object == NULL) {
+	fprintf(stderr,
+		"*W unable to allocate the static page table; static space not protected.\n");
+	free(static_page_written);
+	free(static_page_object);
+	static_page_written = NULL;
+	static_page_object = NULL;
+	return;
+    }
+
+    for (i = 0; i <= pages; i++) {
+	lispobj *page_start = (lispobj *) static_page_address(i);
+
+	while (obj < end && obj + CEILING(object_words(obj), 2) <= page_start)
+	    obj += CEILING(object_words(obj), 2);
+	static_page_object[i] = obj;
+	static_page_written[i] = i == pages;
+    }
+
+    os_protect((os_vm_address_t) static_space, pages * GC_PAGE_SIZE,
+	       OS_VM_PROT_READ | OS_VM_PROT_EXECUTE);
+    gc_static_pages = pages;
+    static_clean_generation = core_generation > 0 ? core_generation : -1;
+}
+
+/*
+ * Read-only space write tracking, in shared core mode: an entry for
+ * each page protected at startup, set once the page has been written
+ * and unprotected again.  Read-only space never points to dynamic
+ * space, so the written pages need no scavenging.
+ */
+static unsigned char *read_only_page_written = NULL;
+
+static void
+protect_read_only_space(void)
+{
+    lispobj *end = (lispobj *) SymbolValue(READ_ONLY_SPACE_FREE_POINTER);
+    int pages = CEILING((char *) end - (char *) read_only_space, GC_PAGE_SIZE)
+	/ GC_PAGE_SIZE;
+
+    read_only_page_written = calloc(pages + 1, 1);
+    if (read_only_page_written == NULL) {
+	fprintf(stderr,
+		"*W unable to allocate the read-only page table; read-only space not protected.\n");
+	return;
+    }
+    os_protect((os_vm_address_t) read_only_space, pages * GC_PAGE_SIZE,
+	       OS_VM_PROT_READ | OS_VM_PROT_EXECUTE);
+    gc_read_only_pages = pages;
+    gc_read_only_pages_written = 0;
+}
+
+/*
+ * The write barrier for read-only space: unprotect the written page
+ * and note it.  Returns 1 if addr was in a protected read-only page.
+ */
+static int
+read_only_write_barrier(void *addr)
+{
+    long page = ((char *) addr - (char *) read_only_space) / GC_PAGE_SIZE;
+
+    if (read_only_page_written == NULL
+	|| (char *) addr < (char *) read_only_space
+	|| page >= gc_read_only_pages || read_only_page_written[page])
+	return 0;
+
+    os_protect((os_vm_address_t) ((char *) read_only_space
+				  + page * GC_PAGE_SIZE),
+	       GC_PAGE_SIZE, OS_VM_PROT_ALL);
+    read_only_page_written[page] = 1;
+    gc_read_only_pages_written++;
+
+    return 1;
+}
+
+/*
+ * Map read-only space read only and write protect static space; see
+ * gencgc_shared_core.  Called at startup once the page fault handler
+ * is installed.
+ */
+void
+gencgc_protect_shared_core(void)
+{
+    protect_read_only_space();
+    protect_static_space();
+}
+
+/*
+ * The write barrier for static space: unprotect the written page and
+ * note it.  Returns 1 if addr was in a protected static page.
+ */
+static int
+static_write_barrier(void *addr)
+{
+    long page = ((char *) addr - (char *) static_space) / GC_PAGE_SIZE;
+
+    if (static_page_written == NULL || (char *) addr < (char *) static_space
+	|| page >= gc_static_pages || static_page_written[page])
+	return 0;
+
+    os_protect((os_vm_address_t) static_page_address(page), GC_PAGE_SIZE,
+	       OS_VM_PROT_ALL);
+    static_page_written[page] = 1;
+    gc_static_pages_written++;
+
+    return 1;
+}
+
+/*
+ * Scavenge static space for a GC of generation.  In shared core mode
+ * only the written pages are scavenged, unless generation may hold
+ * objects the unwritten pages point to.
+ */
+static void
+scavenge_static_space(int generation, int raise)
+{
+    lispobj *end = (lispobj *) SymbolValue(STATIC_SPACE_FREE_POINTER);
+    int page;
+
+    if (static_page_written == NULL || static_clean_generation < 0
+	|| generation == static_clean_generation) {
+	scavenge(static_space, end - static_space);
+	if (static_page_written != NULL && generation == static_clean_generation
+	    && raise)
+	    static_clean_generation++;
+	return;
+    }
+
+    for (page = 0; page <= gc_static_pages; page++)
+	if (static_page_written[page]) {
+	    lispobj *start = static_page_object[page];
+	    lispobj *stop = end;
+
+	    while (page < gc_static_pages && static_page_written[page + 1])
+		page++;
+	    if (page < gc_static_pages && static_page_object[page + 1] < end) {
+		lispobj *obj = static_page_object[page + 1];
+
+		stop = obj + CEILING(object_words(obj), 2);
+	    }
+	    scavenge(start, stop - start);
+	}
+}
+
+/*
+ * GC events.  Each generation collected by collect_garbage is
+ * recorded in gc_event_ring with the time spent in each phase, the
+ * write protection at the end of collect_garbage being counted in the
+ * event of the last generation.  Times are in nanoseconds from the
+ * monotonic clock.
+ *
+ * Lisp reads the ring with gc_event_read while it runs, without
+ * stopping the GC threads or disabling GC.  Each entry has a sequence
+ * word that is odd while the entry is being written and 2n + 2 once
+ * it holds event n, so a reader can tell a stale or torn copy.
+ */
+enum gc_phase {
+    GC_PHASE_PREPARE,		/* setup, and mark-region marking */
+    GC_PHASE_STACKS,		/* the conservative stack scan */
+    GC_PHASE_ROOTS,		/* the other roots and static space */
+    GC_PHASE_OLDER,		/* scavenge_generation of the others */
+    GC_PHASE_NEWSPACE,		/* scavenge_newspace_generation */
+    GC_PHASE_WEAK,		/* weak pointers and weak tables */
+    GC_PHASE_FREE,		/* free_oldspace and the page tables */
+    GC_PHASE_PROTECT,		/* write_protect_generation_pages */
+    GC_PHASES
+};
+
+struct gc_event {
+    unsigned long long seq;
+    /* The rest is what gc_event_read copies, in this order. */
+    unsigned long long collection;
+    unsigned long long generation;
+    unsigned long long raise;
+    unsigned long long start_nsec;
+    unsigned long long end_nsec;
+    /* Bytes copied or promoted into new_space. */
+    unsigned long long bytes_copied;
+    unsigned long long bytes_freed;
+    unsigned long long pages_freed;
+    unsigned long long phase_nsec[GC_PHASES];
+};
+
+#define GC_EVENTS 256
+#define GC_EVENT_WORDS \
+    (sizeof(struct gc_event) / sizeof(unsigned long long) - 1)
+
+static struct gc_event gc_event_ring[GC_EVENTS];
+
+/* The event being recorded, and the end of its last phase. */
+static struct gc_event gc_event_current;
+static boolean gc_event_pending = FALSE;
+static unsigned long long gc_event_mark;
 
-	if (handler.c != (void (*)(HANDLER_ARGS)) SIG_IGN
-	    && handler.c != (void (*)(HANDLER_ARGS)) SIG_DFL)
-	    scavenge((interrupt_handlers + i), 1);
-    }
+/* The number of collect_garbage calls so far. */
+static unsigned long long gc_event_collections = 0;
+
+static void
+gc_event_publish(void)
+{
+    unsigned long long n = gc_events_written;
+    struct gc_event *event = &gc_event_ring[n % GC_EVENTS];
+
+    if (!gc_event_pending)
+	return;
+    gc_event_pending = FALSE;
+    gc_event_current.end_nsec = gc_event_mark;
+    gc_event_current.seq = 2 * n + 2;
+
+    event->seq = 2 * n + 1;
+    __sync_synchronize();
+    memcpy((char *) event + sizeof(event->seq),
+	   (char *) &gc_event_current + sizeof(event->seq),
+	   GC_EVENT_WORDS * sizeof(unsigned long long));
+    __sync_synchronize();
+    event->seq = 2 * n + 2;
+    gc_events_written = n + 1;
 }
 
-#if !(defined(i386) || defined(__x86_64))
+/*
+ * Start recording the GC of generation, publishing the event of the
+ * generation before it.
+ */
 static void
-scavenge_control_stack(void)
+gc_event_begin(int generation, int raise)
 {
-    unsigned long current_stack_size;
+    gc_event_publish();
+    memset(&gc_event_current, 0, sizeof(gc_event_current));
+    gc_event_current.collection = gc_event_collections;
+    gc_event_current.generation = generation;
+    gc_event_current.raise = raise;
+    gc_event_mark = gc_time_nsec();
+    gc_event_current.start_nsec = gc_event_mark;
+    gc_event_pending = TRUE;
+}
 
-    current_stack_size = current_control_stack_pointer - control_stack;
+/* Count the time since the end of the last phase in phase. */
+static void
+gc_event_phase(enum gc_phase phase)
+{
+    unsigned long long now = gc_time_nsec();
 
-#ifdef PRINTNOISE
-    printf("Scavenging the control stack (%d bytes) ...\n",
-	   current_stack_size * sizeof(lispobj));
-#endif
+    gc_event_current.phase_nsec[phase] += now - gc_event_mark;
+    gc_event_mark = now;
+}
 
-    scavenge(control_stack, current_stack_size);
+/*
+ * Copy event n into out, which has room for words words: its
+ * collection number, generation, raise, start and end times, bytes
+ * copied, bytes and pages freed, and the time of each phase.  Return
+ * the number of words copied, or 0 if the event isn't in the ring,
+ * either not written yet or overwritten.
+ */
+int
+gc_event_read(unsigned long long n, unsigned long long *out, int words)
+{
+    struct gc_event *event = &gc_event_ring[n % GC_EVENTS];
+    unsigned long long seq = event->seq;
 
-#ifdef PRINTNOISE
-    printf("Done scavenging the control stack.\n");
-#endif
+    if (words > GC_EVENT_WORDS)
+	words = GC_EVENT_WORDS;
+    if (seq != 2 * n + 2)
+	return 0;
+    __sync_synchronize();
+    memcpy(out, (char *) event + sizeof(event->seq),
+	   words * sizeof(unsigned long long));
+    __sync_synchronize();
+    return event->seq == seq ? words : 0;
 }
-#endif
 
 /*
  * Garbage collect a generation. If raise is 0 the remains of the
@@ -7723,6 +10617,11 @@ garbage_collect_generation(int generation, int raise)
 {
     unsigned long i;
     unsigned long static_space_size;
+    unsigned long long stack_scan_start;
+    unsigned long new_space_bytes;
+#if defined(i386) || defined(__x86_64)
+    boolean mark_region = FALSE;
+#endif
 
 #if defined(i386) || defined(__x86_64)
     invalid_stack_start = (void *) control_stack;
@@ -7742,6 +10641,7 @@ garbage_collect_generation(int generation, int raise)
     /* Initialise the weak pointer list. */
     weak_pointers = NULL;
     weak_hash_tables = NIL;
+    clear_weak_pending();
 
     /*
      * When a generation is not being raised it is transported to a
@@ -7767,6 +10667,7 @@ garbage_collect_generation(int generation, int raise)
      */
 
     gc_alloc_generation = new_space;
+    new_space_bytes = generations[new_space].bytes_allocated;
     generations[new_space].alloc_start_page = 0;
     generations[new_space].alloc_unboxed_start_page = 0;
     generations[new_space].alloc_large_start_page = 0;
@@ -7777,7 +10678,7 @@ garbage_collect_generation(int generation, int raise)
      * pages need to be cleared.
      */
     for (i = 0; i < last_free_page; i++)
-	page_table[i].flags &= ~PAGE_DONT_MOVE_MASK;
+	page_flags[i] &= ~PAGE_DONT_MOVE_MASK;
 
     /*
      * Un-write-protect the old-space pages. This is essential for the
@@ -7788,6 +10689,27 @@ garbage_collect_generation(int generation, int raise)
      */
     unprotect_oldspace();
 
+#if defined(i386) || defined(__x86_64)
+    object_start_new_epoch();
+
+    /* Mark the oldest generation so its dense blocks can stay put. */
+    if (satb_state != SATB_OFF && from_space == mark_generation) {
+	if (!raise && generation == gencgc_oldest_gen_to_gc)
+	    mark_region = satb_finish();
+	else
+	    satb_stop();
+    } else if (gencgc_mark_region && !raise
+	&& generation == gencgc_oldest_gen_to_gc) {
+	unsigned long long mark_start = gc_time_usec();
+
+	mark_region = mark_region_mark(&raise);
+	gc_mark_region_usec += gc_time_usec() - mark_start;
+    }
+#endif
+
+    gc_event_phase(GC_PHASE_PREPARE);
+    stack_scan_start = gc_time_usec();
+
 #if defined(i386) || defined(__x86_64)
     /* Scavenge the stacks conservative roots. */
     {
@@ -7800,7 +10722,26 @@ garbage_collect_generation(int generation, int raise)
 #endif
 
 #ifdef CONTROL_STACKS
-    scavenge_thread_stacks();
+    scavenge_thread_stacks(preserve_pointer);
+#endif
+
+    gc_last_stack_scan_usec = gc_time_usec() - stack_scan_start;
+    gc_stack_scan_usec += gc_last_stack_scan_usec;
+    gc_event_phase(GC_PHASE_STACKS);
+
+#if defined(i386) || defined(__x86_64)
+    if (mark_region) {
+	unsigned long long pages = gc_mark_region_pages;
+	unsigned long long filled = gc_mark_region_filled_bytes;
+
+	mark_region_keep_dense_blocks();
+	if (gencgc_verbose > 1)
+	    fprintf(stderr,
+		    "Mark-region: %llu pages kept in place, %llu bytes filled\n",
+		    gc_mark_region_pages - pages,
+		    gc_mark_region_filled_bytes - filled);
+	mark_snapshot = FALSE;
+    }
 #endif
 
     if (gencgc_verbose > 1) {
@@ -7870,7 +10811,8 @@ garbage_collect_generation(int generation, int raise)
     if (gencgc_verbose > 1)
 	fprintf(stderr, "Scavenge static space: %ld bytes\n",
 		static_space_size * sizeof(lispobj));
-    scavenge(static_space, static_space_size);
+    scavenge_static_space(generation, raise);
+    gc_event_phase(GC_PHASE_ROOTS);
 
     /*
      * All generations but the generation being GCed need to be
@@ -7880,15 +10822,18 @@ garbage_collect_generation(int generation, int raise)
     for (i = 0; i < NUM_GENERATIONS; i++)
 	if (i != generation && i != new_space)
 	    scavenge_generation(i);
+    gc_event_phase(GC_PHASE_OLDER);
 
     /*
      * Finally scavenge the new_space generation.  Keep going until no
      * more objects are moved into the new generation.
      */
     scavenge_newspace_generation(new_space);
+    gc_event_phase(GC_PHASE_NEWSPACE);
 
     /* I think we should do this *before* the rescan check */
     scan_weak_objects();
+    gc_event_phase(GC_PHASE_WEAK);
 
 #define RESCAN_CHECK 0
 #if RESCAN_CHECK
@@ -7922,18 +10867,25 @@ garbage_collect_generation(int generation, int raise)
     gc_alloc_update_page_tables(0, &boxed_region);
     gc_alloc_update_page_tables(1, &unboxed_region);
 
+    gc_event_current.bytes_copied =
+	generations[new_space].bytes_allocated - new_space_bytes;
+
     /* Free the pages in oldspace, but not those marked dont_move. */
-    free_oldspace();
+    gc_event_current.bytes_freed = free_oldspace();
+    gc_event_current.pages_freed = oldspace_pages_freed;
 
     /*
      * If the GC is not raising the age then lower the generation back
-     * to its normal generation number.
+     * to its normal generation number.  Either way, index the room
+     * left on the new_space pages, including those kept in place.
      */
+    for (i = 0; i < last_free_page; i++)
+	if (page_bytes_used[i] != 0 && PAGE_GENERATION(i) == new_space) {
+	    if (!raise)
+		PAGE_FLAGS_UPDATE(i, PAGE_GENERATION_MASK, generation);
+	    note_page(i);
+	}
     if (!raise) {
-	for (i = 0; i < last_free_page; i++)
-	    if (page_table[i].bytes_used != 0
-		&& PAGE_GENERATION(i) == NUM_GENERATIONS)
-		    PAGE_FLAGS_UPDATE(i, PAGE_GENERATION_MASK, generation);
 	if (gc_assert_level > 0) {
 	    gc_assert(generations[generation].bytes_allocated == 0);
 	}
@@ -7967,6 +10919,8 @@ garbage_collect_generation(int generation, int raise)
     else
 	/* Else increase it. */
 	generations[generation].num_gc++;
+
+    gc_event_phase(GC_PHASE_FREE);
 }
 
 /* Update last_free_page then ALLOCATION_POINTER */
@@ -7977,7 +10931,7 @@ update_dynamic_space_free_pointer(void)
     int i;
 
     for (i = 0; i < dynamic_space_pages; i++)
-	if (PAGE_ALLOCATED(i) && page_table[i].bytes_used != 0)
+	if (PAGE_ALLOCATED(i) && page_bytes_used[i] != 0)
 	    last_page = i;
 
     last_free_page = last_page + 1;
@@ -7987,6 +10941,111 @@ update_dynamic_space_free_pointer(void)
 }
 
 
+/*
+ * The GC policy; see gencgc_pause_target_usec.  Called at the end of
+ * each GC that started at start_usec.  Generation 0 held
+ * nursery_bytes and the older generations older_bytes when it
+ * started, and nursery_only is true if no older generation was
+ * collected.
+ */
+static void
+gc_policy_update(unsigned long long start_usec, unsigned long nursery_bytes,
+		 unsigned long older_bytes, boolean nursery_only)
+{
+    static unsigned long long last_end_usec = 0;
+    unsigned long long end_usec = gc_time_usec();
+    unsigned long pause = end_usec - start_usec;
+    unsigned long max_bytes = gencgc_nursery_max_bytes;
+    double nursery;
+    int gc_time;
+
+    if (last_end_usec != 0) {
+	gc_time = 100.0 * pause / (end_usec - last_end_usec + 1);
+	gc_policy_gc_time = (3 * gc_policy_gc_time + gc_time) / 4;
+    }
+    last_end_usec = end_usec;
+
+    if (gencgc_pause_target_usec == 0 && gencgc_gc_time_target == 0) {
+	gc_policy_nursery_bytes = 0;
+	if (gc_policy_active) {
+	    generations[0].trigger_age = gc_policy_saved_trigger_age;
+	    generations[1].bytes_consed_between_gc = gc_policy_saved_bytes_consed;
+	    gc_policy_active = FALSE;
+	}
+	return;
+    }
+    if (!nursery_only || nursery_bytes == 0)
+	return;
+
+    if (!gc_policy_active) {
+	gc_policy_saved_trigger_age = generations[0].trigger_age;
+	gc_policy_saved_bytes_consed = generations[1].bytes_consed_between_gc;
+	gc_policy_active = TRUE;
+    }
+
+    if (gc_policy_pause_usec == 0)
+	gc_policy_pause_usec = pause;
+    else
+	gc_policy_pause_usec = (3 * gc_policy_pause_usec + pause) / 4;
+    if (bytes_allocated > older_bytes) {
+	int survival = 100.0 * (bytes_allocated - older_bytes) / nursery_bytes;
+
+	gc_policy_survival = (3 * gc_policy_survival + survival) / 4;
+    }
+
+    /*
+     * Nursery GC pauses grow with the survivors, so scale the nursery
+     * in proportion to the pause, and let it grow only as far as the
+     * pause target allows.
+     */
+    nursery = gc_policy_nursery_bytes ? gc_policy_nursery_bytes : nursery_bytes;
+    if (gencgc_pause_target_usec && gc_policy_pause_usec > gencgc_pause_target_usec) {
+	nursery *= (double) gencgc_pause_target_usec / gc_policy_pause_usec;
+	if (nursery < gc_policy_nursery_bytes / 2)
+	    nursery = gc_policy_nursery_bytes / 2;
+    } else if (gencgc_gc_time_target && gc_policy_gc_time > gencgc_gc_time_target) {
+	double grow = 1.5;
+
+	if (gencgc_pause_target_usec
+	    && grow * gc_policy_pause_usec > gencgc_pause_target_usec)
+	    grow = (double) gencgc_pause_target_usec / gc_policy_pause_usec;
+	nursery *= grow;
+    } else if (gencgc_pause_target_usec
+	       && gc_policy_pause_usec < gencgc_pause_target_usec / 2) {
+	nursery *= 1.25;
+    } else if (gencgc_pause_target_usec == 0
+	       && gc_policy_gc_time < gencgc_gc_time_target / 2) {
+	/* Well under the GC time target; give the memory back. */
+	nursery *= 0.875;
+    }
+
+    if (max_bytes == 0)
+	max_bytes = dynamic_space_size / 8;
+    if (nursery > max_bytes)
+	nursery = max_bytes;
+    if (nursery < gencgc_nursery_min_bytes)
+	nursery = gencgc_nursery_min_bytes;
+    gc_policy_nursery_bytes = nursery;
+
+    /*
+     * When most of the nursery survives, promote it at once instead of
+     * copying it again; when little does, keep the survivors another
+     * GC so more of them die young.  Generation 1 is then collected
+     * about once per nursery's worth of promotions.
+     */
+    if (gc_policy_survival > 50)
+	generations[0].trigger_age = 0;
+    else if (gc_policy_survival < 10)
+	generations[0].trigger_age = 2;
+    else
+	generations[0].trigger_age = 1;
+    generations[1].bytes_consed_between_gc = gc_policy_nursery_bytes;
+
+    gc_policy_updates++;
+}
+
+static void alloc_sample_gc(void);
+
 /*
  * GC all generations below last_gen, raising their objects to the
  * next generation until all generations below last_gen are empty.
@@ -8004,8 +11063,12 @@ collect_garbage(unsigned last_gen)
     int raise;
     int gen_to_wp;
     int i;
+    struct alloc_context *mutator_context = current_alloc_context;
+    unsigned long long start_usec = gc_time_usec();
+    unsigned long nursery_bytes, older_bytes;
 
     boxed_region.free_pointer = (void *) get_current_region_free();
+    alloc_sample_gc();
 
     /* Check last_gen */
     if (last_gen > NUM_GENERATIONS) {
@@ -8016,8 +11079,16 @@ collect_garbage(unsigned last_gen)
     }
 
     /* Flush the alloc regions updating the tables. */
-    gc_alloc_update_page_tables(0, &boxed_region);
-    gc_alloc_update_page_tables(1, &unboxed_region);
+    close_alloc_contexts();
+    current_alloc_context = &main_alloc_context;
+    nursery_bytes = generations[0].bytes_allocated;
+    older_bytes = bytes_allocated - nursery_bytes;
+
+#ifdef __linux__
+    /* Forget the write protection of pages written since the last GC. */
+    if (gencgc_soft_dirty)
+	soft_dirty_unprotect_written_pages();
+#endif
 
     /* Verify the new objects created by lisp code. */
     if (pre_verify_gen_0) {
@@ -8031,6 +11102,7 @@ collect_garbage(unsigned last_gen)
 	print_generation_stats(0);
 
     scavenger_hooks = (struct scavenger_hook *) NIL;
+    gc_event_collections++;
 
     do {
 	/* Collect the generation */
@@ -8062,6 +11134,7 @@ collect_garbage(unsigned last_gen)
 	    generations[gen + 1].cum_sum_bytes_allocated +=
 		generations[gen + 1].bytes_allocated;
 
+	gc_event_begin(gen, raise);
 	garbage_collect_generation(gen, raise);
 
 	/* Reset the memory age cum_sum */
@@ -8109,6 +11182,14 @@ collect_garbage(unsigned last_gen)
 
 	write_protect_generation_pages(gen_to_wp);
     }
+    gc_event_phase(GC_PHASE_PROTECT);
+    gc_event_publish();
+
+#ifdef __linux__
+    /* Start tracking writes from here; the scavenger hooks may write. */
+    if (gencgc_soft_dirty)
+	soft_dirty_reset();
+#endif
 
     /*
      * Set gc_alloc back to generation 0. The current regions should be
@@ -8118,12 +11199,18 @@ collect_garbage(unsigned last_gen)
 	gc_assert(boxed_region.free_pointer - boxed_region.start_addr == 0);
     }
     gc_alloc_generation = 0;
+    current_alloc_context = mutator_context;
 
     update_dynamic_space_free_pointer();
+    large_runs_rebuild();
 
     set_current_region_free((lispobj) boxed_region.free_pointer);
     set_current_region_end((lispobj) boxed_region.end_addr);
 
+#if defined(i386) || defined(__x86_64)
+    satb_maybe_start(&last_gen);
+#endif
+
     /* Call the scavenger hook functions */
     {
 	struct scavenger_hook *sh;
@@ -8144,6 +11231,8 @@ collect_garbage(unsigned last_gen)
 	}
 	scavenger_hooks = (struct scavenger_hook *) NIL;
     }
+
+    gc_policy_update(start_usec, nursery_bytes, older_bytes, gen == 1);
 }
 
 
@@ -8174,15 +11263,16 @@ gc_free_heap(void)
 	     * write protected - except that the generation is used for the
 	     * current region but it sets that up.
 	     */
-	    page_table[page].flags &= ~PAGE_ALLOCATED_MASK;
-	    page_table[page].bytes_used = 0;
+	    page_flags[page] &= ~PAGE_ALLOCATED_MASK;
+	    page_bytes_used[page] = 0;
+	    note_page(page);
 
 	    /* Zero the page. */
 	    page_start = (void *) page_address(page);
 
 	    /* First remove any write protection */
 	    os_protect((os_vm_address_t) page_start, GC_PAGE_SIZE, OS_VM_PROT_ALL);
-	    page_table[page].flags &= ~PAGE_WRITE_PROTECTED_MASK;
+	    page_flags[page] &= ~PAGE_WRITE_PROTECTED_MASK;
 
             switch (gencgc_unmap_zero) {
               case MODE_MAP:
@@ -8212,7 +11302,7 @@ gc_free_heap(void)
              */
 	    if (gc_assert_level > 0) {
 		gc_assert(!PAGE_ALLOCATED(page));
-		gc_assert(page_table[page].bytes_used == 0);
+		gc_assert(page_bytes_used[page] == 0);
 	    }
 
             page_start = (int *) page_address(page);
@@ -8246,19 +11336,12 @@ gc_free_heap(void)
 
     /* Initialise gc_alloc */
     gc_alloc_generation = 0;
-    boxed_region.first_page = 0;
-    boxed_region.last_page = -1;
-    boxed_region.start_addr = page_address(0);
-    boxed_region.free_pointer = page_address(0);
-    boxed_region.end_addr = page_address(0);
-
-    unboxed_region.first_page = 0;
-    unboxed_region.last_page = -1;
-    unboxed_region.start_addr = page_address(0);
-    unboxed_region.free_pointer = page_address(0);
-    unboxed_region.end_addr = page_address(0);
+    current_alloc_context = &main_alloc_context;
+    alloc_context_reset(&main_alloc_context);
+    memset(page_claim, 0, dynamic_space_pages);
 
     last_free_page = 0;
+    large_runs_rebuild();
 
     set_alloc_pointer((lispobj) heap_base);
 
@@ -8287,23 +11370,62 @@ gc_init(void)
     /* The number of pages needed for the dynamic space - rounding up. */
     dynamic_space_pages = (dynamic_space_size + (GC_PAGE_SIZE - 1)) / GC_PAGE_SIZE;
 
-    page_table =
-        (struct page *) malloc(dynamic_space_pages * sizeof(struct page));
-    if (page_table == NULL) {
+    page_flags = malloc(dynamic_space_pages * sizeof(page_flags_t));
+    page_first_object_offset = malloc(dynamic_space_pages * sizeof(int));
+    page_bytes_used = malloc(dynamic_space_pages * sizeof(unsigned short));
+    if (page_flags == NULL || page_first_object_offset == NULL
+	|| page_bytes_used == NULL) {
 	fprintf(stderr, "Unable to allocate page table.\n");
 	exit(1);
     }
 
+    page_claim = calloc(dynamic_space_pages, 1);
+    if (page_claim == NULL) {
+	fprintf(stderr, "Unable to allocate page claim table.\n");
+	exit(1);
+    }
+
+    /* All pages start free. */
+    page_index_init(&free_page_index, TRUE);
+    for (i = 0; i <= NUM_GENERATIONS; i++) {
+	page_index_init(&partial_page_index[i][0], FALSE);
+	page_index_init(&partial_page_index[i][1], FALSE);
+    }
+
+#if defined(i386) || defined(__x86_64)
+    object_start_init();
+#endif
+
+#ifdef __linux__
+    if (gencgc_soft_dirty && !soft_dirty_init()) {
+	fprintf(stderr,
+		"Note:  soft-dirty page tracking is not available; using page protection.\n");
+	gencgc_soft_dirty = FALSE;
+    }
+    if (gencgc_huge_pages) {
+	if (huge_pages_init())
+	    gencgc_unmap_zero = MODE_MADVISE;
+	else {
+	    fprintf(stderr,
+		    "Note:  transparent huge pages are not available.\n");
+	    gencgc_huge_pages = FALSE;
+	}
+    }
+#else
+    gencgc_soft_dirty = FALSE;
+    gencgc_huge_pages = FALSE;
+#endif
+
     /* Initialise each page structure. */
 
     for (i = 0; i < dynamic_space_pages; i++) {
 	/* Initial all pages as free. */
-        page_table[i].flags = 0;
-	page_table[i].flags &= ~PAGE_ALLOCATED_MASK;
-	page_table[i].bytes_used = 0;
+        page_flags[i] = 0;
+	page_flags[i] &= ~PAGE_ALLOCATED_MASK;
+	page_bytes_used[i] = 0;
 
 	/* Pages are not write protected at startup. */
-	page_table[i].flags &= ~PAGE_WRITE_PROTECTED_MASK;
+	page_flags[i] &= ~PAGE_WRITE_PROTECTED_MASK;
     }
 
     bytes_allocated = 0;
@@ -8326,17 +11448,8 @@ gc_init(void)
 
     /* Initialise gc_alloc */
     gc_alloc_generation = 0;
-    boxed_region.first_page = 0;
-    boxed_region.last_page = -1;
-    boxed_region.start_addr = page_address(0);
-    boxed_region.free_pointer = page_address(0);
-    boxed_region.end_addr = page_address(0);
-
-    unboxed_region.first_page = 0;
-    unboxed_region.last_page = -1;
-    unboxed_region.start_addr = page_address(0);
-    unboxed_region.free_pointer = page_address(0);
-    unboxed_region.end_addr = page_address(0);
+    current_alloc_context = &main_alloc_context;
+    alloc_context_reset(&main_alloc_context);
 
     last_free_page = 0;
 
@@ -8352,6 +11465,114 @@ gc_init(void)
  * XX A scan is needed to identify the closest first objects for pages.
  */
 
+/*
+ * Return the page table of the dynamic space up to the allocation
+ * pointer as it is to be saved in a core: a malloc'ed block of
+ * *npages core_pages followed by *ngenerations core_generations,
+ * *bytes long.  The caller frees it.  Returns NULL if it can't be
+ * allocated; the core is then saved without a page table.
+ */
+void *
+gc_save_page_table(int *npages, int *ngenerations, long *bytes)
+{
+    int n = ((char *) get_alloc_pointer() - heap_base + GC_PAGE_SIZE - 1)
+	/ GC_PAGE_SIZE;
+    struct core_page *pages;
+    struct core_generation *gens;
+    int i;
+
+    *npages = n;
+    *ngenerations = NUM_GENERATIONS;
+    *bytes = n * sizeof(struct core_page)
+	+ NUM_GENERATIONS * sizeof(struct core_generation);
+    pages = malloc(*bytes);
+    if (pages == NULL)
+	return NULL;
+
+    for (i = 0; i < n; i++) {
+	/* Protection and the flags only used during a GC aren't saved. */
+	pages[i].flags = PAGE_FLAGS(i, PAGE_ALLOCATED_MASK | PAGE_UNBOXED_MASK
+				    | PAGE_LARGE_OBJECT_MASK
+				    | PAGE_GENERATION_MASK);
+	pages[i].bytes_used = page_bytes_used[i];
+	pages[i].first_object_offset = page_first_object_offset[i];
+    }
+
+    gens = (struct core_generation *) (pages + n);
+    for (i = 0; i < NUM_GENERATIONS; i++) {
+	gens[i].bytes_allocated = generations[i].bytes_allocated;
+	gens[i].num_gc = generations[i].num_gc;
+	gens[i].cum_sum_bytes_allocated = generations[i].cum_sum_bytes_allocated;
+	gens[i].unused = 0;
+    }
+
+    return pages;
+}
+
+/*
+ * Load the page table saved by gc_save_page_table for the npages
+ * pages of the dynamic space just mapped from a core, followed by the
+ * statistics of ngenerations generations.  The pages keep
+ * their boxed, unboxed and large object kinds, but all of them go
+ * into the oldest generation found among them: the pages of one
+ * generation may point to objects of a younger one, so only a single
+ * generation can be write protected as a whole by
+ * gencgc_pickup_dynamic.  The statistics of that generation are taken
+ * from the core.
+ */
+void
+gc_load_page_table(void *data, int npages, int ngenerations)
+{
+    struct core_page *pages = data;
+    struct core_generation *gens;
+    int gen = 0;
+    int i;
+
+    if (npages > dynamic_space_pages) {
+	fprintf(stderr,
+		"*W core page table has %d pages, more than the dynamic space; ignored.\n",
+		npages);
+	return;
+    }
+
+    for (i = 0; i < npages; i++)
+	if ((pages[i].flags & PAGE_ALLOCATED_MASK)
+	    && (pages[i].flags & PAGE_GENERATION_MASK) > gen)
+	    gen = pages[i].flags & PAGE_GENERATION_MASK;
+    if (gen >= NUM_GENERATIONS)
+	gen = NUM_GENERATIONS - 1;
+
+    bytes_allocated = 0;
+    for (i = 0; i < npages; i++) {
+	page_flags[i] = pages[i].flags & ~PAGE_GENERATION_MASK;
+	if (page_flags[i] & PAGE_ALLOCATED_MASK)
+	    page_flags[i] |= gen;
+	page_bytes_used[i] = pages[i].bytes_used;
+	page_first_object_offset[i] = pages[i].first_object_offset;
+	bytes_allocated += page_bytes_used[i];
+	note_page(i);
+    }
+    last_free_page = npages;
+
+    generations[gen].bytes_allocated = bytes_allocated;
+    generations[gen].gc_trigger =
+	bytes_allocated + generations[gen].bytes_consed_between_gc;
+    if (gen < ngenerations) {
+	gens = (struct core_generation *) (pages + npages);
+	generations[gen].num_gc = gens[gen].num_gc;
+	generations[gen].cum_sum_bytes_allocated =
+	    gens[gen].cum_sum_bytes_allocated;
+    }
+
+    core_generation = gen;
+}
+
+/*
+ * Set up the page table for the dynamic space loaded from the core.
+ * If the core had a page table, gc_load_page_table has already filled
+ * it in, and the saved heap only needs write protecting.  Otherwise
+ * the whole heap becomes one block of boxed pages in generation 0.
+ */
 void
 gencgc_pickup_dynamic(void)
 {
@@ -8359,21 +11580,30 @@ gencgc_pickup_dynamic(void)
     unsigned long addr = DYNAMIC_0_SPACE_START;
     unsigned long alloc_ptr = (unsigned long) get_alloc_pointer();
 
-    /* Initialise the first region. */
-    do {
-	page_table[page].flags |= PAGE_ALLOCATED_MASK;
-	page_table[page].flags &= ~(PAGE_UNBOXED_MASK | PAGE_GENERATION_MASK
-				    | PAGE_LARGE_OBJECT_MASK);
-	page_table[page].bytes_used = GC_PAGE_SIZE;
-	page_table[page].first_object_offset =
-	    (char *) DYNAMIC_0_SPACE_START - page_address(page);
-	addr += GC_PAGE_SIZE;
-	page++;
-    }
-    while (addr < alloc_ptr);
+    if (core_generation > 0) {
+	if (enable_page_protection)
+	    write_protect_generation_pages(core_generation);
+#ifdef __linux__
+	if (gencgc_soft_dirty)
+	    soft_dirty_reset();
+#endif
+    } else if (core_generation < 0) {
+	/* Initialise the first region. */
+	do {
+	    page_flags[page] |= PAGE_ALLOCATED_MASK;
+	    page_flags[page] &= ~(PAGE_UNBOXED_MASK | PAGE_GENERATION_MASK
+				  | PAGE_LARGE_OBJECT_MASK);
+	    page_bytes_used[page] = GC_PAGE_SIZE;
+	    page_first_object_offset[page] =
+		(char *) DYNAMIC_0_SPACE_START - page_address(page);
+	    addr += GC_PAGE_SIZE;
+	    page++;
+	}
+	while (addr < alloc_ptr);
 
-    generations[0].bytes_allocated = GC_PAGE_SIZE * page;
-    bytes_allocated = GC_PAGE_SIZE * page;
+	generations[0].bytes_allocated = GC_PAGE_SIZE * page;
+	bytes_allocated = GC_PAGE_SIZE * page;
+    }
 
     set_current_region_free((lispobj) boxed_region.free_pointer);
     set_current_region_end((lispobj) boxed_region.end_addr);
@@ -8402,6 +11632,316 @@ gencgc_pickup_dynamic(void)
 
 void do_pending_interrupt(void);
 
+/*
+ * The allocation samples.  Function names are kept as C strings, so
+ * the samples stay valid when GC moves code, and the samples with the
+ * same stack of names and object type are counted together.  The name
+ * of each return address is cached until the next GC.
+ */
+#define ALLOC_SAMPLE_DEPTH 32
+#define ALLOC_SAMPLE_STACKS 4096
+#define ALLOC_SAMPLE_NAMES 8192
+#define ALLOC_SAMPLE_PCS 4096
+
+extern int lisp_backtrace_pcs(unsigned long *pcs, int max);
+extern int lisp_pc_name(unsigned long pc, char *buf, int size);
+
+struct alloc_sample {
+    unsigned long long count;
+    unsigned long long bytes;
+    int type;
+    int depth;
+    int names[ALLOC_SAMPLE_DEPTH];
+};
+
+static struct alloc_sample *alloc_samples = NULL;
+static int alloc_sample_count = 0;
+/* Open addressed index of alloc_samples: entry + 1, or 0 if empty. */
+static int *alloc_sample_index = NULL;
+
+static char **alloc_sample_names = NULL;
+static int alloc_sample_name_count = 0;
+/* Open addressed index of alloc_sample_names, likewise. */
+static int *alloc_sample_name_index = NULL;
+
+static struct {
+    unsigned long pc;
+    int name;
+} alloc_sample_pcs[ALLOC_SAMPLE_PCS];
+
+/*
+ * The object of the last sample, whose type is only known once Lisp
+ * has written its header, and the bytes allocated since that sample.
+ */
+static struct alloc_sample alloc_sample_pending;
+static char *alloc_sample_object = NULL;
+static unsigned long long alloc_sample_bytes_since = 0;
+/* The region free pointer after the last refill. */
+static char *alloc_sample_mark = NULL;
+
+/*
+ * Sampling is kept under ALLOC_SAMPLE_MAX_PERCENT of the run time.
+ * Once every ALLOC_SAMPLE_WINDOW_NSEC, the time spent sampling in the
+ * window is compared with its length, and if it is over the limit the
+ * interval is doubled, at most ALLOC_SAMPLE_MAX_BACKOFF times.  As
+ * each sample is weighted by the bytes since the last one, the
+ * profile stays unbiased, just coarser.
+ */
+#define ALLOC_SAMPLE_MAX_PERCENT 5
+#define ALLOC_SAMPLE_WINDOW_NSEC 100000000ULL
+#define ALLOC_SAMPLE_MAX_BACKOFF 10
+
+static int alloc_sample_backoff = 0;
+static unsigned long long alloc_sample_window_start = 0;
+static unsigned long long alloc_sample_window_nsec = 0;
+
+static unsigned
+alloc_sample_hash(const unsigned char *p, int nbytes)
+{
+    unsigned hash = 2166136261u;
+
+    while (nbytes-- > 0)
+	hash = (hash ^ *p++) * 16777619u;
+    return hash;
+}
+
+static boolean
+alloc_sample_init(void)
+{
+    if (alloc_samples != NULL)
+	return TRUE;
+    alloc_samples = calloc(ALLOC_SAMPLE_STACKS, sizeof(struct alloc_sample));
+    alloc_sample_index = calloc(2 * ALLOC_SAMPLE_STACKS, sizeof(int));
+    alloc_sample_names = calloc(ALLOC_SAMPLE_NAMES, sizeof(char *));
+    alloc_sample_name_index = calloc(2 * ALLOC_SAMPLE_NAMES, sizeof(int));
+    if (alloc_samples == NULL || alloc_sample_index == NULL
+	|| alloc_sample_names == NULL || alloc_sample_name_index == NULL) {
+	fprintf(stderr, "*W can't allocate the allocation sample tables.\n");
+	free(alloc_samples);
+	free(alloc_sample_index);
+	free(alloc_sample_names);
+	free(alloc_sample_name_index);
+	alloc_samples = NULL;
+	gencgc_alloc_sample_bytes = 0;
+	return FALSE;
+    }
+    return TRUE;
+}
+
+/* Return the number of name, adding it if need be, or -1 if full. */
+static int
+alloc_sample_intern(const char *name)
+{
+    int len = strlen(name);
+    unsigned slot = alloc_sample_hash((const unsigned char *) name, len)
+	% (2 * ALLOC_SAMPLE_NAMES);
+
+    while (alloc_sample_name_index[slot] != 0) {
+	int i = alloc_sample_name_index[slot] - 1;
+
+	if (strcmp(alloc_sample_names[i], name) == 0)
+	    return i;
+	slot = (slot + 1) % (2 * ALLOC_SAMPLE_NAMES);
+    }
+    if (alloc_sample_name_count == ALLOC_SAMPLE_NAMES)
+	return -1;
+    alloc_sample_names[alloc_sample_name_count] = strdup(name);
+    if (alloc_sample_names[alloc_sample_name_count] == NULL)
+	return -1;
+    alloc_sample_name_index[slot] = ++alloc_sample_name_count;
+    return alloc_sample_name_count - 1;
+}
+
+/* The number of the name of the Lisp function at pc, or -1. */
+static int
+alloc_sample_pc_name(unsigned long pc)
+{
+    unsigned slot = (pc >> 2) % ALLOC_SAMPLE_PCS;
+    char name[256];
+    int n;
+
+    if (alloc_sample_pcs[slot].pc == pc)
+	return alloc_sample_pcs[slot].name;
+    n = lisp_pc_name(pc, name, sizeof(name)) ? alloc_sample_intern(name) : -1;
+    alloc_sample_pcs[slot].pc = pc;
+    alloc_sample_pcs[slot].name = n;
+    return n;
+}
+
+/* Add the pending sample, now that its object has a header. */
+static void
+alloc_sample_finish(void)
+{
+    struct alloc_sample *sample = &alloc_sample_pending;
+    lispobj word = *(lispobj *) alloc_sample_object;
+    int nbytes = offsetof(struct alloc_sample, names)
+	+ sample->depth * sizeof(int);
+    unsigned slot;
+
+    alloc_sample_object = NULL;
+
+    sample->type = cons_first_word_p(word) ? 0 : TypeOf(word);
+
+    slot = alloc_sample_hash((unsigned char *) &sample->type,
+			     nbytes - offsetof(struct alloc_sample, type))
+	% (2 * ALLOC_SAMPLE_STACKS);
+    while (alloc_sample_index[slot] != 0) {
+	struct alloc_sample *old = &alloc_samples[alloc_sample_index[slot] - 1];
+
+	if (memcmp(&old->type, &sample->type,
+		   nbytes - offsetof(struct alloc_sample, type)) == 0) {
+	    old->count++;
+	    old->bytes += sample->bytes;
+	    return;
+	}
+	slot = (slot + 1) % (2 * ALLOC_SAMPLE_STACKS);
+    }
+    if (alloc_sample_count == ALLOC_SAMPLE_STACKS) {
+	gc_alloc_samples_dropped++;
+	return;
+    }
+    memcpy(&alloc_samples[alloc_sample_count], sample, nbytes);
+    alloc_samples[alloc_sample_count].count = 1;
+    alloc_sample_index[slot] = ++alloc_sample_count;
+}
+
+/*
+ * Add the time of a sample taken from start to now, in nanoseconds,
+ * and double the interval if sampling took too much of the last
+ * window.
+ */
+static void
+alloc_sample_budget(unsigned long long start, unsigned long long now)
+{
+    gc_alloc_sample_nsec += now - start;
+    alloc_sample_window_nsec += now - start;
+    if (alloc_sample_window_start == 0)
+	alloc_sample_window_start = start;
+    if (now - alloc_sample_window_start < ALLOC_SAMPLE_WINDOW_NSEC)
+	return;
+
+    if (alloc_sample_window_nsec * 100
+	> (now - alloc_sample_window_start) * ALLOC_SAMPLE_MAX_PERCENT
+	&& alloc_sample_backoff < ALLOC_SAMPLE_MAX_BACKOFF)
+	alloc_sample_backoff++;
+    alloc_sample_window_start = now;
+    alloc_sample_window_nsec = 0;
+}
+
+/*
+ * Called by alloc on each refill with the object it allocated and its
+ * size, and the free pointer of the region before the refill.
+ */
+static void
+alloc_sample_refill(char *object, int nbytes, char *old_free)
+{
+    unsigned long long start;
+    unsigned long pcs[ALLOC_SAMPLE_DEPTH + 8];
+    int npcs, i;
+
+    if (alloc_sample_mark != NULL && old_free >= alloc_sample_mark)
+	alloc_sample_bytes_since += old_free - alloc_sample_mark;
+    alloc_sample_bytes_since += nbytes;
+    alloc_sample_mark = (char *) get_current_region_free();
+
+    gc_alloc_sample_interval =
+	gencgc_alloc_sample_bytes << alloc_sample_backoff;
+    if (alloc_sample_bytes_since < gc_alloc_sample_interval
+	|| !alloc_sample_init())
+	return;
+
+    start = gc_time_nsec();
+    alloc_sample_pending.bytes = alloc_sample_bytes_since;
+    alloc_sample_pending.depth = 0;
+    alloc_sample_bytes_since = 0;
+    npcs = lisp_backtrace_pcs(pcs, ALLOC_SAMPLE_DEPTH + 8);
+    for (i = 0; i < npcs && alloc_sample_pending.depth < ALLOC_SAMPLE_DEPTH;
+	 i++) {
+	int name = alloc_sample_pc_name(pcs[i]);
+
+	if (name >= 0)
+	    alloc_sample_pending.names[alloc_sample_pending.depth++] = name;
+    }
+    alloc_sample_object = object;
+    gc_alloc_samples++;
+    alloc_sample_budget(start, gc_time_nsec());
+}
+
+/*
+ * Before a GC: add the pending sample and forget the cached names,
+ * as code may move.
+ */
+static void
+alloc_sample_gc(void)
+{
+    if (alloc_sample_object != NULL)
+	alloc_sample_finish();
+    alloc_sample_mark = NULL;
+    memset(alloc_sample_pcs, 0, sizeof(alloc_sample_pcs));
+}
+
+/*
+ * Lisp's view of the samples, for ALLOC-PROFILE-SAMPLES.  Field 0 of
+ * a sample is its count, 1 its bytes, 2 the object type (0 for a
+ * cons) and 3 the number of frames.
+ */
+int
+gc_alloc_sample_count(void)
+{
+    if (alloc_sample_object != NULL)
+	alloc_sample_finish();
+    return alloc_sample_count;
+}
+
+unsigned long long
+gc_alloc_sample_field(int i, int field)
+{
+    struct alloc_sample *sample = &alloc_samples[i];
+
+    switch (field) {
+      case 0:
+	  return sample->count;
+      case 1:
+	  return sample->bytes;
+      case 2:
+	  return sample->type;
+      default:
+	  return sample->depth;
+    }
+}
+
+/* The name of frame j of sample i, innermost first. */
+char *
+gc_alloc_sample_frame(int i, int j)
+{
+    return alloc_sample_names[alloc_samples[i].names[j]];
+}
+
+void
+gc_alloc_samples_reset(void)
+{
+    int i;
+
+    if (alloc_samples == NULL)
+	return;
+    for (i = 0; i < alloc_sample_name_count; i++)
+	free(alloc_sample_names[i]);
+    memset(alloc_sample_index, 0, 2 * ALLOC_SAMPLE_STACKS * sizeof(int));
+    memset(alloc_sample_name_index, 0, 2 * ALLOC_SAMPLE_NAMES * sizeof(int));
+    memset(alloc_sample_pcs, 0, sizeof(alloc_sample_pcs));
+    alloc_sample_count = 0;
+    alloc_sample_name_count = 0;
+    alloc_sample_object = NULL;
+    alloc_sample_bytes_since = 0;
+    alloc_sample_backoff = 0;
+    alloc_sample_window_start = 0;
+    alloc_sample_window_nsec = 0;
+    gc_alloc_samples = 0;
+    gc_alloc_samples_dropped = 0;
+    gc_alloc_sample_nsec = 0;
+    gc_alloc_sample_interval = 0;
+}
+
 char *
 alloc(int nbytes)
 {
@@ -8423,6 +11963,8 @@ alloc(int nbytes)
     }
 
     bytes_allocated_sum += nbytes;
+    if (alloc_sample_object != NULL)
+	alloc_sample_finish();
 
     for (;;) {
 	char *new_free_pointer = (void *) (get_current_region_free() + nbytes);
@@ -8433,16 +11975,27 @@ alloc(int nbytes)
 	    set_current_region_free((lispobj) new_free_pointer);
             break;
 	} else if (bytes_allocated <= auto_gc_trigger) {
+	    unsigned long long refill_start = gc_time_nsec();
+	    char *old_free = (char *) get_current_region_free();
+
 	    /* Call gc_alloc.  */
 	    boxed_region.free_pointer = (void *) get_current_region_free();
 	    boxed_region.end_addr =
 		(void *) SymbolValue(CURRENT_REGION_END_ADDR);
 
 	    new_obj = gc_alloc(nbytes);
+	    gc_alloc_refills++;
+	    gc_alloc_refill_nsec += gc_time_nsec() - refill_start;
+#if defined(i386) || defined(__x86_64)
+	    if (satb_state == SATB_MARKING)
+		satb_mark_step();
+#endif
 
 	    set_current_region_free((lispobj) boxed_region.free_pointer);
 	    set_current_region_end((lispobj) boxed_region.end_addr);
 
+	    if (gencgc_alloc_sample_bytes != 0)
+		alloc_sample_refill(new_obj, nbytes, old_free);
             break;
 	} else {
 	    /* Run GC and try again.  */
@@ -8626,8 +12179,8 @@ print_bytes_allocated_sum(void)
 void
 get_page_table_info(int page, int* flags, int* bytes)
 {
-    *flags = page_table[page].flags;
-    *bytes = page_table[page].bytes_used;
+    *flags = page_flags[page];
+    *bytes = page_bytes_used[page];
 }
 
 /*
@@ -36,7 +36,7 @@ int gc_write_barrier(void *);
 #define PAGE_NEEDS_ZEROING_MARKER	0xdead0000
 
 /*
- * The various fields packed into the struct page flags member.
+ * The various fields packed into the page_flags entry of a page.
  */
 
 /*
@@ -48,11 +48,11 @@ int gc_write_barrier(void *);
 
 #define PAGE_GENERATION_MASK		0x0000000f
 #define PAGE_GENERATION(page) \
-	(page_table[page].flags & PAGE_GENERATION_MASK)
+	(page_flags[page] & PAGE_GENERATION_MASK)
 
-#define PAGE_FLAGS(page, mask) (page_table[page].flags & (mask))
+#define PAGE_FLAGS(page, mask) (page_flags[page] & (mask))
 #define PAGE_FLAGS_UPDATE(page, mmask, mflags) \
-     (page_table[page].flags = (page_table[page].flags & ~(mmask)) | (mflags))
+     (page_flags[page] = (page_flags[page] & ~(mmask)) | (mflags))
 
 
 /*
@@ -69,7 +69,7 @@ int gc_write_barrier(void *);
 
 #define PAGE_WRITE_PROTECTED_MASK	(1 << PAGE_BASE_BIT_SHIFT)
 #define PAGE_WRITE_PROTECTED(page) \
-	(page_table[page].flags & PAGE_WRITE_PROTECTED_MASK)
+	(page_flags[page] & PAGE_WRITE_PROTECTED_MASK)
 
 /*
  * Page allocated flag: 0 for a free page; 1 when allocated. If
@@ -78,14 +78,14 @@ int gc_write_barrier(void *);
  */
 
 #define PAGE_ALLOCATED_MASK	(1 << (PAGE_BASE_BIT_SHIFT + 1))
-#define PAGE_ALLOCATED(page)	(page_table[page].flags & PAGE_ALLOCATED_MASK)
+#define PAGE_ALLOCATED(page)	(page_flags[page] & PAGE_ALLOCATED_MASK)
 
 /*
  * Unboxed region flag: 1 for unboxed objects, 0 for boxed objects.
  */
 #define PAGE_UNBOXED_SHIFT		(PAGE_BASE_BIT_SHIFT + 2)
 #define PAGE_UNBOXED_MASK		(1 << PAGE_UNBOXED_SHIFT)
-#define PAGE_UNBOXED(page)	(page_table[page].flags & PAGE_UNBOXED_MASK)
+#define PAGE_UNBOXED(page)	(page_flags[page] & PAGE_UNBOXED_MASK)
 #define PAGE_UNBOXED_VAL(page)	(PAGE_UNBOXED(page) >> PAGE_UNBOXED_SHIFT)
 
 /*
@@ -95,7 +95,7 @@ int gc_write_barrier(void *);
 
 #define PAGE_DONT_MOVE_MASK		(1 << (PAGE_BASE_BIT_SHIFT + 3))
 #define PAGE_DONT_MOVE(page) \
-	(page_table[page].flags & PAGE_DONT_MOVE_MASK)
+	(page_flags[page] & PAGE_DONT_MOVE_MASK)
 
 /*
  * If the page is part of a large object then this flag is set. No
@@ -106,32 +106,37 @@ int gc_write_barrier(void *);
 #define PAGE_LARGE_OBJECT_SHIFT		(PAGE_BASE_BIT_SHIFT + 4)
 #define PAGE_LARGE_OBJECT_MASK		(1 << PAGE_LARGE_OBJECT_SHIFT)
 #define PAGE_LARGE_OBJECT(page) \
-	(page_table[page].flags & PAGE_LARGE_OBJECT_MASK)
+	(page_flags[page] & PAGE_LARGE_OBJECT_MASK)
 #define PAGE_LARGE_OBJECT_VAL(page) \
 	(PAGE_LARGE_OBJECT(page) >> PAGE_LARGE_OBJECT_SHIFT)
 
-struct page {
-    /*
-     * Page flags.
-     */
+/*
+ * The page table is kept as separate arrays indexed by page, so that
+ * the loops over all the pages looking for pages of some generation
+ * or with some flags only touch the two bytes of flags of each page.
+ */
 
-    unsigned flags;
+/*
+ * Page flags.
+ */
+typedef unsigned short page_flags_t;
 
-    /*
-     * It is important to know the offset to the first object in the
-     * page. Currently it's only important to know if an object starts
-     * at the begining of the page in which case the offset would be 0
-     */
-    int first_object_offset;
+extern page_flags_t *page_flags;
 
-    /*
-     * The number of bytes of this page that are used. This may be less
-     * than the actual bytes used for pages within the current
-     * allocation regions. It should be 0 for all unallocated pages (not
-     * hard to achieve).
-     */
-    int bytes_used;
-};
+/*
+ * It is important to know the offset to the first object in the
+ * page. Currently it's only important to know if an object starts
+ * at the begining of the page in which case the offset would be 0
+ */
+extern int *page_first_object_offset;
+
+/*
+ * The number of bytes of this page that are used. This may be less
+ * than the actual bytes used for pages within the current
+ * allocation regions. It should be 0 for all unallocated pages (not
+ * hard to achieve).
+ */
+extern unsigned short *page_bytes_used;
 
 
 
@@ -164,8 +169,32 @@ struct page {
 /*#define GC_PAGE_SIZE (8*4096)*/
 #endif
 
+#if GC_PAGE_SIZE > 65535
+#error "page_bytes_used can't hold GC_PAGE_SIZE"
+#endif
+
 extern unsigned dynamic_space_pages;
-extern struct page *page_table;
+
+/*
+ * The page table as saved in a core file, in the CORE_PAGE_TABLE
+ * entry: one core_page for each page of the saved dynamic space,
+ * followed by one core_generation for each generation.
+ */
+struct core_page {
+    page_flags_t flags;
+    unsigned short bytes_used;
+    int first_object_offset;
+};
+
+struct core_generation {
+    unsigned long long bytes_allocated;
+    unsigned long long cum_sum_bytes_allocated;
+    int num_gc;
+    int unused;			/* Keeps the size the same on x86 and amd64. */
+};
+
+void *gc_save_page_table(int *npages, int *ngenerations, long *bytes);
+void gc_load_page_table(void *data, int npages, int ngenerations);
 
 
 /*
@@ -183,11 +212,43 @@ struct alloc_region {
     char *start_addr;
 };
 
-extern struct alloc_region boxed_region;
-extern struct alloc_region unboxed_region;
+/*
+ * An allocation context holds the regions one thread of control
+ * allocates from, and the free pages it has claimed for its next
+ * regions.
+ */
+struct alloc_context {
+    struct alloc_region boxed;
+    struct alloc_region unboxed;
+
+    /* Claimed free pages for the next boxed regions, if first <= last. */
+    int batch_first_page;
+    int batch_last_page;
+
+    struct alloc_context *next;
+};
+
+extern struct alloc_context main_alloc_context;
+extern struct alloc_context *current_alloc_context;
+
+#define boxed_region (current_alloc_context->boxed)
+#define unboxed_region (current_alloc_context->unboxed)
+
+struct alloc_context *gc_make_alloc_context(void);
+void gc_set_alloc_context(struct alloc_context *context);
+void gc_free_alloc_context(struct alloc_context *context);
+
+extern boolean gencgc_soft_dirty;
+extern boolean gencgc_huge_pages;
+extern boolean gencgc_mark_region;
+extern boolean gencgc_concurrent_mark;
+extern unsigned long gencgc_pause_target_usec;
+extern int gencgc_gc_time_target;
+extern boolean gencgc_shared_core;
 
 
 void gencgc_pickup_dynamic(void);
+void gencgc_protect_shared_core(void);
 
 #ifdef i386
 void sniff_code_object(struct code *code, unsigned displacement);
@@ -202,5 +263,8 @@ void gc_alloc_update_page_tables(int unboxed,
 				 struct alloc_region *alloc_region);
 
 extern char *alloc(int);
+lispobj gc_alloc_pinned_vector(int type, int length, int nwords);
+long gc_write_heap_snapshot(char *path);
+int gc_event_read(unsigned long long n, unsigned long long *out, int words);
 
 #endif /* _GENCGC_H_ */
@@ -668,6 +668,40 @@ main(int argc, const char *argv[], const char *envp[])
 			DYNAMIC_SPACE_SIZE / (1024 * 1024UL));
 		exit(1);
 	    }
+#ifdef GENCGC
+	} else if (strcmp(arg, "-gc-soft-dirty") == 0) {
+	    gencgc_soft_dirty = TRUE;
+	} else if (strcmp(arg, "-gc-huge-pages") == 0) {
+	    gencgc_huge_pages = TRUE;
+	} else if (strcmp(arg, "-gc-mark-region") == 0) {
+	    gencgc_mark_region = TRUE;
+	} else if (strcmp(arg, "-gc-concurrent-mark") == 0) {
+	    gencgc_concurrent_mark = TRUE;
+	} else if (strcmp(arg, "-gc-pause-target") == 0) {
+	    const char *str = *++argptr;
+
+	    if (str == NULL) {
+		fprintf(stderr,
+			"-gc-pause-target must be followed by a time in milliseconds.\n");
+		exit(1);
+	    }
+	    gencgc_pause_target_usec = atof(str) * 1000;
+	} else if (strcmp(arg, "-gc-time-target") == 0) {
+	    const char *str = *++argptr;
+
+	    if (str == NULL) {
+		fprintf(stderr,
+			"-gc-time-target must be followed by a percentage.\n");
+		exit(1);
+	    }
+	    gencgc_gc_time_target = atoi(str);
+	    if (gencgc_gc_time_target < 1 || gencgc_gc_time_target > 99) {
+		fprintf(stderr, "-gc-time-target must be between 1 and 99.\n");
+		exit(1);
+	    }
+	} else if (strcmp(arg, "-shared-core") == 0) {
+	    gencgc_shared_core = TRUE;
+#endif
 	} else if (strcmp(arg, "-monitor") == 0) {
 	    monitor = TRUE;
 	} else if (strcmp(arg, "-debug-lisp-search") == 0) {
@@ -861,6 +895,11 @@ main(int argc, const char *argv[], const char *envp[])
     arch_install_interrupt_handlers();
     os_install_interrupt_handlers();
 
+#ifdef GENCGC
+    if (gencgc_shared_core)
+	gencgc_protect_shared_core();
+#endif
+
 #ifdef PSEUDO_ATOMIC_ATOMIC
     /* Turn on pseudo atomic for when we call into lisp. */
     SetSymbolValue(PSEUDO_ATOMIC_ATOMIC, make_fixnum(1));
@@ -596,6 +596,28 @@ os_sleep(double seconds)
 	requested = remaining;
     }
 }
+
+/*
+ * Return the time of a clock that is never set back, for timeouts.
+ * Where there's no CLOCK_MONOTONIC, this is the time of day.
+ */
+void
+os_monotonic_time(int64_t *sec, long *nsec)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    *sec = ts.tv_sec;
+    *nsec = ts.tv_nsec;
+#else
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    *sec = tv.tv_sec;
+    *nsec = tv.tv_usec * 1000;
+#endif
+}
 
 /*
  * Interface to stat/fstat/lstat.
@@ -34,12 +34,26 @@
 
 extern int version;
 
+/*
+ * The format save writes the spaces in, one of the CORE_FORMAT
+ * values.  Set from Lisp by save-lisp's :core-format argument.
+ */
+int save_core_format = CORE_FORMAT_FLAT;
+
+/* The run tables of the spaces written sparse, for CORE_SPACE_RUNS. */
+static struct {
+    int id;
+    int nruns;
+    long table_page;
+} space_runs[3];
+static int space_runs_count = 0;
+
 static long
 write_bytes(FILE * file, char *addr, long bytes)
 {
-    long count, here, data;
+    long count, here, data, pad;
 
-    bytes = (bytes + CORE_PAGESIZE - 1) & ~(CORE_PAGESIZE - 1);
+    pad = ((bytes + CORE_PAGESIZE - 1) & ~(CORE_PAGESIZE - 1)) - bytes;
 
     fflush(file);
     here = ftell(file);
@@ -57,15 +71,191 @@ write_bytes(FILE * file, char *addr, long bytes)
 	    bytes = 0;
 	}
     }
+    /* Pad with zeros, rather than reading past the end of addr. */
+    while (pad-- > 0)
+	putc(0, file);
     fflush(file);
     fseek(file, here, 0);
     return data / CORE_PAGESIZE - 1;
 }
 
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12
+
+/*
+ * Write a block of nlit literals and, unless mlen is 0, a match of
+ * mlen bytes at offset back, in the format described in core.h.
+ * Returns the new output position, or NULL if the block doesn't fit.
+ */
+static unsigned char *
+lz_emit(unsigned char *op, unsigned char *op_end, const unsigned char *lit,
+	long nlit, long offset, long mlen)
+{
+    unsigned char *token;
+    long n;
+
+    if (op_end - op < 1 + nlit + nlit / 255 + 1 + 2 + mlen / 255 + 1)
+	return NULL;
+
+    token = op++;
+    *token = (nlit >= 15 ? 15 : nlit) << 4;
+    if (nlit >= 15) {
+	for (n = nlit - 15; n >= 255; n -= 255)
+	    *op++ = 255;
+	*op++ = n;
+    }
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (mlen == 0)
+	return op;
+
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    n = mlen - LZ_MIN_MATCH;
+    *token |= n >= 15 ? 15 : n;
+    if (n >= 15) {
+	for (n -= 15; n >= 255; n -= 255)
+	    *op++ = 255;
+	*op++ = n;
+    }
+    return op;
+}
+
+/*
+ * Compress len bytes from src into dst, which has room for dst_len
+ * bytes.  Matches are found through a hash table of the last position
+ * each 4 byte sequence was seen at, which is enough for heap pages:
+ * what matters is that runs of zeros, fill patterns and repeated
+ * headers come out small, and that decoding is fast.  Returns the
+ * compressed size, or -1 if it doesn't fit.
+ */
+static long
+lz_compress(const unsigned char *src, long len, unsigned char *dst,
+	    long dst_len)
+{
+    const unsigned char *table[1 << LZ_HASH_BITS];
+    const unsigned char *ip = src, *anchor = src, *end = src + len;
+    unsigned char *op = dst, *op_end = dst + dst_len;
+
+    memset(table, 0, sizeof(table));
+
+    while (end - ip > LZ_MIN_MATCH) {
+	const unsigned char *ref;
+	u32 seq;
+	unsigned hash;
+	long mlen;
+
+	memcpy(&seq, ip, sizeof(seq));
+	hash = (seq * 2654435761U) >> (32 - LZ_HASH_BITS);
+	ref = table[hash];
+	table[hash] = ip;
+	if (ref == NULL || ip - ref > LZ_MAX_OFFSET
+	    || memcmp(ref, ip, LZ_MIN_MATCH) != 0) {
+	    ip++;
+	    continue;
+	}
+
+	for (mlen = LZ_MIN_MATCH; ip + mlen < end && ref[mlen] == ip[mlen];
+	     mlen++);
+	op = lz_emit(op, op_end, anchor, ip - anchor, ip - ref, mlen);
+	if (op == NULL)
+	    return -1;
+	ip += mlen;
+	anchor = ip;
+    }
+
+    op = lz_emit(op, op_end, anchor, end - anchor, 0, 0);
+    return op == NULL ? -1 : op - dst;
+}
+
+static boolean
+zero_page_p(char *addr)
+{
+    long *p = (long *) addr;
+    long *end = (long *) (addr + CORE_PAGESIZE);
+
+    while (p < end)
+	if (*p++ != 0)
+	    return FALSE;
+    return TRUE;
+}
+
+/*
+ * Write the pages of a space that aren't all zero as runs, compressed
+ * if save_core_format says so and it helps, followed by the table of
+ * runs, and note the table for the CORE_SPACE_RUNS entry.
+ */
+static void
+output_runs(FILE * file, int id, char *addr, long bytes)
+{
+    long npages = (bytes + CORE_PAGESIZE - 1) / CORE_PAGESIZE;
+    long run_bytes = CORE_RUN_PAGES * CORE_PAGESIZE;
+    long buffer_bytes = run_bytes + run_bytes / 128 + 2 * CORE_PAGESIZE;
+    struct core_run *runs = malloc((npages + 1) * sizeof(struct core_run));
+    unsigned char *buffer = NULL;
+    long page = 0, stored = 0;
+    int nruns = 0;
+
+    if (save_core_format == CORE_FORMAT_COMPRESSED)
+	buffer = malloc(buffer_bytes);
+    if (runs == NULL
+	|| (save_core_format == CORE_FORMAT_COMPRESSED && buffer == NULL)) {
+	perror("Can't allocate the run table");
+	exit(1);
+    }
+
+    while (page < npages) {
+	struct core_run *run;
+	long start, len, packed;
+
+	if (zero_page_p(addr + page * CORE_PAGESIZE)) {
+	    page++;
+	    continue;
+	}
+	start = page;
+	while (page < npages && page - start < CORE_RUN_PAGES
+	       && !zero_page_p(addr + page * CORE_PAGESIZE))
+	    page++;
+
+	run = &runs[nruns++];
+	run->page = start;
+	run->page_count = page - start;
+	run->data_bytes = 0;
+	len = run->page_count * CORE_PAGESIZE;
+
+	if (buffer != NULL) {
+	    packed = lz_compress((unsigned char *) addr + start * CORE_PAGESIZE,
+				 len, buffer, buffer_bytes - CORE_PAGESIZE);
+	    if (packed > 0 && packed < len) {
+		/* write_bytes writes whole pages. */
+		memset(buffer + packed, 0, CORE_PAGESIZE);
+		run->data_page = write_bytes(file, (char *) buffer, packed);
+		run->data_bytes = packed;
+		stored += packed;
+		continue;
+	    }
+	}
+	run->data_page = write_bytes(file, addr + start * CORE_PAGESIZE, len);
+	stored += len;
+    }
+
+    printf("  %d runs, %ld bytes stored.\n", nruns, stored);
+
+    space_runs[space_runs_count].id = id;
+    space_runs[space_runs_count].nruns = nruns;
+    space_runs[space_runs_count].table_page =
+	write_bytes(file, (char *) runs, nruns * sizeof(struct core_run));
+    space_runs_count++;
+
+    free(buffer);
+    free(runs);
+}
+
 static void
 output_space(FILE * file, int id, lispobj * addr, lispobj * end)
 {
-    int words, bytes, data;
+    int words, bytes, data, pages;
     static char *names[] = { NULL, "Dynamic", "Static", "Read-Only" };
 
     putw(id, file);
@@ -77,13 +267,67 @@ output_space(FILE * file, int id, lispobj * addr, lispobj * end)
     printf("Writing %d bytes from the %s space at 0x%08lX.\n",
 	   bytes, names[id], (unsigned long) addr);
 
-    data = write_bytes(file, (char *) addr, bytes);
+    if (save_core_format == CORE_FORMAT_FLAT) {
+	data = write_bytes(file, (char *) addr, bytes);
+	pages = (bytes + CORE_PAGESIZE - 1) / CORE_PAGESIZE;
+    } else {
+	output_runs(file, id, (char *) addr, bytes);
+	data = 0;
+	pages = 0;
+    }
 
     putw(data, file);
     putw((long) addr / CORE_PAGESIZE, file);
-    putw((bytes + CORE_PAGESIZE - 1) / CORE_PAGESIZE, file);
+    putw(pages, file);
+}
+
+/* Write the CORE_SPACE_RUNS entry for the spaces written as runs. */
+static void
+output_space_runs(FILE * file)
+{
+    int i;
+
+    if (space_runs_count == 0)
+	return;
+
+    putw(CORE_SPACE_RUNS, file);
+    putw(2 + 3 * space_runs_count, file);
+    for (i = 0; i < space_runs_count; i++) {
+	putw(space_runs[i].id, file);
+	putw(space_runs[i].nruns, file);
+	putw(space_runs[i].table_page, file);
+    }
 }
 
+#ifdef GENCGC
+/*
+ * Write the CORE_PAGE_TABLE entry, so the loaded core keeps the page
+ * kinds and generation of the saved heap.
+ */
+static void
+output_page_table(FILE * file)
+{
+    int npages, ngenerations;
+    long bytes;
+    void *data = gc_save_page_table(&npages, &ngenerations, &bytes);
+
+    if (data == NULL)
+	return;
+
+    printf("Writing the page table for %d pages.\n", npages);
+
+    putw(CORE_PAGE_TABLE, file);
+    putw(7, file);
+    putw(CORE_PAGE_TABLE_VERSION, file);
+    putw(GC_PAGE_SIZE, file);
+    putw(npages, file);
+    putw(ngenerations, file);
+    putw(write_bytes(file, data, bytes), file);
+
+    free(data);
+}
+#endif
+
 #ifdef DEBUG_BAD_HEAP
 static void
 dump_region(struct alloc_region *alloc_region)
@@ -95,9 +339,9 @@ dump_region(struct alloc_region *alloc_region)
     fprintf(stderr, "start_addr   = %p\n", alloc_region->start_addr);
 
     fprintf(stderr, " page_table[%d]\n", alloc_region->first_page);
-    fprintf(stderr, "   flags     = %x\n", page_table[alloc_region->first_page].flags);
-    fprintf(stderr, "   offset    = %x\n", page_table[alloc_region->first_page].first_object_offset);
-    fprintf(stderr, "   used      = %x\n", page_table[alloc_region->first_page].bytes_used);
+    fprintf(stderr, "   flags     = %x\n", page_flags[alloc_region->first_page]);
+    fprintf(stderr, "   offset    = %x\n", page_first_object_offset[alloc_region->first_page]);
+    fprintf(stderr, "   used      = %x\n", page_bytes_used[alloc_region->first_page]);
 }
 #endif
 
@@ -233,6 +477,11 @@ save(char *filename, lispobj init_function, int sse2_mode)
 		 (lispobj *) SymbolValue(ALLOCATION_POINTER));
 #endif
 
+#ifdef GENCGC
+    output_page_table(file);
+#endif
+    output_space_runs(file);
+
     putw(CORE_INITIAL_FUNCTION, file);
     putw(3, file);
     putw(init_function, file);
@@ -10,6 +10,7 @@
 
 #include "core.h"
 
+extern int save_core_format;
 extern boolean save(char *filename, lispobj initfun, int sse2_mode);
 
 #endif /* _SAVE_H_ */
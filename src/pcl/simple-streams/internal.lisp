@@ -21,8 +21,9 @@
       (make-array size :element-type '(unsigned-byte 8))))
 
 (defun free-buffer (buffer)
+  ;; Only buffers of the default size come from the pool.
   (when (sys:system-area-pointer-p buffer)
-    (push buffer lisp::*available-buffers*))
+    (lisp::release-buffer buffer lisp::bytes-per-buffer))
   t)
 
 
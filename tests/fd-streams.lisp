@@ -34,3 +34,230 @@
 	  (setf s (open *test-file*))
 	  (file-length s))
      (delete-file *test-file*))))
+
+(defun test-octets (n)
+  (let ((octets (make-array n :element-type '(unsigned-byte 8))))
+    (dotimes (k n octets)
+      (setf (aref octets k) (mod k 251)))))
+
+(defun write-test-file (octets &optional (file *test-file*))
+  (with-open-file (s file
+		     :direction :output
+		     :if-exists :supersede
+		     :element-type '(unsigned-byte 8))
+    (write-sequence octets s)))
+
+(defun read-test-file (&optional (file *test-file*))
+  (with-open-file (s file :element-type '(unsigned-byte 8))
+    (let ((octets (make-array (file-length s)
+			      :element-type '(unsigned-byte 8))))
+      (read-sequence octets s)
+      octets)))
+
+(define-test buffer-size.classes
+  (:tag :fd-streams)
+  ;; Sizes are rounded up to a power of two from 4KB to 16MB.
+  (assert-equal '(4096 4096 8192 131072 16777216)
+		(mapcar #'(lambda (bytes)
+			    (nth-value 1 (lisp::buffer-size-class bytes)))
+			(list 1 4096 4097 100000 (* 64 1024 1024)))))
+
+(define-test buffer-size.open
+  (:tag :fd-streams)
+  (unwind-protect
+       (with-open-file (s *test-file*
+			  :direction :io
+			  :if-exists :supersede
+			  :element-type '(unsigned-byte 8)
+			  :buffer-size 100000)
+	 (assert-eql 131072 (lisp::fd-stream-buffer-size s))
+	 (assert-eql 131072 (lisp::fd-stream-ibuf-length s))
+	 (assert-eql 131072 (lisp::fd-stream-obuf-length s)))
+    (delete-file *test-file*)))
+
+(define-test buffer-size.release
+  (:tag :fd-streams)
+  ;; Closing a stream gives its buffer back to the pool of its size.
+  (let ((lisp::*max-available-buffer-bytes* (* 64 1024 1024))
+	(sap nil))
+    (unwind-protect
+	 (let ((s (open *test-file*
+			:direction :output
+			:if-exists :supersede
+			:element-type '(unsigned-byte 8)
+			:buffer-size 65536)))
+	   (setf sap (lisp::fd-stream-obuf-sap s))
+	   (close s))
+      (delete-file *test-file*))
+    (assert-true (member sap
+			 (svref lisp::*available-buffers*
+				(lisp::buffer-size-class 65536))
+			 :test #'sys:sap=))
+    (assert-false (member sap
+			  (svref lisp::*available-buffers*
+				 (lisp::buffer-size-class 4096))
+			  :test #'sys:sap=))))
+
+(define-test buffer-size.transfer
+  (:tag :fd-streams)
+  ;; Reads and writes of more than a buffer, with different sizes at
+  ;; each end.
+  (let ((octets (test-octets 300000)))
+    (unwind-protect
+	 (progn
+	   (with-open-file (s *test-file*
+			      :direction :output
+			      :if-exists :supersede
+			      :element-type '(unsigned-byte 8)
+			      :buffer-size 4096)
+	     (write-sequence octets s))
+	   (with-open-file (s *test-file*
+			      :element-type '(unsigned-byte 8)
+			      :buffer-size 65536)
+	     (let ((result (make-array 300000
+				       :element-type '(unsigned-byte 8))))
+	       (assert-eql 300000 (read-sequence result s))
+	       (assert-equalp octets result)
+	       (assert-eql nil (read-byte s nil nil)))))
+      (delete-file *test-file*))))
+
+(define-test output-later.writev
+  (:tag :fd-streams)
+  ;; Output to a full non-blocking pipe is queued, in pieces that don't
+  ;; line up with the pipe's pages, and written out with writev as the
+  ;; other end reads it.
+  (let ((octets (test-octets 200000))
+	(in nil)
+	(out nil))
+    (multiple-value-bind (in-fd out-fd)
+	(unix:unix-pipe)
+      (unwind-protect
+	   (progn
+	     (unix:unix-fcntl out-fd unix:f-setfl unix:o_nonblock)
+	     (setf out (sys:make-fd-stream out-fd
+					   :output t
+					   :element-type '(unsigned-byte 8)))
+	     (setf in (sys:make-fd-stream in-fd
+					  :input t
+					  :element-type '(unsigned-byte 8)))
+	     (loop for start from 0 below (length octets) by 3000
+		   do (write-sequence octets out
+				      :start start
+				      :end (min (+ start 3000) (length octets)))
+		      (force-output out))
+	     (assert-true (cdr (lisp::fd-stream-output-later out)))
+	     (let ((result (make-array (length octets)
+				       :element-type '(unsigned-byte 8))))
+	       (assert-eql (length octets) (read-sequence result in))
+	       (assert-equalp octets result))
+	     (assert-false (lisp::fd-stream-output-later out))
+	     (assert-false (lisp::fd-stream-output-later-tail out))
+	     (assert-false (lisp::fd-stream-handler out)))
+	(if out (close out) (unix:unix-close out-fd))
+	(if in (close in) (unix:unix-close in-fd))))))
+
+(defparameter *copy-file*
+  (merge-pathnames #p"test-copy.tmp" *test-path*))
+
+(defun copy-test-file (if-exists &rest copy-args)
+  ;; Copy *TEST-FILE* to *COPY-FILE*, after reading 10 octets so that
+  ;; the input has some buffered, and return what the copy returned.
+  (with-open-file (input *test-file* :element-type '(unsigned-byte 8))
+    (with-open-file (output *copy-file*
+			    :direction :output
+			    :if-exists if-exists
+			    :element-type '(unsigned-byte 8))
+      (loop repeat 10 do (read-byte input))
+      (apply #'ext:copy-stream-to-stream input output copy-args))))
+
+(define-test copy-stream.file
+  (:tag :fd-streams)
+  (let ((octets (test-octets 200000)))
+    (unwind-protect
+	 (progn
+	   (write-test-file octets)
+	   (assert-eql 199990
+		       (copy-test-file :supersede))
+	   (assert-equalp (subseq octets 10) (read-test-file *copy-file*))
+	   (assert-eql 1000
+		       (copy-test-file :supersede :count 1000))
+	   (assert-equalp (subseq octets 10 1010)
+			  (read-test-file *copy-file*)))
+      (delete-file *test-file*)
+      (when (probe-file *copy-file*)
+	(delete-file *copy-file*)))))
+
+(define-test copy-stream.append
+  (:tag :fd-streams)
+  ;; Sendfile and splice can't write to a file opened for appending, so
+  ;; this is copied through the buffer.
+  (let ((octets (test-octets 200000)))
+    (unwind-protect
+	 (progn
+	   (write-test-file octets)
+	   (write-test-file (test-octets 5) *copy-file*)
+	   (assert-eql 199990
+		       (copy-test-file :append))
+	   (assert-equalp (concatenate '(vector (unsigned-byte 8))
+				       (test-octets 5)
+				       (subseq octets 10))
+			  (read-test-file *copy-file*)))
+      (delete-file *test-file*)
+      (when (probe-file *copy-file*)
+	(delete-file *copy-file*)))))
+
+(define-test copy-stream.pipe
+  (:tag :fd-streams)
+  ;; A pipe can't be read with sendfile, so this is spliced.
+  (let ((octets (test-octets 10000))
+	(in nil))
+    (multiple-value-bind (in-fd out-fd)
+	(unix:unix-pipe)
+      (unwind-protect
+	   (progn
+	     (with-open-stream (out (sys:make-fd-stream
+				     out-fd
+				     :output t
+				     :element-type '(unsigned-byte 8)))
+	       (write-sequence octets out))
+	     (setf in (sys:make-fd-stream in-fd
+					  :input t
+					  :element-type '(unsigned-byte 8)))
+	     (with-open-file (output *copy-file*
+				     :direction :output
+				     :if-exists :supersede
+				     :element-type '(unsigned-byte 8))
+	       (assert-eql 10000 (ext:copy-stream-to-stream in output)))
+	     (assert-equalp octets (read-test-file *copy-file*)))
+	(if in (close in) (unix:unix-close in-fd))
+	(when (probe-file *copy-file*)
+	  (delete-file *copy-file*))))))
+
+(define-test copy-stream.characters
+  (:tag :fd-streams)
+  (let ((string (make-string 100000 :initial-element #\a)))
+    (setf (char string 99999) #\b)
+    (with-input-from-string (input string)
+      (assert-equal string
+		    (with-output-to-string (output)
+		      (assert-eql 100000
+				  (ext:copy-stream-to-stream input output)))))))
+
+(define-test send-file.range
+  (:tag :fd-streams)
+  (let ((octets (test-octets 20000)))
+    (unwind-protect
+	 (progn
+	   (write-test-file octets)
+	   (with-open-file (output *copy-file*
+				   :direction :output
+				   :if-exists :supersede
+				   :element-type '(unsigned-byte 8))
+	     (assert-eql 4900
+			 (ext:send-file *test-file* output :start 100 :end 5000))
+	     (assert-eql 15000
+			 (ext:send-file *test-file* output :start 5000)))
+	   (assert-equalp (subseq octets 100) (read-test-file *copy-file*)))
+      (delete-file *test-file*)
+      (when (probe-file *copy-file*)
+	(delete-file *copy-file*)))))
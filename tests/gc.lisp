@@ -0,0 +1,341 @@
+;;;; -*- Lisp -*-
+
+(require :contrib-heap-snapshot)
+
+(defpackage gc-tests
+  (:use #:common-lisp #:lisp-unit))
+
+(in-package #:gc-tests)
+
+(defparameter *test-path*
+  (merge-pathnames (make-pathname :name :unspecific :type :unspecific
+                                  :version :unspecific)
+                   *load-truename*)
+  "Directory for temporary test files.")
+
+(defclass hash-key () ())
+
+(define-test eq-hash.stable-across-gc
+  (:tag :gc)
+  ;; Symbols and instances keep their hashes when the GC moves them, so
+  ;; an EQ table keyed by them doesn't need a rehash.
+  (let* ((keys (append (list nil t 'car :test)
+		       (loop repeat 100 collect (gensym))
+		       (loop repeat 100 collect (make-symbol "SAME"))
+		       (loop repeat 100 collect (make-instance 'hash-key))))
+	 (hashes (mapcar #'lisp::eq-hash keys))
+	 (table (make-hash-table :test 'eq)))
+    (loop for key in keys
+	  for i from 0
+	  do (setf (gethash key table) i))
+    (ext:gc :full t)
+    (assert-equal hashes (mapcar #'lisp::eq-hash keys))
+    (assert-eql 0 (lisp::hash-table-needing-rehash table))
+    (assert-true (loop for key in keys
+		       for i from 0
+		       always (eql i (gethash key table))))))
+
+(define-test eq-hash.static-symbols
+  (:tag :gc)
+  ;; Symbols in static space, where purify puts those of a saved core,
+  ;; are hashed by address, so ones of the same name in different
+  ;; packages don't collide.
+  (assert-false (lisp::static-symbol-p (make-symbol "CAR")))
+  (when (lisp::static-symbol-p 'car)
+    (assert-false (= (lisp::eq-hash 'car)
+		     (lisp::eq-hash (make-symbol "CAR"))))))
+
+(defstruct hash-struct)
+
+(define-test eq-hash.address-keys
+  (:tag :gc)
+  ;; Structures and conses have no stable hash and are still hashed by
+  ;; address, so EQ and EQL tables find them again once the GC has
+  ;; moved them.
+  (let ((keys (append (loop repeat 100 collect (make-hash-struct))
+		      (loop repeat 100 collect (list 1 2))))
+	(eq-table (make-hash-table :test 'eq))
+	(eql-table (make-hash-table :test 'eql)))
+    (assert-false (some #'lisp::stable-hash keys))
+    (loop for key in keys
+	  for i from 0
+	  do (setf (gethash key eq-table) i)
+	     (setf (gethash key eql-table) i))
+    (ext:gc :full t)
+    (dolist (table (list eq-table eql-table))
+      (assert-eql (length keys) (hash-table-count table))
+      (assert-true (loop for key in keys
+			 for i from 0
+			 always (eql i (gethash key table)))))))
+
+(define-test eq-hash.equal-table-symbols
+  (:tag :gc)
+  ;; Only EQ and EQL tables are marked for the GC and purify by symbol
+  ;; keys; EQUAL tables hash symbols by name.
+  (let ((keys (loop for i below 100
+		    collect (make-symbol (format nil "KEY-~D" i))))
+	(equal-table (make-hash-table :test 'equal))
+	(eq-table (make-hash-table :test 'eq)))
+    (dolist (key keys)
+      (setf (gethash key equal-table) t)
+      (setf (gethash key eq-table) t))
+    (assert-eql vm:vector-normal-subtype
+		(kernel:get-header-data (lisp::hash-table-table equal-table)))
+    (assert-eql vm:vector-valid-hashing-subtype
+		(kernel:get-header-data (lisp::hash-table-table eq-table)))
+    (ext:gc :full t)
+    (assert-true (every #'(lambda (key) (gethash key equal-table)) keys))))
+
+;; Put N entries in TABLE, whose keys and values are fresh conses when
+;; CONS-KEYS and CONS-VALUES are true and fixnums otherwise.  Nothing
+;; else refers to the conses.
+(defun fill-weak-table (table n &key cons-keys cons-values)
+  (dotimes (i n)
+    (setf (gethash (if cons-keys (list i) i) table)
+	  (if cons-values (list i) i))))
+
+#+gencgc
+(define-test weak-hash.unreferenced
+  (:tag :gc)
+  ;; An entry goes once what the table is weak on, its key, its value
+  ;; or either of them, is no longer referenced elsewhere.
+  (dolist (weakness '(:key :value :key-and-value))
+    (let ((table (make-hash-table :test 'eq :weak-p weakness)))
+      (fill-weak-table table 100
+		       :cons-keys (member weakness '(:key :key-and-value))
+		       :cons-values (member weakness '(:value :key-and-value)))
+      (assert-eql 100 (hash-table-count table) weakness)
+      (ext:gc :full t)
+      (assert-eql 0 (hash-table-count table) weakness))))
+
+#+gencgc
+(define-test weak-hash.referenced
+  (:tag :gc)
+  ;; An entry whose key and value are both referenced elsewhere stays.
+  (let ((keys (loop for i below 100 collect (list i)))
+	(vals (loop for i below 100 collect (list i))))
+    (dolist (weakness '(:key :value :key-and-value))
+      (let ((table (make-hash-table :test 'eq :weak-p weakness)))
+	(loop for key in keys
+	      for value in vals
+	      do (setf (gethash key table) value))
+	(ext:gc :full t)
+	(assert-eql 100 (hash-table-count table) weakness)
+	(assert-true (loop for key in keys
+			   for value in vals
+			   always (eq value (gethash key table)))
+		     weakness)))
+    ;; A :key-and-value entry goes when only its key is referenced.
+    (let ((table (make-hash-table :test 'eq :weak-p :key-and-value)))
+      (dolist (key keys)
+	(setf (gethash key table) (list key)))
+      (ext:gc :full t)
+      (assert-eql 0 (hash-table-count table)))))
+
+;; Chain KEY to a fresh value in TABLE1, and that value to another in
+;; TABLE2, so that the value is only referenced from TABLE1.
+(defun chain-weak-tables (key table1 table2)
+  (let ((middle (list key)))
+    (setf (gethash key table1) middle)
+    (setf (gethash middle table2) (list middle))
+    nil))
+
+#+gencgc
+(define-test weak-hash.chained
+  (:tag :gc)
+  ;; The value of an entry kept in one table keeps alive its entry in
+  ;; another, where it is the key, and both go with the first key.
+  (let ((key (list 'key))
+	(table1 (make-hash-table :test 'eq :weak-p :key))
+	(table2 (make-hash-table :test 'eq :weak-p :key)))
+    (chain-weak-tables key table1 table2)
+    (ext:gc :full t)
+    (assert-eql 1 (hash-table-count table1))
+    (assert-eql 1 (hash-table-count table2))
+    (assert-true (gethash (gethash key table1) table2))
+    (setf key nil)
+    (ext:gc :full t)
+    (assert-eql 0 (hash-table-count table1))
+    (assert-eql 0 (hash-table-count table2))))
+
+#+gencgc
+(define-test weak-hash.stats
+  (:tag :gc)
+  ;; The tables and entries looked at and the entries removed are
+  ;; counted.
+  (let ((table (make-hash-table :test 'eq :weak-p :key)))
+    (multiple-value-bind (tables entries rechecks removed)
+	(lisp::gencgc-weak-stats)
+      (declare (ignore rechecks))
+      (fill-weak-table table 100 :cons-keys t)
+      (ext:gc :full t)
+      (multiple-value-bind (new-tables new-entries new-rechecks new-removed)
+	  (lisp::gencgc-weak-stats)
+	(declare (ignore new-rechecks))
+	(assert-true (> new-tables tables))
+	(assert-true (>= (- new-entries entries) 100))
+	(assert-true (>= (- new-removed removed) 100))
+	(assert-eql 0 (hash-table-count table))))))
+
+(define-test pinned-vector.not-moved
+  (:tag :gc)
+  ;; A pinned vector stays where it is, with its contents, across GCs.
+  (let* ((octets (make-array 100000
+			     :element-type '(unsigned-byte 8)
+			     :initial-element 7
+			     :allocation :pinned))
+	 (doubles (make-array 10
+			      :element-type 'double-float
+			      :initial-element 1d0
+			      :allocation :pinned))
+	 (string (make-array 10
+			     :element-type 'base-char
+			     :initial-element #\a
+			     :allocation :pinned))
+	 (vectors (list octets doubles string))
+	 (addresses (mapcar #'kernel:get-lisp-obj-address vectors)))
+    (ext:gc)
+    (ext:gc :full t)
+    (assert-equal addresses (mapcar #'kernel:get-lisp-obj-address vectors))
+    (assert-true (every #'(lambda (x) (= x 7)) octets))
+    (assert-true (every #'(lambda (x) (= x 1d0)) doubles))
+    (assert-equal "aaaaaaaaaa" string)))
+
+#+gencgc
+(define-test pinned-vector.stats
+  (:tag :gc)
+  (let ((before (nth-value 2 (lisp::gencgc-large-object-stats))))
+    (make-array 10 :element-type '(unsigned-byte 32) :allocation :pinned)
+    (assert-eql (1+ before) (nth-value 2 (lisp::gencgc-large-object-stats)))))
+
+(define-test pinned-vector.errors
+  (:tag :gc)
+  ;; Only simple vectors of unboxed elements can be pinned.
+  #+gencgc
+  (assert-error 'error (make-array 10 :allocation :pinned))
+  (assert-error 'error (make-array '(2 2)
+				   :element-type 'double-float
+				   :allocation :pinned))
+  (assert-error 'error (make-array 10
+				   :element-type 'double-float
+				   :adjustable t
+				   :allocation :pinned)))
+
+(defun cons-some (n)
+  (let ((vectors '()))
+    (dotimes (i n)
+      (push (make-array 10) vectors))
+    (length vectors)))
+
+#+gencgc
+(define-test alloc-profile.samples
+  (:tag :gc)
+  (unwind-protect
+       (progn
+	 (lisp::alloc-profile-start :bytes 65536)
+	 (cons-some 100000)
+	 (lisp::alloc-profile-stop)
+	 (let ((samples (lisp::alloc-profile-samples))
+	       (taken (lisp::gencgc-alloc-sample-stats)))
+	   (assert-true samples)
+	   (assert-true (plusp taken))
+	   ;; The interval is only ever raised from the one asked for.
+	   (assert-true (>= (nth-value 3 (lisp::gencgc-alloc-sample-stats))
+			    65536))
+	   ;; Each is the bytes, the count, the type and the stack.
+	   (assert-true (every #'(lambda (sample)
+				   (and (plusp (first sample))
+					(plusp (second sample))
+					(third sample)))
+			       samples))
+	   ;; Nothing more is sampled once stopped.
+	   (cons-some 100000)
+	   (assert-eql taken (lisp::gencgc-alloc-sample-stats))
+	   (assert-true (plusp (length (with-output-to-string (s)
+					 (lisp::alloc-profile-report
+					  :stream s)))))))
+    (lisp::alloc-profile-stop)))
+
+#+gencgc
+(define-test alloc-profile.folded
+  (:tag :gc)
+  (let ((file (merge-pathnames #p"alloc.folded" *test-path*)))
+    (unwind-protect
+	 (progn
+	   (lisp::alloc-profile-start :bytes 65536)
+	   (cons-some 100000)
+	   (lisp::alloc-profile-stop)
+	   (lisp::alloc-profile-write-folded file)
+	   ;; Each line is the frames and type, separated by semicolons,
+	   ;; then a space and the bytes.
+	   (with-open-file (s file)
+	     (let ((lines (loop for line = (read-line s nil)
+				while line
+				collect line)))
+	       (assert-true lines)
+	       (assert-true
+		(every #'(lambda (line)
+			   (let ((space (position #\space line :from-end t)))
+			     (and space
+				  (plusp (parse-integer line
+							:start (1+ space))))))
+		       lines)))))
+      (lisp::alloc-profile-stop)
+      (when (probe-file file)
+	(delete-file file)))))
+
+#+gencgc
+(define-test heap-snapshot.write
+  (:tag :gc)
+  ;; The snapshot written has every object, and the contrib reads it.
+  (let ((file (merge-pathnames #p"heap.snap" *test-path*)))
+    (unwind-protect
+	 (let ((objects (lisp::write-heap-snapshot file)))
+	   (assert-true (plusp objects))
+	   (let ((snapshot (heap-snapshot:read-snapshot file)))
+	     (assert-eql objects (heap-snapshot::snapshot-count snapshot))
+	     (assert-true (heap-snapshot:type-summary snapshot :count 5))))
+      (when (probe-file file)
+	(delete-file file)))))
+
+#+gencgc
+(define-test heap-snapshot.error
+  (:tag :gc)
+  (assert-error 'error
+		(lisp::write-heap-snapshot "/nonexistent/heap.snap" :gc nil)))
+
+#+gencgc
+(define-test gc-events.full-gc
+  (:tag :gc)
+  ;; A full GC records an event for each generation it collects, with
+  ;; its phase times.
+  (let ((since (nth-value 1 (lisp::gc-events))))
+    (ext:gc :full t)
+    (multiple-value-bind (events next)
+	(lisp::gc-events since)
+      (assert-true events)
+      (assert-eql (+ since (length events)) next)
+      (dolist (event events)
+	(assert-equal lisp::*gc-event-keys*
+		      (loop for key in event by #'cddr collect key))
+	(assert-true (<= (getf event :start) (getf event :end)))
+	(assert-true (<= (+ (getf event :prepare) (getf event :stacks)
+			    (getf event :roots) (getf event :older)
+			    (getf event :newspace) (getf event :weak)
+			    (getf event :free))
+			 (- (getf event :end) (getf event :start)))))
+      ;; Nothing new since then.
+      (assert-false (lisp::gc-events next)))))
+
+#+gencgc
+(define-test gc-events.ring
+  (:tag :gc)
+  ;; Only the last 256 events are kept.
+  (loop repeat 300 do (ext:gc))
+  (multiple-value-bind (events next)
+      (lisp::gc-events)
+    (assert-true (> next 256))
+    (assert-eql 256 (length events))
+    ;; Asking for older ones gives the same.
+    (assert-eql 256 (length (lisp::gc-events (- next 300))))
+    (assert-eql 10 (length (lisp::gc-events (- next 10))))))
@@ -0,0 +1,204 @@
+;;;; -*- Lisp -*-
+
+(defpackage serve-event-tests
+  (:use #:common-lisp #:lisp-unit))
+
+(in-package #:serve-event-tests)
+
+(defparameter *test-path*
+  (merge-pathnames (make-pathname :name :unspecific :type :unspecific
+                                  :version :unspecific)
+                   *load-truename*)
+  "Directory for temporary test files.")
+
+(defparameter *test-file*
+  (merge-pathnames #p"serve-event.tmp" *test-path*))
+
+(defparameter *backends* '(:select #+linux :epoll))
+
+;; Run BODY once with each serve-event backend.
+(defmacro with-each-backend (&body body)
+  `(dolist (backend *backends*)
+     (let ((sys:*serve-event-backend* backend))
+       ,@body)))
+
+(defmacro with-pipe ((in out) &body body)
+  `(multiple-value-bind (,in ,out)
+       (unix:unix-pipe)
+     (unwind-protect
+	  (progn ,@body)
+       (unix:unix-close ,in)
+       (unix:unix-close ,out))))
+
+(define-test serve-event.pipe-input
+  (:tag :serve-event)
+  (with-each-backend
+    (with-pipe (in out)
+      (let* ((called nil)
+	     (handler (sys:add-fd-handler in :input
+					  #'(lambda (fd)
+					      (declare (ignore fd))
+					      (setf called t)))))
+	(unwind-protect
+	     (progn
+	       (assert-false (sys:serve-event 0) backend)
+	       (assert-false called backend)
+	       (unix:unix-write out "x" 0 1)
+	       (assert-true (sys:serve-event 1) backend)
+	       (assert-true called backend))
+	  (sys:remove-fd-handler handler))
+	;; Once removed, the handler isn't called.
+	(setf called nil)
+	(sys:serve-event 0)
+	(assert-false called backend)))))
+
+(define-test serve-event.pipe-output
+  (:tag :serve-event)
+  (with-each-backend
+    (with-pipe (in out)
+      (let ((called nil))
+	(sys:with-fd-handler (out :output #'(lambda (fd)
+					      (declare (ignore fd))
+					      (setf called t)))
+	  (assert-true (sys:serve-event 0) backend)
+	  (assert-true called backend))))))
+
+(define-test serve-event.two-handlers
+  (:tag :serve-event)
+  ;; Removing one of the handlers of a descriptor leaves the other.
+  (with-each-backend
+    (with-pipe (in out)
+      (let* ((first 0)
+	     (second 0)
+	     (handler (sys:add-fd-handler in :input
+					  #'(lambda (fd)
+					      (declare (ignore fd))
+					      (incf first)))))
+	(sys:with-fd-handler (in :input #'(lambda (fd)
+					    (declare (ignore fd))
+					    (incf second)))
+	  (unix:unix-write out "x" 0 1)
+	  (sys:serve-event 1)
+	  (sys:remove-fd-handler handler)
+	  (sys:serve-event 1)
+	  (assert-eql 1 first backend)
+	  (assert-true (>= second 1) backend))))))
+
+(define-test serve-event.regular-file
+  (:tag :serve-event)
+  ;; Epoll won't take a regular file, which is always ready, as with
+  ;; select.
+  (with-each-backend
+    (unwind-protect
+	 (with-open-file (s *test-file*
+			    :direction :output
+			    :if-exists :supersede)
+	   (let ((called nil))
+	     (sys:with-fd-handler ((lisp::fd-stream-fd s) :input
+				   #'(lambda (fd)
+				       (declare (ignore fd))
+				       (setf called t)))
+	       (sys:serve-event 0)
+	       (assert-true called backend))))
+      (delete-file *test-file*))))
+
+(define-test serve-event.wait-until-fd-usable
+  (:tag :serve-event)
+  (with-each-backend
+    (with-pipe (in out)
+      (assert-false (sys:wait-until-fd-usable in :input 0) backend)
+      (assert-false (sys:wait-until-fd-usable in :input 0.05) backend)
+      (unix:unix-write out "x" 0 1)
+      (assert-true (sys:wait-until-fd-usable in :input 0) backend)
+      (assert-true (sys:wait-until-fd-usable in :input 1) backend)
+      (assert-true (sys:wait-until-fd-usable in :input) backend))))
+
+#+linux
+(define-test serve-event.switch-backend
+  (:tag :serve-event)
+  ;; Going back to select closes the epoll descriptor.
+  (let ((sys:*serve-event-backend* :epoll))
+    (sys:serve-event 0)
+    (assert-true lisp::*epoll-fd*))
+  (let ((sys:*serve-event-backend* :select))
+    (sys:serve-event 0)
+    (assert-false lisp::*epoll-fd*)))
+
+;; Serve events until TEST is true or SECONDS have passed.
+(defun serve-until (test &optional (seconds 2))
+  (let ((end (+ (get-internal-real-time)
+		(* seconds internal-time-units-per-second))))
+    (loop until (or (funcall test)
+		    (> (get-internal-real-time) end))
+	  do (sys:serve-event 0.1))))
+
+(define-test timer.order
+  (:tag :serve-event)
+  (with-each-backend
+    (let ((fired '()))
+      (sys:add-timer 0.03 #'(lambda () (push 3 fired)))
+      (sys:add-timer 0.01 #'(lambda () (push 1 fired)))
+      (sys:add-timer 0.02 #'(lambda () (push 2 fired)))
+      (serve-until #'(lambda () (= (length fired) 3)))
+      (assert-equal '(1 2 3) (reverse fired) backend))))
+
+(define-test timer.remove
+  (:tag :serve-event)
+  (let* ((fired nil)
+	 (timer (sys:add-timer 0.01 #'(lambda () (setf fired t))))
+	 (done nil))
+    (sys:remove-timer timer)
+    (sys:add-timer 0.05 #'(lambda () (setf done t)))
+    (serve-until #'(lambda () done))
+    (assert-true done)
+    (assert-false fired)
+    ;; Removing it again does nothing.
+    (sys:remove-timer timer)))
+
+(define-test timer.remove-expired
+  (:tag :serve-event)
+  ;; A timer removed by one that came due at the same time isn't called.
+  (let* ((fired '())
+	 (other nil))
+    (sys:add-timer 0.01 #'(lambda ()
+			    (push 1 fired)
+			    (sys:remove-timer other)))
+    (setf other (sys:add-timer 0.01 #'(lambda () (push 2 fired))))
+    (sys:add-timer 0.05 #'(lambda () (push 3 fired)))
+    (serve-until #'(lambda () (member 3 fired)))
+    (assert-equal '(1 3) (reverse fired))))
+
+(define-test timer.throw
+  (:tag :serve-event)
+  ;; If a timer function throws, the others that were due are called
+  ;; later.
+  (let ((fired nil))
+    (sys:add-timer 0.01 #'(lambda () (throw 'timer-test :thrown)))
+    (sys:add-timer 0.01 #'(lambda () (setf fired t)))
+    (assert-eq :thrown
+	       (catch 'timer-test
+		 (serve-until (constantly nil) 1)))
+    (serve-until #'(lambda () fired))
+    (assert-true fired)))
+
+(define-test timer.wakes-serve-event
+  (:tag :serve-event)
+  ;; Serve-event doesn't sleep past the next timer.
+  (with-each-backend
+    (let ((fired nil)
+	  (start (get-internal-real-time)))
+      (sys:add-timer 0.05 #'(lambda () (setf fired t)))
+      (assert-true (sys:serve-event 10) backend)
+      (assert-true fired backend)
+      (assert-true (< (- (get-internal-real-time) start)
+		      internal-time-units-per-second)
+		   backend))))
+
+(define-test timer.far
+  (:tag :serve-event)
+  ;; A timer further out than the wheel reaches is kept until removed.
+  (let* ((fired nil)
+	 (timer (sys:add-timer 10000000 #'(lambda () (setf fired t)))))
+    (sys:serve-event 0)
+    (sys:remove-timer timer)
+    (assert-false fired)))